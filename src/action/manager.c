@@ -25,5 +25,944 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "action/manager.h"
+#include "logger/trace.h"
+#include "objects/array.h"
+#include "util/attributes.h"
+#include "util/debug.h"
+
+/**
+ * Number of keys hashed per bucket of the perfect hash, on average
+ */
+#define PHASH_BUCKET_KEYS 4
+
+/**
+ * Number of seeds tried for a bucket before the table is enlarged
+ */
+#define PHASH_SEED_MAX (1 << 16)
+
+/**
+ * Index of no node
+ */
+#define NODE_NONE UINT32_MAX
+
+/**
+ * A keybinding, as defined
+ */
+struct binding {
+    uint32_t mode; //!< the mode the binding is active in
+    uint32_t nkeys; //!< number of keys of the chord
+    uint64_t keys[WS_ACTION_CHORD_MAX]; //!< the keys, see key_pack()
+    struct ws_action* action; //!< the action to trigger
+};
+
+/**
+ * Node of the keybinding trie
+ *
+ * The children of a node are stored consecutively, sorted by key. Nodes
+ * without children complete a binding.
+ */
+struct node {
+    uint64_t key; //!< the key leading to the node, see key_pack()
+    uint32_t first; //!< index of the first child
+    uint32_t count; //!< number of children
+    struct ws_action* action; //!< the action, for nodes completing a binding
+};
+
+/**
+ * Queue of triggered actions
+ */
+struct queue {
+    struct ws_action* head; //!< first action, NULL if the queue is empty
+    struct ws_action* tail; //!< last action
+};
+
+/**
+ * State of the action manager
+ */
+struct ws_action_manager {
+    struct ws_action** actions; //!< all defined actions
+    size_t nactions; //!< number of defined actions
+    size_t size; //!< capacity of `actions`
+
+    struct ws_array bindings; //!< keybindings, see struct binding
+    struct ws_array nodes; //!< the trie, first keys of all modes first
+    uint32_t nroots; //!< number of nodes for first keys
+    uint32_t* seeds; //!< seed of each bucket of the perfect hash
+    uint32_t nbuckets; //!< number of buckets, a power of two
+    uint32_t* slots; //!< index of the node of each slot of the perfect hash
+    uint32_t nslots; //!< number of slots
+    uint32_t mode; //!< the current mode
+    uint32_t pending; //!< node reached by the chord typed so far, or none
+
+    struct queue queues[WS_ACTION_PRIORITY_COUNT]; //!< triggered actions
+    uint64_t pushes; //!< number of times an action was queued
+};
+
+/**
+ * Logging context of the action manager
+ */
+static struct ws_logger_context const log_ctx = { .prefix = "action" };
+
+/**
+ * The action manager
+ */
+static struct ws_action_manager manager;
+
+/**
+ * Pack a key into a word
+ *
+ * The mode is only part of first keys of chords.
+ *
+ * @return the packed key
+ */
+static inline uint64_t
+key_pack(
+    uint32_t mode, //!< The mode
+    struct ws_action_key key //!< The key
+) {
+    return ((uint64_t) mode << 48) | ((uint64_t) key.mods << 32) | key.keysym;
+}
+
+/**
+ * Hash a packed key
+ *
+ * @return the hash
+ */
+static inline uint32_t
+key_hash(
+    uint64_t key, //!< The packed key
+    uint32_t seed //!< The seed
+) {
+    // finalizer of MurmurHash3
+    key ^= seed * UINT64_C(0x9e3779b97f4a7c15);
+    key ^= key >> 33;
+    key *= UINT64_C(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    key *= UINT64_C(0xc4ceb9fe1a85ec53);
+    key ^= key >> 33;
+    return key;
+}
+
+/**
+ * Get the current time, in nanoseconds
+ */
+static uint64_t
+now(void);
+
+/**
+ * Run the due actions of a queue
+ *
+ * Only actions queued before the call are run. The queue stays intact while
+ * an action runs, so the action may trigger actions or change policies.
+ *
+ * @return the number of actions run
+ */
+static size_t
+queue_run(
+    struct queue* queue, //!< The queue
+    uint64_t time, //!< The current time
+    size_t limit //!< Number of actions to run at most
+);
+
+/**
+ * Append an action to a queue
+ */
+static void
+queue_push(
+    struct queue* queue, //!< The queue
+    struct ws_action* action //!< The action
+);
+
+/**
+ * Remove an action from a queue
+ */
+static void
+queue_remove(
+    struct queue* queue, //!< The queue
+    struct ws_action* action //!< The action, ignored if not in the queue
+);
+
+/**
+ * Find a binding
+ *
+ * @return the index of the binding, or the number of bindings if there is none
+ */
+static size_t
+binding_find(
+    uint32_t mode, //!< The mode
+    uint64_t const* keys, //!< The packed keys
+    size_t nkeys //!< Number of keys
+);
+
+/**
+ * Compare two bindings by mode and keys
+ *
+ * @return less than, equal to or greater than zero if `a` is less than, equal
+ *         to or greater than `b`
+ */
+static int
+binding_cmp(
+    void const* a, //!< The binding to compare
+    void const* b //!< The binding to compare with
+);
+
+/**
+ * Rebuild the trie and the perfect hash from the bindings
+ *
+ * The bindings are sorted. If building fails, the old tables are kept.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+tables_build(void);
+
+/**
+ * Add the children of a node to the trie
+ *
+ * The bindings in the range share the keys leading to the node and are
+ * sorted.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+trie_build(
+    uint32_t node, //!< The node, NODE_NONE for the first keys
+    size_t lo, //!< Index of the first binding
+    size_t hi, //!< Index behind the last binding
+    uint32_t depth //!< Number of keys leading to the node
+);
+
+/**
+ * Build the perfect hash of the first keys
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+phash_build(void);
+
+/**
+ * Free the trie and the perfect hash
+ */
+static void
+tables_free(void);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_action_manager_init(void)
+{
+    manager.actions = NULL;
+    manager.nactions = 0;
+    manager.size = 0;
+
+    ws_array_init(&manager.bindings, sizeof(struct binding));
+    ws_array_init(&manager.nodes, sizeof(struct node));
+    manager.mode = 0;
+    manager.pending = NODE_NONE;
+    memset(manager.queues, 0, sizeof(manager.queues));
+    manager.pushes = 0;
+    return 0;
+}
+
+void
+ws_action_manager_deinit(void)
+{
+    for (size_t i = 0; i < manager.nactions; ++i) {
+        ws_command_program_free(manager.actions[i]->program);
+        free(manager.actions[i]->name);
+        free(manager.actions[i]);
+    }
+    free(manager.actions);
+    manager.actions = NULL;
+    manager.nactions = 0;
+    manager.size = 0;
+
+    tables_free();
+    ws_array_deinit(&manager.bindings);
+    ws_array_deinit(&manager.nodes);
+    memset(manager.queues, 0, sizeof(manager.queues));
+}
+
+int
+ws_action_manager_define(
+    char const* name,
+    struct ws_command_statement const* stmts,
+    size_t nstmts
+) {
+    struct ws_command_program* program;
+    int res = ws_command_compile(stmts, nstmts, &program);
+    if (res < 0) {
+        return res;
+    }
+
+    struct ws_action* action = ws_action_manager_find(name);
+    if (action) {
+        ws_command_program_free(action->program);
+        action->program = program;
+        return 0;
+    }
+
+    if (manager.nactions == manager.size) {
+        size_t size = manager.size ? manager.size * 2 : 16;
+        struct ws_action** actions;
+        actions = realloc(manager.actions, sizeof(*actions) * size);
+        if (!actions) {
+            res = -ENOMEM;
+            goto cleanup_program;
+        }
+        manager.actions = actions;
+        manager.size = size;
+    }
+
+    action = calloc(1, sizeof(*action));
+    if (!action) {
+        res = -ENOMEM;
+        goto cleanup_program;
+    }
+
+    action->name = strdup(name);
+    if (!action->name) {
+        res = -ENOMEM;
+        goto cleanup_action;
+    }
+
+    action->program = program;
+    manager.actions[manager.nactions++] = action;
+    return 0;
+
+cleanup_action:
+    free(action);
+cleanup_program:
+    ws_command_program_free(program);
+    return res;
+}
+
+struct ws_action*
+ws_action_manager_find(
+    char const* name
+) {
+    for (size_t i = 0; i < manager.nactions; ++i) {
+        if (strcmp(manager.actions[i]->name, name) == 0) {
+            return manager.actions[i];
+        }
+    }
+    return NULL;
+}
+
+int
+ws_action_manager_bind(
+    uint32_t mode,
+    struct ws_action_key const* keys,
+    size_t nkeys,
+    struct ws_action* action
+) {
+    if (!nkeys || (nkeys > WS_ACTION_CHORD_MAX) ||
+            (mode >= WS_ACTION_MODE_COUNT)) {
+        return -EINVAL;
+    }
+
+    struct binding binding = {
+        .mode = mode,
+        .nkeys = nkeys,
+        .action = action,
+    };
+    for (size_t i = 0; i < nkeys; ++i) {
+        binding.keys[i] = key_pack(0, keys[i]);
+    }
+
+    // a chord which begins another one could never be completed
+    for (size_t i = 0; i < manager.bindings.len; ++i) {
+        struct binding* other = ws_array_at(&manager.bindings, i);
+        size_t common = other->nkeys < nkeys ? other->nkeys : nkeys;
+        if ((other->mode != mode) ||
+                memcmp(other->keys, binding.keys, common * sizeof(uint64_t))) {
+            continue;
+        }
+        if (other->nkeys != nkeys) {
+            return -EEXIST;
+        }
+
+        struct ws_action* prev = other->action;
+        other->action = action;
+        int res = tables_build();
+        if (res < 0) {
+            // the bindings were sorted in the meantime
+            other = ws_array_at(&manager.bindings,
+                                binding_find(mode, binding.keys, nkeys));
+            other->action = prev;
+        }
+        return res;
+    }
+
+    int res = ws_array_push(&manager.bindings, &binding);
+    if (res < 0) {
+        return res;
+    }
+
+    res = tables_build();
+    if (res < 0) {
+        ws_array_remove(&manager.bindings,
+                        binding_find(mode, binding.keys, nkeys));
+    }
+    return res;
+}
+
+int
+ws_action_manager_unbind(
+    uint32_t mode,
+    struct ws_action_key const* keys,
+    size_t nkeys
+) {
+    if (!nkeys || (nkeys > WS_ACTION_CHORD_MAX)) {
+        return -ENOENT;
+    }
+
+    uint64_t packed[WS_ACTION_CHORD_MAX];
+    for (size_t i = 0; i < nkeys; ++i) {
+        packed[i] = key_pack(0, keys[i]);
+    }
+
+    size_t index = binding_find(mode, packed, nkeys);
+    if (index == manager.bindings.len) {
+        return -ENOENT;
+    }
+    struct binding binding = *(struct binding*) ws_array_at(&manager.bindings,
+                                                            index);
+    ws_array_remove(&manager.bindings, index);
+
+    int res = tables_build();
+    if (res < 0) {
+        // the slot was just freed, so this doesn't allocate
+        ws_array_push(&manager.bindings, &binding);
+    }
+    return res;
+}
+
+int
+ws_action_manager_set_mode(
+    uint32_t mode
+) {
+    if (mode >= WS_ACTION_MODE_COUNT) {
+        return -EINVAL;
+    }
+    manager.mode = mode;
+    manager.pending = NODE_NONE;
+    return 0;
+}
+
+int
+ws_action_manager_key(
+    struct ws_action_key key,
+    struct ws_action** action
+) {
+    struct node const* nodes = ws_array_at(&manager.nodes, 0);
+    struct node const* node = NULL;
+    if (manager.pending == NODE_NONE) {
+        // first key of a binding, the mode is part of the key
+        if (!manager.nslots) {
+            return WS_ACTION_KEY_NONE;
+        }
+        uint64_t packed = key_pack(manager.mode, key);
+        uint32_t bucket = key_hash(packed, 0) & (manager.nbuckets - 1);
+        uint32_t slot = key_hash(packed, manager.seeds[bucket]) %
+                        manager.nslots;
+        uint32_t index = manager.slots[slot];
+        if ((index != NODE_NONE) && (nodes[index].key == packed)) {
+            node = nodes + index;
+        }
+    } else {
+        // further key of a chord, among at most a few siblings
+        struct node const* parent = nodes + manager.pending;
+        uint64_t packed = key_pack(0, key);
+        uint32_t lo = parent->first;
+        uint32_t hi = parent->first + parent->count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (nodes[mid].key < packed) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if ((lo < parent->first + parent->count) &&
+                (nodes[lo].key == packed)) {
+            node = nodes + lo;
+        }
+    }
+
+    if (!node) {
+        manager.pending = NODE_NONE;
+        return WS_ACTION_KEY_NONE;
+    }
+    if (node->count) {
+        manager.pending = node - nodes;
+        return WS_ACTION_KEY_PENDING;
+    }
+    manager.pending = NODE_NONE;
+    *action = node->action;
+    return WS_ACTION_KEY_MATCH;
+}
+
+int
+ws_action_manager_set_policy(
+    struct ws_action* action,
+    struct ws_action_policy const* policy
+) {
+    if ((unsigned) policy->priority >= WS_ACTION_PRIORITY_COUNT) {
+        return -EINVAL;
+    }
+
+    // a queued action moves to the tail of its new class
+    if (action->queued && (policy->priority != action->policy.priority)) {
+        queue_remove(manager.queues + action->policy.priority, action);
+        queue_push(manager.queues + policy->priority, action);
+    }
+    action->policy = *policy;
+    return 0;
+}
+
+void
+ws_action_manager_trigger(
+    struct ws_action* action
+) {
+    uint64_t time = now();
+    action->due = time + (uint64_t) action->policy.debounce * 1000000;
+    if (action->queued) {
+        return;
+    }
+
+    action->queued = true;
+    queue_push(manager.queues + action->policy.priority, action);
+}
+
+size_t
+ws_action_manager_dispatch(
+    size_t budget
+) {
+    WS_TRACE_SCOPE("action dispatch");
+
+    uint64_t time = now();
+    size_t run = queue_run(manager.queues, time, budget);
+    for (int i = 1; i < WS_ACTION_PRIORITY_COUNT; ++i) {
+        size_t limit = run < budget ? budget - run : 1;
+        run += queue_run(manager.queues + i, time, limit);
+    }
+    return run;
+}
+
+int
+ws_action_manager_timeout(void)
+{
+    uint64_t time = now();
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < WS_ACTION_PRIORITY_COUNT; ++i) {
+        for (struct ws_action* action = manager.queues[i].head; action;
+                action = action->next) {
+            uint64_t at = action->due > action->next_run ? action->due :
+                                                           action->next_run;
+            next = at < next ? at : next;
+        }
+    }
+
+    if (next == UINT64_MAX) {
+        return -1;
+    }
+    if (next <= time) {
+        return 0;
+    }
+    uint64_t ms = (next - time + 999999) / 1000000;
+    return ms > INT32_MAX ? INT32_MAX : (int) ms;
+}
+
+int
+ws_action_run(
+    struct ws_action const* action,
+    struct ws_value* result
+) {
+    return ws_command_program_run(action->program, result);
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static uint64_t
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+queue_run(
+    struct queue* queue,
+    uint64_t time,
+    size_t limit
+) {
+    // actions triggered by the ones run are pushed behind, and wait for the
+    // next dispatch
+    uint64_t stamp = manager.pushes;
+
+    size_t run = 0;
+    while (run < limit) {
+        // running an action may change the queue, so the search for the next
+        // one starts over each time, skipping the ones which are not due yet
+        struct ws_action* prev = NULL;
+        struct ws_action* action = queue->head;
+        while (action && (action->stamp <= stamp) &&
+                ((action->due > time) || (action->next_run > time))) {
+            prev = action;
+            action = action->next;
+        }
+        if (!action || (action->stamp > stamp)) {
+            break;
+        }
+
+        if (prev) {
+            prev->next = action->next;
+        } else {
+            queue->head = action->next;
+        }
+        if (queue->tail == action) {
+            queue->tail = prev;
+        }
+        action->next = NULL;
+        action->queued = false;
+
+        if (action->policy.rate) {
+            action->next_run = time + 1000000000 / action->policy.rate;
+        }
+        int res = ws_action_run(action, NULL);
+        if (res < 0) {
+            ws_debug(&log_ctx, "action %s failed: %d", action->name, res);
+        }
+        ++run;
+    }
+    return run;
+}
+
+static void
+queue_push(
+    struct queue* queue,
+    struct ws_action* action
+) {
+    action->next = NULL;
+    action->stamp = ++manager.pushes;
+    if (queue->tail) {
+        queue->tail->next = action;
+    } else {
+        queue->head = action;
+    }
+    queue->tail = action;
+}
+
+static void
+queue_remove(
+    struct queue* queue,
+    struct ws_action* action
+) {
+    struct ws_action** link = &queue->head;
+    struct ws_action* prev = NULL;
+    while (*link && (*link != action)) {
+        prev = *link;
+        link = &prev->next;
+    }
+    if (!*link) {
+        return;
+    }
+
+    *link = action->next;
+    if (queue->tail == action) {
+        queue->tail = prev;
+    }
+    action->next = NULL;
+}
+
+static size_t
+binding_find(
+    uint32_t mode,
+    uint64_t const* keys,
+    size_t nkeys
+) {
+    size_t i;
+    for (i = 0; i < manager.bindings.len; ++i) {
+        struct binding const* binding = ws_array_at(&manager.bindings, i);
+        if ((binding->mode == mode) && (binding->nkeys == nkeys) &&
+                !memcmp(binding->keys, keys, nkeys * sizeof(*keys))) {
+            break;
+        }
+    }
+    return i;
+}
+
+static int
+binding_cmp(
+    void const* a,
+    void const* b
+) {
+    struct binding const* x = a;
+    struct binding const* y = b;
+    if (x->mode != y->mode) {
+        return x->mode < y->mode ? -1 : 1;
+    }
+
+    uint32_t n = x->nkeys < y->nkeys ? x->nkeys : y->nkeys;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (x->keys[i] != y->keys[i]) {
+            return x->keys[i] < y->keys[i] ? -1 : 1;
+        }
+    }
+    return (x->nkeys > y->nkeys) - (x->nkeys < y->nkeys);
+}
+
+static int
+tables_build(void)
+{
+    // the old tables stay in place until the new ones are complete
+    struct ws_array nodes = manager.nodes;
+    uint32_t nroots = manager.nroots;
+    uint32_t* seeds = manager.seeds;
+    uint32_t nbuckets = manager.nbuckets;
+    uint32_t* slots = manager.slots;
+    uint32_t nslots = manager.nslots;
+    ws_array_init(&manager.nodes, sizeof(struct node));
+    manager.seeds = NULL;
+    manager.slots = NULL;
+    tables_free();
+
+    // sorted, bindings sharing keys form ranges, one per node of the trie
+    ws_array_sort(&manager.bindings, binding_cmp);
+    int res = trie_build(NODE_NONE, 0, manager.bindings.len, 0);
+    if (res == 0) {
+        res = phash_build();
+    }
+    if (res < 0) {
+        tables_free();
+        ws_array_deinit(&manager.nodes);
+        manager.nodes = nodes;
+        manager.nroots = nroots;
+        manager.seeds = seeds;
+        manager.nbuckets = nbuckets;
+        manager.slots = slots;
+        manager.nslots = nslots;
+        return res;
+    }
+
+    ws_array_deinit(&nodes);
+    free(seeds);
+    free(slots);
+
+    // nodes moved, so a chord typed so far can't be continued
+    manager.pending = NODE_NONE;
+    return 0;
+}
+
+static int
+trie_build(
+    uint32_t node,
+    size_t lo,
+    size_t hi,
+    uint32_t depth
+) {
+    // the children are allocated as one block, then filled in
+    uint32_t first = manager.nodes.len;
+    uint32_t count = 0;
+    uint64_t prev = 0;
+    for (size_t i = lo; i < hi; ++i) {
+        struct binding const* binding = ws_array_at(&manager.bindings, i);
+        uint64_t key = binding->keys[depth];
+        if (node == NODE_NONE) {
+            key |= (uint64_t) binding->mode << 48;
+        }
+        if (!count || (key != prev)) {
+            struct node child = { .key = key, .action = binding->action };
+            int res = ws_array_push(&manager.nodes, &child);
+            if (res < 0) {
+                return res;
+            }
+            ++count;
+            prev = key;
+        }
+    }
+
+    if (node == NODE_NONE) {
+        manager.nroots = count;
+    } else {
+        struct node* parent = ws_array_at(&manager.nodes, node);
+        parent->first = first;
+        parent->count = count;
+    }
+
+    // recurse into the ranges of bindings with more keys
+    size_t begin = lo;
+    for (uint32_t i = 0; i < count; ++i) {
+        struct node const* child = ws_array_at(&manager.nodes, first + i);
+        uint64_t key = child->key;
+        size_t end = begin;
+        while (end < hi) {
+            struct binding const* binding = ws_array_at(&manager.bindings,
+                                                        end);
+            uint64_t other = binding->keys[depth];
+            if (node == NODE_NONE) {
+                other |= (uint64_t) binding->mode << 48;
+            }
+            if (other != key) {
+                break;
+            }
+            ++end;
+        }
+
+        // chords never begin other chords, so a range is a leaf or a subtree
+        struct binding const* binding = ws_array_at(&manager.bindings, begin);
+        if (binding->nkeys > depth + 1) {
+            int res = trie_build(first + i, begin, end, depth + 1);
+            if (res < 0) {
+                return res;
+            }
+        }
+        begin = end;
+    }
+    return 0;
+}
+
+static int
+phash_build(void)
+{
+    // hash and displace: keys are distributed to buckets, and each bucket
+    // gets a seed under which its keys go to free slots, largest buckets first
+    uint32_t n = manager.nroots;
+    if (!n) {
+        return 0;
+    }
+
+    manager.nbuckets = 1;
+    while (manager.nbuckets * PHASH_BUCKET_KEYS < n) {
+        manager.nbuckets *= 2;
+    }
+    manager.nslots = n + n / 4 + 1;
+
+    uint32_t* order = malloc(n * sizeof(*order));
+    uint32_t* bucket_of = malloc(n * sizeof(*bucket_of));
+    uint32_t* members = malloc(n * sizeof(*members));
+    uint32_t* sizes = calloc(manager.nbuckets + 1, sizeof(*sizes));
+    manager.seeds = calloc(manager.nbuckets, sizeof(*manager.seeds));
+    if (!order || !bucket_of || !members || !sizes || !manager.seeds) {
+        free(order);
+        free(bucket_of);
+        free(members);
+        free(sizes);
+        return -ENOMEM;
+    }
+
+    struct node const* nodes = ws_array_at(&manager.nodes, 0);
+    for (uint32_t i = 0; i < n; ++i) {
+        bucket_of[i] = key_hash(nodes[i].key, 0) & (manager.nbuckets - 1);
+        ++sizes[bucket_of[i] + 1];
+    }
+
+    // group the keys by bucket, `sizes` turning into the buckets' offsets
+    uint32_t max = 0;
+    for (uint32_t b = 1; b <= manager.nbuckets; ++b) {
+        max = sizes[b] > max ? sizes[b] : max;
+        sizes[b] += sizes[b - 1];
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        members[sizes[bucket_of[i]]++] = i;
+    }
+    for (uint32_t b = manager.nbuckets; b > 0; --b) {
+        sizes[b] = sizes[b - 1];
+    }
+    sizes[0] = 0;
+
+    // order the keys by bucket, largest buckets first
+    uint32_t pos = 0;
+    for (uint32_t size = max; size > 0; --size) {
+        for (uint32_t b = 0; b < manager.nbuckets; ++b) {
+            if (sizes[b + 1] - sizes[b] == size) {
+                memcpy(order + pos, members + sizes[b], size * sizeof(*order));
+                pos += size;
+            }
+        }
+    }
+
+    int res = 0;
+    while (1) {
+        free(manager.slots);
+        manager.slots = malloc(manager.nslots * sizeof(*manager.slots));
+        if (!manager.slots) {
+            res = -ENOMEM;
+            break;
+        }
+        memset(manager.slots, 0xFF, manager.nslots * sizeof(*manager.slots));
+
+        bool placed = true;
+        for (pos = 0; (pos < n) && placed; ) {
+            uint32_t b = bucket_of[order[pos]];
+            uint32_t end = pos + sizes[b + 1] - sizes[b];
+
+            placed = false;
+            for (uint32_t seed = 1; seed < PHASH_SEED_MAX; ++seed) {
+                uint32_t i;
+                for (i = pos; i < end; ++i) {
+                    uint32_t slot = key_hash(nodes[order[i]].key, seed) %
+                                    manager.nslots;
+                    if (manager.slots[slot] != NODE_NONE) {
+                        break;
+                    }
+                    manager.slots[slot] = order[i];
+                }
+                if (i == end) {
+                    manager.seeds[b] = seed;
+                    placed = true;
+                    break;
+                }
+
+                // undo the partial placement
+                while (i-- > pos) {
+                    uint32_t slot = key_hash(nodes[order[i]].key, seed) %
+                                    manager.nslots;
+                    manager.slots[slot] = NODE_NONE;
+                }
+            }
+            pos = end;
+        }
+        if (placed) {
+            break;
+        }
+        manager.nslots *= 2;
+    }
+
+    free(order);
+    free(bucket_of);
+    free(members);
+    free(sizes);
+    return res;
+}
 
+static void
+tables_free(void)
+{
+    manager.nodes.len = 0;
+    manager.nroots = 0;
+    free(manager.seeds);
+    manager.seeds = NULL;
+    manager.nbuckets = 0;
+    free(manager.slots);
+    manager.slots = NULL;
+    manager.nslots = 0;
+}
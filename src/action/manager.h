@@ -25,9 +25,256 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_ACTION_MANAGER_H__
 #define __WS_ACTION_MANAGER_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "command/processor.h"
+#include "util/attributes.h"
+
+/**
+ * Priority classes of actions
+ *
+ * Triggered actions of a class run before those of the classes after it.
+ */
+enum ws_action_priority {
+    WS_ACTION_PRIORITY_INPUT, //!< direct responses to input
+    WS_ACTION_PRIORITY_LAYOUT, //!< rearranging windows
+    WS_ACTION_PRIORITY_BACKGROUND, //!< anything else, e.g. status updates
+    WS_ACTION_PRIORITY_COUNT, //!< number of priority classes
+};
+
+/**
+ * Scheduling policy of an action
+ */
+struct ws_action_policy {
+    enum ws_action_priority priority; //!< the priority class
+    uint32_t debounce; //!< quiet time before running, in ms, 0 for none
+    uint32_t rate; //!< maximum number of runs per second, 0 for no limit
+};
+
+/**
+ * An action: a named command script
+ *
+ * Actions are what keybindings and hooks trigger. The script is compiled once,
+ * when the action is defined, and the compiled program is cached with the
+ * action. Running an action never parses or walks a command tree.
+ */
+struct ws_action {
+    char* name; //!< name of the action
+    struct ws_command_program* program; //!< compiled script of the action
+    struct ws_action_policy policy; //!< scheduling policy
+    struct ws_action* next; //!< next action in the queue of its class
+    uint64_t due; //!< time the debounce ends, in ns
+    uint64_t next_run; //!< time the throttle allows the next run, in ns
+    uint64_t stamp; //!< number of the push which queued the action
+    bool queued; //!< whether the action was triggered and did not run yet
+};
+
+/**
+ * Maximum number of keys of a chord
+ */
+#define WS_ACTION_CHORD_MAX 8
+
+/**
+ * Number of modes keybindings may be defined for
+ */
+#define WS_ACTION_MODE_COUNT (1 << 16)
+
+/**
+ * A key, as pressed
+ */
+struct ws_action_key {
+    uint32_t keysym; //!< the keysym
+    uint16_t mods; //!< mask of the modifiers held
+};
+
+/**
+ * Outcome of dispatching a key
+ */
+enum ws_action_key_result {
+    WS_ACTION_KEY_NONE, //!< the key is not bound, any chord was abandoned
+    WS_ACTION_KEY_PENDING, //!< the key continues a chord
+    WS_ACTION_KEY_MATCH, //!< the key completes a binding
+};
+
+/**
+ * Initialize the action manager
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_action_manager_init(void);
+
+/**
+ * Deinitialize the action manager, freeing all actions
+ */
+void
+ws_action_manager_deinit(void);
+
+/**
+ * Define an action, or redefine an existing one
+ *
+ * The command list is compiled right away; the action manager does not keep a
+ * reference to it. If an action with the name exists, its program is
+ * replaced, so handles obtained via ws_action_manager_find() stay valid.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_action_manager_define(
+    char const* name, //!< Name of the action
+    struct ws_command_statement const* stmts, //!< The script of the action
+    size_t nstmts //!< Number of statements in the script
+)
+__ws_nonnull__(1);
+
+/**
+ * Find an action by name
+ *
+ * @return the action or NULL if there is no action with the name
+ */
+struct ws_action*
+ws_action_manager_find(
+    char const* name //!< Name of the action
+)
+__ws_nonnull__(1);
+
+/**
+ * Bind a key or chord to an action
+ *
+ * Keybindings are defined per mode, mode 0 being the one active initially.
+ * Binding a chord which is already bound in the mode replaces the action.
+ * Within a mode, no chord may be the beginning of another one.
+ *
+ * @return 0 on success, -EINVAL if the chord is empty, too long or the mode
+ *         out of range, -EEXIST if the chord conflicts with another one,
+ *         another negative error number otherwise
+ */
+int
+ws_action_manager_bind(
+    uint32_t mode, //!< The mode the binding is active in
+    struct ws_action_key const* keys, //!< The keys of the chord
+    size_t nkeys, //!< Number of keys
+    struct ws_action* action //!< The action to trigger
+)
+__ws_nonnull__(2, 4);
+
+/**
+ * Remove a keybinding
+ *
+ * @return 0 on success, -ENOENT if the chord is not bound in the mode,
+ *         another negative error number otherwise
+ */
+int
+ws_action_manager_unbind(
+    uint32_t mode, //!< The mode the binding is active in
+    struct ws_action_key const* keys, //!< The keys of the chord
+    size_t nkeys //!< Number of keys
+)
+__ws_nonnull__(2);
+
+/**
+ * Switch to another mode, abandoning any chord
+ *
+ * @return 0 on success, -EINVAL if the mode is out of range
+ */
+int
+ws_action_manager_set_mode(
+    uint32_t mode //!< The mode to switch to
+);
+
+/**
+ * Dispatch a key press
+ *
+ * The first key of a binding is looked up in a perfect hash table of all
+ * first keys of all modes, further keys of a chord in a trie. Either way, a
+ * key press resolves in constant time and without allocating. The tables are
+ * rebuilt whenever the bindings change, never on a key press.
+ *
+ * @return a ws_action_key_result. For WS_ACTION_KEY_MATCH, the action is
+ *         stored to `action`.
+ */
+int
+ws_action_manager_key(
+    struct ws_action_key key, //!< The key pressed
+    struct ws_action** action //!< Location to store the action to
+)
+__ws_nonnull__(2);
 
+/**
+ * Set the scheduling policy of an action
+ *
+ * Actions run as input-critical, without debounce or throttle, by default.
+ * If the action is triggered, the new policy applies from its next run on.
+ *
+ * @return 0 on success, -EINVAL if the priority class is out of range
+ */
+int
+ws_action_manager_set_policy(
+    struct ws_action* action, //!< The action
+    struct ws_action_policy const* policy //!< The policy
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Trigger an action
+ *
+ * The action is queued in its priority class and run by
+ * ws_action_manager_dispatch(). Triggering an action which is queued already
+ * doesn't queue it again: the triggers coalesce into one run, which happens
+ * once the action was not triggered for the debounce time, and not before
+ * the throttle allows it. This way, the latest of a flood of triggers, e.g.
+ * by autorepeat, wins.
+ */
+void
+ws_action_manager_trigger(
+    struct ws_action* action //!< The action
+)
+__ws_nonnull__(1);
+
+/**
+ * Run triggered actions which are due
+ *
+ * Actions are run by priority class, and in the order they were triggered
+ * within a class. At most `budget` actions run, except that each class after
+ * the first gets to run one action even if the budget is used up, so floods
+ * of higher priority actions don't starve the lower classes. Results are
+ * discarded.
+ *
+ * @return the number of actions run
+ */
+size_t
+ws_action_manager_dispatch(
+    size_t budget //!< Number of actions to run at most
+);
+
+/**
+ * Get the time until the next triggered action is due
+ *
+ * This is meant to be used as the timeout of the main loop's poll.
+ *
+ * @return the time in ms, rounded up, -1 if no action is triggered
+ */
+int
+ws_action_manager_timeout(void);
+
+/**
+ * Run an action
+ *
+ * The caller owns the result. Pass NULL for `result` to discard it.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_action_run(
+    struct ws_action const* action, //!< The action to run
+    struct ws_value* result //!< Location to store the result to
+)
+__ws_nonnull__(1);
 
 #endif // __WS_ACTION_MANAGER_H__
@@ -25,5 +25,923 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "command/processor.h"
+#include "logger/trace.h"
+#include "objects/queue.h"
+#include "objects/string.h"
+#include "util/arena.h"
+#include "util/arithmetical.h"
+#include "util/debug.h"
+#include "util/pool.h"
+#include "values/nil.h"
+
+/**
+ * Entry of the command registry
+ */
+struct registry_entry {
+    char const* name; //!< interned name of the command
+    struct ws_command const* command; //!< the command
+};
+
+/**
+ * State of the command processor
+ */
+struct ws_command_processor {
+    struct ws_queue queue; //!< calls posted, but not yet processed
+    struct ws_queue batches; //!< batches submitted, but not yet committed
+    struct ws_queue done; //!< calls completed by worker threads
+    size_t capacity; //!< capacity of the queues
+    struct ws_pool pool; //!< worker threads running offloaded calls
+    bool offload; //!< whether the worker threads are running
+    size_t inflight; //!< number of calls handed to the workers, not yet done
+    struct ws_command_batch* held; //!< batches popped, but not yet committed
+    struct ws_command_batch* held_tail; //!< last batch held back
+    size_t held_calls; //!< number of calls in the batches held back
+    struct ws_command_call** txn; //!< scratch space for the transaction
+    size_t txn_size; //!< capacity of the transaction scratch space
+    struct ws_command_call** seen; //!< scratch hash table for coalescing
+    size_t seen_size; //!< capacity of the hash table
+    struct ws_arena arena; //!< arena for values created while executing
+    struct registry_entry* registry; //!< commands, hashed by interned name
+    size_t registry_size; //!< number of slots in the registry
+    size_t ncommands; //!< number of registered commands
+};
+
+/**
+ * Logging context of the command processor
+ */
+static struct ws_logger_context const log_ctx = { .prefix = "command" };
+
+/**
+ * Number of registers a program may use without allocating the register file
+ */
+#define PROGRAM_STACK_REGS 64
+
+/**
+ * Size of the chunks of the arena for transient values
+ */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/**
+ * The command processor
+ */
+static struct ws_command_processor processor;
+
+/*
+ *
+ * Forward declarations
+ *
+ */
+
+/**
+ * Make sure the scratch space can hold a transaction of `ncalls` calls
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+reserve_scratch(
+    size_t ncalls //!< Number of calls in the transaction
+);
+
+/**
+ * Find the registry slot of a command
+ *
+ * @return the slot holding the command or the empty slot it would go to
+ */
+static struct registry_entry*
+registry_slot(
+    char const* name, //!< Name of the command, not necessarily interned
+    size_t len, //!< Length of the name
+    uint64_t hash //!< Hash of the name
+);
+
+/**
+ * Double the size of the command registry
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+grow_registry(void);
+
+/**
+ * Execute a call
+ *
+ * @return the return value of the command
+ */
+static int
+execute(
+    struct ws_command_call* call, //!< The call to execute
+    struct ws_value* result //!< Location to store the result to, nil
+);
+
+/**
+ * Process a call: hand it to a worker thread or execute it right away
+ *
+ * Calls executed right away are passed to their `done` function and freed.
+ */
+static void
+process(
+    struct ws_command_call* call, //!< The call to process
+    bool offload //!< Whether the call may be handed to a worker thread
+);
+
+/**
+ * Run an offloaded call, on a worker thread
+ */
+static void
+offload_run(
+    struct ws_pool_task* task //!< The task of the call
+);
+
+/**
+ * Hand the results of calls completed by worker threads to the callers
+ */
+static void
+reap(void);
+
+/**
+ * Run a program on a register file
+ *
+ * @return 0 on success, the error returned by the failing command otherwise
+ */
+static int
+run_program(
+    struct ws_command_program const* program, //!< The program to run
+    struct ws_value* regs, //!< The register file, initialized
+    struct ws_value* result //!< Location to store the result to
+);
+
+/**
+ * Drop superseded calls from a transaction
+ *
+ * Dropped calls are freed and their slot in the transaction set to NULL.
+ */
+static void
+coalesce(
+    struct ws_command_call** txn, //!< The transaction
+    size_t ncalls //!< Number of calls in the transaction
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+struct ws_command_call*
+ws_command_call_new(
+    struct ws_command const* command,
+    size_t nargs
+) {
+    struct ws_command_call* call;
+    call = calloc(1, sizeof(*call) + sizeof(*call->args) * nargs);
+    if (!call) {
+        return NULL;
+    }
+
+    call->command = command;
+    call->nargs = nargs;
+    return call;
+}
+
+void
+ws_command_call_free(
+    struct ws_command_call* call
+) {
+    if (!call) {
+        return;
+    }
+
+    for (size_t i = 0; i < call->nargs; ++i) {
+        ws_value_unref(call->args[i]);
+    }
+    free(call);
+}
+
+struct ws_command_batch*
+ws_command_batch_new(
+    size_t ncalls
+) {
+    struct ws_command_batch* batch;
+    batch = calloc(1, sizeof(*batch) + sizeof(*batch->calls) * ncalls);
+    if (!batch) {
+        return NULL;
+    }
+
+    batch->ncalls = ncalls;
+    return batch;
+}
+
+void
+ws_command_batch_free(
+    struct ws_command_batch* batch
+) {
+    if (!batch) {
+        return;
+    }
+
+    for (size_t i = 0; i < batch->ncalls; ++i) {
+        ws_command_call_free(batch->calls[i]);
+    }
+    free(batch);
+}
+
+int
+ws_command_compile(
+    struct ws_command_statement const* stmts,
+    size_t nstmts,
+    struct ws_command_program** program
+) {
+    size_t nregs = 0;
+    size_t ninsns = 1; // the final RET
+    size_t ncommands = 0;
+
+    if (!nstmts) {
+        return -EINVAL;
+    }
+
+    // first pass: size the program and validate the list
+    for (size_t i = 0; i < nstmts; ++i) {
+        if (!stmts[i].command) {
+            return -EINVAL;
+        }
+
+        for (size_t j = 0; j < stmts[i].nargs; ++j) {
+            struct ws_command_operand const* arg = stmts[i].args + j;
+            if (arg->kind == WS_COMMAND_OPERAND_RESULT) {
+                if (arg->result >= i) {
+                    return -EINVAL;
+                }
+                ++ninsns;
+            }
+        }
+
+        nregs += 1 + stmts[i].nargs;
+        ++ninsns;
+    }
+
+    if ((nregs > UINT16_MAX) || (nstmts > UINT16_MAX)) {
+        return -E2BIG;
+    }
+
+    // one allocation holding header, command table, image and code
+    size_t size = sizeof(**program);
+    size_t off_image = size + sizeof(*(*program)->commands) * nstmts;
+    off_image = (off_image + _Alignof(struct ws_value) - 1) &
+                ~(_Alignof(struct ws_value) - 1);
+    size_t off_code = off_image + sizeof(*(*program)->image) * nregs;
+    size = off_code + sizeof(*(*program)->code) * ninsns;
+
+    struct ws_command_program* prog = calloc(1, size);
+    if (!prog) {
+        return -ENOMEM;
+    }
+    prog->commands = (struct ws_command const**) (prog + 1);
+    prog->image = (struct ws_value*) ((char*) prog + off_image);
+    prog->code = (struct ws_command_insn*) ((char*) prog + off_code);
+    prog->nregs = nregs;
+
+    // second pass: emit code, remembering the result register of each
+    // statement for later references
+    struct ws_command_insn* insn = prog->code;
+    uint16_t* result_reg = malloc(sizeof(*result_reg) * nstmts);
+    if (!result_reg) {
+        free(prog);
+        return -ENOMEM;
+    }
+
+    uint16_t reg = 0;
+    for (size_t i = 0; i < nstmts; ++i) {
+        struct ws_command_statement const* stmt = stmts + i;
+        uint16_t base = reg;
+
+        for (size_t j = 0; j < stmt->nargs; ++j) {
+            struct ws_command_operand const* arg = stmt->args + j;
+            uint16_t dst = base + 1 + j;
+            if (arg->kind == WS_COMMAND_OPERAND_CONST) {
+                prog->image[dst] = ws_value_ref(arg->value);
+            } else {
+                *insn++ = (struct ws_command_insn) {
+                    .op = WS_COMMAND_OP_MOVE,
+                    .a = dst,
+                    .b = result_reg[arg->result],
+                };
+            }
+        }
+
+        // look up the command in the table, adding it if necessary
+        size_t cmd = 0;
+        while ((cmd < ncommands) && (prog->commands[cmd] != stmt->command)) {
+            ++cmd;
+        }
+        if (cmd == ncommands) {
+            prog->commands[ncommands++] = stmt->command;
+        }
+
+        *insn++ = (struct ws_command_insn) {
+            .op = WS_COMMAND_OP_CALL,
+            .a = cmd,
+            .b = base,
+            .c = stmt->nargs,
+        };
+
+        result_reg[i] = base;
+        reg += 1 + stmt->nargs;
+    }
+
+    *insn++ = (struct ws_command_insn) {
+        .op = WS_COMMAND_OP_RET,
+        .a = result_reg[nstmts - 1],
+    };
+
+    free(result_reg);
+    prog->ncommands = ncommands;
+    prog->ninsns = insn - prog->code;
+    *program = prog;
+    return 0;
+}
+
+int
+ws_command_program_run(
+    struct ws_command_program const* program,
+    struct ws_value* result
+) {
+    WS_TRACE_SCOPE("program");
+    struct ws_value stack_regs[PROGRAM_STACK_REGS];
+    struct ws_value* regs = stack_regs;
+    struct ws_value dummy = ws_value_nil();
+
+    if (program->nregs > PROGRAM_STACK_REGS) {
+        regs = malloc(sizeof(*regs) * program->nregs);
+        if (!regs) {
+            return -ENOMEM;
+        }
+    }
+
+    memcpy(regs, program->image, sizeof(*regs) * program->nregs);
+    int res = run_program(program, regs, result ? result : &dummy);
+    ws_value_unref(dummy);
+
+    // the result registers hold the only references on intermediate results
+    for (size_t i = 0; i < program->ninsns; ++i) {
+        if (program->code[i].op == WS_COMMAND_OP_CALL) {
+            ws_value_unref(regs[program->code[i].b]);
+        }
+    }
+
+    if (regs != stack_regs) {
+        free(regs);
+    }
+    return res;
+}
+
+void
+ws_command_program_free(
+    struct ws_command_program* program
+) {
+    if (!program) {
+        return;
+    }
+
+    // only slots of constants are non-nil in the image
+    for (size_t i = 0; i < program->nregs; ++i) {
+        ws_value_unref(program->image[i]);
+    }
+    free(program);
+}
+
+int
+ws_command_register(
+    struct ws_command const* command
+) {
+    char const* name = ws_string_intern(command->name, strlen(command->name));
+    if (!name) {
+        return -ENOMEM;
+    }
+
+    // keep the load factor at or below one half
+    if ((processor.ncommands + 1) * 2 > processor.registry_size) {
+        int res = grow_registry();
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    struct registry_entry* entry;
+    entry = registry_slot(name, ws_string_interned_len(name),
+                          ws_string_interned_hash(name));
+    if (entry->name) {
+        return -EEXIST;
+    }
+
+    entry->name = name;
+    entry->command = command;
+    ++processor.ncommands;
+    return 0;
+}
+
+struct ws_command const*
+ws_command_find(
+    char const* name,
+    size_t len
+) {
+    if (!processor.registry_size) {
+        return NULL;
+    }
+    return registry_slot(name, len, ws_string_hash_bytes(name, len))->command;
+}
+
+struct ws_command const*
+ws_command_find_interned(
+    char const* name
+) {
+    if (!processor.registry_size) {
+        return NULL;
+    }
+
+    size_t mask = processor.registry_size - 1;
+    size_t pos = ws_string_interned_hash(name) & mask;
+    struct registry_entry* entry;
+    while ((entry = processor.registry + pos)->name) {
+        if (entry->name == name) {
+            return entry->command;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+int
+ws_command_processor_init(
+    size_t capacity
+) {
+    int res = ws_queue_init(&processor.queue, capacity);
+    if (res < 0) {
+        return res;
+    }
+
+    res = ws_queue_init(&processor.batches, capacity);
+    if (res < 0) {
+        ws_queue_deinit(&processor.queue);
+        return res;
+    }
+
+    res = ws_queue_init(&processor.done, capacity);
+    if (res < 0) {
+        ws_queue_deinit(&processor.batches);
+        ws_queue_deinit(&processor.queue);
+        return res;
+    }
+
+    processor.capacity = processor.queue.mask + 1;
+    processor.inflight = 0;
+    res = ws_pool_init(&processor.pool, 0);
+    processor.offload = res >= 0;
+    if (!processor.offload) {
+        ws_warn(&log_ctx, "cannot start worker threads: %s", strerror(-res));
+    }
+
+    processor.held = NULL;
+    processor.held_tail = NULL;
+    processor.held_calls = 0;
+    processor.txn = NULL;
+    processor.txn_size = 0;
+    processor.seen = NULL;
+    processor.seen_size = 0;
+    ws_arena_init(&processor.arena, ARENA_CHUNK_SIZE);
+    return 0;
+}
+
+void
+ws_command_processor_deinit(void)
+{
+    if (processor.offload) {
+        ws_pool_deinit(&processor.pool);
+        processor.offload = false;
+    }
+    reap();
+    ws_queue_deinit(&processor.done);
+
+    void* call;
+    while (ws_queue_pop(&processor.queue, &call) == 0) {
+        ws_command_call_free(call);
+    }
+    ws_queue_deinit(&processor.queue);
+
+    void* batch;
+    while (ws_queue_pop(&processor.batches, &batch) == 0) {
+        ws_command_batch_free(batch);
+    }
+    ws_queue_deinit(&processor.batches);
+
+    while (processor.held) {
+        struct ws_command_batch* next = processor.held->next;
+        ws_command_batch_free(processor.held);
+        processor.held = next;
+    }
+    processor.held_tail = NULL;
+    processor.held_calls = 0;
+
+    free(processor.txn);
+    free(processor.seen);
+    ws_arena_deinit(&processor.arena);
+
+    free(processor.registry);
+    processor.registry = NULL;
+    processor.registry_size = 0;
+    processor.ncommands = 0;
+}
+
+int
+ws_command_processor_post(
+    struct ws_command_call* call
+) {
+    return ws_queue_push(&processor.queue, call);
+}
+
+int
+ws_command_processor_submit(
+    struct ws_command_batch* batch
+) {
+    return ws_queue_push(&processor.batches, batch);
+}
+
+size_t
+ws_command_processor_dispatch(void)
+{
+    WS_TRACE_SCOPE("dispatch");
+    void* batch[WS_COMMAND_BATCH_SIZE];
+    size_t executed = 0;
+
+    if (processor.inflight) {
+        struct ws_arena* prev = ws_value_use_arena(&processor.arena);
+        reap();
+        ws_value_use_arena(prev);
+        ws_arena_reset(&processor.arena);
+    }
+
+    while (executed < processor.capacity) {
+        size_t count = ws_queue_pop_batch(&processor.queue, batch,
+                                          WS_COMMAND_BATCH_SIZE);
+        if (!count) {
+            break;
+        }
+
+        // values created by the calls die with the batch
+        struct ws_arena* prev = ws_value_use_arena(&processor.arena);
+        for (size_t i = 0; i < count; ++i) {
+            process(batch[i], true);
+        }
+        ws_value_use_arena(prev);
+        ws_arena_reset(&processor.arena);
+
+        executed += count;
+    }
+
+    return executed;
+}
+
+ssize_t
+ws_command_processor_commit(void)
+{
+    WS_TRACE_SCOPE("commit");
+    void* batches[WS_COMMAND_BATCH_SIZE];
+    size_t ncalls = 0;
+    size_t executed = 0;
+    size_t count;
+
+    // queue the pending batches behind the ones held back by a failed commit
+    do {
+        count = ws_queue_pop_batch(&processor.batches, batches,
+                                   WS_COMMAND_BATCH_SIZE);
+
+        for (size_t b = 0; b < count; ++b) {
+            struct ws_command_batch* batch = batches[b];
+            batch->next = NULL;
+            if (processor.held_tail) {
+                processor.held_tail->next = batch;
+            } else {
+                processor.held = batch;
+            }
+            processor.held_tail = batch;
+            processor.held_calls += batch->ncalls;
+        }
+    } while (count == WS_COMMAND_BATCH_SIZE);
+
+    // running a batch on its own would overtake the ones before it, so the
+    // whole transaction waits until there is scratch space for it
+    if (reserve_scratch(processor.held_calls) < 0) {
+        ws_warn(&log_ctx, "cannot commit %zu calls: out of memory",
+                processor.held_calls);
+        return -ENOMEM;
+    }
+
+    // gather the calls of all pending batches into one transaction
+    struct ws_command_batch* batch = processor.held;
+    while (batch) {
+        struct ws_command_batch* next = batch->next;
+        for (size_t i = 0; i < batch->ncalls; ++i) {
+            if (batch->calls[i]) {
+                processor.txn[ncalls++] = batch->calls[i];
+            }
+        }
+
+        // the calls now belong to the transaction
+        free(batch);
+        batch = next;
+    }
+    processor.held = NULL;
+    processor.held_tail = NULL;
+    processor.held_calls = 0;
+
+    if (ncalls) {
+        coalesce(processor.txn, ncalls);
+    }
+
+    // values created by the calls die with the transaction, and all of them
+    // run here, so the frame sees the whole transaction applied
+    struct ws_arena* prev = ws_value_use_arena(&processor.arena);
+    for (size_t i = 0; i < ncalls; ++i) {
+        struct ws_command_call* call = processor.txn[i];
+        if (call) {
+            process(call, false);
+            ++executed;
+        }
+    }
+
+    ws_value_use_arena(prev);
+    ws_arena_reset(&processor.arena);
+    return executed;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static int
+reserve_scratch(
+    size_t ncalls
+) {
+    if (ncalls > processor.txn_size) {
+        size_t size = ws_round_up_pow2(ncalls);
+        struct ws_command_call** txn;
+
+        txn = realloc(processor.txn, sizeof(*txn) * size);
+        if (!txn) {
+            return -ENOMEM;
+        }
+        processor.txn = txn;
+        processor.txn_size = size;
+    }
+
+    // keep the load factor of the hash table at or below one half
+    if (ncalls * 2 > processor.seen_size) {
+        size_t size = ws_round_up_pow2(ncalls * 2);
+        struct ws_command_call** seen;
+
+        seen = realloc(processor.seen, sizeof(*seen) * size);
+        if (!seen) {
+            return -ENOMEM;
+        }
+        processor.seen = seen;
+        processor.seen_size = size;
+    }
+
+    return 0;
+}
+
+static struct registry_entry*
+registry_slot(
+    char const* name,
+    size_t len,
+    uint64_t hash
+) {
+    size_t mask = processor.registry_size - 1;
+    size_t pos = hash & mask;
+    struct registry_entry* entry;
+
+    while ((entry = processor.registry + pos)->name) {
+        if ((entry->name == name) ||
+                ((ws_string_interned_len(entry->name) == len) &&
+                 (memcmp(entry->name, name, len) == 0))) {
+            break;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return entry;
+}
+
+static int
+grow_registry(void)
+{
+    size_t old_size = processor.registry_size;
+    struct registry_entry* old = processor.registry;
+    size_t size = old_size ? old_size * 2 : 64;
+
+    processor.registry = calloc(size, sizeof(*processor.registry));
+    if (!processor.registry) {
+        processor.registry = old;
+        return -ENOMEM;
+    }
+    processor.registry_size = size;
+
+    for (size_t i = 0; i < old_size; ++i) {
+        if (old[i].name) {
+            char const* name = old[i].name;
+            *registry_slot(name, ws_string_interned_len(name),
+                           ws_string_interned_hash(name)) = old[i];
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+static int
+execute(
+    struct ws_command_call* call,
+    struct ws_value* result
+) {
+    WS_TRACE_SCOPE(call->command->name);
+    int res = call->command->func(call->args, call->nargs, result);
+    if (res < 0) {
+        ws_debug(&log_ctx, "%s failed: %s", call->command->name,
+                 strerror(-res));
+    }
+    return res;
+}
+
+static void
+process(
+    struct ws_command_call* call,
+    bool offload
+) {
+    // the done queue can hold all calls in flight, so workers never have to
+    // wait for the compositor thread to make room
+    if (offload && processor.offload &&
+            (call->command->flags & WS_COMMAND_OFFLOAD) &&
+            (processor.inflight < processor.capacity)) {
+        call->task.run = offload_run;
+        if (ws_pool_submit(&processor.pool, &call->task) == 0) {
+            ++processor.inflight;
+            return;
+        }
+    }
+
+    struct ws_value result = ws_value_nil();
+    int res = execute(call, &result);
+    if (call->done) {
+        call->done(call, res, &result);
+    }
+    ws_value_unref(result);
+    ws_command_call_free(call);
+}
+
+static void
+offload_run(
+    struct ws_pool_task* task
+) {
+    struct ws_command_call* call;
+    call = (struct ws_command_call*)
+           ((char*) task - offsetof(struct ws_command_call, task));
+
+    call->result = ws_value_nil();
+    call->res = execute(call, &call->result);
+    ws_queue_push(&processor.done, call);
+}
+
+static void
+reap(void)
+{
+    WS_TRACE_SCOPE("reap");
+    void* batch[WS_COMMAND_BATCH_SIZE];
+    size_t count;
+
+    do {
+        count = ws_queue_pop_batch(&processor.done, batch,
+                                   WS_COMMAND_BATCH_SIZE);
+        for (size_t i = 0; i < count; ++i) {
+            struct ws_command_call* call = batch[i];
+            if (call->done) {
+                call->done(call, call->res, &call->result);
+            }
+            ws_value_unref(call->result);
+            ws_command_call_free(call);
+        }
+        processor.inflight -= count;
+    } while (count == WS_COMMAND_BATCH_SIZE);
+}
+
+static int
+run_program(
+    struct ws_command_program const* program,
+    struct ws_value* regs,
+    struct ws_value* result
+) {
+    struct ws_command_insn const* ip = program->code;
+    int res;
+
+#ifdef __GNUC__
+    // direct threading: each handler jumps straight to the next one
+    static void* const handlers[] = {
+        [WS_COMMAND_OP_MOVE] = &&op_MOVE,
+        [WS_COMMAND_OP_CALL] = &&op_CALL,
+        [WS_COMMAND_OP_RET]  = &&op_RET,
+    };
+#   define DISPATCH() goto *handlers[ip->op]
+#   define OP(name) op_##name
+#else
+#   define DISPATCH() goto dispatch
+#   define OP(name) case WS_COMMAND_OP_##name
+#endif
+
+    DISPATCH();
+#ifndef __GNUC__
+dispatch:
+    switch (ip->op) {
+#endif
+
+OP(MOVE):
+    regs[ip->a] = regs[ip->b];
+    ++ip;
+    DISPATCH();
+
+OP(CALL):
+    {
+        struct ws_command const* command = program->commands[ip->a];
+        res = command->func(regs + ip->b + 1, ip->c, regs + ip->b);
+        if (res < 0) {
+            ws_debug(&log_ctx, "%s failed in program: %s", command->name,
+                     strerror(-res));
+            return res;
+        }
+        ++ip;
+        DISPATCH();
+    }
+
+OP(RET):
+    // hand the reference over to the caller
+    *result = regs[ip->a];
+    regs[ip->a] = ws_value_nil();
+    return 0;
+
+#ifndef __GNUC__
+    }
+    return -EINVAL;
+#endif
+
+#undef OP
+#undef DISPATCH
+}
+
+static void
+coalesce(
+    struct ws_command_call** txn,
+    size_t ncalls
+) {
+    size_t mask = processor.seen_size - 1;
+    for (size_t i = 0; i <= mask; ++i) {
+        processor.seen[i] = NULL;
+    }
+
+    // walk backwards, so the first call we see for a key is the one to keep
+    size_t i = ncalls;
+    while (i--) {
+        struct ws_command_call* call = txn[i];
+        if (!(call->command->flags & WS_COMMAND_COALESCE)) {
+            continue;
+        }
+
+        uintptr_t hash = (uintptr_t) call->command ^
+                         ((uintptr_t) call->target * 0x9E3779B97F4A7C15ull);
+        hash ^= hash >> 29;
+
+        size_t pos = hash & mask;
+        while (processor.seen[pos]) {
+            struct ws_command_call* other = processor.seen[pos];
+            if ((other->command == call->command) &&
+                    (other->target == call->target)) {
+                break;
+            }
+            pos = (pos + 1) & mask;
+        }
 
+        if (processor.seen[pos]) {
+            // superseded by a later call
+            ws_command_call_free(call);
+            txn[i] = NULL;
+        } else {
+            processor.seen[pos] = call;
+        }
+    }
+}
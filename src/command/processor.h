@@ -25,9 +25,407 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_COMMAND_PROCESSOR_H__
 #define __WS_COMMAND_PROCESSOR_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "util/attributes.h"
+#include "util/pool.h"
+#include "values/value.h"
+
+/**
+ * Number of commands the processor takes from its queue in one go
+ */
+#define WS_COMMAND_BATCH_SIZE 64
+
+/**
+ * Command flags
+ */
+enum ws_command_flags {
+    /**
+     * Successive calls on the same target supersede each other
+     *
+     * If a transaction contains several calls of such a command for the same
+     * target, only the last one is executed. Geometry updates are the
+     * prime example: only the final geometry matters.
+     */
+    WS_COMMAND_COALESCE = 1 << 0,
+
+    /**
+     * The command may run on a worker thread
+     *
+     * Commands which don't touch compositor state and may take a while, e.g.
+     * queries over large sets or serialization of big trees, should carry
+     * this flag, so they don't hold up the compositor thread. Such a command
+     * must only touch state which is safe to use from any thread. Values it
+     * creates are allocated from the heap rather than an arena.
+     *
+     * Only calls dispatched on their own are offloaded. Within a committed
+     * transaction, the command runs on the compositor thread like any other.
+     */
+    WS_COMMAND_OFFLOAD = 1 << 1,
+};
+
+/**
+ * Function implementing a command
+ *
+ * The arguments are borrowed: the command must not release them. The result
+ * slot is nil when the command is invoked; the command stores a value it owns
+ * a reference on, which is passed on to the caller.
+ *
+ * When run by the command processor, values created by the command are
+ * allocated from an arena which is reset after the batch. Values which are
+ * kept beyond the command, e.g. in compositor state, have to be passed through
+ * ws_value_persist().
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+typedef int (*ws_command_func)(
+    struct ws_value* args, //!< the arguments of the call
+    size_t nargs, //!< number of arguments
+    struct ws_value* result //!< location to store the result to
+);
+
+/**
+ * A command which can be invoked via the API
+ */
+struct ws_command {
+    char const* name; //!< name of the command
+    ws_command_func func; //!< implementation of the command
+    int flags; //!< flags, see enum ws_command_flags
+};
+
+struct ws_command_call;
+
+/**
+ * Function receiving the result of a call run by the processor
+ *
+ * It is always invoked on the compositor thread, even if the command ran on a
+ * worker thread. The result is borrowed: it has to be passed through
+ * ws_value_persist() to be kept. The call is freed once the function returns.
+ */
+typedef void (*ws_command_done_func)(
+    struct ws_command_call* call, //!< the call which completed
+    int res, //!< the return value of the command
+    struct ws_value* result //!< the result of the command
+);
+
+/**
+ * An invocation of a command, waiting to be processed
+ */
+struct ws_command_call {
+    struct ws_command const* command; //!< the command to invoke
+    void const* target; //!< object the call operates on, used for coalescing
+    ws_command_done_func done; //!< receives the result, NULL to discard it
+    void* data; //!< user data for `done`
+    struct ws_pool_task task; //!< task running the call on a worker thread
+    int res; //!< return value of a call run on a worker thread
+    struct ws_value result; //!< result of a call run on a worker thread
+    size_t nargs; //!< number of arguments
+    struct ws_value args[]; //!< the arguments, owned by the call
+};
+
+/**
+ * A batch of command calls, executed as one transaction
+ */
+struct ws_command_batch {
+    struct ws_command_batch* next; //!< next batch held back by the processor
+    size_t ncalls; //!< number of calls in the batch
+    struct ws_command_call* calls[]; //!< the calls, in order of execution
+};
+
+/**
+ * Kinds of operands of a statement
+ */
+enum ws_command_operand_kind {
+    WS_COMMAND_OPERAND_CONST, //!< a constant value
+    WS_COMMAND_OPERAND_RESULT, //!< the result of an earlier statement
+};
+
+/**
+ * Operand of a statement in a command list
+ */
+struct ws_command_operand {
+    enum ws_command_operand_kind kind; //!< kind of the operand
+    union {
+        struct ws_value value; //!< the constant, for constant operands
+        size_t result; //!< index of the statement whose result to use
+    };
+};
+
+/**
+ * A statement in a command list
+ *
+ * A command list is the source form of a command script: an array of
+ * statements which are executed in order. Arguments of a statement may refer
+ * to the result of an earlier statement, which is how nested command trees
+ * are expressed. The result of the last statement is the result of the list.
+ */
+struct ws_command_statement {
+    struct ws_command const* command; //!< the command to invoke
+    size_t nargs; //!< number of operands
+    struct ws_command_operand const* args; //!< the operands
+};
+
+/**
+ * Opcodes of compiled command programs
+ */
+enum ws_command_opcode {
+    WS_COMMAND_OP_MOVE, //!< copy register b to register a
+    WS_COMMAND_OP_CALL, //!< call command a, result in b, args after it
+    WS_COMMAND_OP_RET, //!< stop and return register a
+};
+
+/**
+ * Instruction of a compiled command program
+ */
+struct ws_command_insn {
+    uint16_t op; //!< the opcode, see enum ws_command_opcode
+    uint16_t a; //!< first operand
+    uint16_t b; //!< second operand
+    uint16_t c; //!< third operand
+};
+
+/**
+ * A command list compiled to bytecode
+ *
+ * Each statement owns a window of registers: one for its result, followed by
+ * one per argument. Constant arguments are baked into the initial register
+ * image, so at run time only results have to be moved around. The program
+ * holds references on its constants. It is allocated in one piece and freed
+ * with ws_command_program_free().
+ */
+struct ws_command_program {
+    size_t ncommands; //!< number of distinct commands used
+    struct ws_command const** commands; //!< commands referenced by CALLs
+    size_t nregs; //!< number of registers
+    struct ws_value* image; //!< initial register contents
+    size_t ninsns; //!< number of instructions
+    struct ws_command_insn* code; //!< the instructions
+};
+
+/**
+ * Allocate a command call with room for `nargs` arguments
+ *
+ * The arguments are initialized to nil. References on values stored as
+ * arguments are released when the call is freed.
+ *
+ * @return a new command call or NULL if the allocation failed
+ */
+struct ws_command_call*
+ws_command_call_new(
+    struct ws_command const* command, //!< The command to invoke
+    size_t nargs //!< Number of arguments
+)
+__ws_malloc__ __ws_nonnull__(1);
+
+/**
+ * Free a command call, releasing its arguments
+ */
+void
+ws_command_call_free(
+    struct ws_command_call* call //!< The call to free
+);
+
+/**
+ * Allocate a batch with room for `ncalls` calls
+ *
+ * The call pointers are initialized to NULL. The batch takes ownership of the
+ * calls stored in it.
+ *
+ * @return a new batch or NULL if the allocation failed
+ */
+struct ws_command_batch*
+ws_command_batch_new(
+    size_t ncalls //!< Number of calls
+)
+__ws_malloc__;
+
+/**
+ * Free a batch and all the calls in it
+ */
+void
+ws_command_batch_free(
+    struct ws_command_batch* batch //!< The batch to free
+);
+
+/**
+ * Compile a command list to a program
+ *
+ * @return 0 on success, a negative error number otherwise. -EINVAL is returned
+ *         for malformed lists, e.g. lists referring to results of statements
+ *         which are not executed before, -E2BIG for lists which are too large.
+ */
+int
+ws_command_compile(
+    struct ws_command_statement const* stmts, //!< The command list
+    size_t nstmts, //!< Number of statements in the list
+    struct ws_command_program** program //!< Location to store the program to
+)
+__ws_nonnull__(3);
+
+/**
+ * Run a compiled program
+ *
+ * The program stops at the first command which fails. The caller owns the
+ * result. Pass NULL for `result` to discard it.
+ *
+ * @return 0 on success, the error returned by the failing command otherwise
+ */
+int
+ws_command_program_run(
+    struct ws_command_program const* program, //!< The program to run
+    struct ws_value* result //!< Location to store the result to
+)
+__ws_nonnull__(1);
+
+/**
+ * Free a compiled program, releasing its constants
+ */
+void
+ws_command_program_free(
+    struct ws_command_program* program //!< The program to free
+);
+
+/**
+ * Register a command, so it can be looked up by name
+ *
+ * Commands must be registered before calls are posted, registration is not
+ * synchronized with lookups.
+ *
+ * @return 0 on success, -EEXIST if a command with the name is registered
+ *         already, another negative error number otherwise
+ */
+int
+ws_command_register(
+    struct ws_command const* command //!< The command to register
+)
+__ws_nonnull__(1);
+
+/**
+ * Find a registered command by name
+ *
+ * @return the command or NULL if there is no command with the name
+ */
+struct ws_command const*
+ws_command_find(
+    char const* name, //!< The name of the command
+    size_t len //!< Length of the name
+)
+__ws_nonnull__(1);
+
+/**
+ * Find a registered command by interned name
+ *
+ * This is cheaper than ws_command_find(): neither hashing nor string
+ * comparisons are involved.
+ *
+ * @return the command or NULL if there is no command with the name
+ */
+struct ws_command const*
+ws_command_find_interned(
+    char const* name //!< The name of the command, interned
+)
+__ws_nonnull__(1);
 
+/**
+ * Initialize the command processor
+ *
+ * This starts the worker threads for commands flagged WS_COMMAND_OFFLOAD. If
+ * they cannot be started, such commands run on the compositor thread.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_command_processor_init(
+    size_t capacity //!< Number of calls which may be pending at a time
+);
+
+/**
+ * Deinitialize the command processor
+ *
+ * Pending calls are discarded. Calls running on worker threads are waited for
+ * and their results handed to their `done` functions.
+ */
+void
+ws_command_processor_deinit(void);
+
+/**
+ * Post a command call to the processor
+ *
+ * This function may be called from any thread and never blocks. On success,
+ * the processor takes ownership of the call.
+ *
+ * @return 0 on success, -EAGAIN if the processor is congested
+ */
+int
+ws_command_processor_post(
+    struct ws_command_call* call //!< The call to post
+)
+__ws_nonnull__(1);
+
+/**
+ * Submit a batch of command calls to the processor
+ *
+ * The calls are not executed right away, but at the next frame boundary,
+ * together with all other batches submitted until then. See
+ * ws_command_processor_commit().
+ *
+ * This function may be called from any thread and never blocks. On success,
+ * the processor takes ownership of the batch.
+ *
+ * @return 0 on success, -EAGAIN if the processor is congested
+ */
+int
+ws_command_processor_submit(
+    struct ws_command_batch* batch //!< The batch to submit
+)
+__ws_nonnull__(1);
+
+/**
+ * Run pending command calls
+ *
+ * This function must only be called from the compositor thread. It executes
+ * at most one queue length worth of calls, so producers cannot keep it busy
+ * forever.
+ *
+ * Calls of commands flagged WS_COMMAND_OFFLOAD are handed to the worker
+ * threads instead. Their results are handed back to the `done` functions by
+ * the next dispatch after they completed, so this function should be called
+ * regularly, e.g. once per frame, even if no calls were posted.
+ *
+ * @return the number of calls executed or handed to worker threads
+ */
+size_t
+ws_command_processor_dispatch(void);
+
+/**
+ * Commit all batches submitted since the last commit
+ *
+ * This function must be called from the compositor thread at each frame
+ * boundary. The calls of all pending batches are merged into one transaction,
+ * in order of submission. Calls of commands flagged WS_COMMAND_COALESCE are
+ * dropped if a later call in the transaction supersedes them. The remaining
+ * calls are executed in one go, so the frame only ever sees the state after
+ * the whole transaction.
+ *
+ * There is no rollback: if a call fails, the following calls are still
+ * executed. Calls of commands flagged WS_COMMAND_OFFLOAD are executed right
+ * here as well, and passed to their `done` functions before this function
+ * returns.
+ *
+ * If the transaction cannot be set up for lack of memory, no call is executed.
+ * The batches are held back and committed, in order, by the next successful
+ * commit, together with the ones submitted until then.
+ *
+ * @return the number of calls executed, -ENOMEM if the transaction could not
+ *         be set up
+ */
+ssize_t
+ws_command_processor_commit(void);
 
 #endif // __WS_COMMAND_PROCESSOR_H__
@@ -0,0 +1,412 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // mremap()
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "compositor/buffer.h"
+#include "util/attributes.h"
+
+/**
+ * Entry of the buffer cache
+ */
+struct cache_entry {
+    struct ws_buffer* buffer; //!< the buffer, NULL for unused entries
+    uint64_t last_use; //!< tick of the last import hitting the entry
+};
+
+/**
+ * The buffer cache
+ *
+ * The cache is small, so a linear scan over the entries is all the lookup we
+ * need. When full, the least recently used buffer is evicted.
+ */
+static struct {
+    struct cache_entry entries[WS_BUFFER_CACHE_SIZE]; //!< the entries
+    uint64_t tick; //!< logical clock for LRU eviction
+    struct ws_buffer_cache_stats stats; //!< statistics
+} cache;
+
+/**
+ * Pool the current thread reads from, NULL if none
+ */
+static _Thread_local struct ws_shm_pool* volatile accessed_pool;
+
+/**
+ * Whether the SIGBUS handler is installed
+ */
+static bool sigbus_installed;
+
+/**
+ * Action for SIGBUS before the handler was installed
+ */
+static struct sigaction sigbus_prev;
+
+/**
+ * Install the SIGBUS handler, if not done already
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+sigbus_install(void);
+
+/**
+ * Handle SIGBUS raised by reading truncated client memory
+ */
+static void
+sigbus_handler(
+    int sig, //!< The signal
+    siginfo_t* info, //!< Information about the fault
+    void* context //!< The context of the faulting thread
+);
+
+/**
+ * Find the cache entry of a handle
+ *
+ * @return the entry or NULL if the handle is not cached
+ */
+static struct cache_entry*
+cache_find(
+    void const* handle //!< The handle to look for
+);
+
+/**
+ * Get a cache entry to store a new buffer in, evicting one if necessary
+ *
+ * @return the entry
+ */
+static struct cache_entry*
+cache_slot(void);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+struct ws_shm_pool*
+ws_shm_pool_new(
+    int fd,
+    size_t size
+) {
+    struct ws_shm_pool* self = NULL;
+    if (!size || (sigbus_install() < 0)) {
+        goto out;
+    }
+
+    self = malloc(sizeof(*self));
+    if (!self) {
+        goto out;
+    }
+
+    self->data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (self->data == MAP_FAILED) {
+        free(self);
+        self = NULL;
+        goto out;
+    }
+    self->size = size;
+    self->refcount = 1;
+    self->broken = false;
+
+out:
+    close(fd);
+    return self;
+}
+
+int
+ws_shm_pool_resize(
+    struct ws_shm_pool* self,
+    size_t size
+) {
+    if (size < self->size) {
+        return -EINVAL;
+    }
+    if (size == self->size) {
+        return 0;
+    }
+
+    void* data = mremap(self->data, self->size, size, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED) {
+        return -errno;
+    }
+
+    self->data = data;
+    self->size = size;
+    return 0;
+}
+
+void
+ws_shm_pool_begin_access(
+    struct ws_shm_pool* self
+) {
+    accessed_pool = self;
+}
+
+int
+ws_shm_pool_end_access(
+    struct ws_shm_pool* self
+) {
+    accessed_pool = NULL;
+    return self->broken ? -EFAULT : 0;
+}
+
+void
+ws_shm_pool_unref(
+    struct ws_shm_pool* self
+) {
+    if (!self || --self->refcount) {
+        return;
+    }
+
+    munmap(self->data, self->size);
+    free(self);
+}
+
+struct ws_buffer*
+ws_buffer_import_shm(
+    void const* handle,
+    struct ws_shm_pool* pool,
+    size_t offset,
+    int32_t width,
+    int32_t height,
+    int32_t stride
+) {
+    struct cache_entry* entry = cache_find(handle);
+    ++cache.stats.imports;
+
+    if (entry) {
+        struct ws_buffer* buffer = entry->buffer;
+        if ((buffer->pool == pool) && (buffer->offset == offset) &&
+                (buffer->width == width) && (buffer->height == height) &&
+                (buffer->stride == stride)) {
+            ++cache.stats.hits;
+            entry->last_use = ++cache.tick;
+            return ws_buffer_ref(buffer);
+        }
+
+        // the handle was reused for something else
+        ws_buffer_forget(handle);
+    }
+
+    // the pixels have to lie within the pool, we read them in place
+    if ((width <= 0) || (height <= 0) ||
+            ((int64_t) stride < (int64_t) width * 4) ||
+            (stride % 4) || (offset % 4) || (offset > pool->size) ||
+            ((size_t) stride * height > pool->size - offset)) {
+        return NULL;
+    }
+
+    struct ws_buffer* buffer = calloc(1, sizeof(*buffer));
+    if (!buffer) {
+        return NULL;
+    }
+
+    buffer->handle = handle;
+    buffer->pool = pool;
+    ++pool->refcount;
+    buffer->offset = offset;
+    buffer->width = width;
+    buffer->height = height;
+    buffer->stride = stride;
+    buffer->refcount = 1;
+
+    entry = cache_slot();
+    entry->buffer = ws_buffer_ref(buffer);
+    entry->last_use = ++cache.tick;
+    return buffer;
+}
+
+struct ws_buffer*
+ws_buffer_wrap(
+    void* data,
+    int32_t width,
+    int32_t height,
+    int32_t stride
+) {
+    if ((width <= 0) || (height <= 0) ||
+            ((int64_t) stride < (int64_t) width * 4) || (stride % 4)) {
+        return NULL;
+    }
+
+    struct ws_buffer* buffer = calloc(1, sizeof(*buffer));
+    if (!buffer) {
+        return NULL;
+    }
+
+    buffer->data = data;
+    buffer->width = width;
+    buffer->height = height;
+    buffer->stride = stride;
+    buffer->refcount = 1;
+    return buffer;
+}
+
+struct ws_buffer*
+ws_buffer_ref(
+    struct ws_buffer* self
+) {
+    ++self->refcount;
+    return self;
+}
+
+void
+ws_buffer_unref(
+    struct ws_buffer* self
+) {
+    if (!self || --self->refcount) {
+        return;
+    }
+
+    ws_shm_pool_unref(self->pool);
+    free(self);
+}
+
+void
+ws_buffer_forget(
+    void const* handle
+) {
+    struct cache_entry* entry = cache_find(handle);
+    if (!entry) {
+        return;
+    }
+
+    ws_buffer_unref(entry->buffer);
+    entry->buffer = NULL;
+}
+
+void
+ws_buffer_cache_get_stats(
+    struct ws_buffer_cache_stats* stats
+) {
+    *stats = cache.stats;
+}
+
+void
+ws_buffer_cache_clear(void)
+{
+    for (size_t i = 0; i < WS_BUFFER_CACHE_SIZE; ++i) {
+        ws_buffer_unref(cache.entries[i].buffer);
+        cache.entries[i].buffer = NULL;
+    }
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static int
+sigbus_install(void)
+{
+    if (sigbus_installed) {
+        return 0;
+    }
+
+    struct sigaction action = {
+        .sa_sigaction = sigbus_handler,
+        .sa_flags = SA_SIGINFO | SA_NODEFER,
+    };
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGBUS, &action, &sigbus_prev) < 0) {
+        return -errno;
+    }
+
+    sigbus_installed = true;
+    return 0;
+}
+
+static void
+sigbus_handler(
+    int sig __ws_unused__,
+    siginfo_t* info,
+    void* context __ws_unused__
+) {
+    struct ws_shm_pool* pool = accessed_pool;
+    char const* addr = info->si_addr;
+
+    if (pool && (addr >= (char const*) pool->data) &&
+            (addr < (char const*) pool->data + pool->size)) {
+        // zeroes in place of the pool: the faulting read is retried and
+        // succeeds
+        void* data = mmap(pool->data, pool->size, PROT_READ,
+                          MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+        if (data != MAP_FAILED) {
+            pool->broken = true;
+            return;
+        }
+    }
+
+    // not ours: the fault recurs once we return, and is handled the way it
+    // would have been without us
+    sigaction(SIGBUS, &sigbus_prev, NULL);
+}
+
+static struct cache_entry*
+cache_find(
+    void const* handle
+) {
+    for (size_t i = 0; i < WS_BUFFER_CACHE_SIZE; ++i) {
+        struct cache_entry* entry = cache.entries + i;
+        if (entry->buffer && (entry->buffer->handle == handle)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static struct cache_entry*
+cache_slot(void)
+{
+    struct cache_entry* lru = cache.entries;
+
+    for (size_t i = 0; i < WS_BUFFER_CACHE_SIZE; ++i) {
+        struct cache_entry* entry = cache.entries + i;
+        if (!entry->buffer) {
+            return entry;
+        }
+        if (entry->last_use < lru->last_use) {
+            lru = entry;
+        }
+    }
+
+    // evicting only drops the cache's reference, users keep theirs
+    ++cache.stats.evictions;
+    ws_buffer_unref(lru->buffer);
+    lru->buffer = NULL;
+    return lru;
+}
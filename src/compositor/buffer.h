@@ -0,0 +1,247 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __WS_COMPOSITOR_BUFFER_H__
+#define __WS_COMPOSITOR_BUFFER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/attributes.h"
+
+/**
+ * Number of imported buffers remembered by the buffer cache
+ */
+#define WS_BUFFER_CACHE_SIZE 64
+
+/**
+ * A shared memory pool of a client, mapped into our address space
+ *
+ * The pool is mapped read-only and shared, so the compositor reads client
+ * pixels right where the client wrote them.
+ *
+ * A client may truncate the memory behind the pool at any time, and reading
+ * past the end of the file raises SIGBUS. Reads from a pool therefore have
+ * to be bracketed by ws_shm_pool_begin_access() and ws_shm_pool_end_access():
+ * if the access faults, the pool's mapping is replaced by zeroed memory and
+ * the pool is marked broken, instead of the compositor being killed.
+ */
+struct ws_shm_pool {
+    void* data; //!< the mapping
+    size_t size; //!< size of the mapping
+    unsigned refcount; //!< references held by the client and buffers
+    volatile bool broken; //!< whether the client truncated the memory
+};
+
+/**
+ * A buffer of pixels
+ *
+ * A buffer is either a view into a shared memory pool, or wraps memory of the
+ * compositor. Pixels are 32 bit ARGB or XRGB. Buffers are reference counted;
+ * surfaces keep a reference on the buffer attached to them.
+ */
+struct ws_buffer {
+    void const* handle; //!< the client's handle of the buffer, if any
+    struct ws_shm_pool* pool; //!< the pool the buffer lives in, if any
+    void* data; //!< the pixels, if not in a pool
+    size_t offset; //!< offset of the pixels within the pool
+    int32_t width; //!< width in pixels
+    int32_t height; //!< height in pixels
+    int32_t stride; //!< distance between rows, in bytes
+    unsigned refcount; //!< number of references
+};
+
+/**
+ * Statistics of the buffer cache
+ */
+struct ws_buffer_cache_stats {
+    uint64_t imports; //!< number of buffers imported
+    uint64_t hits; //!< number of imports served from the cache
+    uint64_t evictions; //!< number of buffers evicted from the cache
+};
+
+/**
+ * Map a client's shared memory pool
+ *
+ * The file descriptor is closed: the mapping is all we need. The first pool
+ * installs the SIGBUS handler guarding accesses to pools.
+ *
+ * @return the pool or NULL on error
+ */
+struct ws_shm_pool*
+ws_shm_pool_new(
+    int fd, //!< File descriptor of the shared memory
+    size_t size //!< Size of the pool
+);
+
+/**
+ * Grow a pool
+ *
+ * Pools can only grow, as clients may still use the memory of buffers.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_shm_pool_resize(
+    struct ws_shm_pool* self, //!< The pool
+    size_t size //!< The new size
+)
+__ws_nonnull__(1);
+
+/**
+ * Start reading from a pool on the calling thread
+ *
+ * Only one pool may be accessed at a time per thread.
+ */
+void
+ws_shm_pool_begin_access(
+    struct ws_shm_pool* self //!< The pool
+)
+__ws_nonnull__(1);
+
+/**
+ * Stop reading from a pool on the calling thread
+ *
+ * @return 0 on success, -EFAULT if the pool turned out to be truncated
+ */
+int
+ws_shm_pool_end_access(
+    struct ws_shm_pool* self //!< The pool
+)
+__ws_nonnull__(1);
+
+/**
+ * Release a reference on a pool, unmapping it with the last one
+ */
+void
+ws_shm_pool_unref(
+    struct ws_shm_pool* self //!< The pool
+);
+
+/**
+ * Import a buffer from a shared memory pool
+ *
+ * If a buffer with the handle was imported before, the cached buffer is
+ * returned and nothing is mapped or copied. Otherwise, a new buffer referring
+ * to the memory in the pool is created and cached.
+ *
+ * @return a new reference on the buffer or NULL on error
+ */
+struct ws_buffer*
+ws_buffer_import_shm(
+    void const* handle, //!< The client's handle of the buffer
+    struct ws_shm_pool* pool, //!< The pool the buffer lives in
+    size_t offset, //!< Offset of the first pixel in the pool
+    int32_t width, //!< Width in pixels
+    int32_t height, //!< Height in pixels
+    int32_t stride //!< Distance between rows, in bytes
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Wrap memory of the compositor in a buffer
+ *
+ * The memory is not copied and must outlive the buffer.
+ *
+ * @return a new buffer or NULL on error
+ */
+struct ws_buffer*
+ws_buffer_wrap(
+    void* data, //!< The pixels
+    int32_t width, //!< Width in pixels
+    int32_t height, //!< Height in pixels
+    int32_t stride //!< Distance between rows, in bytes
+)
+__ws_nonnull__(1);
+
+/**
+ * Take a reference on a buffer
+ *
+ * @return the buffer
+ */
+struct ws_buffer*
+ws_buffer_ref(
+    struct ws_buffer* self //!< The buffer
+)
+__ws_nonnull__(1);
+
+/**
+ * Release a reference on a buffer, freeing it with the last one
+ */
+void
+ws_buffer_unref(
+    struct ws_buffer* self //!< The buffer
+);
+
+/**
+ * Drop a buffer from the cache
+ *
+ * To be called when the client destroys the buffer. Surfaces still showing
+ * the buffer keep their reference.
+ */
+void
+ws_buffer_forget(
+    void const* handle //!< The client's handle of the buffer
+)
+__ws_nonnull__(1);
+
+/**
+ * Get the pixels of a buffer
+ *
+ * The pointer is only valid until the pool of the buffer is resized.
+ *
+ * @return the first pixel
+ */
+static inline uint32_t const*
+ws_buffer_pixels(
+    struct ws_buffer const* self //!< The buffer
+) {
+    if (self->pool) {
+        return (uint32_t const*) ((char const*) self->pool->data +
+                                  self->offset);
+    }
+    return self->data;
+}
+
+/**
+ * Get the statistics of the buffer cache
+ */
+void
+ws_buffer_cache_get_stats(
+    struct ws_buffer_cache_stats* stats //!< Location to store the stats to
+)
+__ws_nonnull__(1);
+
+/**
+ * Drop all buffers from the cache
+ */
+void
+ws_buffer_cache_clear(void);
+
+#endif // __WS_COMPOSITOR_BUFFER_H__
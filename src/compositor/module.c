@@ -25,5 +25,485 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "command/processor.h"
 #include "compositor/module.h"
+#include "logger/trace.h"
+#include "objects/array.h"
+#include "util/attributes.h"
+#include "util/debug.h"
+
+/**
+ * Color of pixels not covered by any surface
+ */
+#define BACKGROUND_COLOR 0xFF000000u
+
+/**
+ * Logging context of the compositor
+ */
+static struct ws_logger_context const log_ctx = { .prefix = "compositor" };
+
+/**
+ * State of the compositor
+ */
+struct ws_compositor {
+    struct ws_compositor_backend* backend; //!< the backend
+    struct ws_array surfaces; //!< surfaces, bottom to top
+    struct ws_region damage; //!< output damage not caused by contents
+    struct ws_region frame_damage; //!< scratch region for repaints
+    struct ws_compositor_stats stats; //!< statistics
+};
+
+/**
+ * The compositor
+ */
+static struct ws_compositor compositor;
+
+/**
+ * Get the rectangle covering the whole output
+ *
+ * @return 0 on success, -ENODEV if the compositor has no backend
+ */
+static inline int
+output_rect(
+    struct ws_rect* rect //!< Location to store the rectangle to
+) {
+    if (!compositor.backend) {
+        return -ENODEV;
+    }
+
+    *rect = (struct ws_rect) {
+        0, 0,
+        compositor.backend->fb.width, compositor.backend->fb.height
+    };
+    return 0;
+}
+
+/**
+ * Damage an area of the output
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+damage_output(
+    struct ws_rect const* rect //!< The area to damage, in output coordinates
+);
+
+/**
+ * Find the index of a surface in the stacking order
+ *
+ * @return 0 on success, -ENOENT if the surface is not stacked
+ */
+static int
+surface_index(
+    struct ws_surface const* surface, //!< The surface to look for
+    size_t* index //!< Location to store the index to
+);
+
+/**
+ * Recomposite a rectangle of the output
+ */
+static void
+composite_rect(
+    struct ws_rect const* rect //!< The rectangle to repaint
+);
+
+/**
+ * Present callback of the headless backend
+ */
+static void
+headless_present(
+    struct ws_compositor_backend* self __ws_unused__, //!< The backend
+    struct ws_region const* damage __ws_unused__ //!< The damaged region
+);
+
+/**
+ * Destroy callback of the headless backend
+ */
+static void
+headless_destroy(
+    struct ws_compositor_backend* self //!< The backend
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+struct ws_compositor_backend*
+ws_compositor_backend_headless_new(
+    int32_t width,
+    int32_t height
+) {
+    if ((width <= 0) || (height <= 0)) {
+        return NULL;
+    }
+
+    struct ws_compositor_backend* self = calloc(1, sizeof(*self));
+    if (!self) {
+        return NULL;
+    }
+
+    self->fb.pixels = calloc((size_t) width * height, sizeof(uint32_t));
+    if (!self->fb.pixels) {
+        free(self);
+        return NULL;
+    }
+
+    self->fb.width = width;
+    self->fb.height = height;
+    self->fb.stride = width;
+    self->present = headless_present;
+    self->destroy = headless_destroy;
+    return self;
+}
+
+int
+ws_compositor_init(
+    struct ws_compositor_backend* backend
+) {
+    memset(&compositor, 0, sizeof(compositor));
+    compositor.backend = backend;
+    ws_array_init(&compositor.surfaces, sizeof(struct ws_surface*));
+    ws_region_init(&compositor.damage);
+    ws_region_init(&compositor.frame_damage);
+
+    return ws_compositor_damage_all();
+}
+
+void
+ws_compositor_deinit(void)
+{
+    while (compositor.surfaces.len) {
+        struct ws_surface** top = ws_array_at(&compositor.surfaces,
+                                              compositor.surfaces.len - 1);
+        ws_compositor_surface_destroy(*top);
+    }
+
+    ws_array_deinit(&compositor.surfaces);
+    ws_region_deinit(&compositor.damage);
+    ws_region_deinit(&compositor.frame_damage);
+
+    ws_buffer_cache_clear();
+
+    if (compositor.backend) {
+        compositor.backend->destroy(compositor.backend);
+        compositor.backend = NULL;
+    }
+}
+
+struct ws_surface*
+ws_compositor_surface_new(
+    struct ws_rect const* geometry
+) {
+    struct ws_surface* surface = calloc(1, sizeof(*surface));
+    if (!surface) {
+        return NULL;
+    }
+
+    surface->geometry = *geometry;
+    ws_region_init(&surface->damage);
+
+    if (ws_array_push(&compositor.surfaces, &surface) < 0) {
+        ws_region_deinit(&surface->damage);
+        free(surface);
+        return NULL;
+    }
+    return surface;
+}
+
+void
+ws_compositor_surface_destroy(
+    struct ws_surface* surface
+) {
+    if (!surface) {
+        return;
+    }
+
+    // whatever was below the surface shows up again
+    damage_output(&surface->geometry);
+
+    size_t index;
+    if (surface_index(surface, &index) == 0) {
+        ws_array_remove(&compositor.surfaces, index);
+    }
+    ws_buffer_unref(surface->buffer);
+    ws_region_deinit(&surface->damage);
+    free(surface);
+}
+
+void
+ws_surface_attach(
+    struct ws_surface* surface,
+    struct ws_buffer* buffer
+) {
+    if (buffer) {
+        ws_buffer_ref(buffer);
+    }
+    ws_buffer_unref(surface->buffer);
+    surface->buffer = buffer;
+}
+
+int
+ws_surface_damage(
+    struct ws_surface* surface,
+    struct ws_rect const* rect
+) {
+    struct ws_rect bounds = {
+        0, 0, surface->geometry.width, surface->geometry.height
+    };
+    struct ws_rect clipped;
+
+    if (!ws_rect_intersect(rect, &bounds, &clipped)) {
+        return 0;
+    }
+    return ws_region_add(&surface->damage, &clipped);
+}
+
+int
+ws_surface_set_geometry(
+    struct ws_surface* surface,
+    struct ws_rect const* geometry
+) {
+    int res = damage_output(&surface->geometry);
+    if (res < 0) {
+        return res;
+    }
+
+    surface->geometry = *geometry;
+    return damage_output(&surface->geometry);
+}
+
+int
+ws_compositor_raise(
+    struct ws_surface* surface
+) {
+    size_t index;
+    int res = surface_index(surface, &index);
+    if (res < 0) {
+        return res;
+    }
+    if (index + 1 == compositor.surfaces.len) {
+        return 0;
+    }
+
+    ws_array_move(&compositor.surfaces, index, compositor.surfaces.len - 1);
+    return damage_output(&surface->geometry);
+}
+
+int
+ws_compositor_damage_all(void)
+{
+    struct ws_rect rect;
+    int res = output_rect(&rect);
+    if (res < 0) {
+        return res;
+    }
+    return damage_output(&rect);
+}
+
+int64_t
+ws_compositor_repaint(void)
+{
+    WS_TRACE_SCOPE("repaint");
+    struct ws_region* damage = &compositor.frame_damage;
+    struct ws_rect output;
+    int res = output_rect(&output);
+    if (res < 0) {
+        return res;
+    }
+
+    // gather the damage of the frame, in output coordinates
+    ws_region_clear(damage);
+    res = ws_region_add_region(damage, &compositor.damage, 0, 0, &output);
+    if (res < 0) {
+        return res;
+    }
+
+    for (size_t i = 0; i < compositor.surfaces.len; ++i) {
+        struct ws_surface* surface;
+        surface = *(struct ws_surface**) ws_array_at(&compositor.surfaces, i);
+
+        struct ws_rect clip;
+        if (ws_rect_intersect(&surface->geometry, &output, &clip)) {
+            res = ws_region_add_region(damage, &surface->damage,
+                                       surface->geometry.x,
+                                       surface->geometry.y, &clip);
+            if (res < 0) {
+                return res;
+            }
+        }
+    }
+
+    if (ws_region_empty(damage)) {
+        ++compositor.stats.frames_skipped;
+        compositor.stats.last_frame_pixels = 0;
+        return 0;
+    }
+
+    size_t count;
+    struct ws_rect const* rects = ws_region_rects(damage, &count);
+    {
+        WS_TRACE_SCOPE("composite");
+        for (size_t i = 0; i < count; ++i) {
+            composite_rect(rects + i);
+        }
+    }
+    {
+        WS_TRACE_SCOPE("present");
+        compositor.backend->present(compositor.backend, damage);
+    }
+
+    // the damage is dealt with
+    ws_region_clear(&compositor.damage);
+    for (size_t i = 0; i < compositor.surfaces.len; ++i) {
+        struct ws_surface* surface;
+        surface = *(struct ws_surface**) ws_array_at(&compositor.surfaces, i);
+        ws_region_clear(&surface->damage);
+    }
+
+    uint64_t pixels = ws_region_area(damage);
+    ++compositor.stats.frames;
+    compositor.stats.pixels += pixels;
+    compositor.stats.last_frame_pixels = pixels;
+    ws_debug(&log_ctx, "frame %llu: %zu rectangles, %llu pixels",
+             (unsigned long long) compositor.stats.frames, count,
+             (unsigned long long) pixels);
+    return pixels;
+}
+
+int64_t
+ws_compositor_frame(void)
+{
+    WS_TRACE_SCOPE("frame");
+    // a failed commit is retried with the next frame, the state is unchanged
+    ws_command_processor_commit();
+    return ws_compositor_repaint();
+}
+
+void
+ws_compositor_get_stats(
+    struct ws_compositor_stats* stats
+) {
+    *stats = compositor.stats;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static int
+damage_output(
+    struct ws_rect const* rect
+) {
+    struct ws_rect output;
+    struct ws_rect clipped;
+    int res = output_rect(&output);
+    if (res < 0) {
+        return res;
+    }
+
+    if (!ws_rect_intersect(rect, &output, &clipped)) {
+        return 0;
+    }
+    return ws_region_add(&compositor.damage, &clipped);
+}
+
+static int
+surface_index(
+    struct ws_surface const* surface,
+    size_t* index
+) {
+    size_t i = compositor.surfaces.len;
+    while (i--) {
+        if (*(struct ws_surface**) ws_array_at(&compositor.surfaces, i) ==
+                surface) {
+            *index = i;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+static void
+composite_rect(
+    struct ws_rect const* rect
+) {
+    struct ws_framebuffer* fb = &compositor.backend->fb;
+
+    for (int32_t y = rect->y; y < rect->y + rect->height; ++y) {
+        uint32_t* row = fb->pixels + y * fb->stride;
+        for (int32_t x = rect->x; x < rect->x + rect->width; ++x) {
+            row[x] = BACKGROUND_COLOR;
+        }
+    }
+
+    // surfaces are opaque, so painting bottom to top does the job
+    for (size_t i = 0; i < compositor.surfaces.len; ++i) {
+        struct ws_surface* surface;
+        surface = *(struct ws_surface**) ws_array_at(&compositor.surfaces, i);
+
+        struct ws_buffer const* buffer = surface->buffer;
+        if (!buffer) {
+            continue;
+        }
+
+        // only the part of the surface the buffer covers is painted
+        struct ws_rect const* geometry = &surface->geometry;
+        struct ws_rect covered = {
+            geometry->x, geometry->y,
+            buffer->width < geometry->width ? buffer->width : geometry->width,
+            buffer->height < geometry->height ? buffer->height
+                                              : geometry->height,
+        };
+
+        struct ws_rect area;
+        if (!ws_rect_intersect(rect, &covered, &area)) {
+            continue;
+        }
+
+        // read straight from the client's memory, which the client may
+        // truncate under our feet
+        uint32_t const* pixels = ws_buffer_pixels(buffer);
+        size_t stride = buffer->stride / sizeof(uint32_t);
+        int32_t sx = area.x - surface->geometry.x;
+        int32_t sy = area.y - surface->geometry.y;
+        bool broken = buffer->pool && buffer->pool->broken;
+        if (buffer->pool) {
+            ws_shm_pool_begin_access(buffer->pool);
+        }
+        for (int32_t y = 0; y < area.height; ++y) {
+            memcpy(fb->pixels + (area.y + y) * fb->stride + area.x,
+                   pixels + (sy + y) * stride + sx,
+                   area.width * sizeof(uint32_t));
+        }
+        if (buffer->pool && (ws_shm_pool_end_access(buffer->pool) < 0) &&
+                !broken) {
+            ws_warn(&log_ctx, "client truncated the memory of a buffer");
+        }
+    }
+}
+
+static void
+headless_present(
+    struct ws_compositor_backend* self __ws_unused__,
+    struct ws_region const* damage __ws_unused__
+) {
+    // nothing to show, the framebuffer is all there is
+}
 
+static void
+headless_destroy(
+    struct ws_compositor_backend* self
+) {
+    free(self->fb.pixels);
+    free(self);
+}
@@ -25,9 +25,210 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_COMPOSITOR_MODULE_H__
 #define __WS_COMPOSITOR_MODULE_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compositor/buffer.h"
+#include "compositor/region.h"
+#include "util/attributes.h"
+
+/**
+ * A framebuffer the compositor renders to
+ *
+ * Pixels are 32 bit ARGB.
+ */
+struct ws_framebuffer {
+    uint32_t* pixels; //!< the pixels
+    int32_t width; //!< width in pixels
+    int32_t height; //!< height in pixels
+    size_t stride; //!< distance between rows, in pixels
+};
+
+/**
+ * A backend, providing a framebuffer and showing its contents
+ */
+struct ws_compositor_backend {
+    struct ws_framebuffer fb; //!< framebuffer to render to
+    /**
+     * Show the framebuffer; only pixels within `damage` changed
+     */
+    void (*present)(struct ws_compositor_backend* self,
+                    struct ws_region const* damage);
+    /**
+     * Destroy the backend
+     */
+    void (*destroy)(struct ws_compositor_backend* self);
+};
+
+/**
+ * A surface: a client's window contents, placed on the output
+ */
+struct ws_surface {
+    struct ws_rect geometry; //!< position and size on the output
+    struct ws_buffer* buffer; //!< contents, NULL if nothing is attached
+    struct ws_region damage; //!< damage since the last frame, surface-local
+};
+
+/**
+ * Statistics of the compositor
+ */
+struct ws_compositor_stats {
+    uint64_t frames; //!< number of frames repainted
+    uint64_t frames_skipped; //!< number of frames without any damage
+    uint64_t pixels; //!< total number of pixels repainted
+    uint64_t last_frame_pixels; //!< number of pixels repainted last frame
+};
+
+/**
+ * Create a headless backend
+ *
+ * The headless backend renders into memory and shows nothing. It is meant for
+ * testing and for running the compositor without any display.
+ *
+ * @return the backend or NULL on error
+ */
+struct ws_compositor_backend*
+ws_compositor_backend_headless_new(
+    int32_t width, //!< Width of the framebuffer
+    int32_t height //!< Height of the framebuffer
+);
+
+/**
+ * Initialize the compositor
+ *
+ * The compositor takes ownership of the backend. The first frame repaints the
+ * whole output.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_compositor_init(
+    struct ws_compositor_backend* backend //!< The backend to use
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize the compositor, destroying all surfaces and the backend
+ */
+void
+ws_compositor_deinit(void);
+
+/**
+ * Create a surface
+ *
+ * The surface is placed on top of all others.
+ *
+ * @return the surface or NULL on error
+ */
+struct ws_surface*
+ws_compositor_surface_new(
+    struct ws_rect const* geometry //!< Initial geometry of the surface
+)
+__ws_nonnull__(1);
+
+/**
+ * Destroy a surface, damaging the area it covered
+ */
+void
+ws_compositor_surface_destroy(
+    struct ws_surface* surface //!< The surface to destroy
+);
+
+/**
+ * Attach new contents to a surface
+ *
+ * The surface takes a reference on the buffer and reads the pixels from it
+ * directly while compositing; they are never copied. Only the regions damaged
+ * via ws_surface_damage() are repainted.
+ */
+void
+ws_surface_attach(
+    struct ws_surface* surface, //!< The surface
+    struct ws_buffer* buffer //!< The new contents, may be NULL
+)
+__ws_nonnull__(1);
+
+/**
+ * Mark part of a surface as changed
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_surface_damage(
+    struct ws_surface* surface, //!< The surface
+    struct ws_rect const* rect //!< The changed area, surface-local
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Move or resize a surface
+ *
+ * Both the old and the new area are damaged.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_surface_set_geometry(
+    struct ws_surface* surface, //!< The surface
+    struct ws_rect const* geometry //!< The new geometry
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Put a surface on top of all others
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_compositor_raise(
+    struct ws_surface* surface //!< The surface to raise
+)
+__ws_nonnull__(1);
+
+/**
+ * Damage the whole output, forcing a full repaint
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_compositor_damage_all(void);
 
+/**
+ * Repaint the damaged parts of the output
+ *
+ * The damage of all surfaces is accumulated, translated to output
+ * coordinates and merged with damage caused by moving surfaces around. Only
+ * the pixels in the resulting region are recomposited and presented. If
+ * nothing is damaged, nothing is done at all.
+ *
+ * @return the number of pixels repainted, or a negative error number
+ */
+int64_t
+ws_compositor_repaint(void);
+
+/**
+ * Run one frame
+ *
+ * Commits the command transaction of the frame (see
+ * ws_command_processor_commit()) and repaints the output. The command
+ * processor must be initialized.
+ *
+ * @return the number of pixels repainted, or a negative error number
+ */
+int64_t
+ws_compositor_frame(void);
+
+/**
+ * Get the statistics of the compositor
+ */
+void
+ws_compositor_get_stats(
+    struct ws_compositor_stats* stats //!< Location to store the stats to
+)
+__ws_nonnull__(1);
 
 #endif // __WS_COMPOSITOR_MODULE_H__
@@ -0,0 +1,269 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "compositor/region.h"
+
+/**
+ * Maximum number of pieces a rectangle is cut into while adding it
+ */
+#define MAX_PIECES (4 * WS_REGION_MAX_RECTS)
+
+/**
+ * Cut a rectangle out of another one
+ *
+ * @return the number of pieces of `rect` not covered by `cut`, at most four
+ */
+static size_t
+subtract(
+    struct ws_rect const* rect, //!< The rectangle to cut from
+    struct ws_rect const* cut, //!< The rectangle to cut out
+    struct ws_rect* pieces //!< Array of four rectangles to store pieces to
+);
+
+/**
+ * Collapse a region, plus a rectangle, to their bounding box
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+collapse(
+    struct ws_region* self, //!< The region
+    struct ws_rect const* rect //!< The rectangle to include
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+bool
+ws_rect_intersect(
+    struct ws_rect const* a,
+    struct ws_rect const* b,
+    struct ws_rect* result
+) {
+    int32_t x1 = a->x > b->x ? a->x : b->x;
+    int32_t y1 = a->y > b->y ? a->y : b->y;
+    int32_t x2 = a->x + a->width < b->x + b->width ? a->x + a->width
+                                                   : b->x + b->width;
+    int32_t y2 = a->y + a->height < b->y + b->height ? a->y + a->height
+                                                     : b->y + b->height;
+
+    *result = (struct ws_rect) { x1, y1, x2 - x1, y2 - y1 };
+    return !ws_rect_empty(result);
+}
+
+void
+ws_region_init(
+    struct ws_region* self
+) {
+    ws_array_init(&self->rects, sizeof(struct ws_rect));
+}
+
+void
+ws_region_deinit(
+    struct ws_region* self
+) {
+    ws_array_deinit(&self->rects);
+}
+
+void
+ws_region_clear(
+    struct ws_region* self
+) {
+    self->rects.len = 0;
+}
+
+int
+ws_region_add(
+    struct ws_region* self,
+    struct ws_rect const* rect
+) {
+    struct ws_rect buf[2][MAX_PIECES];
+    struct ws_rect* pieces = buf[0];
+    size_t npieces = 1;
+    size_t count;
+    struct ws_rect const* rects = ws_region_rects(self, &count);
+
+    if (ws_rect_empty(rect)) {
+        return 0;
+    }
+    pieces[0] = *rect;
+
+    // cut away whatever is covered already
+    for (size_t i = 0; (i < count) && npieces; ++i) {
+        struct ws_rect* next = pieces == buf[0] ? buf[1] : buf[0];
+        size_t nnext = 0;
+
+        for (size_t p = 0; p < npieces; ++p) {
+            if (nnext + 4 > MAX_PIECES) {
+                return collapse(self, rect);
+            }
+            nnext += subtract(pieces + p, rects + i, next + nnext);
+        }
+
+        pieces = next;
+        npieces = nnext;
+    }
+
+    if (count + npieces > WS_REGION_MAX_RECTS) {
+        return collapse(self, rect);
+    }
+
+    for (size_t p = 0; p < npieces; ++p) {
+        int res = ws_array_push(&self->rects, pieces + p);
+        if (res < 0) {
+            return res;
+        }
+    }
+    return 0;
+}
+
+int
+ws_region_add_region(
+    struct ws_region* self,
+    struct ws_region const* other,
+    int32_t dx,
+    int32_t dy,
+    struct ws_rect const* clip
+) {
+    size_t count;
+    struct ws_rect const* rects = ws_region_rects(other, &count);
+
+    for (size_t i = 0; i < count; ++i) {
+        struct ws_rect rect = rects[i];
+        rect.x += dx;
+        rect.y += dy;
+
+        if (ws_rect_intersect(&rect, clip, &rect)) {
+            int res = ws_region_add(self, &rect);
+            if (res < 0) {
+                return res;
+            }
+        }
+    }
+    return 0;
+}
+
+uint64_t
+ws_region_area(
+    struct ws_region const* self
+) {
+    size_t count;
+    struct ws_rect const* rects = ws_region_rects(self, &count);
+    uint64_t area = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        area += (uint64_t) rects[i].width * rects[i].height;
+    }
+    return area;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static size_t
+subtract(
+    struct ws_rect const* rect,
+    struct ws_rect const* cut,
+    struct ws_rect* pieces
+) {
+    struct ws_rect overlap;
+    if (!ws_rect_intersect(rect, cut, &overlap)) {
+        pieces[0] = *rect;
+        return 1;
+    }
+
+    size_t n = 0;
+    int32_t right = rect->x + rect->width;
+    int32_t bottom = rect->y + rect->height;
+    int32_t overlap_bottom = overlap.y + overlap.height;
+
+    // full-width band above the overlap
+    if (overlap.y > rect->y) {
+        pieces[n++] = (struct ws_rect) {
+            rect->x, rect->y, rect->width, overlap.y - rect->y
+        };
+    }
+    // full-width band below the overlap
+    if (overlap_bottom < bottom) {
+        pieces[n++] = (struct ws_rect) {
+            rect->x, overlap_bottom, rect->width, bottom - overlap_bottom
+        };
+    }
+    // left and right of the overlap, within its band
+    if (overlap.x > rect->x) {
+        pieces[n++] = (struct ws_rect) {
+            rect->x, overlap.y, overlap.x - rect->x, overlap.height
+        };
+    }
+    if (overlap.x + overlap.width < right) {
+        pieces[n++] = (struct ws_rect) {
+            overlap.x + overlap.width, overlap.y,
+            right - overlap.x - overlap.width, overlap.height
+        };
+    }
+
+    return n;
+}
+
+static int
+collapse(
+    struct ws_region* self,
+    struct ws_rect const* rect
+) {
+    size_t count;
+    struct ws_rect const* rects = ws_region_rects(self, &count);
+    int32_t x1 = rect->x;
+    int32_t y1 = rect->y;
+    int32_t x2 = rect->x + rect->width;
+    int32_t y2 = rect->y + rect->height;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (rects[i].x < x1) {
+            x1 = rects[i].x;
+        }
+        if (rects[i].y < y1) {
+            y1 = rects[i].y;
+        }
+        if (rects[i].x + rects[i].width > x2) {
+            x2 = rects[i].x + rects[i].width;
+        }
+        if (rects[i].y + rects[i].height > y2) {
+            y2 = rects[i].y + rects[i].height;
+        }
+    }
+
+    ws_region_clear(self);
+    struct ws_rect extents = { x1, y1, x2 - x1, y2 - y1 };
+    return ws_array_push(&self->rects, &extents);
+}
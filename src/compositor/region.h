@@ -0,0 +1,181 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __WS_COMPOSITOR_REGION_H__
+#define __WS_COMPOSITOR_REGION_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "objects/array.h"
+#include "util/attributes.h"
+
+/**
+ * Maximum number of rectangles a region is made of
+ *
+ * Regions with more rectangles are collapsed to their bounding box. Repainting
+ * a few pixels too many is cheaper than juggling lots of tiny rectangles.
+ */
+#define WS_REGION_MAX_RECTS 32
+
+/**
+ * A rectangle
+ */
+struct ws_rect {
+    int32_t x; //!< left edge
+    int32_t y; //!< top edge
+    int32_t width; //!< width, rectangles with zero width are empty
+    int32_t height; //!< height, rectangles with zero height are empty
+};
+
+/**
+ * A region: a set of pixels, made of disjoint rectangles
+ */
+struct ws_region {
+    struct ws_array rects; //!< the rectangles, which never overlap
+};
+
+/**
+ * Check whether a rectangle is empty
+ *
+ * @return true if the rectangle contains no pixels, false otherwise
+ */
+static inline bool
+ws_rect_empty(
+    struct ws_rect const* rect //!< The rectangle
+) {
+    return (rect->width <= 0) || (rect->height <= 0);
+}
+
+/**
+ * Intersect two rectangles
+ *
+ * @return true if the intersection is not empty, false otherwise
+ */
+bool
+ws_rect_intersect(
+    struct ws_rect const* a, //!< The first rectangle
+    struct ws_rect const* b, //!< The second rectangle
+    struct ws_rect* result //!< Location to store the intersection to
+)
+__ws_nonnull__(1, 2, 3);
+
+/**
+ * Initialize an empty region
+ */
+void
+ws_region_init(
+    struct ws_region* self //!< The region to initialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize a region
+ */
+void
+ws_region_deinit(
+    struct ws_region* self //!< The region to deinitialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Make a region empty
+ *
+ * The memory of the region is kept for reuse.
+ */
+void
+ws_region_clear(
+    struct ws_region* self //!< The region to clear
+)
+__ws_nonnull__(1);
+
+/**
+ * Check whether a region is empty
+ *
+ * @return true if the region contains no pixels, false otherwise
+ */
+static inline bool
+ws_region_empty(
+    struct ws_region const* self //!< The region
+) {
+    return !self->rects.len;
+}
+
+/**
+ * Get the rectangles of a region
+ *
+ * @return the rectangles, `count` many
+ */
+static inline struct ws_rect const*
+ws_region_rects(
+    struct ws_region const* self, //!< The region
+    size_t* count //!< Location to store the number of rectangles to
+) {
+    *count = self->rects.len;
+    return (struct ws_rect const*) self->rects.data;
+}
+
+/**
+ * Add a rectangle to a region
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_region_add(
+    struct ws_region* self, //!< The region
+    struct ws_rect const* rect //!< The rectangle to add
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Add another region, translated and clipped, to a region
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_region_add_region(
+    struct ws_region* self, //!< The region
+    struct ws_region const* other, //!< The region to add
+    int32_t dx, //!< Horizontal offset to apply to `other`
+    int32_t dy, //!< Vertical offset to apply to `other`
+    struct ws_rect const* clip //!< Rectangle to clip `other` to
+)
+__ws_nonnull__(1, 2, 5);
+
+/**
+ * Compute the number of pixels in a region
+ *
+ * @return the area of the region
+ */
+uint64_t
+ws_region_area(
+    struct ws_region const* self //!< The region
+)
+__ws_nonnull__(1) __ws_pure__;
+
+#endif // __WS_COMPOSITOR_REGION_H__
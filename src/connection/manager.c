@@ -25,5 +25,1305 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4()
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include "connection/manager.h"
+#include "logger/trace.h"
+#include "objects/string.h"
+#include "util/arithmetical.h"
+#include "util/debug.h"
+#include "values/array.h"
+#include "values/nil.h"
+#include "values/value_named.h"
+
+/**
+ * Size a chunk for merged small writes is allocated with
+ */
+#define SMALL_CHUNK_SIZE 4096
+
+/**
+ * Initial capacity of the input buffer
+ */
+#define INPUT_INITIAL_SIZE 4096
+
+/**
+ * Maximum number of events processed per epoll_wait()
+ */
+#define MAX_EVENTS 64
+
+/**
+ * The connection has unread input or buffered input left to process
+ */
+#define CONN_READABLE (1 << 0)
+
+/**
+ * The connection was closed, it is freed at the end of the dispatch
+ */
+#define CONN_CLOSED (1 << 1)
+
+/**
+ * The connection is linked into the pending list
+ */
+#define CONN_PENDING (1 << 2)
+
+/**
+ * The wire format of the connection is settled
+ */
+#define CONN_NEGOTIATED (1 << 3)
+
+/**
+ * The connection exceeded its output quota and messages are being dropped
+ */
+#define CONN_OVERLOADED (1 << 4)
+
+/**
+ * Logging context of the connection manager
+ */
+static struct ws_logger_context const log_ctx = { .prefix = "connection" };
+
+/**
+ * A subscription of a connection
+ */
+struct subscription {
+    struct ws_connection* conn; //!< the subscriber
+    struct ws_value filter; //!< the filter, persisted
+};
+
+/**
+ * An event connections may subscribe to
+ */
+struct topic {
+    char const* name; //!< name of the event, interned
+    struct ws_array subscriptions; //!< the subscriptions
+};
+
+/**
+ * The connection manager
+ */
+static struct {
+    int epoll_fd; //!< the epoll instance
+    int listen_fd; //!< the listening socket
+    int reserve_fd; //!< spare descriptor, given up to turn clients away
+    char* path; //!< the path of the listening socket
+    struct ws_connection_handlers handlers; //!< protocol handlers
+    struct ws_connection* connections; //!< all connections
+    struct ws_connection* pending; //!< connections with unread input
+    struct ws_connection* closed; //!< connections to be freed
+    struct ws_array scratch; //!< buffer values are encoded into
+    struct ws_array topics; //!< events with subscriptions, by interned name
+    bool publishing; //!< whether an event is being published
+    struct ws_connection_policy policy; //!< policy for slow clients
+    struct ws_connection_stats stats; //!< counters of all connections
+} manager = {
+    .epoll_fd = -1,
+    .listen_fd = -1,
+    .reserve_fd = -1,
+    .policy = { .quota = WS_CONNECTION_DEFAULT_QUOTA },
+};
+
+/**
+ * Accept all pending connections
+ */
+static void
+accept_connections(void);
+
+/**
+ * Read from a connection and pass the data to the handler
+ *
+ * Reads until the socket would block or the read budget is exhausted, in
+ * which case the connection is marked as pending.
+ */
+static void
+connection_read(
+    struct ws_connection* self //!< The connection
+);
+
+/**
+ * Pass buffered input to the handler
+ *
+ * @return 0 on success, a negative error number if the connection must be
+ *         closed
+ */
+static int
+connection_process(
+    struct ws_connection* self //!< The connection
+);
+
+/**
+ * Settle the wire format of a connection, given its first bytes
+ *
+ * @return 0 on success, a negative error number if the connection must be
+ *         closed
+ */
+static int
+connection_negotiate(
+    struct ws_connection* self //!< The connection
+);
+
+/**
+ * Write as much of the output queue as the socket takes
+ *
+ * @return 0 on success, a negative error number if the connection must be
+ *         closed
+ */
+static int
+connection_flush(
+    struct ws_connection* self //!< The connection
+);
+
+/**
+ * Flush the output queue after queueing data, closing the connection on error
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+send_flush(
+    struct ws_connection* self //!< The connection
+);
+
+/**
+ * Check whether output fits into the quota of a connection
+ *
+ * If it doesn't, the policy is applied: the output is to be dropped, or the
+ * connection is closed.
+ *
+ * @return 0 if the output fits, -ENOBUFS otherwise
+ */
+static int
+output_admit(
+    struct ws_connection* self, //!< The connection
+    size_t len //!< Number of bytes to queue
+);
+
+/**
+ * Drop a queued state event superseded by a new one
+ */
+static void
+output_supersede(
+    struct ws_connection* self, //!< The connection
+    char const* event, //!< Name of the event, interned
+    uint64_t object //!< The object the event is about
+);
+
+/**
+ * Append a chunk to the output queue
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+output_push(
+    struct ws_connection* self, //!< The connection
+    struct ws_connection_chunk* chunk, //!< The chunk, reference is consumed
+    char const* event, //!< State event the chunk holds, or NULL
+    uint64_t object //!< Object the state event is about
+);
+
+/**
+ * Publish an event
+ *
+ * @return the number of connections the event was sent to, a negative error
+ *         number otherwise
+ */
+static int
+publish(
+    char const* event, //!< Name of the event, interned
+    bool state, //!< Whether the event is a state event
+    uint64_t object, //!< Object a state event is about
+    struct ws_value data //!< Data of the event
+);
+
+/**
+ * Find the topic of an event
+ *
+ * There are few kinds of events, so a linear scan comparing interned
+ * pointers is all it takes.
+ *
+ * @return the topic or NULL if nobody ever subscribed to the event
+ */
+static struct topic*
+find_topic(
+    char const* event //!< Name of the event, interned
+);
+
+/**
+ * Find the subscription of a connection in a topic
+ *
+ * @return the index of the subscription or the number of subscriptions if
+ *         the connection is not subscribed
+ */
+static size_t
+find_subscription(
+    struct topic const* topic, //!< The topic
+    struct ws_connection const* conn //!< The connection
+);
+
+/**
+ * Check whether event data matches a filter
+ *
+ * @return true if the data matches, false otherwise
+ */
+static bool
+filter_matches(
+    struct ws_value filter, //!< The filter
+    struct ws_value data //!< The event data
+);
+
+/**
+ * Predicate keeping subscriptions not belonging to a connection
+ *
+ * @return true if the subscription does not belong to the connection
+ */
+static bool
+subscription_keep(
+    void const* elem, //!< The subscription
+    void* ctx //!< The connection
+);
+
+/**
+ * Drop all subscriptions of a connection
+ */
+static void
+drop_subscriptions(
+    struct ws_connection* conn //!< The connection
+);
+
+/**
+ * Free a connection
+ */
+static void
+connection_free(
+    struct ws_connection* self //!< The connection
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_connection_manager_init(
+    char const* path,
+    struct ws_connection_handlers const* handlers
+) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, path);
+
+    manager.handlers = *handlers;
+    ws_array_init(&manager.scratch, 1);
+    ws_array_init(&manager.topics, sizeof(struct topic));
+    manager.path = strdup(path);
+    if (!manager.path) {
+        return -ENOMEM;
+    }
+
+    int res;
+    manager.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (manager.epoll_fd < 0) {
+        res = -errno;
+        goto cleanup;
+    }
+
+    // when we run out of descriptors, this one makes room to accept and drop
+    // the waiting connections, which edge triggering won't report again
+    manager.reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (manager.reserve_fd < 0) {
+        res = -errno;
+        goto cleanup;
+    }
+
+    manager.listen_fd = socket(AF_UNIX,
+                               SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (manager.listen_fd < 0) {
+        res = -errno;
+        goto cleanup;
+    }
+
+    unlink(path);
+    if ((bind(manager.listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) ||
+            (listen(manager.listen_fd, SOMAXCONN) < 0)) {
+        res = -errno;
+        goto cleanup;
+    }
+
+    // the listening socket is the only one with a NULL pointer
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET };
+    event.data.ptr = NULL;
+    if (epoll_ctl(manager.epoll_fd, EPOLL_CTL_ADD, manager.listen_fd,
+                  &event) < 0) {
+        res = -errno;
+        goto cleanup;
+    }
+
+    return 0;
+
+cleanup:
+    ws_connection_manager_deinit();
+    return res;
+}
+
+void
+ws_connection_manager_deinit(void)
+{
+    while (manager.connections) {
+        ws_connection_close(manager.connections);
+    }
+    while (manager.pending) {
+        struct ws_connection* conn = manager.pending;
+        manager.pending = conn->next_pending;
+        connection_free(conn);
+    }
+    while (manager.closed) {
+        struct ws_connection* conn = manager.closed;
+        manager.closed = conn->next_pending;
+        connection_free(conn);
+    }
+
+    if (manager.listen_fd >= 0) {
+        close(manager.listen_fd);
+        manager.listen_fd = -1;
+        unlink(manager.path);
+    }
+    if (manager.reserve_fd >= 0) {
+        close(manager.reserve_fd);
+        manager.reserve_fd = -1;
+    }
+    if (manager.epoll_fd >= 0) {
+        close(manager.epoll_fd);
+        manager.epoll_fd = -1;
+    }
+
+    free(manager.path);
+    manager.path = NULL;
+    ws_array_deinit(&manager.scratch);
+
+    // the connections took their subscriptions with them
+    for (size_t i = 0; i < manager.topics.len; ++i) {
+        struct topic* topic = ws_array_at(&manager.topics, i);
+        ws_array_deinit(&topic->subscriptions);
+    }
+    ws_array_deinit(&manager.topics);
+}
+
+void
+ws_connection_manager_set_policy(
+    struct ws_connection_policy const* policy
+) {
+    manager.policy = *policy;
+}
+
+void
+ws_connection_manager_get_stats(
+    struct ws_connection_stats* stats
+) {
+    *stats = manager.stats;
+}
+
+void
+ws_connection_manager_log_stats(void)
+{
+    struct ws_connection_stats const* stats = &manager.stats;
+    ws_info(&log_ctx,
+            "%llu bytes sent, %llu events sent, %llu coalesced, "
+            "%llu messages dropped, %llu slow clients disconnected, "
+            "at most %llu bytes queued",
+            (unsigned long long) stats->bytes_sent,
+            (unsigned long long) stats->events_sent,
+            (unsigned long long) stats->events_coalesced,
+            (unsigned long long) stats->dropped,
+            (unsigned long long) stats->disconnects,
+            (unsigned long long) stats->peak_queued);
+}
+
+int
+ws_connection_manager_get_fd(void)
+{
+    return manager.epoll_fd;
+}
+
+int
+ws_connection_manager_dispatch(
+    int timeout
+) {
+    // connections with input left over must not wait for new events
+    struct ws_connection* pending = manager.pending;
+    manager.pending = NULL;
+    if (pending) {
+        timeout = 0;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(manager.epoll_fd, events, MAX_EVENTS, timeout);
+    if (count < 0) {
+        if (errno != EINTR) {
+            return -errno;
+        }
+        count = 0;
+    }
+
+    WS_TRACE_SCOPE("connection dispatch");
+    for (int i = 0; i < count; ++i) {
+        struct ws_connection* conn = events[i].data.ptr;
+        if (!conn) {
+            accept_connections();
+            continue;
+        }
+        if (conn->flags & CONN_CLOSED) {
+            continue;
+        }
+
+        if (events[i].events & EPOLLERR) {
+            ws_connection_close(conn);
+            continue;
+        }
+        if ((events[i].events & EPOLLOUT) && (connection_flush(conn) < 0)) {
+            ws_connection_close(conn);
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) {
+            conn->flags |= CONN_READABLE;
+            if (!(conn->flags & CONN_PENDING)) {
+                connection_read(conn);
+            }
+        }
+    }
+
+    // give connections which were cut short their next turn
+    while (pending) {
+        struct ws_connection* conn = pending;
+        pending = conn->next_pending;
+        conn->flags &= ~CONN_PENDING;
+        if (conn->flags & CONN_CLOSED) {
+            connection_free(conn);
+        } else {
+            connection_read(conn);
+        }
+    }
+
+    while (manager.closed) {
+        struct ws_connection* conn = manager.closed;
+        manager.closed = conn->next_pending;
+        connection_free(conn);
+    }
+
+    return 0;
+}
+
+struct ws_connection_chunk*
+ws_connection_chunk_new(
+    size_t cap
+) {
+    struct ws_connection_chunk* self = malloc(sizeof(*self) + cap);
+    if (!self) {
+        return NULL;
+    }
+
+    atomic_init(&self->refcount, 1);
+    self->len = 0;
+    self->cap = cap;
+    return self;
+}
+
+void
+ws_connection_chunk_unref(
+    struct ws_connection_chunk* self
+) {
+    if (self && (atomic_fetch_sub_explicit(&self->refcount, 1,
+                                           memory_order_acq_rel) == 1)) {
+        free(self);
+    }
+}
+
+int
+ws_connection_send(
+    struct ws_connection* self,
+    void const* data,
+    size_t len
+) {
+    if (self->flags & CONN_CLOSED) {
+        return -EPIPE;
+    }
+
+    int res = output_admit(self, len);
+    if (res < 0) {
+        return res;
+    }
+
+    // merge into the last chunk if it is ours alone and has room left
+    if (self->out.count) {
+        size_t last = (self->out.head + self->out.count - 1) &
+                      (self->out.cap - 1);
+        struct ws_connection_output* entry = self->out.entries + last;
+        struct ws_connection_chunk* chunk = entry->chunk;
+        if (chunk && !entry->event &&
+                (atomic_load_explicit(&chunk->refcount,
+                                      memory_order_relaxed) == 1) &&
+                (chunk->cap - chunk->len >= len)) {
+            memcpy(chunk->data + chunk->len, data, len);
+            chunk->len += len;
+            self->out.bytes += len;
+            return send_flush(self);
+        }
+    }
+
+    struct ws_connection_chunk* chunk;
+    chunk = ws_connection_chunk_new(len > SMALL_CHUNK_SIZE ? len
+                                                           : SMALL_CHUNK_SIZE);
+    if (!chunk) {
+        return -ENOMEM;
+    }
+    memcpy(chunk->data, data, len);
+    chunk->len = len;
+
+    res = output_push(self, chunk, NULL, 0);
+    if (res < 0) {
+        return res;
+    }
+    return send_flush(self);
+}
+
+int
+ws_connection_send_chunk(
+    struct ws_connection* self,
+    struct ws_connection_chunk* chunk
+) {
+    if (self->flags & CONN_CLOSED) {
+        return -EPIPE;
+    }
+
+    int res = output_admit(self, chunk->len);
+    if (res < 0) {
+        return res;
+    }
+
+    res = output_push(self, ws_connection_chunk_ref(chunk), NULL, 0);
+    if (res < 0) {
+        return res;
+    }
+    return send_flush(self);
+}
+
+int
+ws_connection_send_value(
+    struct ws_connection* self,
+    struct ws_value value
+) {
+    manager.scratch.len = 0;
+    int res = ws_serialize_encode(self->format, value, &manager.scratch);
+    if (res < 0) {
+        return res;
+    }
+    return ws_connection_send(self, manager.scratch.data, manager.scratch.len);
+}
+
+int
+ws_connection_subscribe(
+    struct ws_connection* self,
+    char const* event,
+    struct ws_value filter
+) {
+    if (manager.publishing) {
+        return -EBUSY;
+    }
+
+    if (!ws_value_is_nil(filter)) {
+        if (ws_value_get_type(filter) != WS_VALUE_TYPE_ARRAY) {
+            return -EINVAL;
+        }
+        size_t len;
+        struct ws_value const* members = ws_value_array_get(filter, &len);
+        for (size_t i = 0; i < len; ++i) {
+            if (ws_value_get_type(members[i]) != WS_VALUE_TYPE_NAMED) {
+                return -EINVAL;
+            }
+        }
+    }
+
+    char const* name = ws_string_intern(event, strlen(event));
+    if (!name) {
+        return -ENOMEM;
+    }
+
+    struct topic* topic = find_topic(name);
+    if (!topic) {
+        struct topic new_topic = { .name = name };
+        ws_array_init(&new_topic.subscriptions, sizeof(struct subscription));
+        int res = ws_array_push(&manager.topics, &new_topic);
+        if (res < 0) {
+            return res;
+        }
+        topic = ws_array_at(&manager.topics, manager.topics.len - 1);
+    }
+
+    // the filter may be arena allocated or borrow an input buffer
+    int res = ws_value_persist(&filter);
+    if (res < 0) {
+        return res;
+    }
+
+    size_t index = find_subscription(topic, self);
+    if (index < topic->subscriptions.len) {
+        struct subscription* sub = ws_array_at(&topic->subscriptions, index);
+        ws_value_unref(sub->filter);
+        sub->filter = filter;
+        return 0;
+    }
+
+    struct subscription sub = { .conn = self, .filter = filter };
+    res = ws_array_push(&topic->subscriptions, &sub);
+    if (res < 0) {
+        ws_value_unref(filter);
+        return res;
+    }
+    ++self->nsubscriptions;
+    return 0;
+}
+
+int
+ws_connection_unsubscribe(
+    struct ws_connection* self,
+    char const* event
+) {
+    if (manager.publishing) {
+        return -EBUSY;
+    }
+
+    struct topic* topic = find_topic(ws_string_intern(event, strlen(event)));
+    if (!topic) {
+        return -ENOENT;
+    }
+
+    size_t index = find_subscription(topic, self);
+    if (index == topic->subscriptions.len) {
+        return -ENOENT;
+    }
+
+    struct subscription* sub = ws_array_at(&topic->subscriptions, index);
+    ws_value_unref(sub->filter);
+    ws_array_remove(&topic->subscriptions, index);
+    --self->nsubscriptions;
+    return 0;
+}
+
+int
+ws_connection_publish(
+    char const* event,
+    struct ws_value data
+) {
+    return publish(event, false, 0, data);
+}
+
+int
+ws_connection_publish_state(
+    char const* event,
+    uint64_t object,
+    struct ws_value data
+) {
+    return publish(event, true, object, data);
+}
+
+void
+ws_connection_close(
+    struct ws_connection* self
+) {
+    if (self->flags & CONN_CLOSED) {
+        return;
+    }
+
+    if (manager.handlers.close) {
+        manager.handlers.close(self);
+    }
+
+    // closing the socket removes it from the epoll set
+    close(self->fd);
+    self->fd = -1;
+    self->flags |= CONN_CLOSED;
+
+    if (self->prev) {
+        self->prev->next = self->next;
+    } else {
+        manager.connections = self->next;
+    }
+    if (self->next) {
+        self->next->prev = self->prev;
+    }
+
+    // a pending connection is still linked; it is skipped and freed later
+    if (!(self->flags & CONN_PENDING)) {
+        self->next_pending = manager.closed;
+        manager.closed = self;
+    }
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static void
+accept_connections(void)
+{
+    while (1) {
+        int fd = accept4(manager.listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) &&
+                    (manager.reserve_fd >= 0)) {
+                // turn the client away rather than leaving it hanging
+                close(manager.reserve_fd);
+                fd = accept4(manager.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                int err = errno;
+                if (fd >= 0) {
+                    ws_warn(&log_ctx, "out of file descriptors, "
+                            "dropping a client");
+                    close(fd);
+                }
+                manager.reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (fd >= 0) {
+                    continue;
+                }
+                errno = err;
+            }
+            // EAGAIN once the backlog is drained
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ws_warn(&log_ctx, "cannot accept connections: %s",
+                        strerror(errno));
+            }
+            return;
+        }
+
+        struct ws_connection* conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = conn,
+        };
+        if (epoll_ctl(manager.epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+
+        conn->next = manager.connections;
+        if (conn->next) {
+            conn->next->prev = conn;
+        }
+        manager.connections = conn;
+
+        if (manager.handlers.open && (manager.handlers.open(conn) < 0)) {
+            ws_connection_close(conn);
+        }
+    }
+}
+
+static void
+connection_read(
+    struct ws_connection* self
+) {
+    WS_TRACE_SCOPE("connection read");
+    size_t budget = WS_CONNECTION_READ_BUDGET;
+
+    while (budget && (self->flags & CONN_READABLE)) {
+        // make room, compacting before growing
+        if (self->in.end == self->in.cap) {
+            if (self->in.start) {
+                memmove(self->in.data, self->in.data + self->in.start,
+                        self->in.end - self->in.start);
+                self->in.end -= self->in.start;
+                self->in.start = 0;
+            } else if (self->in.cap < WS_CONNECTION_INPUT_MAX) {
+                size_t cap = self->in.cap ? self->in.cap * 2
+                                          : INPUT_INITIAL_SIZE;
+                char* data = realloc(self->in.data, cap);
+                if (!data) {
+                    goto close;
+                }
+                self->in.data = data;
+                self->in.cap = cap;
+            } else {
+                // the handler can't make sense of a full buffer
+                goto close;
+            }
+        }
+
+        size_t space = self->in.cap - self->in.end;
+        ssize_t res = read(self->fd, self->in.data + self->in.end,
+                           space < budget ? space : budget);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                self->flags &= ~CONN_READABLE;
+                break;
+            }
+            goto close;
+        }
+        if (res == 0) {
+            // the peer is gone, hand over what's left and close
+            connection_process(self);
+            goto close;
+        }
+
+        self->in.end += res;
+        budget -= res;
+
+        if (connection_process(self) < 0) {
+            goto close;
+        }
+        if (self->flags & CONN_CLOSED) {
+            return;
+        }
+    }
+
+    // edge triggered: no new event arrives for the unread input
+    if ((self->flags & CONN_READABLE) && !(self->flags & CONN_PENDING)) {
+        self->flags |= CONN_PENDING;
+        self->next_pending = manager.pending;
+        manager.pending = self;
+    }
+    return;
+
+close:
+    ws_connection_close(self);
+}
+
+static int
+connection_process(
+    struct ws_connection* self
+) {
+    WS_TRACE_SCOPE("connection process");
+    if (!(self->flags & CONN_NEGOTIATED)) {
+        int res = connection_negotiate(self);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    while ((self->flags & CONN_NEGOTIATED) &&
+            (self->in.start < self->in.end)) {
+        ssize_t res = manager.handlers.data(self,
+                                            self->in.data + self->in.start,
+                                            self->in.end - self->in.start);
+        if (res < 0) {
+            return (int) res;
+        }
+        if ((res == 0) || (self->flags & CONN_CLOSED)) {
+            break;
+        }
+        self->in.start += res;
+    }
+
+    if (self->in.start == self->in.end) {
+        self->in.start = self->in.end = 0;
+    }
+    return 0;
+}
+
+static int
+connection_negotiate(
+    struct ws_connection* self
+) {
+    char const* data = self->in.data + self->in.start;
+    size_t len = self->in.end - self->in.start;
+
+    // the format is told by the first byte
+    if (!len) {
+        return 0;
+    }
+    if (data[0] != WS_CONNECTION_MAGIC_MSGPACK[0]) {
+        self->format = WS_SERIALIZE_FORMAT_JSON;
+        self->flags |= CONN_NEGOTIATED;
+        return 0;
+    }
+
+    size_t cmp = len < WS_CONNECTION_MAGIC_SIZE ? len
+                                                : WS_CONNECTION_MAGIC_SIZE;
+    if (memcmp(data, WS_CONNECTION_MAGIC_MSGPACK, cmp)) {
+        return -EPROTO;
+    }
+    if (len < WS_CONNECTION_MAGIC_SIZE) {
+        // wait for the rest
+        return 0;
+    }
+
+    self->in.start += WS_CONNECTION_MAGIC_SIZE;
+    self->format = WS_SERIALIZE_FORMAT_MSGPACK;
+    self->flags |= CONN_NEGOTIATED;
+    return ws_connection_send(self, WS_CONNECTION_MAGIC_MSGPACK,
+                              WS_CONNECTION_MAGIC_SIZE);
+}
+
+static int
+connection_flush(
+    struct ws_connection* self
+) {
+    WS_TRACE_SCOPE("connection flush");
+    while (self->out.count) {
+        if (!self->out.entries[self->out.head].chunk) {
+            // superseded, see output_supersede()
+            self->out.head = (self->out.head + 1) & (self->out.cap - 1);
+            --self->out.count;
+            continue;
+        }
+
+        struct iovec iov[WS_CONNECTION_IOV_MAX];
+        size_t niov = 0;
+        for (size_t i = 0; (i < self->out.count) &&
+                           (niov < WS_CONNECTION_IOV_MAX); ++i) {
+            size_t index = (self->out.head + i) & (self->out.cap - 1);
+            struct ws_connection_chunk* chunk = self->out.entries[index].chunk;
+            if (chunk) {
+                iov[niov].iov_base = chunk->data;
+                iov[niov].iov_len = chunk->len;
+                ++niov;
+            }
+        }
+        iov[0].iov_base = (char*) iov[0].iov_base + self->out.offset;
+        iov[0].iov_len -= self->out.offset;
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = niov };
+        ssize_t res = sendmsg(self->fd, &msg, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // EPOLLOUT tells us when to continue
+                return 0;
+            }
+            return -errno;
+        }
+
+        self->out.bytes -= res;
+        self->stats.bytes_sent += res;
+        manager.stats.bytes_sent += res;
+
+        size_t written = res + self->out.offset;
+        while (self->out.count) {
+            struct ws_connection_chunk* chunk;
+            chunk = self->out.entries[self->out.head].chunk;
+            if (chunk) {
+                if (written < chunk->len) {
+                    break;
+                }
+                written -= chunk->len;
+                ws_connection_chunk_unref(chunk);
+            }
+            self->out.head = (self->out.head + 1) & (self->out.cap - 1);
+            --self->out.count;
+        }
+        self->out.offset = written;
+
+        if ((self->flags & CONN_OVERLOADED) &&
+                (self->out.bytes <= manager.policy.quota / 2)) {
+            self->flags &= ~CONN_OVERLOADED;
+            ws_info(&log_ctx,
+                    "client %d caught up, %llu messages dropped so far",
+                    self->fd, (unsigned long long) self->stats.dropped);
+        }
+    }
+
+    self->out.head = 0;
+    self->out.offset = 0;
+    return 0;
+}
+
+static int
+send_flush(
+    struct ws_connection* self
+) {
+    int res = connection_flush(self);
+    if (res < 0) {
+        ws_connection_close(self);
+    }
+    return res;
+}
+
+static int
+output_admit(
+    struct ws_connection* self,
+    size_t len
+) {
+    size_t quota = manager.policy.quota;
+    if (!quota || (self->out.bytes + len <= quota)) {
+        return 0;
+    }
+
+    if (manager.policy.disconnect) {
+        ws_warn(&log_ctx,
+                "disconnecting client %d, %zu bytes of output queued",
+                self->fd, self->out.bytes);
+        ++self->stats.disconnects;
+        ++manager.stats.disconnects;
+        ws_connection_close(self);
+        return -ENOBUFS;
+    }
+
+    if (!(self->flags & CONN_OVERLOADED)) {
+        self->flags |= CONN_OVERLOADED;
+        ws_warn(&log_ctx,
+                "client %d doesn't keep up, %zu bytes of output queued, "
+                "dropping messages", self->fd, self->out.bytes);
+    }
+    ++self->stats.dropped;
+    ++manager.stats.dropped;
+    return -ENOBUFS;
+}
+
+static void
+output_supersede(
+    struct ws_connection* self,
+    char const* event,
+    uint64_t object
+) {
+    // the first entry may be partially written already
+    for (size_t i = self->out.offset ? 1 : 0; i < self->out.count; ++i) {
+        size_t index = (self->out.head + i) & (self->out.cap - 1);
+        struct ws_connection_output* entry = self->out.entries + index;
+        if (entry->chunk && (entry->event == event) &&
+                (entry->object == object)) {
+            // there is at most one, as each supersedes the one before
+            self->out.bytes -= entry->chunk->len;
+            ws_connection_chunk_unref(entry->chunk);
+            entry->chunk = NULL;
+            ++self->stats.events_coalesced;
+            ++manager.stats.events_coalesced;
+            return;
+        }
+    }
+}
+
+static int
+output_push(
+    struct ws_connection* self,
+    struct ws_connection_chunk* chunk,
+    char const* event,
+    uint64_t object
+) {
+    if (self->out.count == self->out.cap) {
+        size_t cap = self->out.cap ? self->out.cap * 2 : 8;
+        struct ws_connection_output* entries;
+        entries = malloc(cap * sizeof(*entries));
+        if (!entries) {
+            ws_connection_chunk_unref(chunk);
+            return -ENOMEM;
+        }
+
+        // unwrap the ring while moving it
+        for (size_t i = 0; i < self->out.count; ++i) {
+            entries[i] = self->out.entries[(self->out.head + i) &
+                                           (self->out.cap - 1)];
+        }
+        free(self->out.entries);
+        self->out.entries = entries;
+        self->out.head = 0;
+        self->out.cap = cap;
+    }
+
+    size_t tail = (self->out.head + self->out.count) & (self->out.cap - 1);
+    self->out.entries[tail] = (struct ws_connection_output) {
+        .chunk = chunk,
+        .event = event,
+        .object = object,
+    };
+    ++self->out.count;
+    self->out.bytes += chunk->len;
+
+    if (self->out.bytes > self->stats.peak_queued) {
+        self->stats.peak_queued = self->out.bytes;
+    }
+    if (self->out.bytes > manager.stats.peak_queued) {
+        manager.stats.peak_queued = self->out.bytes;
+    }
+    return 0;
+}
+
+static int
+publish(
+    char const* event,
+    bool state,
+    uint64_t object,
+    struct ws_value data
+) {
+    WS_TRACE_SCOPE("publish");
+    struct topic* topic = find_topic(event);
+    if (!topic) {
+        return 0;
+    }
+
+    // one encoding per wire format, shared by all subscribers using it
+    struct ws_connection_chunk* chunks[WS_SERIALIZE_FORMAT_MSGPACK + 1] = {0};
+    int sent = 0;
+
+    manager.publishing = true;
+    for (size_t i = 0; i < topic->subscriptions.len; ++i) {
+        struct subscription* sub = ws_array_at(&topic->subscriptions, i);
+        struct ws_connection* conn = sub->conn;
+        if ((conn->flags & CONN_CLOSED) || !filter_matches(sub->filter, data)) {
+            continue;
+        }
+
+        struct ws_connection_chunk** chunk = chunks + conn->format;
+        if (!*chunk) {
+            manager.scratch.len = 0;
+            int res = ws_serialize_encode_event(conn->format, event, data,
+                                                &manager.scratch);
+            if (res >= 0) {
+                *chunk = ws_connection_chunk_new(manager.scratch.len);
+                res = *chunk ? 0 : -ENOMEM;
+            }
+            if (res < 0) {
+                sent = res;
+                break;
+            }
+            memcpy((*chunk)->data, manager.scratch.data, manager.scratch.len);
+            (*chunk)->len = manager.scratch.len;
+        }
+
+        // dropping the outdated state may be enough to stay within the quota
+        if (state) {
+            output_supersede(conn, event, object);
+        }
+        if ((output_admit(conn, (*chunk)->len) < 0) ||
+                (output_push(conn, ws_connection_chunk_ref(*chunk),
+                             state ? event : NULL, object) < 0)) {
+            continue;
+        }
+
+        ++conn->stats.events_sent;
+        ++manager.stats.events_sent;
+        if (send_flush(conn) >= 0) {
+            ++sent;
+        }
+    }
+    manager.publishing = false;
+
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(*chunks); ++i) {
+        ws_connection_chunk_unref(chunks[i]);
+    }
+    return sent;
+}
+
+static struct topic*
+find_topic(
+    char const* event
+) {
+    for (size_t i = 0; i < manager.topics.len; ++i) {
+        struct topic* topic = ws_array_at(&manager.topics, i);
+        if (topic->name == event) {
+            return topic;
+        }
+    }
+    return NULL;
+}
+
+static size_t
+find_subscription(
+    struct topic const* topic,
+    struct ws_connection const* conn
+) {
+    size_t i = 0;
+    while (i < topic->subscriptions.len) {
+        struct subscription const* sub;
+        sub = ws_array_at(&topic->subscriptions, i);
+        if (sub->conn == conn) {
+            break;
+        }
+        ++i;
+    }
+    return i;
+}
+
+static bool
+filter_matches(
+    struct ws_value filter,
+    struct ws_value data
+) {
+    if (ws_value_is_nil(filter)) {
+        return true;
+    }
+    if (ws_value_get_type(data) != WS_VALUE_TYPE_ARRAY) {
+        return false;
+    }
+
+    size_t nconds;
+    size_t nfields;
+    struct ws_value const* conds = ws_value_array_get(filter, &nconds);
+    struct ws_value const* fields = ws_value_array_get(data, &nfields);
+    for (size_t i = 0; i < nconds; ++i) {
+        struct ws_value field;
+        field = ws_value_named_find(fields, nfields,
+                                    ws_value_named_get_name(conds[i]));
+        if (!ws_value_equal(field, ws_value_named_get_value(conds[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+subscription_keep(
+    void const* elem,
+    void* ctx
+) {
+    return ((struct subscription const*) elem)->conn != ctx;
+}
+
+static void
+drop_subscriptions(
+    struct ws_connection* conn
+) {
+    for (size_t i = 0; conn->nsubscriptions && (i < manager.topics.len); ++i) {
+        struct topic* topic = ws_array_at(&manager.topics, i);
+        size_t keep = ws_array_stable_partition(&topic->subscriptions,
+                                                subscription_keep, conn);
+        for (size_t j = keep; j < topic->subscriptions.len; ++j) {
+            struct subscription* sub = ws_array_at(&topic->subscriptions, j);
+            ws_value_unref(sub->filter);
+            --conn->nsubscriptions;
+        }
+        topic->subscriptions.len = keep;
+    }
+}
+
+static void
+connection_free(
+    struct ws_connection* self
+) {
+    drop_subscriptions(self);
 
+    while (self->out.count) {
+        ws_connection_chunk_unref(self->out.entries[self->out.head].chunk);
+        self->out.head = (self->out.head + 1) & (self->out.cap - 1);
+        --self->out.count;
+    }
+    free(self->out.entries);
+    free(self->in.data);
+    free(self);
+}
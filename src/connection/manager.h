@@ -25,9 +25,385 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_CONNECTION_MANAGER_H__
 #define __WS_CONNECTION_MANAGER_H__
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "serialize/module.h"
+#include "util/attributes.h"
+#include "values/value.h"
+
+/**
+ * Maximum number of bytes buffered for input on a connection
+ *
+ * A message which doesn't fit is a protocol error.
+ */
+#define WS_CONNECTION_INPUT_MAX (1 << 20)
+
+/**
+ * Number of bytes read from one connection before others get their turn
+ */
+#define WS_CONNECTION_READ_BUDGET (64 << 10)
+
+/**
+ * Maximum number of chunks written with one system call
+ */
+#define WS_CONNECTION_IOV_MAX 64
+
+/**
+ * Bytes a client opens the connection with to speak MessagePack
+ *
+ * The first byte is one MessagePack never uses and JSON can't start with.
+ * The server confirms the switch by sending the same bytes back. Clients
+ * starting with anything else speak JSON.
+ */
+#define WS_CONNECTION_MAGIC_MSGPACK "\xc1ws\x01"
+
+/**
+ * Length of WS_CONNECTION_MAGIC_MSGPACK
+ */
+#define WS_CONNECTION_MAGIC_SIZE 4
+
+/**
+ * Default number of bytes which may be queued for output on a connection
+ */
+#define WS_CONNECTION_DEFAULT_QUOTA (4 << 20)
+
+/**
+ * A reference counted chunk of output
+ *
+ * Chunks are queued on connections without copying them, so the same chunk
+ * may be queued on any number of connections.
+ */
+struct ws_connection_chunk {
+    atomic_uint refcount; //!< number of references
+    size_t len; //!< number of bytes used
+    size_t cap; //!< number of bytes available
+    char data[]; //!< the bytes
+};
+
+/**
+ * An entry of the output queue of a connection
+ */
+struct ws_connection_output {
+    struct ws_connection_chunk* chunk; //!< the chunk, NULL if superseded
+    char const* event; //!< state event the chunk holds, interned, or NULL
+    uint64_t object; //!< object the state event is about
+};
+
+/**
+ * Counters of the connection manager
+ */
+struct ws_connection_stats {
+    uint64_t bytes_sent; //!< bytes written to sockets
+    uint64_t events_sent; //!< events queued for sending
+    uint64_t events_coalesced; //!< state events superseded before sending
+    uint64_t dropped; //!< messages dropped because of the output quota
+    uint64_t disconnects; //!< connections closed because of the quota
+    uint64_t peak_queued; //!< most bytes queued on a connection at once
+};
+
+/**
+ * How to deal with clients which don't keep up with their output
+ */
+struct ws_connection_policy {
+    size_t quota; //!< bytes which may be queued per connection, 0 for any
+    bool disconnect; //!< close connections exceeding the quota, don't drop
+};
+
+/**
+ * A client connection
+ */
+struct ws_connection {
+    int fd; //!< the socket
+    unsigned flags; //!< internal state of the connection
+    enum ws_serialize_format format; //!< wire format of the connection
+    void* userdata; //!< data of the protocol handler
+    size_t nsubscriptions; //!< number of events subscribed to
+    struct ws_connection_stats stats; //!< counters of the connection
+    struct ws_connection* prev; //!< previous connection
+    struct ws_connection* next; //!< next connection
+    struct ws_connection* next_pending; //!< next connection with pending work
+    struct {
+        char* data; //!< buffered bytes
+        size_t start; //!< first byte not consumed yet
+        size_t end; //!< end of the buffered bytes
+        size_t cap; //!< size of the buffer
+    } in; //!< input buffer
+    struct {
+        struct ws_connection_output* entries; //!< ring of queued chunks
+        size_t head; //!< index of the first queued entry
+        size_t count; //!< number of queued entries
+        size_t cap; //!< capacity of the ring, a power of two
+        size_t offset; //!< bytes of the first chunk written already
+        size_t bytes; //!< bytes queued, in total
+    } out; //!< output queue
+};
+
+/**
+ * Protocol handlers of the connection manager
+ */
+struct ws_connection_handlers {
+    /**
+     * A client connected
+     *
+     * @return 0 to accept the connection, a negative error number otherwise
+     */
+    int (*open)(struct ws_connection* conn);
+
+    /**
+     * Data arrived
+     *
+     * The data may be modified in place. Bytes not consumed are passed again,
+     * together with further data, once it arrives. The wire format of the
+     * connection is negotiated before the first call.
+     *
+     * @return the number of bytes consumed, a negative error number to close
+     *         the connection
+     */
+    ssize_t (*data)(struct ws_connection* conn, char* data, size_t len);
+
+    /**
+     * A connection is about to be closed
+     */
+    void (*close)(struct ws_connection* conn);
+};
+
+/**
+ * Initialize the connection manager
+ *
+ * Creates the listening socket at the given path and the epoll instance all
+ * connections are multiplexed with.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_connection_manager_init(
+    char const* path, //!< Path of the socket to listen on
+    struct ws_connection_handlers const* handlers //!< Protocol handlers
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Close all connections and deinitialize the connection manager
+ */
+void
+ws_connection_manager_deinit(void);
+
+/**
+ * Set the policy for clients which don't keep up with their output
+ *
+ * By default, WS_CONNECTION_DEFAULT_QUOTA bytes may be queued per
+ * connection, and messages exceeding it are dropped.
+ */
+void
+ws_connection_manager_set_policy(
+    struct ws_connection_policy const* policy //!< The policy
+)
+__ws_nonnull__(1);
+
+/**
+ * Get the counters of the connection manager, summed over all connections
+ */
+void
+ws_connection_manager_get_stats(
+    struct ws_connection_stats* stats //!< Location to store the counters to
+)
+__ws_nonnull__(1);
+
+/**
+ * Log the counters of the connection manager
+ */
+void
+ws_connection_manager_log_stats(void);
+
+/**
+ * Get the file descriptor of the connection manager
+ *
+ * The descriptor becomes readable whenever there's work for
+ * ws_connection_manager_dispatch(), so it can be added to the main loop.
+ *
+ * @return the file descriptor
+ */
+int
+ws_connection_manager_get_fd(void);
+
+/**
+ * Process I/O of all connections
+ *
+ * Reads from each connection are limited per call, so that a single chatty
+ * client does not stall the caller. Connections with unread input are
+ * processed again on the next call, which won't block then.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_connection_manager_dispatch(
+    int timeout //!< Milliseconds to wait for events, -1 for infinity
+);
+
+/**
+ * Allocate a chunk
+ *
+ * @return a new chunk with a reference count of one, NULL on error
+ */
+struct ws_connection_chunk*
+ws_connection_chunk_new(
+    size_t cap //!< Number of bytes to allocate
+);
+
+/**
+ * Take a reference on a chunk
+ *
+ * @return the chunk
+ */
+static inline struct ws_connection_chunk*
+ws_connection_chunk_ref(
+    struct ws_connection_chunk* self //!< The chunk
+) {
+    atomic_fetch_add_explicit(&self->refcount, 1, memory_order_relaxed);
+    return self;
+}
+
+/**
+ * Release a reference on a chunk, freeing it with the last one
+ */
+void
+ws_connection_chunk_unref(
+    struct ws_connection_chunk* self //!< The chunk
+);
+
+/**
+ * Queue data on a connection
+ *
+ * The data is copied, small writes are merged into a single chunk.
+ *
+ * @return 0 on success, -ENOBUFS if the output quota of the connection is
+ *         exceeded, another negative error number otherwise
+ */
+int
+ws_connection_send(
+    struct ws_connection* self, //!< The connection
+    void const* data, //!< The data to send
+    size_t len //!< Number of bytes to send
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Queue a chunk on a connection
+ *
+ * The connection takes a reference on the chunk; the chunk must not be
+ * modified afterwards.
+ *
+ * @return 0 on success, -ENOBUFS if the output quota of the connection is
+ *         exceeded, another negative error number otherwise
+ */
+int
+ws_connection_send_chunk(
+    struct ws_connection* self, //!< The connection
+    struct ws_connection_chunk* chunk //!< The chunk to send
+)
+__ws_nonnull__(1, 2);
 
+/**
+ * Send a value to a connection
+ *
+ * The value is encoded in the wire format of the connection.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_connection_send_value(
+    struct ws_connection* self, //!< The connection
+    struct ws_value value //!< The value to send
+)
+__ws_nonnull__(1);
+
+/**
+ * Subscribe a connection to an event
+ *
+ * The filter is evaluated on the server for each event published: it is
+ * either nil, matching every event, or an object (an array of named values).
+ * An event matches the object if its data is an object as well, and each
+ * member of the filter equals the member of the same name in the data.
+ *
+ * Subscribing to an event again replaces the filter. Subscriptions end when
+ * the connection is freed.
+ *
+ * @return 0 on success, -EBUSY while an event is published, another negative
+ *         error number otherwise
+ */
+int
+ws_connection_subscribe(
+    struct ws_connection* self, //!< The connection
+    char const* event, //!< Name of the event
+    struct ws_value filter //!< The filter
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Unsubscribe a connection from an event
+ *
+ * @return 0 on success, -ENOENT if the connection was not subscribed,
+ *         -EBUSY while an event is published
+ */
+int
+ws_connection_unsubscribe(
+    struct ws_connection* self, //!< The connection
+    char const* event //!< Name of the event
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Publish an event to all matching subscribers
+ *
+ * The event is encoded at most once per wire format in use, and the same
+ * chunk is queued on every matching connection.
+ *
+ * @return the number of connections the event was sent to, a negative error
+ *         number otherwise
+ */
+int
+ws_connection_publish(
+    char const* event, //!< Name of the event, interned
+    struct ws_value data //!< Data of the event
+)
+__ws_nonnull__(1);
+
+/**
+ * Publish a state event to all matching subscribers
+ *
+ * A state event supersedes earlier events of the same name about the same
+ * object, e.g. focus or geometry changes. If a subscriber has not received
+ * such an earlier event yet, it is dropped in favour of the new one, so slow
+ * subscribers only get to see the latest state.
+ *
+ * @return the number of connections the event was sent to, a negative error
+ *         number otherwise
+ */
+int
+ws_connection_publish_state(
+    char const* event, //!< Name of the event, interned
+    uint64_t object, //!< The object the event is about
+    struct ws_value data //!< Data of the event
+)
+__ws_nonnull__(1);
+
+/**
+ * Close a connection
+ *
+ * The connection is freed once the current dispatch is done with it.
+ */
+void
+ws_connection_close(
+    struct ws_connection* self //!< The connection
+)
+__ws_nonnull__(1);
 
 #endif // __WS_CONNECTION_MANAGER_H__
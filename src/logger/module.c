@@ -25,5 +25,961 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
 #include "logger/module.h"
 
+/**
+ * Maximum number of arguments captured per message
+ */
+#define RECORD_ARGS 16
+
+/**
+ * Space for string arguments per message, in bytes
+ */
+#define RECORD_TEXT 96
+
+/**
+ * Number of records per ring, must be a power of two
+ */
+#define RING_SIZE 2048
+
+/**
+ * Size of the output buffer of the logger thread
+ */
+#define OUTPUT_SIZE (64 << 10)
+
+/**
+ * Maximum length of a single conversion specification we reproduce
+ */
+#define SPEC_MAX 32
+
+/**
+ * Kind of argument a conversion specification consumes
+ */
+enum arg_type {
+    ARG_NONE, //!< no argument, e.g. "%%" or something we don't understand
+    ARG_INT, //!< a signed integer
+    ARG_UINT, //!< an unsigned integer
+    ARG_CHAR, //!< a character
+    ARG_DOUBLE, //!< a floating point number
+    ARG_STRING, //!< a string, copied into the record
+    ARG_POINTER, //!< a pointer, only its value is printed
+};
+
+/**
+ * A parsed printf conversion specification
+ */
+struct spec {
+    size_t flags_len; //!< length of the flags, width and precision
+    enum arg_type type; //!< the kind of argument consumed
+    char conv; //!< the conversion character
+    char length[3]; //!< the length modifier
+    bool star_width; //!< whether the width is passed as an argument
+    bool star_precision; //!< whether the precision is passed as an argument
+};
+
+/**
+ * An argument captured from a call site
+ */
+union arg {
+    long long i; //!< signed integers, characters, widths and precisions
+    unsigned long long u; //!< unsigned integers
+    double d; //!< floating point numbers
+    void const* p; //!< pointers
+    size_t text; //!< offset of a string in the text of the record
+};
+
+/**
+ * A log message, not yet formatted
+ */
+struct record {
+    uint64_t stamp; //!< time the message was logged, to keep threads in order
+    struct ws_logger_context const* ctx; //!< the context of the message
+    char const* fmt; //!< the format string
+    uint8_t level; //!< the level of the message
+    uint8_t nargs; //!< the number of captured arguments
+    bool truncated; //!< whether there were more arguments than we capture
+    uint16_t text_len; //!< the number of bytes used in `text`
+    union arg args[RECORD_ARGS]; //!< the captured arguments
+    char text[RECORD_TEXT]; //!< copies of string arguments
+};
+
+/**
+ * Single-producer/single-consumer ring of records
+ *
+ * Each thread logging owns a ring, the logger thread consumes all of them.
+ * When a thread exits, its ring is handed to the next thread starting to log.
+ */
+struct ring {
+    struct ring* next; //!< next ring in the list of all rings
+    atomic_bool taken; //!< whether some thread owns the ring
+    atomic_ulong dropped; //!< messages dropped because the ring was full
+    WS_CACHELINE_ALIGNED atomic_size_t head; //!< next record to consume
+    WS_CACHELINE_ALIGNED atomic_size_t tail; //!< next record to produce
+    struct record records[RING_SIZE]; //!< the records
+};
+
+/**
+ * Names of the log levels
+ */
+static char const* const level_names[] = {
+    [WS_LOG_ERROR] = "error",
+    [WS_LOG_WARN] = "warning",
+    [WS_LOG_INFO] = "info",
+    [WS_LOG_DEBUG] = "debug",
+};
+
+/**
+ * Context of messages of the logger itself
+ */
+static struct ws_logger_context const log_ctx = { .prefix = "logger" };
+
+/**
+ * The logger
+ */
+static struct {
+    int fd; //!< file descriptor to write to
+    atomic_bool running; //!< whether the logger thread is running
+    atomic_uint generation; //!< incremented whenever the rings are freed
+    _Atomic(struct ring*) rings; //!< all rings, new ones are put in front
+    pthread_t thread; //!< the logger thread
+    pthread_key_t key; //!< key to release rings of exiting threads
+    char* out; //!< output buffer of the logger thread
+    size_t out_len; //!< number of bytes in the output buffer
+    atomic_bool sleeping; //!< whether the logger thread waits for records
+    pthread_mutex_t lock; //!< lock the logger thread sleeps with
+    pthread_cond_t wake; //!< signalled when a record is logged
+} logger = {
+    .fd = STDERR_FILENO,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+atomic_int ws_logger_level = WS_LOG_INFO;
+
+/**
+ * The ring of the current thread
+ */
+static _Thread_local struct {
+    struct ring* ring; //!< the ring, NULL if none was acquired yet
+    unsigned int generation; //!< generation the ring was acquired in
+} local;
+
+/**
+ * Get the ring of the current thread, acquire one if necessary
+ *
+ * @return the ring, NULL if none could be allocated
+ */
+static struct ring*
+ring_get(void);
+
+/**
+ * Release the ring of an exiting thread
+ */
+static void
+ring_release(
+    void* ring //!< The ring
+);
+
+/**
+ * Parse a conversion specification
+ *
+ * @return the length of the specification
+ */
+static size_t
+spec_parse(
+    char const* fmt, //!< Format string, pointing to a '%'
+    struct spec* spec //!< Specification to fill in
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Capture the arguments of a message
+ */
+static void
+record_capture(
+    struct record* record, //!< Record to capture the arguments into
+    va_list args //!< The arguments
+)
+__ws_nonnull__(1);
+
+/**
+ * Format a message as a line
+ *
+ * The line is terminated by a newline, not a NUL.
+ *
+ * @return the length of the line
+ */
+static size_t
+record_format(
+    struct record const* record, //!< The record to format
+    char* line //!< Buffer of WS_LOGGER_LINE_MAX bytes to format into
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Format a single conversion
+ *
+ * @return the number of bytes written, excluding the NUL
+ */
+static size_t
+format_arg(
+    char* buf, //!< Buffer to format into
+    size_t size, //!< Size of the buffer
+    char const* conv, //!< The specification, as in the format string
+    struct spec const* spec, //!< The parsed specification
+    struct record const* record, //!< The record holding the arguments
+    union arg const* args //!< The arguments of this conversion
+)
+__ws_nonnull__(1, 3, 4, 5, 6);
+
+/**
+ * Main function of the logger thread
+ */
+static void*
+logger_main(
+    void* arg //!< Unused
+);
+
+/**
+ * Consume and format all records currently in the rings
+ *
+ * @return the number of records consumed
+ */
+static size_t
+logger_drain(void);
+
+/**
+ * Check whether any ring holds records
+ *
+ * @return true if there is something to log
+ */
+static bool
+logger_pending(void);
+
+/**
+ * Wake the logger thread if it is sleeping
+ */
+static void
+logger_wake(void);
+
+/**
+ * Put a message of the logger itself into the output buffer
+ */
+static void
+logger_note(
+    char const* fmt, //!< printf-like format string
+    ...
+)
+__ws_nonnull__(1) __ws_format__(printf, 1, 2);
+
+/**
+ * Write out the output buffer
+ */
+static void
+logger_write(
+    char const* buf, //!< Data to write
+    size_t len //!< Number of bytes to write
+);
+
+/**
+ * Get a timestamp to order records by
+ */
+static uint64_t
+timestamp(void);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_logger_init(
+    int fd,
+    enum ws_log_level level
+) {
+    logger.fd = fd;
+    atomic_store_explicit(&ws_logger_level, level, memory_order_relaxed);
+
+    logger.out = malloc(OUTPUT_SIZE);
+    if (!logger.out) {
+        return -ENOMEM;
+    }
+    logger.out_len = 0;
+
+    int res = pthread_key_create(&logger.key, ring_release);
+    if (res) {
+        free(logger.out);
+        return -res;
+    }
+
+    atomic_store_explicit(&logger.running, true, memory_order_release);
+    res = pthread_create(&logger.thread, NULL, logger_main, NULL);
+    if (res) {
+        atomic_store_explicit(&logger.running, false, memory_order_release);
+        pthread_key_delete(logger.key);
+        free(logger.out);
+        return -res;
+    }
+    return 0;
+}
+
+void
+ws_logger_deinit(void)
+{
+    if (atomic_exchange(&logger.running, false)) {
+        // the thread drains the rings once more before exiting
+        pthread_mutex_lock(&logger.lock);
+        pthread_cond_signal(&logger.wake);
+        pthread_mutex_unlock(&logger.lock);
+        pthread_join(logger.thread, NULL);
+        pthread_key_delete(logger.key);
+        free(logger.out);
+    }
+
+    struct ring* ring = atomic_exchange(&logger.rings, NULL);
+    while (ring) {
+        struct ring* next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    atomic_fetch_add(&logger.generation, 1);
+
+    logger.fd = STDERR_FILENO;
+    atomic_store_explicit(&ws_logger_level, WS_LOG_INFO, memory_order_relaxed);
+}
+
+void
+ws_log(
+    struct ws_logger_context const* ctx,
+    enum ws_log_level level,
+    char const* fmt,
+    ...
+) {
+    va_list args;
+    va_start(args, fmt);
+    ws_logv(ctx, level, fmt, args);
+    va_end(args);
+}
+
+void
+ws_logv(
+    struct ws_logger_context const* ctx,
+    enum ws_log_level level,
+    char const* fmt,
+    va_list args
+) {
+    if (!ws_logger_enabled(level)) {
+        return;
+    }
+
+    struct ring* ring = NULL;
+    if (atomic_load_explicit(&logger.running, memory_order_acquire)) {
+        ring = ring_get();
+    }
+
+    if (!ring) {
+        // no logger thread (yet), write the message ourselves
+        struct record record = { .ctx = ctx, .fmt = fmt, .level = level };
+        record_capture(&record, args);
+
+        char line[WS_LOGGER_LINE_MAX];
+        logger_write(line, record_format(&record, line));
+        return;
+    }
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head >= RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct record* record = ring->records + (tail & (RING_SIZE - 1));
+    record->stamp = timestamp();
+    record->ctx = ctx;
+    record->fmt = fmt;
+    record->level = level;
+    record_capture(record, args);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    logger_wake();
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static struct ring*
+ring_get(void)
+{
+    unsigned int generation = atomic_load_explicit(&logger.generation,
+                                                   memory_order_relaxed);
+    if (local.ring && (local.generation == generation)) {
+        return local.ring;
+    }
+
+    // reuse the ring of a thread which exited, if there is one
+    struct ring* ring = atomic_load_explicit(&logger.rings,
+                                             memory_order_acquire);
+    for (; ring; ring = ring->next) {
+        bool taken = false;
+        if (atomic_compare_exchange_strong(&ring->taken, &taken, true)) {
+            break;
+        }
+    }
+
+    if (!ring) {
+        ring = aligned_alloc(alignof(struct ring), sizeof(*ring));
+        if (!ring) {
+            return NULL;
+        }
+        atomic_init(&ring->taken, true);
+        atomic_init(&ring->dropped, 0);
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+
+        ring->next = atomic_load_explicit(&logger.rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&logger.rings,
+                                                      &ring->next, ring,
+                                                      memory_order_release,
+                                                      memory_order_relaxed));
+    }
+
+    local.ring = ring;
+    local.generation = generation;
+    pthread_setspecific(logger.key, ring);
+    return ring;
+}
+
+static void
+ring_release(
+    void* ring
+) {
+    unsigned int generation = atomic_load_explicit(&logger.generation,
+                                                   memory_order_relaxed);
+    if (local.generation == generation) {
+        // the logger thread will still consume what is left in the ring
+        atomic_store_explicit(&((struct ring*) ring)->taken, false,
+                              memory_order_release);
+    }
+    local.ring = NULL;
+}
+
+static size_t
+spec_parse(
+    char const* fmt,
+    struct spec* spec
+) {
+    char const* cur = fmt + 1;
+    *spec = (struct spec) { .type = ARG_NONE };
+
+    cur += strspn(cur, "-+ #0'");
+    if (*cur == '*') {
+        spec->star_width = true;
+        ++cur;
+    } else {
+        cur += strspn(cur, "0123456789");
+    }
+    if (*cur == '.') {
+        ++cur;
+        if (*cur == '*') {
+            spec->star_precision = true;
+            ++cur;
+        } else {
+            cur += strspn(cur, "0123456789");
+        }
+    }
+    spec->flags_len = cur - fmt - 1;
+
+    size_t length = strspn(cur, "hljztLq");
+    if (length < sizeof(spec->length)) {
+        memcpy(spec->length, cur, length);
+    }
+    cur += length;
+
+    spec->conv = *cur;
+    switch (spec->conv) {
+    case 'd':
+    case 'i':
+        spec->type = ARG_INT;
+        break;
+
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        spec->type = ARG_UINT;
+        break;
+
+    case 'c':
+        spec->type = ARG_CHAR;
+        break;
+
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        spec->type = ARG_DOUBLE;
+        break;
+
+    case 's':
+        spec->type = ARG_STRING;
+        break;
+
+    case 'p':
+        spec->type = ARG_POINTER;
+        break;
+
+    case '\0':
+        // specification cut short, print it as it is
+        return cur - fmt;
+
+    default:
+        // "%%" and whatever we don't support
+        break;
+    }
+
+    return cur + 1 - fmt;
+}
+
+static void
+record_capture(
+    struct record* record,
+    va_list args
+) {
+    va_list ap;
+    va_copy(ap, args);
+
+    record->nargs = 0;
+    record->truncated = false;
+    record->text_len = 0;
+
+    char const* cur = record->fmt;
+    while ((cur = strchr(cur, '%'))) {
+        struct spec spec;
+        cur += spec_parse(cur, &spec);
+        if (spec.type == ARG_NONE) {
+            continue;
+        }
+
+        size_t needed = 1 + spec.star_width + spec.star_precision;
+        if (record->nargs + needed > RECORD_ARGS) {
+            record->truncated = true;
+            break;
+        }
+
+        union arg* arg = record->args + record->nargs;
+        record->nargs += needed;
+        if (spec.star_width) {
+            (arg++)->i = va_arg(ap, int);
+        }
+        long long precision = -1;
+        if (spec.star_precision) {
+            precision = (arg++)->i = va_arg(ap, int);
+        }
+
+        char const* length = spec.length;
+        switch (spec.type) {
+        case ARG_INT:
+            if (!strcmp(length, "hh")) {
+                arg->i = (signed char) va_arg(ap, int);
+            } else if (!strcmp(length, "h")) {
+                arg->i = (short) va_arg(ap, int);
+            } else if (!strcmp(length, "l")) {
+                arg->i = va_arg(ap, long);
+            } else if (!strcmp(length, "ll") || !strcmp(length, "q")) {
+                arg->i = va_arg(ap, long long);
+            } else if (!strcmp(length, "j")) {
+                arg->i = va_arg(ap, intmax_t);
+            } else if (!strcmp(length, "z")) {
+                arg->i = va_arg(ap, ssize_t);
+            } else if (!strcmp(length, "t")) {
+                arg->i = va_arg(ap, ptrdiff_t);
+            } else {
+                arg->i = va_arg(ap, int);
+            }
+            break;
+
+        case ARG_UINT:
+            if (!strcmp(length, "hh")) {
+                arg->u = (unsigned char) va_arg(ap, unsigned int);
+            } else if (!strcmp(length, "h")) {
+                arg->u = (unsigned short) va_arg(ap, unsigned int);
+            } else if (!strcmp(length, "l")) {
+                arg->u = va_arg(ap, unsigned long);
+            } else if (!strcmp(length, "ll") || !strcmp(length, "q")) {
+                arg->u = va_arg(ap, unsigned long long);
+            } else if (!strcmp(length, "j")) {
+                arg->u = va_arg(ap, uintmax_t);
+            } else if (!strcmp(length, "z")) {
+                arg->u = va_arg(ap, size_t);
+            } else if (!strcmp(length, "t")) {
+                arg->u = (size_t) va_arg(ap, ptrdiff_t);
+            } else {
+                arg->u = va_arg(ap, unsigned int);
+            }
+            break;
+
+        case ARG_CHAR:
+            // wide characters are printed as narrow ones
+            arg->i = *length ? (int) va_arg(ap, wint_t) : va_arg(ap, int);
+            break;
+
+        case ARG_DOUBLE:
+            arg->d = *length == 'L' ? (double) va_arg(ap, long double)
+                                    : va_arg(ap, double);
+            break;
+
+        case ARG_STRING:
+            {
+                char const* str = va_arg(ap, char const*);
+                if (!str) {
+                    str = "(null)";
+                } else if (*length) {
+                    str = "(wide string)";
+                }
+
+                // copy as much as fits, the last byte is always a NUL
+                size_t room = RECORD_TEXT - 1 - record->text_len;
+                if ((precision >= 0) && ((size_t) precision < room)) {
+                    room = precision;
+                }
+                size_t len = strnlen(str, room);
+
+                arg->text = record->text_len;
+                memcpy(record->text + record->text_len, str, len);
+                record->text_len += len;
+                record->text[record->text_len] = '\0';
+                if (record->text_len < RECORD_TEXT - 1) {
+                    ++record->text_len;
+                }
+            }
+            break;
+
+        case ARG_POINTER:
+            arg->p = va_arg(ap, void const*);
+            break;
+
+        case ARG_NONE:
+            break;
+        }
+    }
+
+    va_end(ap);
+}
+
+static size_t
+record_format(
+    struct record const* record,
+    char* line
+) {
+    size_t const size = WS_LOGGER_LINE_MAX - 1; // room for the newline
+    int res = snprintf(line, size, "[%s] %s: ", record->ctx->prefix,
+                       level_names[record->level]);
+    size_t len = res < 0 ? 0 : (size_t) res;
+    if (len > size - 1) {
+        // snprintf() tells the length it wanted, not the one it wrote
+        len = size - 1;
+    }
+
+    char const* fmt = record->fmt;
+    size_t nargs = 0;
+    while ((len < size - 1) && *fmt) {
+        char const* next = strchr(fmt, '%');
+        size_t literal = next ? (size_t) (next - fmt) : strlen(fmt);
+        if (literal > size - 1 - len) {
+            literal = size - 1 - len;
+        }
+        memcpy(line + len, fmt, literal);
+        len += literal;
+        fmt += literal;
+        if (!next || fmt != next) {
+            break;
+        }
+
+        struct spec spec;
+        size_t spec_len = spec_parse(fmt, &spec);
+        if (spec.type == ARG_NONE) {
+            if (spec.conv == '%') {
+                line[len++] = '%';
+            }
+            fmt += spec_len;
+            continue;
+        }
+
+        size_t needed = 1 + spec.star_width + spec.star_precision;
+        if (nargs + needed > record->nargs) {
+            // arguments beyond RECORD_ARGS were not captured
+            res = snprintf(line + len, size - len, "...");
+            len += res < 0 ? 0 : (size_t) res;
+            if (len > size - 1) {
+                len = size - 1;
+            }
+            break;
+        }
+
+        len += format_arg(line + len, size - len, fmt, &spec, record,
+                          record->args + nargs);
+        if (len >= size) {
+            len = size - 1;
+        }
+        nargs += needed;
+        fmt += spec_len;
+    }
+
+    line[len++] = '\n';
+    return len;
+}
+
+static size_t
+format_arg(
+    char* buf,
+    size_t size,
+    char const* conv,
+    struct spec const* spec,
+    struct record const* record,
+    union arg const* args
+) {
+    // rebuild the specification with values in place of '*' and the length
+    // modifier adjusted to what we captured the argument as
+    char fmt[SPEC_MAX + 2 * 24];
+    size_t len = 0;
+    fmt[len++] = '%';
+
+    union arg const* star = args;
+    args += spec->star_width + spec->star_precision;
+
+    char const* cur = conv + 1;
+    char const* end = cur + spec->flags_len;
+    for (; (cur < end) && (len < SPEC_MAX); ++cur) {
+        if (*cur != '*') {
+            fmt[len++] = *cur;
+            continue;
+        }
+
+        long long value = (star++)->i;
+        if ((cur[-1] == '.') && (value < 0)) {
+            // a negative precision is taken as if it were omitted
+            --len;
+            continue;
+        }
+        len += snprintf(fmt + len, sizeof(fmt) - len, "%lld", value);
+    }
+    if ((spec->type == ARG_INT) || (spec->type == ARG_UINT)) {
+        fmt[len++] = 'l';
+        fmt[len++] = 'l';
+    }
+    fmt[len++] = spec->conv;
+    fmt[len] = '\0';
+
+    int res;
+    switch (spec->type) {
+    case ARG_INT:
+        res = snprintf(buf, size, fmt, args->i);
+        break;
+
+    case ARG_UINT:
+        res = snprintf(buf, size, fmt, args->u);
+        break;
+
+    case ARG_CHAR:
+        res = snprintf(buf, size, fmt, (int) args->i);
+        break;
+
+    case ARG_DOUBLE:
+        res = snprintf(buf, size, fmt, args->d);
+        break;
+
+    case ARG_STRING:
+        res = snprintf(buf, size, fmt, record->text + args->text);
+        break;
+
+    case ARG_POINTER:
+        res = snprintf(buf, size, fmt, args->p);
+        break;
+
+    default:
+        res = 0;
+        break;
+    }
+    return res < 0 ? 0 : (size_t) res;
+}
+
+static void*
+logger_main(
+    void* arg __ws_unused__
+) {
+    while (atomic_load_explicit(&logger.running, memory_order_acquire)) {
+        if (logger_drain()) {
+            continue;
+        }
+
+        // producers check `sleeping` after publishing a record, we check the
+        // rings after setting it: one of us sees the other
+        pthread_mutex_lock(&logger.lock);
+        atomic_store(&logger.sleeping, true);
+        if (!logger_pending() &&
+                atomic_load_explicit(&logger.running, memory_order_acquire)) {
+            pthread_cond_wait(&logger.wake, &logger.lock);
+        }
+        atomic_store_explicit(&logger.sleeping, false, memory_order_relaxed);
+        pthread_mutex_unlock(&logger.lock);
+    }
+
+    // whatever was logged until we were told to stop
+    logger_drain();
+    return NULL;
+}
+
+static size_t
+logger_drain(void)
+{
+    size_t consumed = 0;
+
+    while (1) {
+        // merge the rings by time, so messages of threads stay in order
+        struct ring* next = NULL;
+        struct record const* record = NULL;
+        struct ring* ring = atomic_load_explicit(&logger.rings,
+                                                 memory_order_acquire);
+        for (; ring; ring = ring->next) {
+            size_t head = atomic_load_explicit(&ring->head,
+                                               memory_order_relaxed);
+            size_t tail = atomic_load_explicit(&ring->tail,
+                                               memory_order_acquire);
+            if (head == tail) {
+                continue;
+            }
+
+            struct record const* first;
+            first = ring->records + (head & (RING_SIZE - 1));
+            if (!record || (first->stamp < record->stamp)) {
+                next = ring;
+                record = first;
+            }
+        }
+        if (!next) {
+            break;
+        }
+
+        if (OUTPUT_SIZE - logger.out_len < WS_LOGGER_LINE_MAX) {
+            logger_write(logger.out, logger.out_len);
+            logger.out_len = 0;
+        }
+        logger.out_len += record_format(record, logger.out + logger.out_len);
+
+        size_t head = atomic_load_explicit(&next->head, memory_order_relaxed);
+        atomic_store_explicit(&next->head, head + 1, memory_order_release);
+        ++consumed;
+    }
+
+    struct ring* ring = atomic_load_explicit(&logger.rings,
+                                             memory_order_acquire);
+    for (; ring; ring = ring->next) {
+        unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0,
+                                                         memory_order_relaxed);
+        if (dropped) {
+            logger_note("%lu messages dropped, logging too fast", dropped);
+        }
+    }
+
+    logger_write(logger.out, logger.out_len);
+    logger.out_len = 0;
+    return consumed;
+}
+
+static bool
+logger_pending(void)
+{
+    struct ring* ring = atomic_load(&logger.rings);
+    for (; ring; ring = ring->next) {
+        if (atomic_load(&ring->head) != atomic_load(&ring->tail)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+logger_wake(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&logger.sleeping, memory_order_relaxed)) {
+        return;
+    }
+
+    pthread_mutex_lock(&logger.lock);
+    pthread_cond_signal(&logger.wake);
+    pthread_mutex_unlock(&logger.lock);
+}
+
+static void
+logger_note(
+    char const* fmt,
+    ...
+) {
+    if (OUTPUT_SIZE - logger.out_len < WS_LOGGER_LINE_MAX) {
+        logger_write(logger.out, logger.out_len);
+        logger.out_len = 0;
+    }
+
+    struct record record = {
+        .ctx = &log_ctx,
+        .fmt = fmt,
+        .level = WS_LOG_WARN,
+    };
+    va_list args;
+    va_start(args, fmt);
+    record_capture(&record, args);
+    va_end(args);
+
+    logger.out_len += record_format(&record, logger.out + logger.out_len);
+}
+
+static void
+logger_write(
+    char const* buf,
+    size_t len
+) {
+    while (len) {
+        ssize_t res = write(logger.fd, buf, len);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // nowhere left to complain to
+            return;
+        }
+        buf += res;
+        len -= res;
+    }
+}
+
+static uint64_t
+timestamp(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -25,9 +25,114 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_LOGGER_MODULE_H__
 #define __WS_LOGGER_MODULE_H__
 
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "util/attributes.h"
+
+/**
+ * Maximum length of a log line, longer lines are truncated
+ */
+#define WS_LOGGER_LINE_MAX 512
+
+/**
+ * Log levels, in decreasing severity
+ */
+enum ws_log_level {
+    WS_LOG_ERROR, //!< something failed
+    WS_LOG_WARN, //!< something is about to fail or behaves badly
+    WS_LOG_INFO, //!< things worth knowing during normal operation
+    WS_LOG_DEBUG, //!< things only worth knowing while debugging
+};
+
+/**
+ * Context of log messages, usually one per module
+ */
+struct ws_logger_context {
+    char const* prefix; //!< prefix put in front of every message
+};
+
+/**
+ * Least severe level currently logged
+ *
+ * Use ws_logger_enabled() rather than accessing this directly.
+ */
+extern atomic_int ws_logger_level;
+
+/**
+ * Check whether messages of a level are currently logged
+ */
+static inline bool
+ws_logger_enabled(
+    enum ws_log_level level //!< The level to check
+) {
+    return (int) level <= atomic_load_explicit(&ws_logger_level,
+                                               memory_order_relaxed);
+}
+
+/**
+ * Initialize the logger
+ *
+ * Starts the logger thread, which formats and writes all messages logged from
+ * then on. Until initialized, messages are written to standard error directly
+ * by the logging thread.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_logger_init(
+    int fd, //!< File descriptor to write to
+    enum ws_log_level level //!< Least severe level to log
+);
+
+/**
+ * Deinitialize the logger
+ *
+ * Writes all pending messages and stops the logger thread. No other thread may
+ * log while the logger is deinitialized.
+ */
+void
+ws_logger_deinit(void);
 
+/**
+ * Log a message
+ *
+ * The message is not formatted right away: the format string and the
+ * arguments are put into a ring buffer of the calling thread, from which the
+ * logger thread picks them up. Hence, logging never blocks. The format string
+ * must stay valid, which is the case for string literals. Strings passed as
+ * arguments are copied, but may be truncated.
+ *
+ * If the ring buffer of the calling thread is full, the message is dropped.
+ * The logger thread reports the number of dropped messages.
+ *
+ * Prefer the macros in util/debug.h, which skip evaluating the arguments of
+ * messages which are not logged anyway.
+ */
+void
+ws_log(
+    struct ws_logger_context const* ctx, //!< The context of the message
+    enum ws_log_level level, //!< The level of the message
+    char const* fmt, //!< printf-like format string
+    ...
+)
+__ws_nonnull__(1, 3) __ws_format__(printf, 3, 4) __ws_cold__;
+
+/**
+ * Log a message, with the arguments in a va_list
+ */
+void
+ws_logv(
+    struct ws_logger_context const* ctx, //!< The context of the message
+    enum ws_log_level level, //!< The level of the message
+    char const* fmt, //!< printf-like format string
+    va_list args //!< The arguments
+)
+__ws_nonnull__(1, 3) __ws_format__(printf, 3, 0) __ws_cold__;
 
 #endif // __WS_LOGGER_MODULE_H__
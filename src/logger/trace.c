@@ -0,0 +1,394 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger/trace.h"
+#include "util/file.h"
+
+/**
+ * Size of the buffer the trace is written through
+ */
+#define OUTPUT_SIZE (64 << 10)
+
+/**
+ * Maximum size of a single event in the output
+ */
+#define EVENT_MAX 512
+
+/**
+ * A recorded span
+ */
+struct span {
+    char const* name; //!< name of the span
+    uint64_t start; //!< time the span began, in nanoseconds
+    uint64_t duration; //!< duration of the span, in nanoseconds
+    long tid; //!< id of the thread which recorded the span
+};
+
+/**
+ * Span buffer of a thread
+ *
+ * When a thread exits, its buffer is handed to the next thread starting to
+ * trace. The spans recorded so far are kept, each tells its thread.
+ */
+struct buffer {
+    struct buffer* next; //!< next buffer in the list of all buffers
+    atomic_bool taken; //!< whether some thread owns the buffer
+    long tid; //!< id of the owning thread, as shown in the trace
+    atomic_size_t head; //!< number of spans recorded so far
+    size_t depth; //!< number of spans currently open
+    uint64_t open[WS_TRACE_DEPTH_MAX]; //!< start times of the open spans
+    char const* names[WS_TRACE_DEPTH_MAX]; //!< names of the open spans
+    struct span spans[WS_TRACE_BUFFER_SIZE]; //!< most recent spans
+};
+
+atomic_bool ws_trace_enabled;
+
+/**
+ * All buffers, new ones are put in front
+ */
+static _Atomic(struct buffer*) buffers;
+
+/**
+ * Incremented whenever the buffers are freed
+ */
+static atomic_uint generation;
+
+/**
+ * Key to release the buffers of exiting threads
+ */
+static pthread_key_t key;
+
+/**
+ * Makes sure `key` is created once
+ */
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * The buffer of the current thread
+ */
+static _Thread_local struct {
+    struct buffer* buffer; //!< the buffer, NULL if none was allocated yet
+    unsigned int generation; //!< generation the buffer was allocated in
+} local;
+
+/**
+ * Get the buffer of the current thread, allocate one if necessary
+ *
+ * @return the buffer, NULL if none could be allocated
+ */
+static struct buffer*
+buffer_get(void);
+
+/**
+ * Create the key releasing buffers of exiting threads
+ */
+static void
+key_create(void);
+
+/**
+ * Hand the buffer of an exiting thread back
+ */
+static void
+buffer_release(
+    void* buffer //!< The buffer of the thread
+);
+
+/**
+ * Write the spans of a buffer
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+buffer_dump(
+    struct buffer* buffer, //!< The buffer to write
+    int fd, //!< File descriptor to write to
+    char* out, //!< Output buffer
+    size_t* len, //!< Number of bytes in the output buffer
+    bool* first //!< Whether no event was written yet
+);
+
+/**
+ * Get the current time, in nanoseconds
+ */
+static uint64_t
+now(void);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+void
+ws_trace_start(void)
+{
+    atomic_store_explicit(&ws_trace_enabled, true, memory_order_relaxed);
+}
+
+void
+ws_trace_stop(void)
+{
+    atomic_store_explicit(&ws_trace_enabled, false, memory_order_relaxed);
+}
+
+void
+ws_trace_deinit(void)
+{
+    ws_trace_stop();
+
+    struct buffer* buffer = atomic_exchange(&buffers, NULL);
+    while (buffer) {
+        struct buffer* next = buffer->next;
+        free(buffer);
+        buffer = next;
+    }
+    atomic_fetch_add(&generation, 1);
+}
+
+void
+ws_trace_begin(
+    char const* name
+) {
+    struct buffer* buffer = buffer_get();
+    if (!buffer) {
+        return;
+    }
+
+    // spans nested too deep are only counted, to keep the nesting intact
+    if (buffer->depth < WS_TRACE_DEPTH_MAX) {
+        buffer->names[buffer->depth] = name;
+        buffer->open[buffer->depth] = now();
+    }
+    ++buffer->depth;
+}
+
+void
+ws_trace_end(void)
+{
+    struct buffer* buffer = buffer_get();
+    if (!buffer || !buffer->depth) {
+        return;
+    }
+
+    --buffer->depth;
+    if (buffer->depth >= WS_TRACE_DEPTH_MAX) {
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    struct span* span = buffer->spans + (head % WS_TRACE_BUFFER_SIZE);
+    span->name = buffer->names[buffer->depth];
+    span->start = buffer->open[buffer->depth];
+    span->duration = now() - span->start;
+    span->tid = buffer->tid;
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+int
+ws_trace_dump(
+    int fd
+) {
+    char* out = malloc(OUTPUT_SIZE);
+    if (!out) {
+        return -ENOMEM;
+    }
+
+    size_t len = 0;
+    bool first = true;
+    int res = 0;
+
+    len += snprintf(out, OUTPUT_SIZE, "{\"traceEvents\":[");
+
+    struct buffer* buffer = atomic_load_explicit(&buffers,
+                                                 memory_order_acquire);
+    for (; buffer && (res == 0); buffer = buffer->next) {
+        res = buffer_dump(buffer, fd, out, &len, &first);
+    }
+
+    if (res == 0) {
+        len += snprintf(out + len, OUTPUT_SIZE - len,
+                        "],\"displayTimeUnit\":\"ns\"}\n");
+        res = ws_file_write_all(fd, out, len);
+    }
+
+    free(out);
+    return res;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static struct buffer*
+buffer_get(void)
+{
+    unsigned int current = atomic_load_explicit(&generation,
+                                                memory_order_relaxed);
+    if (WS_LIKELY(local.buffer && (local.generation == current))) {
+        return local.buffer;
+    }
+
+    pthread_once(&key_once, key_create);
+
+    // reuse the buffer of a thread which exited, if there is one
+    struct buffer* buffer = atomic_load_explicit(&buffers,
+                                                 memory_order_acquire);
+    for (; buffer; buffer = buffer->next) {
+        bool taken = false;
+        if (atomic_compare_exchange_strong(&buffer->taken, &taken, true)) {
+            break;
+        }
+    }
+
+    if (!buffer) {
+        buffer = malloc(sizeof(*buffer));
+        if (!buffer) {
+            return NULL;
+        }
+        atomic_init(&buffer->taken, true);
+        atomic_init(&buffer->head, 0);
+
+        buffer->next = atomic_load_explicit(&buffers, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&buffers, &buffer->next,
+                                                      buffer,
+                                                      memory_order_release,
+                                                      memory_order_relaxed));
+    }
+    buffer->tid = syscall(SYS_gettid);
+    buffer->depth = 0;
+
+    local.buffer = buffer;
+    local.generation = current;
+    pthread_setspecific(key, buffer);
+    return buffer;
+}
+
+static void
+key_create(void)
+{
+    pthread_key_create(&key, buffer_release);
+}
+
+static void
+buffer_release(
+    void* buffer
+) {
+    unsigned int current = atomic_load_explicit(&generation,
+                                                memory_order_relaxed);
+    if (local.generation == current) {
+        atomic_store_explicit(&((struct buffer*) buffer)->taken, false,
+                              memory_order_release);
+    }
+}
+
+static int
+buffer_dump(
+    struct buffer* buffer,
+    int fd,
+    char* out,
+    size_t* len,
+    bool* first
+) {
+    long pid = getpid();
+
+    // the thread may overwrite spans while we copy them out: everything it
+    // may have overwritten by the time we're done is dropped afterwards
+    size_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    size_t begin = head > WS_TRACE_BUFFER_SIZE ? head - WS_TRACE_BUFFER_SIZE
+                                               : 0;
+    size_t count = head - begin;
+
+    struct span* spans = malloc(sizeof(*spans) * (count ? count : 1));
+    if (!spans) {
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        spans[i] = buffer->spans[(begin + i) % WS_TRACE_BUFFER_SIZE];
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    size_t done = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    size_t skip = 0;
+    if (done - begin >= WS_TRACE_BUFFER_SIZE) {
+        skip = done - begin - WS_TRACE_BUFFER_SIZE + 1;
+        if (skip > count) {
+            skip = count;
+        }
+    }
+
+    int res = 0;
+    for (size_t i = skip; i < count; ++i) {
+        struct span const* span = spans + i;
+
+        if (OUTPUT_SIZE - *len < EVENT_MAX) {
+            res = ws_file_write_all(fd, out, *len);
+            if (res < 0) {
+                break;
+            }
+            *len = 0;
+        }
+
+        // timestamps are in microseconds
+        int written = snprintf(out + *len, EVENT_MAX,
+                               "%s{\"name\":\"%.256s\",\"ph\":\"X\","
+                               "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,"
+                               "\"pid\":%ld,\"tid\":%ld}",
+                               *first ? "" : ",", span->name,
+                               (unsigned long long) span->start / 1000,
+                               (unsigned long long) span->start % 1000,
+                               (unsigned long long) span->duration / 1000,
+                               (unsigned long long) span->duration % 1000,
+                               pid, span->tid);
+        if (written > 0) {
+            *len += written < EVENT_MAX ? written : EVENT_MAX - 1;
+            *first = false;
+        }
+    }
+
+    free(spans);
+    return res;
+}
+
+static uint64_t
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,186 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WS_LOGGER_TRACE_H__
+#define __WS_LOGGER_TRACE_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "util/attributes.h"
+
+/**
+ * @file trace.h
+ *
+ * Tracing of hot paths
+ *
+ * A span covers the execution of a piece of code, e.g. a frame or a command.
+ * Spans nest, and are recorded with nanosecond timestamps into a buffer of the
+ * thread executing them. Each buffer keeps the most recent spans of its thread,
+ * like a flight recorder, and can be dumped in the Chrome trace format, to be
+ * viewed in chrome://tracing or Perfetto.
+ *
+ * A span usually covers a whole block:
+ *
+ *      {
+ *          WS_TRACE_SCOPE("repaint");
+ *          ...
+ *      }
+ *
+ * While tracing is stopped, a span costs a load and a branch when entered and
+ * a branch when left.
+ */
+
+/**
+ * Number of spans kept per thread
+ */
+#define WS_TRACE_BUFFER_SIZE 4096
+
+/**
+ * Maximum nesting depth of spans
+ *
+ * Spans nested deeper are not recorded.
+ */
+#define WS_TRACE_DEPTH_MAX 32
+
+/**
+ * Whether spans are being recorded
+ *
+ * Use ws_trace_start() and ws_trace_stop() rather than accessing this
+ * directly.
+ */
+extern atomic_bool ws_trace_enabled;
+
+/**
+ * A span of a scope, see WS_TRACE_SCOPE
+ */
+struct ws_trace_scope {
+    bool active; //!< whether the span is being recorded
+};
+
+/**
+ * Start recording spans
+ */
+void
+ws_trace_start(void);
+
+/**
+ * Stop recording spans
+ *
+ * The spans recorded so far are kept.
+ */
+void
+ws_trace_stop(void);
+
+/**
+ * Free the buffers of all threads
+ *
+ * No thread may trace while or after this function is called, unless tracing
+ * is started again.
+ */
+void
+ws_trace_deinit(void);
+
+/**
+ * Begin a span
+ *
+ * Each call must be matched by a call to ws_trace_end() on the same thread.
+ * Tracing should be checked to be enabled first; WS_TRACE_SCOPE does this.
+ */
+void
+ws_trace_begin(
+    char const* name //!< Name of the span, must stay valid, e.g. a literal,
+                     //!< and must not need escaping in JSON
+)
+__ws_nonnull__(1);
+
+/**
+ * End the innermost span of the calling thread
+ */
+void
+ws_trace_end(void);
+
+/**
+ * Write the recorded spans of all threads to a file, in Chrome trace format
+ *
+ * This may be called while other threads are tracing. Spans those threads
+ * record while the buffers are written out may be missing from the dump.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_trace_dump(
+    int fd //!< File descriptor to write the trace to
+);
+
+/**
+ * Begin a span if tracing is enabled
+ *
+ * @return the scope to pass to ws_trace_scope_end()
+ */
+static inline struct ws_trace_scope
+ws_trace_scope_begin(
+    char const* name //!< Name of the span
+) {
+    struct ws_trace_scope scope = {
+        .active = WS_UNLIKELY(atomic_load_explicit(&ws_trace_enabled,
+                                                   memory_order_relaxed)),
+    };
+    if (scope.active) {
+        ws_trace_begin(name);
+    }
+    return scope;
+}
+
+/**
+ * End a span begun by ws_trace_scope_begin(), if one was begun
+ */
+static inline void
+ws_trace_scope_end(
+    struct ws_trace_scope* scope //!< The scope
+) {
+    if (scope->active) {
+        ws_trace_end();
+    }
+}
+
+#define WS_TRACE_CONCAT_(a, b) a##b
+#define WS_TRACE_CONCAT(a, b) WS_TRACE_CONCAT_(a, b)
+
+/**
+ * Trace the rest of the enclosing block as a span
+ */
+#ifdef __GNUC__
+#define WS_TRACE_SCOPE(name) \
+    struct ws_trace_scope WS_TRACE_CONCAT(ws_trace_scope_, __LINE__) \
+    __ws_cleanup__(ws_trace_scope_end) = ws_trace_scope_begin(name)
+#else
+#define WS_TRACE_SCOPE(name) do {} while (0)
+#endif
+
+#endif // __WS_LOGGER_TRACE_H__
@@ -25,5 +25,538 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "objects/array.h"
 
+/**
+ * Arrays shorter than this are sorted by insertion sort
+ */
+#define INSERTION_SORT_THRESHOLD 16
+
+/**
+ * Initial capacity of an array
+ */
+#define MIN_CAPACITY 8
+
+/**
+ * Swap two elements
+ */
+static inline void
+swap(
+    char* a, //!< The first element
+    char* b, //!< The second element
+    size_t size //!< Size of an element
+);
+
+/**
+ * Reverse a range of elements
+ */
+static void
+reverse(
+    char* begin, //!< First element of the range
+    char* end, //!< End of the range
+    size_t size //!< Size of an element
+);
+
+/**
+ * Rotate a range of elements, so `mid` becomes the first one
+ */
+static void
+rotate(
+    char* begin, //!< First element of the range
+    char* mid, //!< Element to become the first one
+    char* end, //!< End of the range
+    size_t size //!< Size of an element
+);
+
+/**
+ * Sort elements of arbitrary size
+ */
+static void
+sort_generic(
+    char* data, //!< The elements
+    size_t len, //!< Number of elements
+    size_t size, //!< Size of an element
+    ws_array_cmp_func cmp //!< Comparison function
+);
+
+/**
+ * Partition a range stably, recursively
+ *
+ * @return the first element not satisfying the predicate
+ */
+static char*
+partition_range(
+    char* begin, //!< First element of the range
+    size_t len, //!< Number of elements in the range
+    size_t size, //!< Size of an element
+    ws_array_pred_func pred, //!< The predicate
+    void* ctx //!< Context passed to the predicate
+);
+
+/**
+ * Define a sort and a search for a scalar type
+ *
+ * The functions are quicksort with median of three pivots, finishing with an
+ * insertion sort, and a lower bound binary search. Elements are compared
+ * with the built-in operators.
+ */
+#define DEFINE_SCALAR_FUNCS(name, type)                                        \
+static void                                                                    \
+sort_##name(                                                                   \
+    type* data,                                                                \
+    size_t len                                                                 \
+) {                                                                            \
+    while (len > INSERTION_SORT_THRESHOLD) {                                   \
+        type* a = data;                                                        \
+        type* b = data + len / 2;                                              \
+        type* c = data + len - 1;                                              \
+        type pivot = *a < *b ? (*b < *c ? *b : (*a < *c ? *c : *a))            \
+                             : (*a < *c ? *a : (*b < *c ? *c : *b));           \
+                                                                               \
+        size_t i = 0;                                                          \
+        size_t j = len - 1;                                                    \
+        for (;;) {                                                             \
+            while (data[i] < pivot) {                                          \
+                ++i;                                                           \
+            }                                                                  \
+            while (pivot < data[j]) {                                          \
+                --j;                                                           \
+            }                                                                  \
+            if (i >= j) {                                                      \
+                break;                                                         \
+            }                                                                  \
+            type tmp = data[i];                                                \
+            data[i++] = data[j];                                               \
+            data[j--] = tmp;                                                   \
+        }                                                                      \
+                                                                               \
+        /* recurse into the smaller half, loop on the larger one */            \
+        size_t left = j + 1;                                                   \
+        if (left < len - left) {                                               \
+            sort_##name(data, left);                                           \
+            data += left;                                                      \
+            len -= left;                                                       \
+        } else {                                                               \
+            sort_##name(data + left, len - left);                              \
+            len = left;                                                        \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    for (size_t i = 1; i < len; ++i) {                                         \
+        type tmp = data[i];                                                    \
+        size_t j = i;                                                          \
+        while (j && (tmp < data[j - 1])) {                                     \
+            data[j] = data[j - 1];                                             \
+            --j;                                                               \
+        }                                                                      \
+        data[j] = tmp;                                                         \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static size_t                                                                  \
+lower_bound_##name(                                                            \
+    type const* data,                                                          \
+    size_t len,                                                                \
+    type key                                                                   \
+) {                                                                            \
+    size_t lo = 0;                                                             \
+    while (len) {                                                              \
+        size_t half = len / 2;                                                 \
+        if (data[lo + half] < key) {                                           \
+            lo += half + 1;                                                    \
+            len -= half + 1;                                                   \
+        } else {                                                               \
+            len = half;                                                        \
+        }                                                                      \
+    }                                                                          \
+    return lo;                                                                 \
+}
+
+DEFINE_SCALAR_FUNCS(int, int64_t)
+DEFINE_SCALAR_FUNCS(object_id, uint64_t)
+
+#undef DEFINE_SCALAR_FUNCS
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+void
+ws_array_init(
+    struct ws_array* self,
+    size_t elem_size
+) {
+    self->data = NULL;
+    self->len = 0;
+    self->cap = 0;
+    self->elem_size = elem_size;
+    self->type = WS_ARRAY_TYPE_GENERIC;
+}
+
+void
+ws_array_init_typed(
+    struct ws_array* self,
+    enum ws_array_type type
+) {
+    switch (type) {
+    case WS_ARRAY_TYPE_INT:
+        ws_array_init(self, sizeof(int64_t));
+        break;
+
+    case WS_ARRAY_TYPE_OBJECT_ID:
+        ws_array_init(self, sizeof(uint64_t));
+        break;
+
+    default:
+        ws_array_init(self, 1);
+        break;
+    }
+    self->type = type;
+}
+
+void
+ws_array_deinit(
+    struct ws_array* self
+) {
+    free(self->data);
+    self->data = NULL;
+    self->len = 0;
+    self->cap = 0;
+}
+
+int
+ws_array_reserve(
+    struct ws_array* self,
+    size_t cap
+) {
+    if (cap <= self->cap) {
+        return 0;
+    }
+
+    // grow geometrically, unless a larger capacity is requested explicitly
+    size_t new_cap = self->cap ? self->cap + self->cap / 2 : MIN_CAPACITY;
+    if (new_cap < cap) {
+        new_cap = cap;
+    }
+
+    if (new_cap > SIZE_MAX / self->elem_size) {
+        return -ENOMEM;
+    }
+
+    char* data = realloc(self->data, new_cap * self->elem_size);
+    if (!data) {
+        return -ENOMEM;
+    }
+
+    self->data = data;
+    self->cap = new_cap;
+    return 0;
+}
+
+int
+ws_array_shrink_to_fit(
+    struct ws_array* self
+) {
+    if (self->len == self->cap) {
+        return 0;
+    }
+
+    if (!self->len) {
+        ws_array_deinit(self);
+        return 0;
+    }
+
+    char* data = realloc(self->data, self->len * self->elem_size);
+    if (!data) {
+        return -ENOMEM;
+    }
+
+    self->data = data;
+    self->cap = self->len;
+    return 0;
+}
+
+int
+ws_array_push(
+    struct ws_array* self,
+    void const* elem
+) {
+    return ws_array_insert(self, self->len, elem);
+}
+
+int
+ws_array_pop(
+    struct ws_array* self,
+    void* elem
+) {
+    if (!self->len) {
+        return -ENOENT;
+    }
+
+    --self->len;
+    if (elem) {
+        memcpy(elem, ws_array_at(self, self->len), self->elem_size);
+    }
+    return 0;
+}
+
+int
+ws_array_insert(
+    struct ws_array* self,
+    size_t index,
+    void const* elem
+) {
+    if (self->len == self->cap) {
+        int res = ws_array_reserve(self, self->len + 1);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    char* pos = ws_array_at(self, index);
+    memmove(pos + self->elem_size, pos, (self->len - index) * self->elem_size);
+    memcpy(pos, elem, self->elem_size);
+    ++self->len;
+    return 0;
+}
+
+void
+ws_array_remove(
+    struct ws_array* self,
+    size_t index
+) {
+    char* pos = ws_array_at(self, index);
+    --self->len;
+    memmove(pos, pos + self->elem_size, (self->len - index) * self->elem_size);
+}
+
+void
+ws_array_move(
+    struct ws_array* self,
+    size_t from,
+    size_t to
+) {
+    if (from < to) {
+        rotate(ws_array_at(self, from), ws_array_at(self, from + 1),
+               ws_array_at(self, to + 1), self->elem_size);
+    } else if (to < from) {
+        rotate(ws_array_at(self, to), ws_array_at(self, from),
+               ws_array_at(self, from + 1), self->elem_size);
+    }
+}
+
+void
+ws_array_sort(
+    struct ws_array* self,
+    ws_array_cmp_func cmp
+) {
+    if (!cmp) {
+        switch (self->type) {
+        case WS_ARRAY_TYPE_INT:
+            sort_int((int64_t*) self->data, self->len);
+            return;
+
+        case WS_ARRAY_TYPE_OBJECT_ID:
+            sort_object_id((uint64_t*) self->data, self->len);
+            return;
+
+        default:
+            // generic arrays cannot be sorted without a comparison
+            return;
+        }
+    }
+
+    sort_generic(self->data, self->len, self->elem_size, cmp);
+}
+
+bool
+ws_array_bsearch(
+    struct ws_array const* self,
+    void const* key,
+    ws_array_cmp_func cmp,
+    size_t* index
+) {
+    size_t lo;
+    bool found;
+
+    if (!cmp && (self->type == WS_ARRAY_TYPE_INT)) {
+        int64_t k = *(int64_t const*) key;
+        lo = lower_bound_int((int64_t const*) self->data, self->len, k);
+        found = (lo < self->len) && (((int64_t const*) self->data)[lo] == k);
+    } else if (!cmp && (self->type == WS_ARRAY_TYPE_OBJECT_ID)) {
+        uint64_t k = *(uint64_t const*) key;
+        lo = lower_bound_object_id((uint64_t const*) self->data, self->len, k);
+        found = (lo < self->len) && (((uint64_t const*) self->data)[lo] == k);
+    } else if (cmp) {
+        size_t len = self->len;
+        lo = 0;
+        while (len) {
+            size_t half = len / 2;
+            if (cmp(ws_array_at(self, lo + half), key) < 0) {
+                lo += half + 1;
+                len -= half + 1;
+            } else {
+                len = half;
+            }
+        }
+        found = (lo < self->len) && (cmp(ws_array_at(self, lo), key) == 0);
+    } else {
+        lo = self->len;
+        found = false;
+    }
+
+    if (index) {
+        *index = lo;
+    }
+    return found;
+}
+
+size_t
+ws_array_stable_partition(
+    struct ws_array* self,
+    ws_array_pred_func pred,
+    void* ctx
+) {
+    // skip the prefix which is partitioned already
+    size_t first = 0;
+    while ((first < self->len) && pred(ws_array_at(self, first), ctx)) {
+        ++first;
+    }
+
+    char* end = partition_range(ws_array_at(self, first), self->len - first,
+                                self->elem_size, pred, ctx);
+    return (end - self->data) / self->elem_size;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static inline void
+swap(
+    char* a,
+    char* b,
+    size_t size
+) {
+    while (size--) {
+        char tmp = *a;
+        *a++ = *b;
+        *b++ = tmp;
+    }
+}
+
+static void
+reverse(
+    char* begin,
+    char* end,
+    size_t size
+) {
+    while (begin < end) {
+        end -= size;
+        if (begin >= end) {
+            break;
+        }
+        swap(begin, end, size);
+        begin += size;
+    }
+}
+
+static void
+rotate(
+    char* begin,
+    char* mid,
+    char* end,
+    size_t size
+) {
+    reverse(begin, mid, size);
+    reverse(mid, end, size);
+    reverse(begin, end, size);
+}
+
+static void
+sort_generic(
+    char* data,
+    size_t len,
+    size_t size,
+    ws_array_cmp_func cmp
+) {
+    while (len > INSERTION_SORT_THRESHOLD) {
+        // median of three, moved to the front
+        char* a = data;
+        char* b = data + (len / 2) * size;
+        char* c = data + (len - 1) * size;
+        char* median = cmp(a, b) < 0
+                     ? (cmp(b, c) < 0 ? b : (cmp(a, c) < 0 ? c : a))
+                     : (cmp(a, c) < 0 ? a : (cmp(b, c) < 0 ? c : b));
+        swap(data, median, size);
+
+        // Hoare partition around the first element
+        size_t i = 0;
+        size_t j = len;
+        for (;;) {
+            do {
+                ++i;
+            } while ((i < len) && (cmp(data + i * size, data) < 0));
+            do {
+                --j;
+            } while (cmp(data, data + j * size) < 0);
+            if (i >= j) {
+                break;
+            }
+            swap(data + i * size, data + j * size, size);
+        }
+        swap(data, data + j * size, size);
+
+        // the pivot is in its final place at j
+        if (j < len - j - 1) {
+            sort_generic(data, j, size, cmp);
+            data += (j + 1) * size;
+            len -= j + 1;
+        } else {
+            sort_generic(data + (j + 1) * size, len - j - 1, size, cmp);
+            len = j;
+        }
+    }
+
+    for (size_t i = 1; i < len; ++i) {
+        size_t j = i;
+        while (j && (cmp(data + j * size, data + (j - 1) * size) < 0)) {
+            swap(data + j * size, data + (j - 1) * size, size);
+            --j;
+        }
+    }
+}
+
+static char*
+partition_range(
+    char* begin,
+    size_t len,
+    size_t size,
+    ws_array_pred_func pred,
+    void* ctx
+) {
+    if (!len) {
+        return begin;
+    }
+    if (len == 1) {
+        return pred(begin, ctx) ? begin + size : begin;
+    }
+
+    // partition both halves, then swap the middle parts by rotation
+    size_t half = len / 2;
+    char* mid = begin + half * size;
+    char* left = partition_range(begin, half, size, pred, ctx);
+    char* right = partition_range(mid, len - half, size, pred, ctx);
+
+    rotate(left, mid, right, size);
+    return left + (right - mid);
+}
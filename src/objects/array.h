@@ -25,10 +25,239 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_OBJECTS_ARRAY_H__
 #define __WS_OBJECTS_ARRAY_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#include "util/attributes.h"
 
-#endif // __WS_OBJECTS_ARRAY_H__
+/**
+ * Element types an array knows about
+ *
+ * Arrays of known types get specialized sorting and searching which compare
+ * elements inline instead of through a function pointer.
+ */
+enum ws_array_type {
+    WS_ARRAY_TYPE_GENERIC, //!< elements of arbitrary size
+    WS_ARRAY_TYPE_INT, //!< int64_t elements
+    WS_ARRAY_TYPE_OBJECT_ID, //!< uint64_t object ids
+};
+
+/**
+ * Comparison function for array elements
+ *
+ * @return less than, equal to or greater than zero if `a` is less than, equal
+ *         to or greater than `b`
+ */
+typedef int (*ws_array_cmp_func)(
+    void const* a, //!< The element to compare
+    void const* b //!< The element to compare with
+);
+
+/**
+ * Predicate on array elements
+ *
+ * @return true if the element satisfies the predicate, false otherwise
+ */
+typedef bool (*ws_array_pred_func)(
+    void const* elem, //!< The element to test
+    void* ctx //!< User provided context
+);
+
+/**
+ * A growable array, stored contiguously
+ *
+ * The capacity grows geometrically, so appending is amortized O(1).
+ */
+struct ws_array {
+    char* data; //!< the elements
+    size_t len; //!< number of elements
+    size_t cap; //!< number of elements the buffer can hold
+    size_t elem_size; //!< size of an element, in bytes
+    enum ws_array_type type; //!< type of the elements
+};
+
+/**
+ * Initialize an array of elements of arbitrary size
+ */
+void
+ws_array_init(
+    struct ws_array* self, //!< The array to initialize
+    size_t elem_size //!< Size of an element
+)
+__ws_nonnull__(1);
+
+/**
+ * Initialize an array of elements of a known type
+ */
+void
+ws_array_init_typed(
+    struct ws_array* self, //!< The array to initialize
+    enum ws_array_type type //!< Type of the elements
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize an array, freeing its buffer
+ */
+void
+ws_array_deinit(
+    struct ws_array* self //!< The array to deinitialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Get a pointer to an element
+ *
+ * The pointer is invalidated by operations changing the capacity.
+ *
+ * @return a pointer to the element
+ */
+static inline void*
+ws_array_at(
+    struct ws_array const* self, //!< The array
+    size_t index //!< Index of the element, must be in range
+) {
+    return self->data + index * self->elem_size;
+}
+
+/**
+ * Make sure an array can hold `cap` elements without reallocation
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_array_reserve(
+    struct ws_array* self, //!< The array
+    size_t cap //!< Number of elements to make room for
+)
+__ws_nonnull__(1);
+
+/**
+ * Release unused capacity
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_array_shrink_to_fit(
+    struct ws_array* self //!< The array
+)
+__ws_nonnull__(1);
+
+/**
+ * Append an element
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_array_push(
+    struct ws_array* self, //!< The array
+    void const* elem //!< The element to append
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Remove the last element
+ *
+ * @return 0 on success, -ENOENT if the array is empty
+ */
+int
+ws_array_pop(
+    struct ws_array* self, //!< The array
+    void* elem //!< Location to store the element to, may be NULL
+)
+__ws_nonnull__(1);
+
+/**
+ * Insert an element, shifting the following elements back
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_array_insert(
+    struct ws_array* self, //!< The array
+    size_t index, //!< Position to insert at, at most the length
+    void const* elem //!< The element to insert
+)
+__ws_nonnull__(1, 3);
+
+/**
+ * Remove an element, shifting the following elements forward
+ *
+ * The order of the remaining elements is preserved.
+ */
+void
+ws_array_remove(
+    struct ws_array* self, //!< The array
+    size_t index //!< Index of the element, must be in range
+)
+__ws_nonnull__(1);
+
+/**
+ * Move an element to another position, keeping the order of the others
+ *
+ * This is what raising a window in the stacking order or moving it to the
+ * front of the focus history boils down to.
+ */
+void
+ws_array_move(
+    struct ws_array* self, //!< The array
+    size_t from, //!< Index of the element to move, must be in range
+    size_t to //!< Index the element ends up at, must be in range
+)
+__ws_nonnull__(1);
+
+/**
+ * Sort an array in place
+ *
+ * For arrays of known types, `cmp` may be NULL, in which case the elements
+ * are sorted in ascending order using a specialized sort. The sort is not
+ * stable.
+ */
+void
+ws_array_sort(
+    struct ws_array* self, //!< The array
+    ws_array_cmp_func cmp //!< Comparison function
+)
+__ws_nonnull__(1);
+
+/**
+ * Search a sorted array
+ *
+ * For arrays of known types, `cmp` may be NULL, in which case the array must
+ * be sorted in ascending order.
+ *
+ * @return true if an element equal to `key` was found, false otherwise. In
+ *         both cases, the index of the first element not less than `key` is
+ *         stored to `index`, if not NULL.
+ */
+bool
+ws_array_bsearch(
+    struct ws_array const* self, //!< The array
+    void const* key, //!< The element to look for
+    ws_array_cmp_func cmp, //!< Comparison function
+    size_t* index //!< Location to store the position to, may be NULL
+)
+__ws_nonnull__(1, 2);
 
+/**
+ * Partition an array, preserving the relative order of elements
+ *
+ * Elements satisfying the predicate are moved to the front. The partition is
+ * done in place, without allocating.
+ *
+ * @return the number of elements satisfying the predicate
+ */
+size_t
+ws_array_stable_partition(
+    struct ws_array* self, //!< The array
+    ws_array_pred_func pred, //!< The predicate
+    void* ctx //!< Context passed to the predicate
+)
+__ws_nonnull__(1, 2);
+
+#endif // __WS_OBJECTS_ARRAY_H__
@@ -25,5 +25,80 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
+
 #include "objects/object.h"
 
+struct ws_object_table ws_objects;
+
+/*
+ * External definitions of the inline functions, for callers which do not
+ * inline them
+ */
+
+extern inline struct ws_object*
+ws_object_find(
+    uint64_t id
+);
+
+extern inline struct ws_object*
+ws_object_from_value(
+    struct ws_value value
+);
+
+extern inline struct ws_object* const*
+ws_object_all(
+    size_t* count
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+struct ws_object*
+ws_object_new(
+    struct ws_object_type const* type
+) {
+    struct ws_object* self = calloc(1, type->size);
+    if (!self) {
+        return NULL;
+    }
+
+    self->type = type;
+    if (ws_object_table_insert(&ws_objects, self, &self->id) < 0) {
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+void
+ws_object_free(
+    struct ws_object* self
+) {
+    if (!self) {
+        return;
+    }
+
+    if (self->type->deinit) {
+        self->type->deinit(self);
+    }
+    ws_object_table_remove(&ws_objects, self->id);
+    free(self);
+}
+
+void
+ws_object_free_all(void)
+{
+    // freeing the last object doesn't move any of the others
+    size_t count;
+    struct ws_object* const* objects = ws_object_all(&count);
+    while (count) {
+        ws_object_free(objects[count - 1]);
+        objects = ws_object_all(&count);
+    }
+    ws_object_table_deinit(&ws_objects);
+}
+
@@ -28,6 +28,112 @@
 #ifndef __WS_OBJECTS_OBJECT_H__
 #define __WS_OBJECTS_OBJECT_H__
 
+#include <stddef.h>
+#include <stdint.h>
 
+#include "util/attributes.h"
+#include "values/object_id.h"
+#include "values/value.h"
+
+struct ws_object;
+
+/**
+ * Type of an object
+ */
+struct ws_object_type {
+    char const* name; //!< name of the type
+    size_t size; //!< size of objects of the type, including the header
+    void (*deinit)(struct ws_object*); //!< release resources, may be NULL
+};
+
+/**
+ * Header of an object
+ *
+ * Objects are referenced through their id by values and commands. Structures
+ * of concrete objects embed this header as their first member.
+ */
+struct ws_object {
+    struct ws_object_type const* type; //!< the type of the object
+    uint64_t id; //!< the id of the object
+};
+
+/**
+ * Table of all objects
+ *
+ * Use the functions below rather than accessing the table directly.
+ */
+extern struct ws_object_table ws_objects;
+
+/**
+ * Allocate an object
+ *
+ * The object is zeroed, apart from the header, and gets a fresh id.
+ *
+ * @return the object or NULL if the allocation failed
+ */
+struct ws_object*
+ws_object_new(
+    struct ws_object_type const* type //!< The type of the object
+)
+__ws_nonnull__(1);
+
+/**
+ * Free an object
+ *
+ * The type's deinit function is called first. Ids of the object are stale
+ * afterwards.
+ */
+void
+ws_object_free(
+    struct ws_object* self //!< The object to free, may be NULL
+);
+
+/**
+ * Find an object by id
+ *
+ * @return the object or NULL if there is no object with the id
+ */
+inline struct ws_object*
+ws_object_find(
+    uint64_t id //!< The id of the object
+) {
+    return ws_object_table_get(&ws_objects, id);
+}
+
+/**
+ * Find the object referenced by a value
+ *
+ * @return the object or NULL if the value is no object id or the id is stale
+ */
+inline struct ws_object*
+ws_object_from_value(
+    struct ws_value value //!< The value
+) {
+    if ((value.bits & WS_VALUE_TAG_MASK) != WS_VALUE_TAG_OBJECT_ID) {
+        return NULL;
+    }
+    return ws_object_find(ws_value_object_id_get(value));
+}
+
+/**
+ * Get all objects
+ *
+ * The array is valid until an object is allocated or freed.
+ *
+ * @return the objects, in no particular order
+ */
+inline struct ws_object* const*
+ws_object_all(
+    size_t* count //!< Location to store the number of objects to
+) {
+    return (struct ws_object* const*) ws_object_table_items(&ws_objects,
+                                                            count);
+}
+
+/**
+ * Free all objects and the object table
+ */
+void
+ws_object_free_all(void);
 
 #endif // __WS_OBJECTS_OBJECT_H__
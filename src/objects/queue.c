@@ -25,5 +25,116 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
 #include "objects/queue.h"
+#include "util/arithmetical.h"
+
+int
+ws_queue_init(
+    struct ws_queue* self,
+    size_t capacity
+) {
+    // at least one cache line worth of cells, as required by aligned_alloc()
+    capacity = ws_round_up_pow2(capacity < 4 ? 4 : capacity);
+    if (!capacity) {
+        return -EINVAL;
+    }
+
+    self->cells = aligned_alloc(WS_CACHELINE_SIZE,
+                                sizeof(*self->cells) * capacity);
+    if (!self->cells) {
+        return -ENOMEM;
+    }
+
+    // each slot starts out as "free for the producer at this position"
+    for (size_t i = 0; i < capacity; ++i) {
+        atomic_init(&self->cells[i].seq, i);
+        self->cells[i].item = NULL;
+    }
+
+    self->mask = capacity - 1;
+    atomic_init(&self->head, 0);
+    self->tail = 0;
+    return 0;
+}
+
+void
+ws_queue_deinit(
+    struct ws_queue* self
+) {
+    free(self->cells);
+    self->cells = NULL;
+}
+
+int
+ws_queue_push(
+    struct ws_queue* self,
+    void* item
+) {
+    struct ws_queue_cell* cell;
+    size_t pos = atomic_load_explicit(&self->head, memory_order_relaxed);
+
+    for (;;) {
+        cell = self->cells + (pos & self->mask);
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            // the slot is ours if nobody else claimed the position meanwhile
+            if (atomic_compare_exchange_weak_explicit(&self->head, &pos,
+                                                      pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // the consumer did not release this slot yet: we are full
+            return -EAGAIN;
+        } else {
+            // another producer was faster
+            pos = atomic_load_explicit(&self->head, memory_order_relaxed);
+        }
+    }
+
+    cell->item = item;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+int
+ws_queue_pop(
+    struct ws_queue* self,
+    void** item
+) {
+    struct ws_queue_cell* cell = self->cells + (self->tail & self->mask);
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+
+    // either empty or a producer claimed the slot but did not fill it yet
+    if (seq != self->tail + 1) {
+        return -EAGAIN;
+    }
+
+    *item = cell->item;
+    // hand the slot to the producer one lap ahead
+    atomic_store_explicit(&cell->seq, self->tail + self->mask + 1,
+                          memory_order_release);
+    ++self->tail;
+    return 0;
+}
 
+size_t
+ws_queue_pop_batch(
+    struct ws_queue* self,
+    void** items,
+    size_t max
+) {
+    size_t count = 0;
+    while ((count < max) && (ws_queue_pop(self, items + count) == 0)) {
+        ++count;
+    }
+    return count;
+}
@@ -25,9 +25,112 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_OBJECTS_QUEUE_H__
 #define __WS_OBJECTS_QUEUE_H__
 
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "util/attributes.h"
+
+/**
+ * One slot of a queue
+ *
+ * The sequence number tells producers and the consumer whose turn it is:
+ * a producer may fill the slot if the sequence matches its position, the
+ * consumer may take the item if the sequence is one above its position.
+ */
+struct ws_queue_cell {
+    atomic_size_t seq; //!< sequence number of the slot
+    void* item; //!< the item stored in the slot
+};
+
+/**
+ * Bounded, lock-free multi-producer/single-consumer queue
+ *
+ * Any number of threads may push items concurrently, but only one thread may
+ * pop them. Neither side ever takes a lock or blocks. If the queue is full,
+ * pushing fails and the producer has to decide what to do with the item.
+ *
+ * The producer and consumer positions live on separate cache lines, so
+ * producers hammering the queue do not invalidate the consumer's line and vice
+ * versa.
+ */
+struct ws_queue {
+    struct ws_queue_cell* cells; //!< the ring of slots
+    size_t mask; //!< capacity - 1, the capacity being a power of two
+    WS_CACHELINE_ALIGNED atomic_size_t head; //!< next position to push to
+    WS_CACHELINE_ALIGNED size_t tail; //!< next position to pop from
+};
+
+/**
+ * Initialize a queue
+ *
+ * The capacity is rounded up to the next power of two.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_queue_init(
+    struct ws_queue* self, //!< The queue to initialize
+    size_t capacity //!< Minimum number of items the queue can hold
+)
+__ws_nonnull__(1);
 
+/**
+ * Deinitialize a queue
+ *
+ * Items still in the queue are not touched. The caller must drain the queue
+ * first if they have to be released.
+ */
+void
+ws_queue_deinit(
+    struct ws_queue* self //!< The queue to deinitialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Push an item to the queue
+ *
+ * This function may be called from any thread.
+ *
+ * @return 0 on success, -EAGAIN if the queue is full
+ */
+int
+ws_queue_push(
+    struct ws_queue* self, //!< The queue to push to
+    void* item //!< The item to push
+)
+__ws_nonnull__(1);
+
+/**
+ * Pop an item from the queue
+ *
+ * This function may only be called from the consuming thread.
+ *
+ * @return 0 on success, -EAGAIN if there is no item ready
+ */
+int
+ws_queue_pop(
+    struct ws_queue* self, //!< The queue to pop from
+    void** item //!< Location to store the item to
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Pop up to `max` items from the queue at once
+ *
+ * This function may only be called from the consuming thread.
+ *
+ * @return the number of items written to `items`
+ */
+size_t
+ws_queue_pop_batch(
+    struct ws_queue* self, //!< The queue to pop from
+    void** items, //!< Array to store the items to
+    size_t max //!< Size of `items`
+)
+__ws_nonnull__(1, 2);
 
 #endif // __WS_OBJECTS_QUEUE_H__
@@ -25,5 +25,357 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "objects/string.h"
 
+/**
+ * An interned string
+ *
+ * Interned strings are handed out as pointers to `str`, the header is found by
+ * stepping back from there.
+ */
+struct interned {
+    uint64_t hash; //!< hash of the string
+    size_t len; //!< length of the string
+    char str[]; //!< the string, NUL-terminated
+};
+
+/**
+ * The table of interned strings
+ */
+static struct {
+    pthread_mutex_t lock; //!< lock protecting the table
+    struct interned** slots; //!< open addressing hash table
+    size_t size; //!< number of slots, a power of two
+    size_t count; //!< number of interned strings
+} intern_table = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Get the header of an interned string
+ *
+ * @return the header
+ */
+static inline struct interned*
+get_interned(
+    char const* str //!< The interned string
+) {
+    return (struct interned*) (str - offsetof(struct interned, str));
+}
+
+/**
+ * Make sure a string can hold `len` bytes plus NUL in a buffer it owns
+ *
+ * The contents are preserved.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+reserve(
+    struct ws_string* self, //!< The string
+    size_t len //!< Length to make room for
+);
+
+/**
+ * Double the size of the intern table
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+grow_intern_table(void);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+void
+ws_string_init(
+    struct ws_string* self
+) {
+    self->len = 0;
+    self->buf[0] = '\0';
+    self->flags = 0;
+}
+
+void
+ws_string_deinit(
+    struct ws_string* self
+) {
+    if (self->flags & WS_STRING_HEAP) {
+        free(self->ext.ptr);
+    }
+    ws_string_init(self);
+}
+
+int
+ws_string_set(
+    struct ws_string* self,
+    char const* str,
+    size_t len
+) {
+    // drop borrowed buffers, we must not write to them
+    if (self->flags & WS_STRING_BORROWED) {
+        ws_string_init(self);
+    }
+
+    self->len = 0;
+    return ws_string_append(self, str, len);
+}
+
+void
+ws_string_borrow(
+    struct ws_string* self,
+    char const* str,
+    size_t len
+) {
+    ws_string_deinit(self);
+    self->ext.ptr = (char*) str;
+    self->ext.cap = 0;
+    self->len = len;
+    self->flags = WS_STRING_BORROWED;
+}
+
+int
+ws_string_append(
+    struct ws_string* self,
+    char const* str,
+    size_t len
+) {
+    if (len > UINT32_MAX - self->len) {
+        return -E2BIG;
+    }
+
+    int res = reserve(self, self->len + len);
+    if (res < 0) {
+        return res;
+    }
+
+    char* buf = (char*) ws_string_cstr(self);
+    if (len) {
+        memcpy(buf + self->len, str, len);
+    }
+    self->len += len;
+    buf[self->len] = '\0';
+    return 0;
+}
+
+int
+ws_string_cmp(
+    struct ws_string const* self,
+    struct ws_string const* other
+) {
+    size_t len = self->len < other->len ? self->len : other->len;
+    int res = memcmp(ws_string_cstr(self), ws_string_cstr(other), len);
+    if (res) {
+        return res;
+    }
+    return (self->len > other->len) - (self->len < other->len);
+}
+
+bool
+ws_string_equal(
+    struct ws_string const* self,
+    struct ws_string const* other
+) {
+    if ((self->flags & other->flags) & WS_STRING_INTERNED) {
+        return self->ext.ptr == other->ext.ptr;
+    }
+
+    return (self->len == other->len) &&
+           (memcmp(ws_string_cstr(self), ws_string_cstr(other),
+                   self->len) == 0);
+}
+
+uint64_t
+ws_string_hash(
+    struct ws_string const* self
+) {
+    if (self->flags & WS_STRING_INTERNED) {
+        return ws_string_interned_hash(self->ext.ptr);
+    }
+    return ws_string_hash_bytes(ws_string_cstr(self), self->len);
+}
+
+uint64_t
+ws_string_hash_bytes(
+    char const* str,
+    size_t len
+) {
+    unsigned char const* p = (unsigned char const*) str;
+
+    // FNV-1a
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    while (len--) {
+        hash ^= *p++;
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+char const*
+ws_string_intern(
+    char const* str,
+    size_t len
+) {
+    uint64_t hash = ws_string_hash_bytes(str, len);
+    char const* result = NULL;
+
+    pthread_mutex_lock(&intern_table.lock);
+
+    // keep the load factor at or below one half
+    if (((intern_table.count + 1) * 2 > intern_table.size) &&
+            (grow_intern_table() < 0)) {
+        goto out;
+    }
+
+    size_t mask = intern_table.size - 1;
+    size_t pos = hash & mask;
+    struct interned* entry;
+    while ((entry = intern_table.slots[pos])) {
+        if ((entry->hash == hash) && (entry->len == len) &&
+                (memcmp(entry->str, str, len) == 0)) {
+            result = entry->str;
+            goto out;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    entry = malloc(sizeof(*entry) + len + 1);
+    if (!entry) {
+        goto out;
+    }
+    entry->hash = hash;
+    entry->len = len;
+    memcpy(entry->str, str, len);
+    entry->str[len] = '\0';
+
+    intern_table.slots[pos] = entry;
+    ++intern_table.count;
+    result = entry->str;
+
+out:
+    pthread_mutex_unlock(&intern_table.lock);
+    return result;
+}
+
+uint64_t
+ws_string_interned_hash(
+    char const* interned
+) {
+    return get_interned(interned)->hash;
+}
+
+size_t
+ws_string_interned_len(
+    char const* interned
+) {
+    return get_interned(interned)->len;
+}
+
+void
+ws_string_set_interned(
+    struct ws_string* self,
+    char const* interned
+) {
+    ws_string_borrow(self, interned, ws_string_interned_len(interned));
+    self->flags |= WS_STRING_INTERNED;
+}
+
+void
+ws_string_intern_deinit(void)
+{
+    pthread_mutex_lock(&intern_table.lock);
+    for (size_t i = 0; i < intern_table.size; ++i) {
+        free(intern_table.slots[i]);
+    }
+    free(intern_table.slots);
+    intern_table.slots = NULL;
+    intern_table.size = 0;
+    intern_table.count = 0;
+    pthread_mutex_unlock(&intern_table.lock);
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static int
+reserve(
+    struct ws_string* self,
+    size_t len
+) {
+    if (self->flags & WS_STRING_HEAP) {
+        if (len < self->ext.cap) {
+            return 0;
+        }
+
+        size_t cap = self->ext.cap * 2;
+        if (cap <= len) {
+            cap = len + 1;
+        }
+        char* ptr = realloc(self->ext.ptr, cap);
+        if (!ptr) {
+            return -ENOMEM;
+        }
+        self->ext.ptr = ptr;
+        self->ext.cap = cap;
+        return 0;
+    }
+
+    if (!(self->flags & WS_STRING_BORROWED) && (len < WS_STRING_INLINE_SIZE)) {
+        return 0;
+    }
+
+    // move from inline or borrowed storage to a buffer of our own
+    size_t cap = len + 1 < 2 * WS_STRING_INLINE_SIZE ? 2 * WS_STRING_INLINE_SIZE
+                                                     : len + 1;
+    char* ptr = malloc(cap);
+    if (!ptr) {
+        return -ENOMEM;
+    }
+    memcpy(ptr, ws_string_cstr(self), self->len + 1);
+
+    self->ext.ptr = ptr;
+    self->ext.cap = cap;
+    self->flags = WS_STRING_HEAP;
+    return 0;
+}
+
+static int
+grow_intern_table(void)
+{
+    size_t size = intern_table.size ? intern_table.size * 2 : 256;
+    struct interned** slots = calloc(size, sizeof(*slots));
+    if (!slots) {
+        return -ENOMEM;
+    }
+
+    // rehash
+    for (size_t i = 0; i < intern_table.size; ++i) {
+        struct interned* entry = intern_table.slots[i];
+        if (!entry) {
+            continue;
+        }
+
+        size_t pos = entry->hash & (size - 1);
+        while (slots[pos]) {
+            pos = (pos + 1) & (size - 1);
+        }
+        slots[pos] = entry;
+    }
+
+    free(intern_table.slots);
+    intern_table.slots = slots;
+    intern_table.size = size;
+    return 0;
+}
@@ -25,9 +25,241 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_OBJECTS_STRING_H__
 #define __WS_OBJECTS_STRING_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/attributes.h"
+
+/**
+ * Number of bytes a string can hold inline, including the terminating NUL
+ */
+#define WS_STRING_INLINE_SIZE 24
+
+/**
+ * Flags of strings
+ */
+enum ws_string_flags {
+    WS_STRING_HEAP      = 1 << 0, //!< the string owns a heap buffer
+    WS_STRING_BORROWED  = 1 << 1, //!< the buffer belongs to someone else
+    WS_STRING_INTERNED  = 1 << 2, //!< the buffer is an interned string
+};
+
+/**
+ * A string with small-string optimization
+ *
+ * Strings of up to WS_STRING_INLINE_SIZE - 1 bytes are stored inside the
+ * struct itself, so names, titles and tags usually never touch the allocator.
+ * Longer strings are kept in a heap buffer. A string may also borrow a buffer
+ * it does not own, e.g. an interned string (see ws_string_intern()).
+ *
+ * The contents are always NUL-terminated. The whole struct is 32 bytes and
+ * strings are limited to UINT32_MAX bytes.
+ */
+struct ws_string {
+    uint32_t len; //!< length of the string, in bytes
+    uint8_t flags; //!< flags, see enum ws_string_flags
+    union {
+        char buf[WS_STRING_INLINE_SIZE]; //!< inline storage
+        struct {
+            char* ptr; //!< the buffer
+            size_t cap; //!< capacity of the buffer, if owned
+        } ext; //!< external storage
+    };
+};
+
+/**
+ * Initialize a string to the empty string
+ */
+void
+ws_string_init(
+    struct ws_string* self //!< The string to initialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize a string, freeing its buffer if it owns one
+ */
+void
+ws_string_deinit(
+    struct ws_string* self //!< The string to deinitialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Set the contents of a string
+ *
+ * The contents are copied.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_string_set(
+    struct ws_string* self, //!< The string to modify
+    char const* str, //!< The new contents
+    size_t len //!< Length of the new contents
+)
+__ws_nonnull__(1);
+
+/**
+ * Make a string borrow a buffer
+ *
+ * The string refers to the buffer without copying it. The buffer must be
+ * NUL-terminated and outlive the string.
+ */
+void
+ws_string_borrow(
+    struct ws_string* self, //!< The string to modify
+    char const* str, //!< The buffer to borrow
+    size_t len //!< Length of the string in the buffer
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Append to a string
+ *
+ * @return 0 on success, -E2BIG if the string would become too long, another
+ *         negative error number otherwise
+ */
+int
+ws_string_append(
+    struct ws_string* self, //!< The string to append to
+    char const* str, //!< The string to append
+    size_t len //!< Length of the string to append
+)
+__ws_nonnull__(1);
+
+/**
+ * Get the contents of a string
+ *
+ * @return the NUL-terminated contents
+ */
+static inline char const*
+ws_string_cstr(
+    struct ws_string const* self //!< The string
+) {
+    return (self->flags & (WS_STRING_HEAP | WS_STRING_BORROWED))
+           ? self->ext.ptr
+           : self->buf;
+}
+
+/**
+ * Compare two strings
+ *
+ * Two interned strings are compared by pointer if they are tested for
+ * equality only, see ws_string_equal().
+ *
+ * @return less than, equal to or greater than zero if `self` is less than,
+ *         equal to or greater than `other`
+ */
+int
+ws_string_cmp(
+    struct ws_string const* self, //!< The string to compare
+    struct ws_string const* other //!< The string to compare with
+)
+__ws_nonnull__(1, 2) __ws_pure__;
+
+/**
+ * Check two strings for equality
+ *
+ * This is a pointer comparison if both strings are interned.
+ *
+ * @return true if the strings are equal, false otherwise
+ */
+bool
+ws_string_equal(
+    struct ws_string const* self, //!< The string to compare
+    struct ws_string const* other //!< The string to compare with
+)
+__ws_nonnull__(1, 2) __ws_pure__;
 
+/**
+ * Compute the hash of a string
+ *
+ * The hash of interned strings is computed only once, when interning them.
+ *
+ * @return the hash
+ */
+uint64_t
+ws_string_hash(
+    struct ws_string const* self //!< The string to hash
+)
+__ws_nonnull__(1) __ws_pure__;
+
+/**
+ * Compute the hash of a byte sequence
+ *
+ * This is the hash function used for all strings.
+ *
+ * @return the hash
+ */
+uint64_t
+ws_string_hash_bytes(
+    char const* str, //!< The bytes to hash
+    size_t len //!< Number of bytes
+)
+__ws_pure__;
+
+/**
+ * Intern a string
+ *
+ * Interned strings are unique: interning equal strings yields the same
+ * pointer, so they can be compared by pointer and hashed by address. They are
+ * immutable, NUL-terminated and live until ws_string_intern_deinit().
+ *
+ * This function is thread safe.
+ *
+ * @return the interned string or NULL if the allocation failed
+ */
+char const*
+ws_string_intern(
+    char const* str, //!< The string to intern
+    size_t len //!< Length of the string
+)
+__ws_nonnull__(1);
+
+/**
+ * Get the hash of an interned string
+ *
+ * @return the hash, as computed by ws_string_hash_bytes()
+ */
+uint64_t
+ws_string_interned_hash(
+    char const* interned //!< The interned string
+)
+__ws_nonnull__(1) __ws_pure__;
+
+/**
+ * Get the length of an interned string
+ *
+ * @return the length
+ */
+size_t
+ws_string_interned_len(
+    char const* interned //!< The interned string
+)
+__ws_nonnull__(1) __ws_pure__;
+
+/**
+ * Make a string refer to an interned string
+ */
+void
+ws_string_set_interned(
+    struct ws_string* self, //!< The string to modify
+    char const* interned //!< The interned string
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Free all interned strings
+ *
+ * All pointers obtained from ws_string_intern() become invalid.
+ */
+void
+ws_string_intern_deinit(void);
 
 #endif // __WS_OBJECTS_STRING_H__
@@ -0,0 +1,1061 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "serialize/flat.h"
+#include "serialize/module.h"
+#include "values/array.h"
+#include "values/bool.h"
+#include "values/int.h"
+#include "values/nil.h"
+#include "values/object_id.h"
+#include "values/set.h"
+#include "values/string.h"
+#include "values/value_named.h"
+
+/**
+ * Magic number at the beginning and at the end of an image
+ *
+ * The last character is the version of the format.
+ */
+#define MAGIC "wsflat\0\1"
+
+/**
+ * Alignment of everything in an image
+ */
+#define ALIGNMENT 8
+
+/**
+ * Header of an image
+ */
+struct header {
+    char magic[sizeof(MAGIC) - 1]; //!< MAGIC
+};
+
+/**
+ * Footer of an image
+ */
+struct footer {
+    struct ws_flat_value root; //!< the root value
+    uint64_t user; //!< user defined number
+    uint64_t size; //!< size of the image, including header and footer
+    char magic[sizeof(MAGIC) - 1]; //!< MAGIC
+};
+
+/**
+ * Key of a map, in a form suitable for comparison
+ */
+struct key {
+    uint8_t type; //!< type of the key, see enum ws_flat_type
+    uint64_t data; //!< the integer or object id
+    char const* str; //!< the string
+    size_t len; //!< length of the string
+};
+
+/**
+ * Pair of a map being built
+ */
+struct pair {
+    struct key key; //!< the key
+    struct ws_flat_value values[2]; //!< the key and the value
+};
+
+/**
+ * Check the data a value refers to
+ *
+ * The data has to lie within the image, between the header and the value
+ * itself.
+ *
+ * @return true if the data is in place, false otherwise
+ */
+static bool
+check(
+    struct ws_flat const* self, //!< The image
+    struct ws_flat_value const* value, //!< The value
+    uint64_t bytes //!< Number of bytes referred to
+);
+
+/**
+ * Get the key stored in a value
+ *
+ * @return true if the value is a valid key, false otherwise
+ */
+static bool
+key_from_flat(
+    struct ws_flat const* self, //!< The image
+    struct ws_flat_value const* value, //!< The value
+    struct key* key //!< Location to store the key to
+);
+
+/**
+ * Compare two keys
+ *
+ * Keys of different types are ordered by type.
+ *
+ * @return less than, equal to or greater than zero if `a` is less than, equal
+ *         to or greater than `b`
+ */
+static int
+key_cmp(
+    struct key const* a, //!< The key to compare
+    struct key const* b //!< The key to compare with
+);
+
+/**
+ * Compare two pairs by key, for sorting
+ *
+ * @return less than, equal to or greater than zero if `a` is less than, equal
+ *         to or greater than `b`
+ */
+static int
+pair_cmp(
+    void const* a, //!< The pair to compare
+    void const* b //!< The pair to compare with
+);
+
+/**
+ * Look up a key in a map
+ *
+ * @return the value stored for the key, NULL if there is none
+ */
+static struct ws_flat_value const*
+map_find(
+    struct ws_flat const* self, //!< The image
+    struct ws_flat_value const* map, //!< The map
+    struct key const* key //!< The key to look for
+);
+
+/**
+ * Turn a flat value into a value
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+to_value(
+    struct ws_flat const* self, //!< The image
+    struct ws_flat_value const* value, //!< The value
+    uint32_t depth, //!< Nesting depth of the value
+    struct ws_value* result //!< Location to store the value to
+);
+
+/**
+ * Turn the values a flat value refers to into an array value
+ *
+ * Map entries with string keys become named values, other ones arrays of key
+ * and value.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+to_array(
+    struct ws_flat const* self, //!< The image
+    struct ws_flat_value const* value, //!< The array, set or map
+    uint32_t depth, //!< Nesting depth of the value
+    struct ws_value* result //!< Location to store the value to
+);
+
+/**
+ * Add a value to an image
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+build_value(
+    struct ws_flat_builder* self, //!< The builder
+    struct ws_value value, //!< The value
+    uint32_t depth, //!< Nesting depth of the value
+    struct ws_flat_value* result //!< Location to store the description to
+);
+
+/**
+ * Add a value of another image to an image
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+build_copy(
+    struct ws_flat_builder* self, //!< The builder
+    struct ws_flat const* image, //!< The image to copy from
+    struct ws_flat_value const* value, //!< The value to copy
+    uint32_t depth, //!< Nesting depth of the value
+    struct ws_flat_value* result //!< Location to store the description to
+);
+
+/**
+ * Add a string to an image
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+build_string(
+    struct ws_flat_builder* self, //!< The builder
+    char const* str, //!< The string
+    size_t len, //!< Length of the string
+    struct ws_flat_value* result //!< Location to store the description to
+);
+
+/**
+ * Move the values on the stack of a builder, starting at `base`, to the image
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+build_values(
+    struct ws_flat_builder* self, //!< The builder
+    size_t base, //!< Index of the first value to move
+    uint8_t type, //!< Type of the value referring to them
+    uint32_t len, //!< Length to store in the value referring to them
+    struct ws_flat_value* result //!< Location to store the description to
+);
+
+/**
+ * Append bytes to an image, followed by padding up to the alignment
+ *
+ * @return the offset of the bytes, or a negative error number
+ */
+static int64_t
+put(
+    struct ws_flat_builder* self, //!< The builder
+    void const* data, //!< The bytes
+    size_t len //!< Number of bytes
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_flat_init(
+    struct ws_flat* self,
+    void const* data,
+    size_t size
+) {
+    memset(self, 0, sizeof(*self));
+
+    if ((uintptr_t) data % ALIGNMENT || size % ALIGNMENT) {
+        return -EINVAL;
+    }
+    if (size < sizeof(struct header) + sizeof(struct footer)) {
+        return -EINVAL;
+    }
+
+    struct header const* header = data;
+    struct footer const* footer = (struct footer const*)
+        ((char const*) data + size - sizeof(*footer));
+    if (memcmp(header->magic, MAGIC, sizeof(header->magic)) ||
+            memcmp(footer->magic, MAGIC, sizeof(footer->magic)) ||
+            footer->size != size) {
+        return -EINVAL;
+    }
+
+    self->data = data;
+    self->size = size;
+    self->root = &footer->root;
+    self->user = footer->user;
+    return 0;
+}
+
+int
+ws_flat_open(
+    struct ws_flat* self,
+    int fd
+) {
+    memset(self, 0, sizeof(*self));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -errno;
+    }
+    if (st.st_size <= 0 || (uint64_t) st.st_size > SIZE_MAX) {
+        return -EINVAL;
+    }
+
+    size_t size = st.st_size;
+    void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return -errno;
+    }
+
+    int res = ws_flat_init(self, data, size);
+    if (res < 0) {
+        munmap(data, size);
+        return res;
+    }
+    self->mapped = size;
+    return 0;
+}
+
+void
+ws_flat_close(
+    struct ws_flat* self
+) {
+    if (self->mapped) {
+        munmap((void*) self->data, self->mapped);
+    }
+    memset(self, 0, sizeof(*self));
+}
+
+char const*
+ws_flat_string(
+    struct ws_flat const* self,
+    struct ws_flat_value const* value,
+    size_t* len
+) {
+    if (value->type != WS_FLAT_TYPE_STRING ||
+            !check(self, value, (uint64_t) value->len + 1)) {
+        return NULL;
+    }
+
+    char const* str = self->data + value->data;
+    if (str[value->len] != '\0') {
+        return NULL;
+    }
+    if (len) {
+        *len = value->len;
+    }
+    return str;
+}
+
+struct ws_flat_value const*
+ws_flat_values(
+    struct ws_flat const* self,
+    struct ws_flat_value const* value,
+    size_t* count
+) {
+    *count = 0;
+
+    uint64_t n;
+    switch (value->type) {
+    case WS_FLAT_TYPE_ARRAY:
+    case WS_FLAT_TYPE_SET:
+        n = value->len;
+        break;
+    case WS_FLAT_TYPE_NAMED:
+        n = 2;
+        break;
+    case WS_FLAT_TYPE_MAP:
+        n = (uint64_t) value->len * 2;
+        break;
+    default:
+        return NULL;
+    }
+
+    if (value->data % ALIGNMENT ||
+            !check(self, value, n * sizeof(struct ws_flat_value))) {
+        return NULL;
+    }
+    *count = n;
+    return (struct ws_flat_value const*) (self->data + value->data);
+}
+
+struct ws_flat_value const*
+ws_flat_map_find(
+    struct ws_flat const* self,
+    struct ws_flat_value const* map,
+    struct ws_value key
+) {
+    struct key k = { .type = ws_value_get_type(key) };
+    switch (k.type) {
+    case WS_FLAT_TYPE_INT:
+        k.data = ws_value_int_get(key);
+        break;
+    case WS_FLAT_TYPE_OBJECT_ID:
+        k.data = ws_value_object_id_get(key);
+        break;
+    case WS_FLAT_TYPE_STRING:
+        k.str = ws_value_string_get(key, &k.len);
+        break;
+    default:
+        return NULL;
+    }
+
+    return map_find(self, map, &k);
+}
+
+struct ws_flat_value const*
+ws_flat_map_find_string(
+    struct ws_flat const* self,
+    struct ws_flat_value const* map,
+    char const* key,
+    size_t len
+) {
+    struct key k = {
+        .type = WS_FLAT_TYPE_STRING,
+        .str = key,
+        .len = len,
+    };
+    return map_find(self, map, &k);
+}
+
+int
+ws_flat_to_value(
+    struct ws_flat const* self,
+    struct ws_flat_value const* value,
+    struct ws_value* result
+) {
+    return to_value(self, value, 0, result);
+}
+
+int
+ws_flat_builder_init(
+    struct ws_flat_builder* self
+) {
+    ws_array_init(&self->out, 1);
+    ws_array_init(&self->stack, sizeof(struct ws_flat_value));
+
+    struct header header;
+    memcpy(header.magic, MAGIC, sizeof(header.magic));
+    int64_t res = put(self, &header, sizeof(header));
+    if (res < 0) {
+        ws_flat_builder_deinit(self);
+        return res;
+    }
+    return 0;
+}
+
+void
+ws_flat_builder_deinit(
+    struct ws_flat_builder* self
+) {
+    ws_array_deinit(&self->out);
+    ws_array_deinit(&self->stack);
+}
+
+int
+ws_flat_builder_value(
+    struct ws_flat_builder* self,
+    struct ws_value value,
+    struct ws_flat_value* result
+) {
+    return build_value(self, value, 0, result);
+}
+
+int
+ws_flat_builder_copy(
+    struct ws_flat_builder* self,
+    struct ws_flat const* image,
+    struct ws_flat_value const* value,
+    struct ws_flat_value* result
+) {
+    return build_copy(self, image, value, 0, result);
+}
+
+int
+ws_flat_builder_string(
+    struct ws_flat_builder* self,
+    char const* str,
+    size_t len,
+    struct ws_flat_value* result
+) {
+    return build_string(self, str, len, result);
+}
+
+int
+ws_flat_builder_map(
+    struct ws_flat_builder* self,
+    struct ws_flat_value* pairs,
+    size_t count,
+    struct ws_flat_value* result
+) {
+    if (count > UINT32_MAX) {
+        return -E2BIG;
+    }
+
+    struct ws_array sorted;
+    ws_array_init(&sorted, sizeof(struct pair));
+    int res = ws_array_reserve(&sorted, count);
+    if (res < 0) {
+        return res;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        struct pair pair = {
+            .key = {
+                .type = pairs[2 * i].type,
+                .data = pairs[2 * i].data,
+            },
+            .values = { pairs[2 * i], pairs[2 * i + 1] },
+        };
+
+        switch (pair.key.type) {
+        case WS_FLAT_TYPE_INT:
+        case WS_FLAT_TYPE_OBJECT_ID:
+            break;
+        case WS_FLAT_TYPE_STRING:
+            // the builder put the string there, no need to check it
+            pair.key.str = self->out.data + pair.key.data;
+            pair.key.len = pairs[2 * i].len;
+            break;
+        default:
+            ws_array_deinit(&sorted);
+            return -EINVAL;
+        }
+        ws_array_push(&sorted, &pair);
+    }
+    ws_array_sort(&sorted, pair_cmp);
+
+    for (size_t i = 0; i < count; ++i) {
+        struct pair* pair = ws_array_at(&sorted, i);
+        if (i && !pair_cmp(pair - 1, pair)) {
+            ws_array_deinit(&sorted);
+            return -EINVAL;
+        }
+        pairs[2 * i] = pair->values[0];
+        pairs[2 * i + 1] = pair->values[1];
+    }
+    ws_array_deinit(&sorted);
+
+    int64_t offset = put(self, pairs, count * 2 * sizeof(*pairs));
+    if (offset < 0) {
+        return offset;
+    }
+    *result = (struct ws_flat_value) {
+        .type = WS_FLAT_TYPE_MAP,
+        .len = count,
+        .data = offset,
+    };
+    return 0;
+}
+
+int
+ws_flat_builder_finish(
+    struct ws_flat_builder* self,
+    struct ws_flat_value const* root,
+    uint64_t user
+) {
+    struct footer footer = {
+        .root = *root,
+        .user = user,
+        .size = self->out.len + sizeof(footer),
+    };
+    memcpy(footer.magic, MAGIC, sizeof(footer.magic));
+
+    int64_t res = put(self, &footer, sizeof(footer));
+    return res < 0 ? res : 0;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static bool
+check(
+    struct ws_flat const* self,
+    struct ws_flat_value const* value,
+    uint64_t bytes
+) {
+    // data referred to always precedes the reference, which keeps accessors
+    // in bounds and rules out cycles
+    uint64_t pos = (char const*) value - self->data;
+    return value->data >= sizeof(struct header) &&
+        value->data <= pos &&
+        bytes <= pos - value->data;
+}
+
+static bool
+key_from_flat(
+    struct ws_flat const* self,
+    struct ws_flat_value const* value,
+    struct key* key
+) {
+    key->type = value->type;
+    key->data = value->data;
+    switch (value->type) {
+    case WS_FLAT_TYPE_INT:
+    case WS_FLAT_TYPE_OBJECT_ID:
+        return true;
+    case WS_FLAT_TYPE_STRING:
+        key->str = ws_flat_string(self, value, &key->len);
+        return key->str != NULL;
+    default:
+        return false;
+    }
+}
+
+static int
+key_cmp(
+    struct key const* a,
+    struct key const* b
+) {
+    if (a->type != b->type) {
+        return a->type < b->type ? -1 : 1;
+    }
+
+    switch (a->type) {
+    case WS_FLAT_TYPE_INT:
+        if ((int64_t) a->data != (int64_t) b->data) {
+            return (int64_t) a->data < (int64_t) b->data ? -1 : 1;
+        }
+        return 0;
+    case WS_FLAT_TYPE_STRING: {
+        size_t len = a->len < b->len ? a->len : b->len;
+        int cmp = memcmp(a->str, b->str, len);
+        if (cmp || a->len == b->len) {
+            return cmp;
+        }
+        return a->len < b->len ? -1 : 1;
+    }
+    default:
+        if (a->data != b->data) {
+            return a->data < b->data ? -1 : 1;
+        }
+        return 0;
+    }
+}
+
+static int
+pair_cmp(
+    void const* a,
+    void const* b
+) {
+    return key_cmp(&((struct pair const*) a)->key,
+                   &((struct pair const*) b)->key);
+}
+
+static struct ws_flat_value const*
+map_find(
+    struct ws_flat const* self,
+    struct ws_flat_value const* map,
+    struct key const* key
+) {
+    if (map->type != WS_FLAT_TYPE_MAP) {
+        return NULL;
+    }
+    size_t count;
+    struct ws_flat_value const* pairs = ws_flat_values(self, map, &count);
+    if (!pairs) {
+        return NULL;
+    }
+
+    // binary search over the pairs, the keys being at even indices
+    size_t lo = 0;
+    size_t hi = count / 2;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        struct key other;
+        if (!key_from_flat(self, pairs + 2 * mid, &other)) {
+            return NULL;
+        }
+
+        int cmp = key_cmp(key, &other);
+        if (!cmp) {
+            return pairs + 2 * mid + 1;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+static int
+to_value(
+    struct ws_flat const* self,
+    struct ws_flat_value const* value,
+    uint32_t depth,
+    struct ws_value* result
+) {
+    if (depth > WS_SERIALIZE_MAX_DEPTH) {
+        return -EINVAL;
+    }
+
+    switch (value->type) {
+    case WS_FLAT_TYPE_NIL:
+        *result = ws_value_nil();
+        return 0;
+    case WS_FLAT_TYPE_BOOL:
+        *result = ws_value_bool(value->data != 0);
+        return 0;
+    case WS_FLAT_TYPE_INT:
+        return ws_value_int_from((int64_t) value->data, result);
+    case WS_FLAT_TYPE_OBJECT_ID:
+        if (value->data > WS_VALUE_OBJECT_ID_MAX) {
+            return -EINVAL;
+        }
+        *result = ws_value_object_id(value->data);
+        return 0;
+    case WS_FLAT_TYPE_STRING: {
+        size_t len;
+        char const* str = ws_flat_string(self, value, &len);
+        if (!str) {
+            return -EINVAL;
+        }
+        return ws_value_string_new(str, len, result);
+    }
+    case WS_FLAT_TYPE_NAMED: {
+        size_t count;
+        struct ws_flat_value const* values;
+        values = ws_flat_values(self, value, &count);
+        char const* name = values ? ws_flat_string(self, values, NULL) : NULL;
+        if (!name) {
+            return -EINVAL;
+        }
+
+        struct ws_value inner;
+        int res = to_value(self, values + 1, depth + 1, &inner);
+        if (res < 0) {
+            return res;
+        }
+        res = ws_value_named_new(name, inner, result);
+        ws_value_unref(inner);
+        return res;
+    }
+    case WS_FLAT_TYPE_SET: {
+        size_t count;
+        struct ws_flat_value const* values;
+        values = ws_flat_values(self, value, &count);
+        if (!values) {
+            return -EINVAL;
+        }
+
+        int res = ws_value_set_new(result);
+        if (res < 0) {
+            return res;
+        }
+        for (size_t i = 0; i < count && res >= 0; ++i) {
+            struct ws_value elem;
+            res = to_value(self, values + i, depth + 1, &elem);
+            if (res < 0) {
+                break;
+            }
+            res = ws_value_set_insert(*result, elem);
+            ws_value_unref(elem);
+        }
+        if (res < 0) {
+            ws_value_unref(*result);
+            return res == -EEXIST ? -EINVAL : res;
+        }
+        return 0;
+    }
+    case WS_FLAT_TYPE_ARRAY:
+    case WS_FLAT_TYPE_MAP:
+        return to_array(self, value, depth, result);
+    default:
+        return -EINVAL;
+    }
+}
+
+static int
+to_array(
+    struct ws_flat const* self,
+    struct ws_flat_value const* value,
+    uint32_t depth,
+    struct ws_value* result
+) {
+    size_t count;
+    struct ws_flat_value const* values = ws_flat_values(self, value, &count);
+    if (!values) {
+        return -EINVAL;
+    }
+
+    size_t step = value->type == WS_FLAT_TYPE_MAP ? 2 : 1;
+    int res = ws_value_array_new(count / step, result);
+    if (res < 0) {
+        return res;
+    }
+
+    for (size_t i = 0; i < count; i += step) {
+        struct ws_value elem;
+        res = to_value(self, values + i, depth + 1, &elem);
+        if (res < 0 || step == 1) {
+            goto push;
+        }
+
+        // map entry: the key has been turned into `elem`, now the value
+        struct ws_value entry;
+        res = to_value(self, values + i + 1, depth + 1, &entry);
+        if (res < 0) {
+            ws_value_unref(elem);
+            break;
+        }
+        struct ws_value key = elem;
+        if (values[i].type == WS_FLAT_TYPE_STRING) {
+            char const* name = ws_value_string_get(key, NULL);
+            res = ws_value_named_new(name, entry, &elem);
+        } else {
+            res = ws_value_array_new(2, &elem);
+            if (res >= 0) {
+                res = ws_value_array_push(elem, key);
+            }
+            if (res >= 0) {
+                res = ws_value_array_push(elem, entry);
+            }
+        }
+        ws_value_unref(key);
+        ws_value_unref(entry);
+
+    push:
+        if (res < 0) {
+            break;
+        }
+        res = ws_value_array_push(*result, elem);
+        ws_value_unref(elem);
+        if (res < 0) {
+            break;
+        }
+    }
+
+    if (res < 0) {
+        ws_value_unref(*result);
+        return res;
+    }
+    return 0;
+}
+
+static int
+build_value(
+    struct ws_flat_builder* self,
+    struct ws_value value,
+    uint32_t depth,
+    struct ws_flat_value* result
+) {
+    if (depth > WS_SERIALIZE_MAX_DEPTH) {
+        return -EINVAL;
+    }
+
+    *result = (struct ws_flat_value) { .type = ws_value_get_type(value) };
+    switch (ws_value_get_type(value)) {
+    case WS_VALUE_TYPE_NIL:
+        return 0;
+    case WS_VALUE_TYPE_BOOL:
+        result->data = ws_value_bool_get(value);
+        return 0;
+    case WS_VALUE_TYPE_INT:
+        result->data = ws_value_int_get(value);
+        return 0;
+    case WS_VALUE_TYPE_OBJECT_ID:
+        result->data = ws_value_object_id_get(value);
+        return 0;
+    case WS_VALUE_TYPE_STRING: {
+        size_t len;
+        char const* str = ws_value_string_get(value, &len);
+        return build_string(self, str, len, result);
+    }
+    default:
+        break;
+    }
+
+    // the descriptions of the elements are collected on the stack, and moved
+    // to the image once the elements themselves are in place
+    size_t base = self->stack.len;
+    struct ws_flat_value elem;
+    int res = 0;
+    uint32_t len = 0;
+
+    switch (ws_value_get_type(value)) {
+    case WS_VALUE_TYPE_SET: {
+        size_t pos = 0;
+        struct ws_value member;
+        while (res >= 0 && ws_value_set_next(value, &pos, &member)) {
+            res = build_value(self, member, depth + 1, &elem);
+            if (res >= 0) {
+                res = ws_array_push(&self->stack, &elem);
+            }
+            ++len;
+        }
+        break;
+    }
+    case WS_VALUE_TYPE_NAMED: {
+        char const* name = ws_value_named_get_name(value);
+        res = build_string(self, name, strlen(name), &elem);
+        if (res >= 0) {
+            res = ws_array_push(&self->stack, &elem);
+        }
+        if (res >= 0) {
+            struct ws_value inner = ws_value_named_get_value(value);
+            res = build_value(self, inner, depth + 1, &elem);
+        }
+        if (res >= 0) {
+            res = ws_array_push(&self->stack, &elem);
+        }
+        len = 2;
+        break;
+    }
+    case WS_VALUE_TYPE_ARRAY: {
+        size_t count;
+        struct ws_value const* values = ws_value_array_get(value, &count);
+        for (size_t i = 0; i < count && res >= 0; ++i) {
+            res = build_value(self, values[i], depth + 1, &elem);
+            if (res >= 0) {
+                res = ws_array_push(&self->stack, &elem);
+            }
+        }
+        len = count;
+        break;
+    }
+    default:
+        return -EINVAL;
+    }
+
+    if (res < 0) {
+        self->stack.len = base;
+        return res;
+    }
+    return build_values(self, base, result->type, len, result);
+}
+
+static int
+build_copy(
+    struct ws_flat_builder* self,
+    struct ws_flat const* image,
+    struct ws_flat_value const* value,
+    uint32_t depth,
+    struct ws_flat_value* result
+) {
+    if (depth > WS_SERIALIZE_MAX_DEPTH) {
+        return -EINVAL;
+    }
+
+    switch (value->type) {
+    case WS_FLAT_TYPE_NIL:
+    case WS_FLAT_TYPE_BOOL:
+    case WS_FLAT_TYPE_INT:
+    case WS_FLAT_TYPE_OBJECT_ID:
+        *result = *value;
+        return 0;
+    case WS_FLAT_TYPE_STRING: {
+        size_t len;
+        char const* str = ws_flat_string(image, value, &len);
+        if (!str) {
+            return -EINVAL;
+        }
+        return build_string(self, str, len, result);
+    }
+    case WS_FLAT_TYPE_NAMED:
+    case WS_FLAT_TYPE_SET:
+    case WS_FLAT_TYPE_ARRAY:
+    case WS_FLAT_TYPE_MAP:
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    size_t count;
+    struct ws_flat_value const* values = ws_flat_values(image, value, &count);
+    if (!values) {
+        return -EINVAL;
+    }
+    if (value->type == WS_FLAT_TYPE_NAMED &&
+            values->type != WS_FLAT_TYPE_STRING) {
+        return -EINVAL;
+    }
+
+    size_t base = self->stack.len;
+    int res = 0;
+    for (size_t i = 0; i < count && res >= 0; ++i) {
+        struct ws_flat_value elem;
+        res = build_copy(self, image, values + i, depth + 1, &elem);
+        if (res >= 0) {
+            res = ws_array_push(&self->stack, &elem);
+        }
+    }
+
+    if (res < 0) {
+        self->stack.len = base;
+        return res;
+    }
+    return build_values(self, base, value->type, value->len, result);
+}
+
+static int
+build_string(
+    struct ws_flat_builder* self,
+    char const* str,
+    size_t len,
+    struct ws_flat_value* result
+) {
+    if (len >= UINT32_MAX) {
+        return -E2BIG;
+    }
+
+    // the terminator comes along, so strings may be used in place
+    int64_t offset = put(self, str, len + 1);
+    if (offset < 0) {
+        return offset;
+    }
+    *result = (struct ws_flat_value) {
+        .type = WS_FLAT_TYPE_STRING,
+        .len = len,
+        .data = offset,
+    };
+    return 0;
+}
+
+static int
+build_values(
+    struct ws_flat_builder* self,
+    size_t base,
+    uint8_t type,
+    uint32_t len,
+    struct ws_flat_value* result
+) {
+    size_t count = self->stack.len - base;
+    int64_t offset = put(self, ws_array_at(&self->stack, base),
+                         count * sizeof(struct ws_flat_value));
+    self->stack.len = base;
+    if (offset < 0) {
+        return offset;
+    }
+
+    *result = (struct ws_flat_value) {
+        .type = type,
+        .len = len,
+        .data = offset,
+    };
+    return 0;
+}
+
+static int64_t
+put(
+    struct ws_flat_builder* self,
+    void const* data,
+    size_t len
+) {
+    size_t padded = (len + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+    size_t offset = self->out.len;
+    int res = ws_array_reserve(&self->out, offset + padded);
+    if (res < 0) {
+        return res;
+    }
+
+    if (len) {
+        memcpy(self->out.data + offset, data, len);
+    }
+    memset(self->out.data + offset + len, 0, padded - len);
+    self->out.len += padded;
+    return offset;
+}
@@ -0,0 +1,328 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WS_SERIALIZE_FLAT_H__
+#define __WS_SERIALIZE_FLAT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "objects/array.h"
+#include "util/attributes.h"
+#include "values/value.h"
+
+/**
+ * @file flat.h
+ *
+ * Flat images of values
+ *
+ * A flat image holds a tree of values in a single buffer, in a layout which
+ * is read in place: there's nothing to parse, pointers are offsets from the
+ * start of the image. An image written to a file can be mapped and used right
+ * away, no matter how large it is.
+ *
+ * Each value is described by a fixed-size struct ws_flat_value. Scalars are
+ * stored right in it, other values refer to data elsewhere in the image.
+ * Images are built bottom-up, so data referred to always precedes the
+ * reference. Accessors check this, which keeps them within the image and
+ * makes cycles impossible, even if the image is damaged.
+ *
+ * The image starts with a header and ends with a footer, which holds the
+ * description of the root value. Numbers are stored in host byte order.
+ */
+
+/**
+ * Types of flat values
+ *
+ * The types shared with values have the same numbers as in enum
+ * ws_value_type.
+ */
+enum ws_flat_type {
+    WS_FLAT_TYPE_NIL = WS_VALUE_TYPE_NIL, //!< no value
+    WS_FLAT_TYPE_BOOL = WS_VALUE_TYPE_BOOL, //!< boolean
+    WS_FLAT_TYPE_INT = WS_VALUE_TYPE_INT, //!< integer
+    WS_FLAT_TYPE_OBJECT_ID = WS_VALUE_TYPE_OBJECT_ID, //!< object id
+    WS_FLAT_TYPE_STRING = WS_VALUE_TYPE_STRING, //!< NUL-terminated string
+    WS_FLAT_TYPE_SET = WS_VALUE_TYPE_SET, //!< set, stored like an array
+    WS_FLAT_TYPE_NAMED = WS_VALUE_TYPE_NAMED, //!< name and value
+    WS_FLAT_TYPE_ARRAY = WS_VALUE_TYPE_ARRAY, //!< sequence of values
+    WS_FLAT_TYPE_MAP = 0x40, //!< key/value pairs sorted by key, flat only
+};
+
+/**
+ * Description of a value in a flat image
+ *
+ * For strings, `data` is the offset of the bytes and `len` their number. For
+ * arrays and sets, `data` is the offset of `len` consecutive elements. Named
+ * values refer to two consecutive values, the name and the value. Maps refer
+ * to `len` pairs of consecutive values, the key and the value.
+ */
+struct ws_flat_value {
+    uint8_t type; //!< type of the value, see enum ws_flat_type
+    uint8_t reserved[3]; //!< zero
+    uint32_t len; //!< number of bytes or elements referred to
+    uint64_t data; //!< the scalar, or offset of the data referred to
+};
+
+/**
+ * A flat image, ready to be read
+ */
+struct ws_flat {
+    char const* data; //!< the image
+    size_t size; //!< size of the image
+    struct ws_flat_value const* root; //!< the root value
+    uint64_t user; //!< user defined number stored with the image
+    size_t mapped; //!< size of the mapping, if the image is a mapped file
+};
+
+/**
+ * Builder of a flat image
+ */
+struct ws_flat_builder {
+    struct ws_array out; //!< the image built so far
+    struct ws_array stack; //!< descriptions of values not placed yet
+};
+
+/**
+ * Initialize a flat image from memory
+ *
+ * The memory must outlive the image.
+ *
+ * @return 0 on success, -EINVAL if the data is no valid image
+ */
+int
+ws_flat_init(
+    struct ws_flat* self, //!< The image to initialize
+    void const* data, //!< The image data, aligned to 8 bytes
+    size_t size //!< Size of the data
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Initialize a flat image by mapping a file
+ *
+ * @return 0 on success, -EINVAL if the file holds no valid image, another
+ *         negative error number otherwise
+ */
+int
+ws_flat_open(
+    struct ws_flat* self, //!< The image to initialize
+    int fd //!< The file
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize a flat image, unmapping the file if it was mapped
+ */
+void
+ws_flat_close(
+    struct ws_flat* self //!< The image
+)
+__ws_nonnull__(1);
+
+/**
+ * Get a string in place
+ *
+ * @return the NUL-terminated string, NULL if the value is not a string or is
+ *         damaged
+ */
+char const*
+ws_flat_string(
+    struct ws_flat const* self, //!< The image
+    struct ws_flat_value const* value, //!< The value, within the image
+    size_t* len //!< Location to store the length to, may be NULL
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Get the values a value refers to, in place
+ *
+ * For arrays and sets, these are the elements. Named values refer to two
+ * values, the name and the value, and maps to two values per entry, the key
+ * and the value.
+ *
+ * @return the values, NULL if the value refers to none or is damaged
+ */
+struct ws_flat_value const*
+ws_flat_values(
+    struct ws_flat const* self, //!< The image
+    struct ws_flat_value const* value, //!< The value, within the image
+    size_t* count //!< Location to store the number of values to
+)
+__ws_nonnull__(1, 2, 3);
+
+/**
+ * Look up a key in a map, in place
+ *
+ * Keys are integers, object ids or strings. The lookup is a binary search.
+ *
+ * @return the value stored for the key, NULL if there is none
+ */
+struct ws_flat_value const*
+ws_flat_map_find(
+    struct ws_flat const* self, //!< The image
+    struct ws_flat_value const* map, //!< The map, within the image
+    struct ws_value key //!< The key to look for
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Look up a string key in a map, in place
+ *
+ * This is ws_flat_map_find() for keys which are not at hand as values.
+ *
+ * @return the value stored for the key, NULL if there is none
+ */
+struct ws_flat_value const*
+ws_flat_map_find_string(
+    struct ws_flat const* self, //!< The image
+    struct ws_flat_value const* map, //!< The map, within the image
+    char const* key, //!< The key to look for
+    size_t len //!< Length of the key, in bytes
+)
+__ws_nonnull__(1, 2, 3);
+
+/**
+ * Turn a flat value into a value
+ *
+ * Maps become arrays. Entries with string keys become named values, other
+ * entries arrays of the key and the value.
+ *
+ * @return 0 on success, -EINVAL if the value is damaged, another negative
+ *         error number otherwise
+ */
+int
+ws_flat_to_value(
+    struct ws_flat const* self, //!< The image
+    struct ws_flat_value const* value, //!< The value, within the image
+    struct ws_value* result //!< Location to store the value to
+)
+__ws_nonnull__(1, 2, 3);
+
+/**
+ * Initialize a builder
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_flat_builder_init(
+    struct ws_flat_builder* self //!< The builder to initialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize a builder
+ */
+void
+ws_flat_builder_deinit(
+    struct ws_flat_builder* self //!< The builder
+)
+__ws_nonnull__(1);
+
+/**
+ * Add a value to the image
+ *
+ * The data the value refers to is added to the image, the description is
+ * stored to `result`. It is to be passed to other functions of the builder,
+ * which put it into the image.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_flat_builder_value(
+    struct ws_flat_builder* self, //!< The builder
+    struct ws_value value, //!< The value to add
+    struct ws_flat_value* result //!< Location to store the description to
+)
+__ws_nonnull__(1, 3);
+
+/**
+ * Add a string to the image
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_flat_builder_string(
+    struct ws_flat_builder* self, //!< The builder
+    char const* str, //!< The string
+    size_t len, //!< Length of the string, in bytes
+    struct ws_flat_value* result //!< Location to store the description to
+)
+__ws_nonnull__(1, 2, 4);
+
+/**
+ * Add a value of another image to the image
+ *
+ * The value is copied without turning it into a value first.
+ *
+ * @return 0 on success, -EINVAL if the value is damaged, another negative
+ *         error number otherwise
+ */
+int
+ws_flat_builder_copy(
+    struct ws_flat_builder* self, //!< The builder
+    struct ws_flat const* image, //!< The image to copy from
+    struct ws_flat_value const* value, //!< The value to copy, within `image`
+    struct ws_flat_value* result //!< Location to store the description to
+)
+__ws_nonnull__(1, 2, 3, 4);
+
+/**
+ * Add a map to the image
+ *
+ * The pairs are given as consecutive keys and values, as returned by the other
+ * functions of the builder. They are sorted by key; keys must be unique.
+ *
+ * @return 0 on success, -EINVAL if there is a key which is no integer, object
+ *         id or string, another negative error number otherwise
+ */
+int
+ws_flat_builder_map(
+    struct ws_flat_builder* self, //!< The builder
+    struct ws_flat_value* pairs, //!< The pairs, sorted in place
+    size_t count, //!< Number of pairs
+    struct ws_flat_value* result //!< Location to store the description to
+)
+__ws_nonnull__(1, 4);
+
+/**
+ * Finish the image
+ *
+ * Afterwards, the image is held in the `out` array of the builder, and
+ * nothing may be added anymore.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_flat_builder_finish(
+    struct ws_flat_builder* self, //!< The builder
+    struct ws_flat_value const* root, //!< The root value
+    uint64_t user //!< User defined number to store with the image
+)
+__ws_nonnull__(1, 2);
+
+#endif // __WS_SERIALIZE_FLAT_H__
@@ -25,5 +25,1567 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "command/processor.h"
 #include "serialize/module.h"
+#include "values/array.h"
+#include "values/bool.h"
+#include "values/int.h"
+#include "objects/string.h"
+#include "values/nil.h"
+#include "values/object_id.h"
+#include "values/set.h"
+#include "values/string.h"
+#include "values/value_named.h"
+
+/**
+ * Number of bytes scanned at once
+ */
+#define BLOCK_SIZE 16
+
+/**
+ * State of the second stage
+ */
+struct stage2 {
+    char* buf; //!< the input
+    size_t pos; //!< current position in the input
+    uint32_t const* structurals; //!< offsets of the structural characters
+    size_t next; //!< index of the next structural character
+};
+
+/**
+ * Result of scanning input
+ */
+enum scan_result {
+    SCAN_MORE, //!< the message continues beyond the input
+    SCAN_DONE, //!< the end of the message was found
+};
+
+/**
+ * Scan input for structural characters
+ *
+ * @return a scan_result or a negative error number
+ */
+static int
+scan(
+    struct ws_serialize_parser* self, //!< The parser
+    char const* buf, //!< The input
+    size_t len //!< Number of bytes of input
+);
+
+/**
+ * Scan a single byte
+ *
+ * @return a scan_result or a negative error number
+ */
+static int
+scan_byte(
+    struct ws_serialize_parser* self, //!< The parser
+    char const* buf, //!< The input
+    size_t pos //!< Position of the byte
+);
+
+/**
+ * Record a structural character
+ *
+ * @return a scan_result or a negative error number
+ */
+static int
+record(
+    struct ws_serialize_parser* self, //!< The parser
+    char c, //!< The character
+    size_t pos //!< Position of the character
+);
+
+/**
+ * Parse a value
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+parse_value(
+    struct stage2* s, //!< State of the second stage
+    struct ws_value* value //!< Location to store the value to
+);
+
+/**
+ * Parse an object or array, after the opening bracket
+ *
+ * The first stage limits the nesting depth, so recursion is bounded.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+parse_container(
+    struct stage2* s, //!< State of the second stage
+    bool object, //!< Whether the container is an object
+    struct ws_value* value //!< Location to store the value to
+);
+
+/**
+ * Unescape and terminate a string in place, after the opening quote
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+parse_string(
+    struct stage2* s, //!< State of the second stage
+    char** str, //!< Location to store the start of the string to
+    size_t* len //!< Location to store the length of the string to
+);
+
+/**
+ * Parse a number or literal
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+parse_scalar(
+    struct stage2* s, //!< State of the second stage
+    struct ws_value* value //!< Location to store the value to
+);
+
+/**
+ * Consume a structural character
+ *
+ * @return true if the next structural character is `c`, false otherwise
+ */
+static bool
+expect(
+    struct stage2* s, //!< State of the second stage
+    char c //!< The character expected
+);
+
+/**
+ * Decode a MessagePack value
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+decode_value(
+    char** pos, //!< Position of the value, moved past it
+    char const* end, //!< End of the message
+    unsigned depth, //!< Nesting depth of the value
+    struct ws_value* value //!< Location to store the value to
+);
+
+/**
+ * Decode a MessagePack string with the payload at the current position
+ *
+ * The string is moved one byte towards the header, so it can be terminated.
+ *
+ * @return the terminated string, NULL if the message ends prematurely or the
+ *         string contains NUL characters
+ */
+static char*
+decode_string(
+    char** pos, //!< Position of the payload, moved past it
+    char const* end, //!< End of the message
+    size_t len //!< Length of the payload
+);
+
+/**
+ * Read a big endian integer
+ *
+ * @return the integer
+ */
+static inline uint64_t
+read_be(
+    char const* buf, //!< The bytes to read
+    size_t size //!< Number of bytes to read
+) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value = (value << 8) | (unsigned char) buf[i];
+    }
+    return value;
+}
+
+/**
+ * Encode a message, optionally wrapped in an event envelope
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+encode_message(
+    enum ws_serialize_format format, //!< The format to encode the value in
+    char const* event, //!< Name of the event, NULL for plain messages
+    struct ws_value value, //!< The value to encode
+    struct ws_array* out //!< The array to append the message to
+);
+
+/**
+ * Implementation of the "to_json" command
+ *
+ * @return 0 on success, -EINVAL if there is not exactly one argument, another
+ *         negative error number otherwise
+ */
+static int
+command_json(
+    struct ws_value* args, //!< The arguments
+    size_t nargs, //!< Number of arguments
+    struct ws_value* result //!< Location to store the JSON text to
+);
+
+/**
+ * Encode a value as JSON
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+encode_json(
+    struct ws_value value, //!< The value to encode
+    unsigned depth, //!< Nesting depth of the value
+    struct ws_array* out //!< The array to append to
+);
+
+/**
+ * Encode a value as MessagePack
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+encode_msgpack(
+    struct ws_value value, //!< The value to encode
+    unsigned depth, //!< Nesting depth of the value
+    struct ws_array* out //!< The array to append to
+);
+
+/**
+ * Encode a named value as a JSON object member, without braces
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+encode_json_member(
+    struct ws_value named, //!< The named value
+    unsigned depth, //!< Nesting depth of the object
+    struct ws_array* out //!< The array to append to
+);
+
+/**
+ * Encode a named value as a MessagePack map entry, without map header
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+encode_msgpack_member(
+    struct ws_value named, //!< The named value
+    unsigned depth, //!< Nesting depth of the map
+    struct ws_array* out //!< The array to append to
+);
+
+/**
+ * Encode a string as JSON
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+put_json_string(
+    struct ws_array* out, //!< The array to append to
+    char const* str, //!< The string
+    size_t len //!< Length of the string
+);
+
+/**
+ * Encode a string as MessagePack
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+put_msgpack_string(
+    struct ws_array* out, //!< The array to append to
+    char const* str, //!< The string
+    size_t len //!< Length of the string
+);
+
+/**
+ * Check whether an array is encoded as an object
+ *
+ * @return true if the array only holds named values, false otherwise
+ */
+static bool
+is_object(
+    struct ws_value const* values, //!< The elements of the array
+    size_t len //!< Number of elements
+);
+
+/**
+ * Append bytes to a byte array
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static inline int
+put(
+    struct ws_array* out, //!< The array to append to
+    void const* data, //!< The bytes to append
+    size_t len //!< Number of bytes to append
+) {
+    if (ws_array_reserve(out, out->len + len) < 0) {
+        return -ENOMEM;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+/**
+ * Append a type byte and a big endian integer to a byte array
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static inline int
+put_be(
+    struct ws_array* out, //!< The array to append to
+    uint8_t type, //!< The type byte
+    uint64_t value, //!< The integer
+    size_t size //!< Number of bytes of the integer
+) {
+    char buf[9] = { (char) type };
+    for (size_t i = 0; i < size; ++i) {
+        buf[size - i] = value >> (8 * i);
+    }
+    return put(out, buf, size + 1);
+}
+
+/**
+ * Check whether a character is white space
+ *
+ * @return true if the character is white space, false otherwise
+ */
+static inline bool
+is_space(
+    char c //!< The character
+) {
+    return (c == ' ') || (c == '\n') || (c == '\r') || (c == '\t');
+}
+
+/**
+ * Skip white space
+ */
+static inline void
+skip_space(
+    struct stage2* s //!< State of the second stage
+) {
+    while (is_space(s->buf[s->pos])) {
+        ++s->pos;
+    }
+}
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+struct ws_command const ws_serialize_command_json = {
+    .name = "to_json",
+    .func = command_json,
+    .flags = WS_COMMAND_OFFLOAD,
+};
+
+void
+ws_serialize_parser_init(
+    struct ws_serialize_parser* self
+) {
+    memset(self, 0, sizeof(*self));
+    ws_array_init(&self->structurals, sizeof(uint32_t));
+}
+
+void
+ws_serialize_parser_deinit(
+    struct ws_serialize_parser* self
+) {
+    ws_array_deinit(&self->structurals);
+}
+
+void
+ws_serialize_parser_reset(
+    struct ws_serialize_parser* self
+) {
+    self->scanned = 0;
+    self->begin = 0;
+    self->depth = 0;
+    self->started = false;
+    self->in_string = false;
+    self->escaped = false;
+    self->structurals.len = 0;
+}
+
+ssize_t
+ws_serialize_parse(
+    struct ws_serialize_parser* self,
+    char* buf,
+    size_t len,
+    struct ws_value* value
+) {
+    if (len > UINT32_MAX) {
+        return -E2BIG;
+    }
+
+    int res = scan(self, buf, len);
+    if (res <= 0) {
+        if (res < 0) {
+            ws_serialize_parser_reset(self);
+        }
+        return res;
+    }
+
+    struct stage2 s = {
+        .buf = buf,
+        .pos = self->begin,
+        .structurals = ws_array_at(&self->structurals, 0),
+        .next = 0,
+    };
+    size_t end = self->scanned;
+    ws_serialize_parser_reset(self);
+
+    res = parse_value(&s, value);
+    if (res < 0) {
+        return res;
+    }
+    return end;
+}
+
+ssize_t
+ws_serialize_decode_msgpack(
+    char* buf,
+    size_t len,
+    struct ws_value* value
+) {
+    if (len < WS_SERIALIZE_MSGPACK_PREFIX_SIZE) {
+        return 0;
+    }
+
+    // the length lets us wait for the whole message without looking at it
+    uint64_t size = read_be(buf, WS_SERIALIZE_MSGPACK_PREFIX_SIZE);
+    if (len - WS_SERIALIZE_MSGPACK_PREFIX_SIZE < size) {
+        return 0;
+    }
+
+    char* pos = buf + WS_SERIALIZE_MSGPACK_PREFIX_SIZE;
+    char* end = pos + size;
+    int res = decode_value(&pos, end, 0, value);
+    if (res < 0) {
+        return res;
+    }
+    if (pos != end) {
+        ws_value_unref(*value);
+        return -EINVAL;
+    }
+    return end - buf;
+}
+
+int
+ws_serialize_encode(
+    enum ws_serialize_format format,
+    struct ws_value value,
+    struct ws_array* out
+) {
+    return encode_message(format, NULL, value, out);
+}
+
+int
+ws_serialize_encode_event(
+    enum ws_serialize_format format,
+    char const* event,
+    struct ws_value data,
+    struct ws_array* out
+) {
+    return encode_message(format, event, data, out);
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static int
+scan(
+    struct ws_serialize_parser* self,
+    char const* buf,
+    size_t len
+) {
+    size_t pos = self->scanned;
+    int res = SCAN_MORE;
+
+    // the message has to start with a bracket
+    while (!self->started) {
+        if (pos == len) {
+            self->scanned = pos;
+            return SCAN_MORE;
+        }
+        if (!is_space(buf[pos])) {
+            if ((buf[pos] != '{') && (buf[pos] != '[')) {
+                return -EINVAL;
+            }
+            self->started = true;
+            self->begin = pos;
+            break;
+        }
+        ++pos;
+    }
+
+    // at most every byte is structural
+    if (ws_array_reserve(&self->structurals, len - self->begin) < 0) {
+        return -ENOMEM;
+    }
+
+#ifdef __SSE2__
+    while ((res == SCAN_MORE) && (pos + BLOCK_SIZE <= len)) {
+        __m128i block = _mm_loadu_si128((__m128i const*) (buf + pos));
+        uint32_t backslashes = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(block, _mm_set1_epi8('\\'))
+        );
+
+        // escapes are rare; the bytes-wise scan deals with them
+        if (backslashes || self->escaped) {
+            for (size_t end = pos + BLOCK_SIZE;
+                 (res == SCAN_MORE) && (pos < end); ++pos) {
+                res = scan_byte(self, buf, pos);
+            }
+            continue;
+        }
+
+        uint32_t quotes = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(block, _mm_set1_epi8('"'))
+        );
+
+        // brackets and braces only differ in bit 5
+        __m128i folded = _mm_or_si128(block, _mm_set1_epi8(0x20));
+        __m128i ops = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                         _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+            _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(':')),
+                         _mm_cmpeq_epi8(block, _mm_set1_epi8(',')))
+        );
+
+        // a bit is set for each byte within a string, including the opening
+        // quote: the prefix xor of the quotes
+        uint32_t in_string = quotes;
+        in_string ^= in_string << 1;
+        in_string ^= in_string << 2;
+        in_string ^= in_string << 4;
+        in_string ^= in_string << 8;
+        if (self->in_string) {
+            in_string = ~in_string;
+        }
+        in_string &= (1u << BLOCK_SIZE) - 1;
+
+        uint32_t structurals = (_mm_movemask_epi8(ops) & ~in_string) | quotes;
+        if (!structurals) {
+            // only string contents and scalars
+            self->in_string = in_string >> (BLOCK_SIZE - 1);
+            pos += BLOCK_SIZE;
+            continue;
+        }
+
+        while (structurals && (res == SCAN_MORE)) {
+            size_t offset = pos + __builtin_ctz(structurals);
+            structurals &= structurals - 1;
+            res = record(self, buf[offset], offset);
+            if (res == SCAN_DONE) {
+                self->scanned = offset + 1;
+                return SCAN_DONE;
+            }
+        }
+        if (res < 0) {
+            return res;
+        }
+        self->in_string = in_string >> (BLOCK_SIZE - 1);
+        pos += BLOCK_SIZE;
+    }
+#endif
+
+    for (; (res == SCAN_MORE) && (pos < len); ++pos) {
+        res = scan_byte(self, buf, pos);
+    }
+
+    self->scanned = pos;
+    return res;
+}
+
+static int
+scan_byte(
+    struct ws_serialize_parser* self,
+    char const* buf,
+    size_t pos
+) {
+    char c = buf[pos];
+
+    if (self->in_string) {
+        if (self->escaped) {
+            self->escaped = false;
+        } else if (c == '\\') {
+            self->escaped = true;
+        } else if (c == '"') {
+            self->in_string = false;
+            return record(self, c, pos);
+        }
+        return SCAN_MORE;
+    }
+
+    switch (c) {
+    case '"':
+        self->in_string = true;
+        // falls through
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case ':':
+    case ',':
+        return record(self, c, pos);
+
+    default:
+        return SCAN_MORE;
+    }
+}
+
+static int
+record(
+    struct ws_serialize_parser* self,
+    char c,
+    size_t pos
+) {
+    uint32_t* structurals = (uint32_t*) self->structurals.data;
+    structurals[self->structurals.len++] = pos;
+
+    if ((c == '{') || (c == '[')) {
+        if (++self->depth > WS_SERIALIZE_MAX_DEPTH) {
+            return -E2BIG;
+        }
+    } else if ((c == '}') || (c == ']')) {
+        if (!self->depth) {
+            return -EINVAL;
+        }
+        if (!--self->depth) {
+            return SCAN_DONE;
+        }
+    }
+    return SCAN_MORE;
+}
+
+static int
+parse_value(
+    struct stage2* s,
+    struct ws_value* value
+) {
+    skip_space(s);
+
+    switch (s->buf[s->pos]) {
+    case '{':
+        if (!expect(s, '{')) {
+            return -EINVAL;
+        }
+        return parse_container(s, true, value);
+
+    case '[':
+        if (!expect(s, '[')) {
+            return -EINVAL;
+        }
+        return parse_container(s, false, value);
+
+    case '"': {
+        if (!expect(s, '"')) {
+            return -EINVAL;
+        }
+        char* str;
+        size_t len;
+        int res = parse_string(s, &str, &len);
+        if (res < 0) {
+            return res;
+        }
+        return ws_value_string_new_borrowed(str, len, value);
+    }
+
+    default:
+        return parse_scalar(s, value);
+    }
+}
+
+static int
+parse_container(
+    struct stage2* s,
+    bool object,
+    struct ws_value* value
+) {
+    char close = object ? '}' : ']';
+    int res = ws_value_array_new(0, value);
+    if (res < 0) {
+        return res;
+    }
+
+    skip_space(s);
+    if (s->buf[s->pos] == close) {
+        expect(s, close);
+        return 0;
+    }
+
+    while (1) {
+        char* name = NULL;
+        if (object) {
+            size_t len;
+            skip_space(s);
+            if (!expect(s, '"') || (parse_string(s, &name, &len) < 0)) {
+                res = -EINVAL;
+                goto cleanup;
+            }
+            skip_space(s);
+            if (!expect(s, ':')) {
+                res = -EINVAL;
+                goto cleanup;
+            }
+        }
+
+        struct ws_value elem;
+        res = parse_value(s, &elem);
+        if (res < 0) {
+            goto cleanup;
+        }
+
+        if (name) {
+            struct ws_value named;
+            res = ws_value_named_new(name, elem, &named);
+            ws_value_unref(elem);
+            if (res < 0) {
+                goto cleanup;
+            }
+            elem = named;
+        }
+
+        res = ws_value_array_push(*value, elem);
+        ws_value_unref(elem);
+        if (res < 0) {
+            goto cleanup;
+        }
+
+        skip_space(s);
+        if (expect(s, close)) {
+            return 0;
+        }
+        if (!expect(s, ',')) {
+            res = -EINVAL;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    ws_value_unref(*value);
+    return res;
+}
+
+static int
+parse_string(
+    struct stage2* s,
+    char** str,
+    size_t* len
+) {
+    // the first stage found the closing quote already
+    char* in = s->buf + s->pos;
+    char* end = s->buf + s->structurals[s->next];
+    char* out = in;
+    if (*end != '"') {
+        return -EINVAL;
+    }
+
+    *str = in;
+    while (in < end) {
+        unsigned char c = *in++;
+        if (c < 0x20) {
+            return -EINVAL;
+        }
+        if (c != '\\') {
+            *out++ = c;
+            continue;
+        }
+
+        c = *in++;
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            *out++ = c;
+            break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+
+        case 'u': {
+            uint32_t code = 0;
+            for (int pair = 0; pair < 2; ++pair) {
+                uint32_t unit = 0;
+                if (end - in < 4) {
+                    return -EINVAL;
+                }
+                for (int i = 0; i < 4; ++i) {
+                    char h = *in++;
+                    unit <<= 4;
+                    if ((h >= '0') && (h <= '9')) {
+                        unit |= h - '0';
+                    } else if (((h | 0x20) >= 'a') && ((h | 0x20) <= 'f')) {
+                        unit |= (h | 0x20) - 'a' + 10;
+                    } else {
+                        return -EINVAL;
+                    }
+                }
+
+                if (!pair) {
+                    code = unit;
+                    if ((code < 0xD800) || (code > 0xDBFF)) {
+                        break;
+                    }
+                    // a high surrogate, the low one has to follow
+                    if ((end - in < 2) || (in[0] != '\\') || (in[1] != 'u')) {
+                        return -EINVAL;
+                    }
+                    in += 2;
+                } else {
+                    if ((unit < 0xDC00) || (unit > 0xDFFF)) {
+                        return -EINVAL;
+                    }
+                    code = 0x10000 + ((code - 0xD800) << 10) + (unit - 0xDC00);
+                }
+            }
+
+            // strings are NUL-terminated, lone low surrogates are invalid
+            if (!code || ((code >= 0xDC00) && (code <= 0xDFFF))) {
+                return -EINVAL;
+            }
+
+            // six escaped bytes always take up more room than UTF-8
+            if (code < 0x80) {
+                *out++ = code;
+            } else if (code < 0x800) {
+                *out++ = 0xC0 | (code >> 6);
+                *out++ = 0x80 | (code & 0x3F);
+            } else if (code < 0x10000) {
+                *out++ = 0xE0 | (code >> 12);
+                *out++ = 0x80 | ((code >> 6) & 0x3F);
+                *out++ = 0x80 | (code & 0x3F);
+            } else {
+                *out++ = 0xF0 | (code >> 18);
+                *out++ = 0x80 | ((code >> 12) & 0x3F);
+                *out++ = 0x80 | ((code >> 6) & 0x3F);
+                *out++ = 0x80 | (code & 0x3F);
+            }
+            break;
+        }
+
+        default:
+            return -EINVAL;
+        }
+    }
+
+    // the closing quote makes room for the terminator
+    *out = '\0';
+    *len = out - *str;
+    ++s->next;
+    s->pos = end - s->buf + 1;
+    return 0;
+}
+
+static int
+parse_scalar(
+    struct stage2* s,
+    struct ws_value* value
+) {
+    static char const delimiters[] = " \t\r\n,}]";
+    char const* p = s->buf + s->pos;
+
+    if (!strncmp(p, "true", 4)) {
+        *value = ws_value_bool(true);
+        p += 4;
+    } else if (!strncmp(p, "false", 5)) {
+        *value = ws_value_bool(false);
+        p += 5;
+    } else if (!strncmp(p, "null", 4)) {
+        *value = ws_value_nil();
+        p += 4;
+    } else {
+        bool negative = (*p == '-');
+        p += negative;
+        if ((*p < '0') || (*p > '9') || ((p[0] == '0') &&
+                                         (p[1] >= '0') && (p[1] <= '9'))) {
+            return -EINVAL;
+        }
+
+        // the magnitude of the smallest integer is one more than the largest
+        uint64_t limit = (uint64_t) WS_VALUE_INT_MAX + negative;
+        uint64_t magnitude = 0;
+        for (; (*p >= '0') && (*p <= '9'); ++p) {
+            unsigned digit = *p - '0';
+            if (magnitude > (limit - digit) / 10) {
+                return -ERANGE;
+            }
+            magnitude = magnitude * 10 + digit;
+        }
+        *value = ws_value_int(negative ? -(int64_t) magnitude
+                                       : (int64_t) magnitude);
+    }
+
+    // fractions and exponents are not supported
+    if (!*p || !strchr(delimiters, *p)) {
+        return -EINVAL;
+    }
+
+    s->pos = p - s->buf;
+    return 0;
+}
+
+static bool
+expect(
+    struct stage2* s,
+    char c
+) {
+    if ((s->buf[s->pos] != c) || (s->structurals[s->next] != s->pos)) {
+        return false;
+    }
+
+    ++s->next;
+    ++s->pos;
+    return true;
+}
+
+static int
+decode_value(
+    char** pos,
+    char const* end,
+    unsigned depth,
+    struct ws_value* value
+) {
+    if (*pos == end) {
+        return -EINVAL;
+    }
+    if (depth > WS_SERIALIZE_MAX_DEPTH) {
+        return -E2BIG;
+    }
+
+    uint8_t type = *(*pos)++;
+    size_t remaining = end - *pos;
+    uint64_t len;
+
+    // fixed size types
+    if ((type <= 0x7f) || (type >= 0xe0)) {
+        *value = ws_value_int((int8_t) type);
+        return 0;
+    }
+    if ((type & 0xe0) == 0xa0) {
+        len = type & 0x1f;
+        goto string;
+    }
+    if ((type & 0xf0) == 0x90) {
+        len = type & 0x0f;
+        goto array;
+    }
+    if ((type & 0xf0) == 0x80) {
+        len = type & 0x0f;
+        goto map;
+    }
+
+    switch (type) {
+    case 0xc0: *value = ws_value_nil(); return 0;
+    case 0xc2: *value = ws_value_bool(false); return 0;
+    case 0xc3: *value = ws_value_bool(true); return 0;
+
+    case 0xcc: case 0xcd: case 0xce: case 0xcf: {
+        size_t size = 1 << (type - 0xcc);
+        if (remaining < size) {
+            return -EINVAL;
+        }
+        uint64_t i = read_be(*pos, size);
+        *pos += size;
+        if (i > WS_VALUE_INT_MAX) {
+            return -ERANGE;
+        }
+        *value = ws_value_int(i);
+        return 0;
+    }
+
+    case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+        size_t size = 1 << (type - 0xd0);
+        if (remaining < size) {
+            return -EINVAL;
+        }
+        // sign extend
+        int64_t i = read_be(*pos, size) << (64 - 8 * size);
+        i >>= 64 - 8 * size;
+        *pos += size;
+        return ws_value_int_from(i, value);
+    }
+
+    case 0xd9: case 0xda: case 0xdb: {
+        size_t size = 1 << (type - 0xd9);
+        if (remaining < size) {
+            return -EINVAL;
+        }
+        len = read_be(*pos, size);
+        *pos += size;
+        goto string;
+    }
+
+    case 0xdc: case 0xdd: {
+        size_t size = 2 << (type - 0xdc);
+        if (remaining < size) {
+            return -EINVAL;
+        }
+        len = read_be(*pos, size);
+        *pos += size;
+        goto array;
+    }
+
+    case 0xde: case 0xdf: {
+        size_t size = 2 << (type - 0xde);
+        if (remaining < size) {
+            return -EINVAL;
+        }
+        len = read_be(*pos, size);
+        *pos += size;
+        goto map;
+    }
+
+    case 0xd7:
+        // fixext 8, the only extension we know of
+        if ((remaining < 9) ||
+                ((uint8_t) **pos != WS_SERIALIZE_MSGPACK_EXT_OBJECT_ID)) {
+            return -EINVAL;
+        }
+        uint64_t id = read_be(*pos + 1, 8);
+        *pos += 9;
+        if (id > WS_VALUE_OBJECT_ID_MAX) {
+            return -ERANGE;
+        }
+        *value = ws_value_object_id(id);
+        return 0;
+
+    default:
+        // floats, binary data and unknown extensions
+        return -EINVAL;
+    }
+
+string:;
+    char* str = decode_string(pos, end, len);
+    if (!str) {
+        return -EINVAL;
+    }
+    return ws_value_string_new_borrowed(str, len, value);
+
+array:
+map:;
+    bool object = ((type & 0xf0) == 0x80) || (type == 0xde) || (type == 0xdf);
+    // every element takes at least a byte, which bounds the allocation
+    if (len > (size_t) (end - *pos)) {
+        return -EINVAL;
+    }
+
+    int res = ws_value_array_new(len, value);
+    if (res < 0) {
+        return res;
+    }
+
+    for (uint64_t i = 0; i < len; ++i) {
+        char* name = NULL;
+        if (object) {
+            // keys have to be strings
+            if (*pos == end) {
+                res = -EINVAL;
+                goto cleanup;
+            }
+            uint8_t key = *(*pos)++;
+            size_t size = 0;
+            if ((key & 0xe0) == 0xa0) {
+                size = key & 0x1f;
+            } else if ((key >= 0xd9) && (key <= 0xdb) &&
+                       ((size_t) (end - *pos) >= (1u << (key - 0xd9)))) {
+                size_t prefix = 1 << (key - 0xd9);
+                size = read_be(*pos, prefix);
+                *pos += prefix;
+            } else {
+                res = -EINVAL;
+                goto cleanup;
+            }
+
+            name = decode_string(pos, end, size);
+            if (!name) {
+                res = -EINVAL;
+                goto cleanup;
+            }
+        }
+
+        struct ws_value elem;
+        res = decode_value(pos, end, depth + 1, &elem);
+        if (res < 0) {
+            goto cleanup;
+        }
+
+        if (name) {
+            struct ws_value named;
+            res = ws_value_named_new(name, elem, &named);
+            ws_value_unref(elem);
+            if (res < 0) {
+                goto cleanup;
+            }
+            elem = named;
+        }
+
+        res = ws_value_array_push(*value, elem);
+        ws_value_unref(elem);
+        if (res < 0) {
+            goto cleanup;
+        }
+    }
+    return 0;
+
+cleanup:
+    ws_value_unref(*value);
+    return res;
+}
+
+static char*
+decode_string(
+    char** pos,
+    char const* end,
+    size_t len
+) {
+    if (((size_t) (end - *pos) < len) || memchr(*pos, '\0', len)) {
+        return NULL;
+    }
+
+    // the header is not needed anymore, the string takes its last byte
+    char* str = *pos - 1;
+    memmove(str, *pos, len);
+    str[len] = '\0';
+    *pos += len;
+    return str;
+}
+
+static int
+encode_message(
+    enum ws_serialize_format format,
+    char const* event,
+    struct ws_value value,
+    struct ws_array* out
+) {
+    size_t start = out->len;
+    unsigned depth = event ? 1 : 0;
+    int res = 0;
+
+    if (format == WS_SERIALIZE_FORMAT_JSON) {
+        if (event) {
+            res = put(out, "{\"event\":", 9);
+            if (res >= 0) {
+                res = put_json_string(out, event, strlen(event));
+            }
+            if (res >= 0) {
+                res = put(out, ",\"data\":", 8);
+            }
+        }
+        if (res >= 0) {
+            res = encode_json(value, depth, out);
+        }
+        if ((res >= 0) && event) {
+            res = put(out, "}", 1);
+        }
+        if (res >= 0) {
+            res = put(out, "\n", 1);
+        }
+    } else {
+        char prefix[WS_SERIALIZE_MSGPACK_PREFIX_SIZE] = { 0 };
+        res = put(out, prefix, sizeof(prefix));
+        if ((res >= 0) && event) {
+            res = put(out, "\x82\xa5" "event", 7);
+            if (res >= 0) {
+                res = put_msgpack_string(out, event, strlen(event));
+            }
+            if (res >= 0) {
+                res = put(out, "\xa4" "data", 5);
+            }
+        }
+        if (res >= 0) {
+            res = encode_msgpack(value, depth, out);
+        }
+
+        uint64_t size = out->len - start - WS_SERIALIZE_MSGPACK_PREFIX_SIZE;
+        if ((res >= 0) && (size > UINT32_MAX)) {
+            res = -E2BIG;
+        }
+        if (res >= 0) {
+            for (size_t i = 0; i < WS_SERIALIZE_MSGPACK_PREFIX_SIZE; ++i) {
+                out->data[start + i] = size >> (8 * (3 - i));
+            }
+        }
+    }
+
+    if (res < 0) {
+        out->len = start;
+    }
+    return res;
+}
+
+static int
+command_json(
+    struct ws_value* args,
+    size_t nargs,
+    struct ws_value* result
+) {
+    if (nargs != 1) {
+        return -EINVAL;
+    }
+
+    // this may run on a worker thread, so only the arguments are touched
+    struct ws_array out;
+    ws_array_init(&out, 1);
+    int res = encode_json(args[0], 0, &out);
+    if (res >= 0) {
+        res = ws_value_string_new(out.data, out.len, result);
+    }
+    ws_array_deinit(&out);
+    return res < 0 ? res : 0;
+}
+
+static int
+encode_json(
+    struct ws_value value,
+    unsigned depth,
+    struct ws_array* out
+) {
+    if (depth > WS_SERIALIZE_MAX_DEPTH) {
+        return -E2BIG;
+    }
+
+    switch (ws_value_get_type(value)) {
+    case WS_VALUE_TYPE_NIL:
+        return put(out, "null", 4);
+
+    case WS_VALUE_TYPE_BOOL:
+        return ws_value_bool_get(value) ? put(out, "true", 4)
+                                        : put(out, "false", 5);
+
+    case WS_VALUE_TYPE_INT:
+    case WS_VALUE_TYPE_OBJECT_ID: {
+        char buf[24];
+        char* p = buf + sizeof(buf);
+        bool negative = false;
+        uint64_t i;
+        if (ws_value_get_type(value) == WS_VALUE_TYPE_INT) {
+            int64_t n = ws_value_int_get(value);
+            negative = n < 0;
+            i = negative ? -(uint64_t) n : (uint64_t) n;
+        } else {
+            i = ws_value_object_id_get(value);
+        }
+        do {
+            *--p = '0' + i % 10;
+            i /= 10;
+        } while (i);
+        if (negative) {
+            *--p = '-';
+        }
+        return put(out, p, buf + sizeof(buf) - p);
+    }
+
+    case WS_VALUE_TYPE_STRING: {
+        size_t len;
+        char const* str = ws_value_string_get(value, &len);
+        return put_json_string(out, str, len);
+    }
+
+    case WS_VALUE_TYPE_NAMED: {
+        int res = put(out, "{", 1);
+        if (res >= 0) {
+            res = encode_json_member(value, depth, out);
+        }
+        if (res >= 0) {
+            res = put(out, "}", 1);
+        }
+        return res;
+    }
+
+    case WS_VALUE_TYPE_ARRAY: {
+        size_t len;
+        struct ws_value const* values = ws_value_array_get(value, &len);
+        bool object = is_object(values, len);
+        int res = put(out, object ? "{" : "[", 1);
+
+        for (size_t i = 0; (res >= 0) && (i < len); ++i) {
+            if (i) {
+                res = put(out, ",", 1);
+            }
+            if (res < 0) {
+                break;
+            }
+            if (object) {
+                res = encode_json_member(values[i], depth, out);
+            } else {
+                res = encode_json(values[i], depth + 1, out);
+            }
+        }
+        if (res >= 0) {
+            res = put(out, object ? "}" : "]", 1);
+        }
+        return res;
+    }
+
+    case WS_VALUE_TYPE_SET: {
+        size_t pos = 0;
+        struct ws_value elem;
+        bool first = true;
+        int res = put(out, "[", 1);
+        while ((res >= 0) && ws_value_set_next(value, &pos, &elem)) {
+            if (!first) {
+                res = put(out, ",", 1);
+            }
+            first = false;
+            if (res >= 0) {
+                res = encode_json(elem, depth + 1, out);
+            }
+        }
+        if (res >= 0) {
+            res = put(out, "]", 1);
+        }
+        return res;
+    }
+    }
+
+    return -EINVAL;
+}
+
+static int
+encode_msgpack(
+    struct ws_value value,
+    unsigned depth,
+    struct ws_array* out
+) {
+    if (depth > WS_SERIALIZE_MAX_DEPTH) {
+        return -E2BIG;
+    }
+
+    switch (ws_value_get_type(value)) {
+    case WS_VALUE_TYPE_NIL:
+        return put(out, "\xc0", 1);
+
+    case WS_VALUE_TYPE_BOOL:
+        return put(out, ws_value_bool_get(value) ? "\xc3" : "\xc2", 1);
+
+    case WS_VALUE_TYPE_INT: {
+        int64_t i = ws_value_int_get(value);
+        if ((i >= -32) && (i <= 0x7f)) {
+            char c = i;
+            return put(out, &c, 1);
+        }
+        if (i >= 0) {
+            // the smallest unsigned type holding the integer
+            if (i <= UINT8_MAX) {
+                return put_be(out, 0xcc, i, 1);
+            }
+            if (i <= UINT16_MAX) {
+                return put_be(out, 0xcd, i, 2);
+            }
+            if (i <= UINT32_MAX) {
+                return put_be(out, 0xce, i, 4);
+            }
+            return put_be(out, 0xcf, i, 8);
+        }
+        if (i >= INT8_MIN) {
+            return put_be(out, 0xd0, i, 1);
+        }
+        if (i >= INT16_MIN) {
+            return put_be(out, 0xd1, i, 2);
+        }
+        if (i >= INT32_MIN) {
+            return put_be(out, 0xd2, i, 4);
+        }
+        return put_be(out, 0xd3, i, 8);
+    }
+
+    case WS_VALUE_TYPE_OBJECT_ID: {
+        int res = put_be(out, 0xd7, WS_SERIALIZE_MSGPACK_EXT_OBJECT_ID, 1);
+        if (res < 0) {
+            return res;
+        }
+        char buf[8];
+        uint64_t id = ws_value_object_id_get(value);
+        for (size_t i = 0; i < sizeof(buf); ++i) {
+            buf[i] = id >> (8 * (7 - i));
+        }
+        return put(out, buf, sizeof(buf));
+    }
+
+    case WS_VALUE_TYPE_STRING: {
+        size_t len;
+        char const* str = ws_value_string_get(value, &len);
+        return put_msgpack_string(out, str, len);
+    }
+
+    case WS_VALUE_TYPE_NAMED: {
+        int res = put(out, "\x81", 1);
+        if (res >= 0) {
+            res = encode_msgpack_member(value, depth, out);
+        }
+        return res;
+    }
+
+    case WS_VALUE_TYPE_ARRAY:
+    case WS_VALUE_TYPE_SET: {
+        bool set = ws_value_get_type(value) == WS_VALUE_TYPE_SET;
+        size_t len;
+        struct ws_value const* values = NULL;
+        if (set) {
+            len = ws_value_set_count(value);
+        } else {
+            values = ws_value_array_get(value, &len);
+        }
+
+        bool object = !set && is_object(values, len);
+        int res;
+        if (len < 16) {
+            char c = (object ? 0x80 : 0x90) | len;
+            res = put(out, &c, 1);
+        } else if (len <= UINT16_MAX) {
+            res = put_be(out, object ? 0xde : 0xdc, len, 2);
+        } else {
+            res = put_be(out, object ? 0xdf : 0xdd, len, 4);
+        }
+
+        size_t pos = 0;
+        for (size_t i = 0; (res >= 0) && (i < len); ++i) {
+            struct ws_value elem;
+            if (set) {
+                ws_value_set_next(value, &pos, &elem);
+            } else {
+                elem = values[i];
+            }
+
+            if (object) {
+                res = encode_msgpack_member(elem, depth, out);
+            } else {
+                res = encode_msgpack(elem, depth + 1, out);
+            }
+        }
+        return res;
+    }
+    }
+
+    return -EINVAL;
+}
+
+static int
+encode_json_member(
+    struct ws_value named,
+    unsigned depth,
+    struct ws_array* out
+) {
+    char const* name = ws_value_named_get_name(named);
+    int res = put_json_string(out, name, ws_string_interned_len(name));
+    if (res >= 0) {
+        res = put(out, ":", 1);
+    }
+    if (res >= 0) {
+        res = encode_json(ws_value_named_get_value(named), depth + 1, out);
+    }
+    return res;
+}
+
+static int
+encode_msgpack_member(
+    struct ws_value named,
+    unsigned depth,
+    struct ws_array* out
+) {
+    char const* name = ws_value_named_get_name(named);
+    int res = put_msgpack_string(out, name, ws_string_interned_len(name));
+    if (res >= 0) {
+        res = encode_msgpack(ws_value_named_get_value(named), depth + 1, out);
+    }
+    return res;
+}
+
+static int
+put_json_string(
+    struct ws_array* out,
+    char const* str,
+    size_t len
+) {
+    static char const hex[] = "0123456789abcdef";
+    static char const shorthands[] = "\"\\\b\t\n\f\r";
+    int res = put(out, "\"", 1);
+
+    // copy runs of characters which need no escaping at once
+    size_t run = 0;
+    for (size_t i = 0; (res >= 0) && (i < len); ++i) {
+        unsigned char c = str[i];
+        if ((c >= 0x20) && (c != '"') && (c != '\\')) {
+            continue;
+        }
+
+        res = put(out, str + run, i - run);
+        run = i + 1;
+        if (res < 0) {
+            break;
+        }
+        char const* shorthand = strchr(shorthands, c);
+        if (c && shorthand) {
+            char escaped[] = { '\\', "\"\\btnfr"[shorthand - shorthands] };
+            res = put(out, escaped, sizeof(escaped));
+        } else {
+            char escaped[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            res = put(out, escaped, sizeof(escaped));
+        }
+    }
+    if (res >= 0) {
+        res = put(out, str + run, len - run);
+    }
+    if (res >= 0) {
+        res = put(out, "\"", 1);
+    }
+    return res;
+}
+
+static int
+put_msgpack_string(
+    struct ws_array* out,
+    char const* str,
+    size_t len
+) {
+    int res;
+    if (len < 32) {
+        char c = 0xa0 | len;
+        res = put(out, &c, 1);
+    } else if (len <= UINT8_MAX) {
+        res = put_be(out, 0xd9, len, 1);
+    } else if (len <= UINT16_MAX) {
+        res = put_be(out, 0xda, len, 2);
+    } else {
+        res = put_be(out, 0xdb, len, 4);
+    }
+    if (res < 0) {
+        return res;
+    }
+    return put(out, str, len);
+}
 
+static bool
+is_object(
+    struct ws_value const* values,
+    size_t len
+) {
+    if (!len) {
+        return false;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        if (ws_value_get_type(values[i]) != WS_VALUE_TYPE_NAMED) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -25,9 +25,189 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_SERIALIZE_MODULE_H__
 #define __WS_SERIALIZE_MODULE_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "objects/array.h"
+#include "util/attributes.h"
+#include "values/value.h"
+
+struct ws_command;
+
+/**
+ * Maximum nesting depth of messages
+ */
+#define WS_SERIALIZE_MAX_DEPTH 64
+
+/**
+ * MessagePack extension type of object ids
+ */
+#define WS_SERIALIZE_MSGPACK_EXT_OBJECT_ID 1
+
+/**
+ * Number of bytes of the length prefix of binary messages
+ */
+#define WS_SERIALIZE_MSGPACK_PREFIX_SIZE 4
+
+/**
+ * Wire formats
+ */
+enum ws_serialize_format {
+    /**
+     * JSON, one message per line
+     */
+    WS_SERIALIZE_FORMAT_JSON,
+    /**
+     * MessagePack, each message prefixed by its length
+     *
+     * The length of the payload is a 32 bit big endian integer. Objects are
+     * MessagePack maps, object ids an extension of type
+     * WS_SERIALIZE_MSGPACK_EXT_OBJECT_ID holding a 64 bit big endian integer.
+     */
+    WS_SERIALIZE_FORMAT_MSGPACK,
+};
+
+/**
+ * Incremental JSON parser
+ *
+ * Parsing happens in two stages. The first one scans the input for the
+ * structural characters ({}[]:, and unescaped quotes), 16 bytes at a time
+ * using SSE2, and records their offsets. It stops at the end of the input,
+ * and picks up where it left when called with more input, until the end of a
+ * message is found. The second stage builds the values, guided by the
+ * offsets: it never searches for the end of a string, for example.
+ *
+ * Messages are JSON objects or arrays. Objects are turned into arrays of
+ * named values, see ws_value_named_find(). Numbers have to be integers.
+ */
+struct ws_serialize_parser {
+    size_t scanned; //!< number of bytes of the input scanned so far
+    size_t begin; //!< offset of the first byte of the message
+    uint32_t depth; //!< nesting depth at the end of the scanned bytes
+    bool started; //!< whether the beginning of the message was found
+    bool in_string; //!< whether the scanned bytes end within a string
+    bool escaped; //!< whether the scanned bytes end with a backslash
+    struct ws_array structurals; //!< offsets of the structural characters
+};
+
+/**
+ * Initialize a parser
+ */
+void
+ws_serialize_parser_init(
+    struct ws_serialize_parser* self //!< The parser
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize a parser
+ */
+void
+ws_serialize_parser_deinit(
+    struct ws_serialize_parser* self //!< The parser
+)
+__ws_nonnull__(1);
+
+/**
+ * Forget about the partially scanned message, if any
+ */
+void
+ws_serialize_parser_reset(
+    struct ws_serialize_parser* self //!< The parser
+)
+__ws_nonnull__(1);
+
+/**
+ * Parse a message
+ *
+ * The input is parsed in place: strings are unescaped and terminated within
+ * the buffer and the values refer to it. Strings only borrow the buffer if
+ * an arena is selected for the values (see ws_value_use_arena()); the buffer
+ * must then stay untouched until the arena is reset or the values are
+ * persisted.
+ *
+ * If the input ends before the message does, nothing is consumed. The parser
+ * remembers how far it got, so the next call must pass the same input again,
+ * followed by more.
+ *
+ * @return the number of bytes consumed if a message was parsed, 0 if more
+ *         input is needed, a negative error number otherwise
+ */
+ssize_t
+ws_serialize_parse(
+    struct ws_serialize_parser* self, //!< The parser
+    char* buf, //!< The input
+    size_t len, //!< Number of bytes of input
+    struct ws_value* value //!< Location to store the message to
+)
+__ws_nonnull__(1, 2, 4);
+
+/**
+ * Decode a MessagePack message
+ *
+ * Decoding happens in place, just like ws_serialize_parse() does it: strings
+ * are moved within the buffer to make room for their terminators, and
+ * borrow the buffer if an arena is selected.
+ *
+ * @return the number of bytes consumed if a message was decoded, 0 if more
+ *         input is needed, a negative error number otherwise
+ */
+ssize_t
+ws_serialize_decode_msgpack(
+    char* buf, //!< The input
+    size_t len, //!< Number of bytes of input
+    struct ws_value* value //!< Location to store the message to
+)
+__ws_nonnull__(1, 3);
 
+/**
+ * Encode a message
+ *
+ * The message is appended to a byte array, see ws_array_init(). Arrays made
+ * of named values only are encoded as objects, sets as arrays. JSON has no
+ * object ids, so they are encoded as plain integers.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_serialize_encode(
+    enum ws_serialize_format format, //!< The format to encode the value in
+    struct ws_value value, //!< The value to encode
+    struct ws_array* out //!< The array to append the message to
+)
+__ws_nonnull__(3);
+
+/**
+ * Encode an event
+ *
+ * The event is wrapped in an envelope naming it, i.e. the message is an
+ * object with the name of the event as "event" and the value as "data".
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_serialize_encode_event(
+    enum ws_serialize_format format, //!< The format to encode the event in
+    char const* event, //!< Name of the event
+    struct ws_value data, //!< Data of the event
+    struct ws_array* out //!< The array to append the message to
+)
+__ws_nonnull__(2, 4);
+
+/**
+ * Command encoding its argument as JSON
+ *
+ * The command "to_json" takes one value and returns a string holding the
+ * JSON text, without a trailing newline. Encoding a big tree takes a while,
+ * so the command is flagged WS_COMMAND_OFFLOAD. It has to be registered with
+ * ws_command_register() to be available.
+ */
+extern struct ws_command const ws_serialize_command_json;
 
 #endif // __WS_SERIALIZE_MODULE_H__
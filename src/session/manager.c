@@ -25,5 +25,1244 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger/trace.h"
+#include "objects/array.h"
 #include "session/manager.h"
+#include "util/attributes.h"
+#include "util/crc32.h"
+#include "util/debug.h"
+#include "util/file.h"
+#include "values/int.h"
+#include "values/nil.h"
+
+/**
+ * Name of the saved session within the session directory
+ */
+#define SESSION_NAME "session"
+
+/**
+ * Name of a session being saved
+ */
+#define SESSION_TMP_NAME "session.tmp"
+
+/**
+ * Name of the checkpoint log within the session directory
+ */
+#define LOG_NAME "checkpoints"
+
+/**
+ * Initial number of slots of a section's table
+ */
+#define TABLE_SIZE_MIN 16
+
+/**
+ * Updated entry of a section
+ */
+struct entry {
+    struct ws_value key; //!< the key, nil if the slot is free
+    struct ws_value state; //!< the state, nil if the entry was removed
+    uint64_t hash; //!< hash of the key
+    uint64_t gen; //!< number of the update which set the state
+    bool dirty; //!< whether the entry changed since the last checkpoint
+};
+
+/**
+ * Updates of a section since the session was saved, open addressing
+ */
+struct table {
+    struct entry* entries; //!< the slots
+    size_t size; //!< number of slots, zero or a power of two
+    size_t count; //!< number of entries
+};
+
+/**
+ * Reference to an entry which changed since the last checkpoint
+ */
+struct dirty {
+    enum ws_session_section section; //!< section of the entry
+    struct ws_value key; //!< key of the entry, referenced
+};
+
+/**
+ * Entry as handed to the checkpointer
+ *
+ * The key and state are referenced, so the entry may change in the meantime
+ * without affecting what is written.
+ */
+struct item {
+    enum ws_session_section section; //!< section of the entry
+    struct ws_value key; //!< key of the entry
+    struct ws_value state; //!< state of the entry, nil if it was removed
+};
+
+/**
+ * Kinds of checkpoints
+ */
+enum job_kind {
+    JOB_DELTA, //!< append the entries to the log
+    JOB_FULL, //!< save the whole session and start the log over
+};
+
+/**
+ * Checkpoint, as handed to the checkpointer
+ */
+struct job {
+    enum job_kind kind; //!< kind of the checkpoint
+    struct ws_array items; //!< the entries, see struct item
+    uint64_t gen; //!< number of the latest update included
+    int result; //!< outcome of writing the checkpoint
+    uint64_t log_size; //!< size of the log after writing the checkpoint
+};
+
+/**
+ * Header of a checkpoint in the log
+ *
+ * The header is followed by the checkpoint, a flat image holding a map from
+ * section numbers to maps from keys to states. Fields are stored in host byte
+ * order.
+ */
+struct log_header {
+    uint64_t size; //!< size of the image
+    uint32_t crc; //!< CRC-32 of the header, with this field zero, and image
+    uint32_t reserved; //!< zero
+};
+
+/**
+ * Logging context of the session manager
+ */
+static struct ws_logger_context const log_ctx = { .prefix = "session" };
+
+/**
+ * State of the session manager
+ */
+static struct {
+    int dir_fd; //!< the session directory
+    int log_fd; //!< the checkpoint log, opened for appending
+    struct ws_flat image; //!< the saved session, mapped
+    struct table sections[WS_SESSION_SECTION_COUNT]; //!< updates per section
+    struct ws_array dirty; //!< entries changed since the last checkpoint
+    uint64_t gen; //!< number of the latest update
+    bool compact; //!< whether the next checkpoint saves the whole session
+    struct ws_session_stats stats; //!< counters
+
+    // shared with the checkpointer thread
+    pthread_t checkpointer; //!< the checkpointer thread
+    bool running; //!< whether the checkpointer thread was started
+    pthread_mutex_t lock; //!< lock protecting the fields below
+    pthread_cond_t wake; //!< signalled when a checkpoint was handed over
+    pthread_cond_t done; //!< signalled when a checkpoint was written
+    struct job job; //!< the checkpoint handed over
+    bool busy; //!< whether the checkpoint was handed over and not collected
+    bool finished; //!< whether the checkpoint was written
+    bool stop; //!< whether the checkpointer is to stop
+} session = { .dir_fd = -1, .log_fd = -1 };
+
+/**
+ * Main function of the checkpointer thread
+ */
+static void*
+checkpointer_main(
+    void* arg //!< Unused
+);
+
+/**
+ * Collect the checkpoint handed to the checkpointer
+ *
+ * @return 0 if no checkpoint is pending or it was collected, -EBUSY if it is
+ *         still being written and `wait` is false
+ */
+static int
+job_collect(
+    bool wait //!< Whether to wait for the checkpoint to be written
+);
+
+/**
+ * Hand the entries to be checkpointed over to a job
+ *
+ * For JOB_DELTA, these are the dirty entries, for JOB_FULL all updated ones.
+ * The entries are marked clean.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+job_freeze(
+    struct job* job, //!< The job, initialized
+    enum job_kind kind //!< Kind of the checkpoint
+);
+
+/**
+ * Write a checkpoint
+ *
+ * This is done by the checkpointer, and only reads the state of the session
+ * manager which doesn't change while a checkpoint is pending.
+ */
+static void
+job_run(
+    struct job* job //!< The checkpoint
+);
+
+/**
+ * Apply the outcome of a written checkpoint and release it
+ *
+ * @return the outcome of writing the checkpoint
+ */
+static int
+job_finish(
+    struct job* job //!< The checkpoint
+);
+
+/**
+ * Append a checkpoint to the log
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+delta_write(
+    struct job* job //!< The checkpoint
+);
+
+/**
+ * Save the whole session
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+full_write(
+    struct job* job //!< The checkpoint
+);
+
+/**
+ * Build an image of the saved session with the entries of a job applied
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+full_build(
+    struct ws_flat_builder* builder, //!< Builder of the image
+    struct job const* job //!< The checkpoint
+);
+
+/**
+ * Add a section to a new image
+ *
+ * The section holds the entries of the saved session which were not updated,
+ * copied over as they are, and the updated entries which were not removed.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+section_build(
+    struct ws_flat_builder* builder, //!< Builder of the image
+    enum ws_session_section section, //!< The section
+    struct table const* table, //!< The updated entries of the section
+    struct ws_flat_value* result //!< Location to store the map to
+);
+
+/**
+ * Map the saved session, if there is one
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+session_load(void);
+
+/**
+ * Open the log and apply the checkpoints after the saved session
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+log_load(void);
+
+/**
+ * Apply the entries of a checkpoint
+ *
+ * The entries are all decoded before the first one is applied, so a damaged
+ * checkpoint is not applied at all.
+ *
+ * @return 0 on success, -EIO if the checkpoint is damaged, another negative
+ *         error number otherwise
+ */
+static int
+log_apply(
+    struct ws_flat const* delta //!< The checkpoint
+);
+
+/**
+ * Get the map of a section in an image
+ *
+ * @return the map, NULL if there is none
+ */
+static struct ws_flat_value const*
+section_map(
+    struct ws_flat const* image, //!< The image
+    enum ws_session_section section //!< The section
+);
+
+/**
+ * Find the slot of a key
+ *
+ * @return the slot holding the key, or the free slot it would go to
+ */
+static struct entry*
+table_slot(
+    struct table const* table, //!< The table
+    struct ws_value key, //!< The key
+    uint64_t hash //!< Hash of the key
+);
+
+/**
+ * Make sure a table has room for another entry
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+table_grow(
+    struct table* table //!< The table
+);
+
+/**
+ * Drop the entries of a table which were updated up to some update
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+table_prune(
+    struct table* table, //!< The table
+    uint64_t gen //!< Number of the latest update to drop
+);
+
+/**
+ * Release the entries of a table, leaving it empty
+ */
+static void
+table_clear(
+    struct table* table //!< The table
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_session_init(
+    char const* path
+) {
+    ws_array_init(&session.dirty, sizeof(struct dirty));
+
+    if ((mkdir(path, 0700) < 0) && (errno != EEXIST)) {
+        return -errno;
+    }
+    session.dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (session.dir_fd < 0) {
+        return -errno;
+    }
+
+    // states decoded from the log must outlive any arena
+    struct ws_arena* prev = ws_value_use_arena(NULL);
+    int res = session_load();
+    if (res == 0) {
+        res = log_load();
+    }
+    ws_value_use_arena(prev);
+
+    // bring the saved session up to date, so it may be restored from
+    if ((res == 0) && session.stats.replayed) {
+        res = ws_session_save();
+    }
+    if (res < 0) {
+        ws_session_deinit();
+        return res;
+    }
+
+    pthread_mutex_init(&session.lock, NULL);
+    pthread_cond_init(&session.wake, NULL);
+    pthread_cond_init(&session.done, NULL);
+    res = pthread_create(&session.checkpointer, NULL, checkpointer_main, NULL);
+    if (res) {
+        pthread_cond_destroy(&session.done);
+        pthread_cond_destroy(&session.wake);
+        pthread_mutex_destroy(&session.lock);
+        ws_session_deinit();
+        return -res;
+    }
+    session.running = true;
+
+    ws_info(&log_ctx, "session of %zu bytes mapped, %llu entries replayed",
+            session.image.size, (unsigned long long) session.stats.replayed);
+    return 0;
+}
+
+void
+ws_session_deinit(void)
+{
+    if (session.running) {
+        job_collect(true);
+
+        pthread_mutex_lock(&session.lock);
+        session.stop = true;
+        pthread_cond_signal(&session.wake);
+        pthread_mutex_unlock(&session.lock);
+        pthread_join(session.checkpointer, NULL);
+
+        pthread_cond_destroy(&session.done);
+        pthread_cond_destroy(&session.wake);
+        pthread_mutex_destroy(&session.lock);
+    }
+
+    for (int i = 0; i < WS_SESSION_SECTION_COUNT; ++i) {
+        table_clear(session.sections + i);
+        free(session.sections[i].entries);
+    }
+    for (size_t i = 0; i < session.dirty.len; ++i) {
+        ws_value_unref(((struct dirty*) ws_array_at(&session.dirty, i))->key);
+    }
+    ws_array_deinit(&session.dirty);
+
+    ws_flat_close(&session.image);
+    if (session.log_fd >= 0) {
+        close(session.log_fd);
+    }
+    if (session.dir_fd >= 0) {
+        close(session.dir_fd);
+    }
+
+    memset(&session, 0, sizeof(session));
+    session.dir_fd = -1;
+    session.log_fd = -1;
+}
+
+int
+ws_session_update(
+    enum ws_session_section section,
+    struct ws_value key,
+    struct ws_value state
+) {
+    switch (ws_value_get_type(key)) {
+    case WS_VALUE_TYPE_INT:
+    case WS_VALUE_TYPE_OBJECT_ID:
+    case WS_VALUE_TYPE_STRING:
+        break;
+    default:
+        return -EINVAL;
+    }
+    if ((unsigned) section >= WS_SESSION_SECTION_COUNT) {
+        return -EINVAL;
+    }
+
+    struct table* table = session.sections + section;
+    int res = table_grow(table);
+    if (res == 0) {
+        res = ws_array_reserve(&session.dirty, session.dirty.len + 1);
+    }
+    if (res < 0) {
+        return res;
+    }
+
+    // the table outlives any arena the values may live in
+    res = ws_value_persist(&state);
+    if (res < 0) {
+        return res;
+    }
+
+    uint64_t hash = ws_value_hash(key);
+    struct entry* entry = table_slot(table, key, hash);
+    if (ws_value_get_type(entry->key) == WS_VALUE_TYPE_NIL) {
+        res = ws_value_persist(&key);
+        if (res < 0) {
+            ws_value_unref(state);
+            return res;
+        }
+        entry->key = key;
+        entry->hash = hash;
+        ++table->count;
+    } else {
+        ws_value_unref(entry->state);
+    }
+    entry->state = state;
+    entry->gen = ++session.gen;
+
+    if (!entry->dirty) {
+        struct dirty dirty = {
+            .section = section,
+            .key = ws_value_ref(entry->key),
+        };
+        ws_array_push(&session.dirty, &dirty);
+        entry->dirty = true;
+    }
+    return 0;
+}
+
+int
+ws_session_checkpoint(void)
+{
+    WS_TRACE_SCOPE("session checkpoint");
+
+    int res = job_collect(false);
+    if (res < 0) {
+        return res;
+    }
+    if (!session.dirty.len && !session.compact) {
+        return 0;
+    }
+
+    // the log has grown to the point where saving everything is cheaper
+    enum job_kind kind = JOB_DELTA;
+    if (session.compact ||
+            ((session.stats.log_size >= WS_SESSION_COMPACT_MIN) &&
+             (session.stats.log_size >= session.image.size))) {
+        kind = JOB_FULL;
+    }
+
+    struct job* job = &session.job;
+    res = job_freeze(job, kind);
+    if (res < 0) {
+        return res;
+    }
+
+    pthread_mutex_lock(&session.lock);
+    session.busy = true;
+    session.finished = false;
+    pthread_cond_signal(&session.wake);
+    pthread_mutex_unlock(&session.lock);
+    return 0;
+}
+
+int
+ws_session_save(void)
+{
+    WS_TRACE_SCOPE("session save");
+
+    // the checkpointer is idle afterwards, so the job is ours
+    if (session.running) {
+        job_collect(true);
+    }
+
+    struct job* job = &session.job;
+    int res = job_freeze(job, JOB_FULL);
+    if (res < 0) {
+        return res;
+    }
+    job_run(job);
+    return job_finish(job);
+}
+
+struct ws_flat_value const*
+ws_session_restore(
+    enum ws_session_section section,
+    struct ws_value key
+) {
+    struct ws_flat_value const* map = section_map(&session.image, section);
+    if (!map) {
+        return NULL;
+    }
+    return ws_flat_map_find(&session.image, map, key);
+}
+
+struct ws_flat_value const*
+ws_session_entries(
+    enum ws_session_section section,
+    size_t* count
+) {
+    *count = 0;
+
+    struct ws_flat_value const* map = section_map(&session.image, section);
+    if (!map) {
+        return NULL;
+    }
+
+    struct ws_flat_value const* values;
+    values = ws_flat_values(&session.image, map, count);
+    *count /= 2;
+    return *count ? values : NULL;
+}
+
+struct ws_flat const*
+ws_session_image(void)
+{
+    return &session.image;
+}
+
+void
+ws_session_get_stats(
+    struct ws_session_stats* stats
+) {
+    *stats = session.stats;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static void*
+checkpointer_main(
+    void* arg __ws_unused__
+) {
+    pthread_mutex_lock(&session.lock);
+    while (1) {
+        while (!(session.busy && !session.finished) && !session.stop) {
+            pthread_cond_wait(&session.wake, &session.lock);
+        }
+        if (session.stop) {
+            break;
+        }
+        pthread_mutex_unlock(&session.lock);
+
+        job_run(&session.job);
+
+        pthread_mutex_lock(&session.lock);
+        session.finished = true;
+        pthread_cond_broadcast(&session.done);
+    }
+    pthread_mutex_unlock(&session.lock);
+    return NULL;
+}
+
+static int
+job_collect(
+    bool wait
+) {
+    pthread_mutex_lock(&session.lock);
+    if (!session.busy) {
+        pthread_mutex_unlock(&session.lock);
+        return 0;
+    }
+    while (wait && !session.finished) {
+        pthread_cond_wait(&session.done, &session.lock);
+    }
+    bool finished = session.finished;
+    if (finished) {
+        session.busy = false;
+    }
+    pthread_mutex_unlock(&session.lock);
+
+    if (!finished) {
+        return -EBUSY;
+    }
+    return job_finish(&session.job);
+}
+
+static int
+job_freeze(
+    struct job* job,
+    enum job_kind kind
+) {
+    *job = (struct job) { .kind = kind, .gen = session.gen };
+    ws_array_init(&job->items, sizeof(struct item));
+
+    size_t count = session.dirty.len;
+    if (kind == JOB_FULL) {
+        count = 0;
+        for (int i = 0; i < WS_SESSION_SECTION_COUNT; ++i) {
+            count += session.sections[i].count;
+        }
+    }
+    int res = ws_array_reserve(&job->items, count);
+    if (res < 0) {
+        ws_array_deinit(&job->items);
+        return res;
+    }
+
+    // the entries are copied by reference, which is as good as a copy of the
+    // state since states are not modified once they are handed over
+    if (kind == JOB_FULL) {
+        for (int i = 0; i < WS_SESSION_SECTION_COUNT; ++i) {
+            struct table* table = session.sections + i;
+            for (size_t j = 0; j < table->size; ++j) {
+                struct entry* entry = table->entries + j;
+                if (ws_value_get_type(entry->key) == WS_VALUE_TYPE_NIL) {
+                    continue;
+                }
+                struct item item = {
+                    .section = i,
+                    .key = ws_value_ref(entry->key),
+                    .state = ws_value_ref(entry->state),
+                };
+                ws_array_push(&job->items, &item);
+                entry->dirty = false;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < session.dirty.len; ++i) {
+        struct dirty* dirty = ws_array_at(&session.dirty, i);
+        struct table* table = session.sections + dirty->section;
+        struct entry* entry = table_slot(table, dirty->key,
+                                         ws_value_hash(dirty->key));
+        if (kind == JOB_DELTA) {
+            struct item item = {
+                .section = dirty->section,
+                .key = ws_value_ref(entry->key),
+                .state = ws_value_ref(entry->state),
+            };
+            ws_array_push(&job->items, &item);
+            entry->dirty = false;
+        }
+        ws_value_unref(dirty->key);
+    }
+    session.dirty.len = 0;
+    session.compact = false;
+    return 0;
+}
+
+static void
+job_run(
+    struct job* job
+) {
+    WS_TRACE_SCOPE("session write");
+
+    if (job->kind == JOB_FULL) {
+        job->result = full_write(job);
+    } else {
+        job->result = delta_write(job);
+    }
+}
+
+static int
+job_finish(
+    struct job* job
+) {
+    int res = job->result;
+
+    if ((res == 0) && (job->kind == JOB_FULL)) {
+        // the saved session holds the entries, unless they changed since
+        struct ws_flat old = session.image;
+        res = session_load();
+        if (res < 0) {
+            session.image = old;
+        } else {
+            ws_flat_close(&old);
+            for (int i = 0; (i < WS_SESSION_SECTION_COUNT) && !res; ++i) {
+                res = table_prune(session.sections + i, job->gen);
+            }
+        }
+    }
+
+    if (res < 0) {
+        // the entries are not on disk, but still in the tables
+        ws_warn(&log_ctx, "writing a checkpoint failed: %s", strerror(-res));
+        session.compact = true;
+    } else {
+        session.stats.log_size = job->log_size;
+        session.stats.entries_written += job->items.len;
+        if (job->kind == JOB_FULL) {
+            ++session.stats.compactions;
+        } else {
+            ++session.stats.checkpoints;
+        }
+    }
+
+    for (size_t i = 0; i < job->items.len; ++i) {
+        struct item* item = ws_array_at(&job->items, i);
+        ws_value_unref(item->key);
+        ws_value_unref(item->state);
+    }
+    ws_array_deinit(&job->items);
+    return res;
+}
+
+static int
+delta_write(
+    struct job* job
+) {
+    struct ws_flat_builder builder;
+    int res = ws_flat_builder_init(&builder);
+    if (res < 0) {
+        return res;
+    }
+
+    struct ws_array pairs[WS_SESSION_SECTION_COUNT];
+    for (int i = 0; i < WS_SESSION_SECTION_COUNT; ++i) {
+        ws_array_init(pairs + i, sizeof(struct ws_flat_value));
+    }
+
+    // removed entries are recorded with a nil state
+    for (size_t i = 0; (i < job->items.len) && (res == 0); ++i) {
+        struct item const* item = ws_array_at(&job->items, i);
+        struct ws_flat_value pair[2];
+        res = ws_flat_builder_value(&builder, item->key, pair);
+        if (res == 0) {
+            res = ws_flat_builder_value(&builder, item->state, pair + 1);
+        }
+        if (res == 0) {
+            res = ws_array_push(pairs + item->section, pair);
+        }
+        if (res == 0) {
+            res = ws_array_push(pairs + item->section, pair + 1);
+        }
+    }
+
+    struct ws_flat_value root[2 * WS_SESSION_SECTION_COUNT];
+    for (int i = 0; (i < WS_SESSION_SECTION_COUNT) && (res == 0); ++i) {
+        root[2 * i] = (struct ws_flat_value) {
+            .type = WS_FLAT_TYPE_INT,
+            .data = i,
+        };
+        res = ws_flat_builder_map(&builder, ws_array_at(pairs + i, 0),
+                                  pairs[i].len / 2, root + 2 * i + 1);
+    }
+    for (int i = 0; i < WS_SESSION_SECTION_COUNT; ++i) {
+        ws_array_deinit(pairs + i);
+    }
+
+    struct ws_flat_value map;
+    if (res == 0) {
+        res = ws_flat_builder_map(&builder, root, WS_SESSION_SECTION_COUNT,
+                                  &map);
+    }
+    if (res == 0) {
+        res = ws_flat_builder_finish(&builder, &map, job->gen);
+    }
+
+    struct log_header header = { .size = builder.out.len };
+    if (res == 0) {
+        header.crc = ws_crc32_update(0, &header, sizeof(header));
+        header.crc = ws_crc32_update(header.crc, builder.out.data,
+                                     builder.out.len);
+        res = ws_file_write_all(session.log_fd, &header, sizeof(header));
+    }
+    if (res == 0) {
+        res = ws_file_write_all(session.log_fd, builder.out.data,
+                                builder.out.len);
+    }
+    if ((res == 0) && (fdatasync(session.log_fd) < 0)) {
+        res = -errno;
+    }
+    ws_flat_builder_deinit(&builder);
+
+    struct stat st;
+    if (fstat(session.log_fd, &st) == 0) {
+        job->log_size = st.st_size;
+    }
+    return res;
+}
+
+static int
+full_write(
+    struct job* job
+) {
+    struct ws_flat_builder builder;
+    int res = ws_flat_builder_init(&builder);
+    if (res == 0) {
+        res = full_build(&builder, job);
+    }
+
+    // the saved session replaces the previous one atomically
+    if (res == 0) {
+        res = ws_file_replace(session.dir_fd, SESSION_NAME, SESSION_TMP_NAME,
+                              builder.out.data, builder.out.len);
+    }
+    ws_flat_builder_deinit(&builder);
+    if (res < 0) {
+        return res;
+    }
+
+    // checkpoints in the log are all in the saved session now, and skipped
+    // on startup if we go down before the log is truncated
+    if (ftruncate(session.log_fd, 0) < 0) {
+        return -errno;
+    }
+    job->log_size = 0;
+    return 0;
+}
+
+static int
+full_build(
+    struct ws_flat_builder* builder,
+    struct job const* job
+) {
+    // the entries of the job, by section, for looking them up by key
+    struct table tables[WS_SESSION_SECTION_COUNT];
+    memset(tables, 0, sizeof(tables));
+    int res = 0;
+
+    for (size_t i = 0; (i < job->items.len) && (res == 0); ++i) {
+        struct item const* item = ws_array_at(&job->items, i);
+        struct table* table = tables + item->section;
+        res = table_grow(table);
+        if (res == 0) {
+            uint64_t hash = ws_value_hash(item->key);
+            *table_slot(table, item->key, hash) = (struct entry) {
+                .key = item->key,
+                .state = item->state,
+                .hash = hash,
+            };
+            ++table->count;
+        }
+    }
+
+    // the root maps section numbers to the sections' maps
+    struct ws_flat_value pairs[2 * WS_SESSION_SECTION_COUNT];
+    for (int i = 0; (i < WS_SESSION_SECTION_COUNT) && (res == 0); ++i) {
+        pairs[2 * i] = (struct ws_flat_value) {
+            .type = WS_FLAT_TYPE_INT,
+            .data = i,
+        };
+        res = section_build(builder, i, tables + i, pairs + 2 * i + 1);
+    }
+    for (int i = 0; i < WS_SESSION_SECTION_COUNT; ++i) {
+        free(tables[i].entries);
+    }
+
+    struct ws_flat_value root;
+    if (res == 0) {
+        res = ws_flat_builder_map(builder, pairs, WS_SESSION_SECTION_COUNT,
+                                  &root);
+    }
+    if (res == 0) {
+        res = ws_flat_builder_finish(builder, &root, job->gen);
+    }
+    return res;
+}
+
+static int
+section_build(
+    struct ws_flat_builder* builder,
+    enum ws_session_section section,
+    struct table const* table,
+    struct ws_flat_value* result
+) {
+    struct ws_array pairs;
+    ws_array_init(&pairs, sizeof(struct ws_flat_value));
+    struct ws_flat_value pair[2];
+    int res = 0;
+
+    struct ws_flat const* old = &session.image;
+    size_t count;
+    struct ws_flat_value const* values = ws_session_entries(section, &count);
+    for (size_t i = 0; (i < count) && (res == 0); ++i) {
+        struct ws_flat_value const* key = values + 2 * i;
+
+        // updated entries are taken from the table below
+        if (table->count) {
+            struct ws_value k;
+            res = ws_flat_to_value(old, key, &k);
+            if (res < 0) {
+                break;
+            }
+            struct entry const* entry = table_slot(table, k, ws_value_hash(k));
+            bool updated = ws_value_get_type(entry->key) != WS_VALUE_TYPE_NIL;
+            ws_value_unref(k);
+            if (updated) {
+                continue;
+            }
+        }
+
+        res = ws_flat_builder_copy(builder, old, key, pair);
+        if (res == 0) {
+            res = ws_flat_builder_copy(builder, old, key + 1, pair + 1);
+        }
+        if (res == 0) {
+            res = ws_array_push(&pairs, pair);
+        }
+        if (res == 0) {
+            res = ws_array_push(&pairs, pair + 1);
+        }
+    }
+
+    for (size_t i = 0; (i < table->size) && (res == 0); ++i) {
+        struct entry const* entry = table->entries + i;
+        if ((ws_value_get_type(entry->key) == WS_VALUE_TYPE_NIL) ||
+                (ws_value_get_type(entry->state) == WS_VALUE_TYPE_NIL)) {
+            continue;
+        }
+
+        res = ws_flat_builder_value(builder, entry->key, pair);
+        if (res == 0) {
+            res = ws_flat_builder_value(builder, entry->state, pair + 1);
+        }
+        if (res == 0) {
+            res = ws_array_push(&pairs, pair);
+        }
+        if (res == 0) {
+            res = ws_array_push(&pairs, pair + 1);
+        }
+    }
+
+    if (res == 0) {
+        res = ws_flat_builder_map(builder, ws_array_at(&pairs, 0),
+                                  pairs.len / 2, result);
+    }
+    ws_array_deinit(&pairs);
+    return res;
+}
+
+static int
+session_load(void)
+{
+    int fd = openat(session.dir_fd, SESSION_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -errno;
+    }
+
+    // the mapping is used in place, nothing is decoded up front
+    int res = ws_flat_open(&session.image, fd);
+    close(fd);
+    if ((res == 0) && (session.image.root->type != WS_FLAT_TYPE_MAP)) {
+        ws_flat_close(&session.image);
+        res = -EINVAL;
+    }
+    if (res < 0) {
+        return res == -EINVAL ? -EIO : res;
+    }
+
+    if (session.gen < session.image.user) {
+        session.gen = session.image.user;
+    }
+    return 0;
+}
+
+static int
+log_load(void)
+{
+    session.log_fd = openat(session.dir_fd, LOG_NAME,
+                            O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (session.log_fd < 0) {
+        return -errno;
+    }
+
+    struct stat st;
+    if (fstat(session.log_fd, &st) < 0) {
+        return -errno;
+    }
+    size_t size = st.st_size;
+    if (!size) {
+        return 0;
+    }
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, session.log_fd, 0);
+    if (data == MAP_FAILED) {
+        return -errno;
+    }
+
+    size_t pos = 0;
+    int res = 0;
+    while ((res == 0) && (size - pos >= sizeof(struct log_header))) {
+        struct log_header header;
+        memcpy(&header, data + pos, sizeof(header));
+        if (header.size > size - pos - sizeof(header)) {
+            break;
+        }
+
+        // the CRC is computed with the CRC field zeroed
+        uint32_t crc = header.crc;
+        header.crc = 0;
+        uint32_t check = ws_crc32_update(0, &header, sizeof(header));
+        char const* image = data + pos + sizeof(header);
+        if (ws_crc32_update(check, image, header.size) != crc) {
+            break;
+        }
+
+        struct ws_flat delta;
+        if (ws_flat_init(&delta, image, header.size) < 0) {
+            break;
+        }
+
+        // checkpoints already in the saved session are skipped
+        if (delta.user > session.image.user) {
+            res = log_apply(&delta);
+            if (res == -EIO) {
+                res = 0;
+                break;
+            }
+            if (session.gen < delta.user) {
+                session.gen = delta.user;
+            }
+        }
+        pos += sizeof(header) + header.size;
+    }
+    munmap(data, size);
+    if (res < 0) {
+        return res;
+    }
+
+    if (pos < size) {
+        // a checkpoint which was being written when we went down, or which
+        // was damaged since, and whatever follows it
+        ws_warn(&log_ctx, "discarding %zu bytes at the end of the log",
+                size - pos);
+        if (ftruncate(session.log_fd, pos) < 0) {
+            return -errno;
+        }
+    }
+    session.stats.log_size = pos;
+    return 0;
+}
+
+static int
+log_apply(
+    struct ws_flat const* delta
+) {
+    struct ws_array items;
+    ws_array_init(&items, sizeof(struct item));
+
+    int res = 0;
+    for (int i = 0; (i < WS_SESSION_SECTION_COUNT) && (res == 0); ++i) {
+        struct ws_flat_value const* map = section_map(delta, i);
+        size_t count = 0;
+        struct ws_flat_value const* values = NULL;
+        if (map) {
+            values = ws_flat_values(delta, map, &count);
+        }
+
+        for (size_t j = 0; j < count; j += 2) {
+            struct item item = { .section = i };
+            if (ws_flat_to_value(delta, values + j, &item.key) < 0) {
+                res = -EIO;
+                break;
+            }
+            if (ws_flat_to_value(delta, values + j + 1, &item.state) < 0) {
+                ws_value_unref(item.key);
+                res = -EIO;
+                break;
+            }
+
+            res = ws_array_push(&items, &item);
+            if (res < 0) {
+                ws_value_unref(item.key);
+                ws_value_unref(item.state);
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < items.len; ++i) {
+        struct item* item = ws_array_at(&items, i);
+        if (res == 0) {
+            res = ws_session_update(item->section, item->key, item->state);
+            if (res == 0) {
+                ++session.stats.replayed;
+            }
+        }
+        ws_value_unref(item->key);
+        ws_value_unref(item->state);
+    }
+    ws_array_deinit(&items);
+    return res;
+}
+
+static struct ws_flat_value const*
+section_map(
+    struct ws_flat const* image,
+    enum ws_session_section section
+) {
+    if (!image->root) {
+        return NULL;
+    }
+
+    struct ws_flat_value const* map;
+    map = ws_flat_map_find(image, image->root, ws_value_int(section));
+    if (!map || (map->type != WS_FLAT_TYPE_MAP)) {
+        return NULL;
+    }
+    return map;
+}
+
+static struct entry*
+table_slot(
+    struct table const* table,
+    struct ws_value key,
+    uint64_t hash
+) {
+    size_t mask = table->size - 1;
+    size_t pos = hash & mask;
+    struct entry* entry;
+
+    while (ws_value_get_type((entry = table->entries + pos)->key) !=
+            WS_VALUE_TYPE_NIL) {
+        if ((entry->hash == hash) && ws_value_equal(entry->key, key)) {
+            break;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return entry;
+}
+
+static int
+table_grow(
+    struct table* table
+) {
+    // keep the load factor below one half
+    if ((table->count + 1) * 2 <= table->size) {
+        return 0;
+    }
+
+    struct table grown = {
+        .size = table->size ? table->size * 2 : TABLE_SIZE_MIN,
+        .count = table->count,
+    };
+    grown.entries = calloc(grown.size, sizeof(*grown.entries));
+    if (!grown.entries) {
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < table->size; ++i) {
+        struct entry* entry = table->entries + i;
+        if (ws_value_get_type(entry->key) != WS_VALUE_TYPE_NIL) {
+            *table_slot(&grown, entry->key, entry->hash) = *entry;
+        }
+    }
+    free(table->entries);
+    *table = grown;
+    return 0;
+}
+
+static int
+table_prune(
+    struct table* table,
+    uint64_t gen
+) {
+    if (!table->count) {
+        return 0;
+    }
+
+    struct table pruned = { .size = table->size };
+    pruned.entries = calloc(pruned.size, sizeof(*pruned.entries));
+    if (!pruned.entries) {
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < table->size; ++i) {
+        struct entry* entry = table->entries + i;
+        if (ws_value_get_type(entry->key) == WS_VALUE_TYPE_NIL) {
+            continue;
+        }
+        if (entry->gen <= gen) {
+            ws_value_unref(entry->key);
+            ws_value_unref(entry->state);
+            continue;
+        }
+        *table_slot(&pruned, entry->key, entry->hash) = *entry;
+        ++pruned.count;
+    }
+    free(table->entries);
+    *table = pruned;
+    return 0;
+}
 
+static void
+table_clear(
+    struct table* table
+) {
+    for (size_t i = 0; i < table->size; ++i) {
+        struct entry* entry = table->entries + i;
+        ws_value_unref(entry->key);
+        ws_value_unref(entry->state);
+        *entry = (struct entry) { .key = ws_value_nil() };
+    }
+    table->count = 0;
+}
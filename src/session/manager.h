@@ -28,6 +28,184 @@
 #ifndef __WS_SESSION_MANAGER_H__
 #define __WS_SESSION_MANAGER_H__
 
+#include <stddef.h>
+#include <stdint.h>
 
+#include "serialize/flat.h"
+#include "util/attributes.h"
+#include "values/value.h"
+
+/**
+ * @file manager.h
+ *
+ * Session state
+ *
+ * The session manager remembers the state of windows, workspaces and scripts
+ * across restarts. The state is kept per section, as a map from keys, which
+ * are integers, object ids or strings, to values.
+ *
+ * Saved sessions are flat images (see serialize/flat.h). On startup, the
+ * latest one is mapped and restoring an entry is a lookup in the mapping,
+ * which is read in place. No matter how many windows there are, nothing is
+ * decoded before it is asked for.
+ *
+ * Updates are tracked in memory. Checkpoints write the entries updated since
+ * the previous checkpoint, and only those, to a log next to the saved session.
+ * The entries are handed over to a background thread, which does the
+ * encoding and writing, so a checkpoint costs the main loop little more than
+ * taking a reference per updated entry. Once the log grows large compared to
+ * the saved session, the background thread saves the whole session instead
+ * and starts the log over.
+ *
+ * On startup, checkpoints logged after the saved session are applied and the
+ * session is saved, so entries may be restored from the mapping again.
+ *
+ * The functions of the session manager must only be called from one thread.
+ * States must not be modified once they are passed to the session manager.
+ */
+
+/**
+ * Minimum size of the checkpoint log before it is compacted, in bytes
+ */
+#define WS_SESSION_COMPACT_MIN (1 << 20)
+
+/**
+ * Sections of the session
+ */
+enum ws_session_section {
+    WS_SESSION_WINDOWS, //!< state of windows
+    WS_SESSION_WORKSPACES, //!< state of workspaces
+    WS_SESSION_VALUES, //!< values stored by scripts
+    WS_SESSION_SECTION_COUNT, //!< number of sections
+};
+
+/**
+ * Counters of the session manager
+ */
+struct ws_session_stats {
+    uint64_t checkpoints; //!< checkpoints written to the log
+    uint64_t compactions; //!< saves of the whole session
+    uint64_t entries_written; //!< entries written by checkpoints
+    uint64_t replayed; //!< entries applied from the log on startup
+    uint64_t log_size; //!< current size of the checkpoint log, in bytes
+};
+
+/**
+ * Initialize the session manager
+ *
+ * The session lives in a directory, which is created if necessary. The
+ * latest saved session is mapped. Checkpoints logged after it are applied and
+ * saved along with it. A checkpoint which was only partially written before a
+ * crash, or which is damaged, is discarded along with the ones following it.
+ *
+ * @return 0 on success, -EIO if the saved session is damaged, another
+ *         negative error number otherwise
+ */
+int
+ws_session_init(
+    char const* path //!< Path of the session directory
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize the session manager
+ *
+ * Updates which were neither checkpointed nor saved are lost.
+ */
+void
+ws_session_deinit(void);
+
+/**
+ * Update the state of an entry
+ *
+ * Passing nil as state removes the entry.
+ *
+ * @return 0 on success, -EINVAL if the key is no integer, object id or string,
+ *         another negative error number otherwise
+ */
+int
+ws_session_update(
+    enum ws_session_section section, //!< The section of the entry
+    struct ws_value key, //!< The key of the entry
+    struct ws_value state //!< The state, a reference is taken
+);
+
+/**
+ * Checkpoint the entries updated since the previous checkpoint
+ *
+ * The entries are written in the background. This is cheap, and meant to be
+ * called periodically from the main loop. If nothing was updated, nothing is
+ * written.
+ *
+ * If writing the previous checkpoint failed, the next one saves the whole
+ * session.
+ *
+ * @return 0 on success, -EBUSY if the previous checkpoint is still being
+ *         written, in which case the entries are part of the next one, another
+ *         negative error number if writing the previous checkpoint failed
+ */
+int
+ws_session_checkpoint(void);
+
+/**
+ * Save the session
+ *
+ * The saved session holds the entries of the previously saved one, with the
+ * updates applied. It replaces the previous one atomically and is mapped in
+ * its place, and the checkpoint log is started over. This blocks the caller,
+ * and is meant to be done before shutting down.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_session_save(void);
+
+/**
+ * Get the saved state of an entry
+ *
+ * The state is read in place, using the functions in serialize/flat.h and the
+ * image returned by ws_session_image(). It stays valid until the next
+ * checkpoint or save, or until the session manager is deinitialized. Updates
+ * made since the session was last saved are not taken into account.
+ *
+ * @return the state, NULL if there is none
+ */
+struct ws_flat_value const*
+ws_session_restore(
+    enum ws_session_section section, //!< The section of the entry
+    struct ws_value key //!< The key of the entry
+);
+
+/**
+ * Get the saved entries of a section
+ *
+ * The entries are returned as consecutive keys and states, sorted by key,
+ * just like ws_flat_values() returns the entries of a map.
+ *
+ * @return the keys and states, NULL if there are none
+ */
+struct ws_flat_value const*
+ws_session_entries(
+    enum ws_session_section section, //!< The section
+    size_t* count //!< Location to store the number of entries to
+)
+__ws_nonnull__(2);
+
+/**
+ * Get the image of the saved session
+ *
+ * @return the image, which holds no root value if no session was saved yet
+ */
+struct ws_flat const*
+ws_session_image(void);
+
+/**
+ * Get the counters of the session manager
+ */
+void
+ws_session_get_stats(
+    struct ws_session_stats* stats //!< Location to store the counters to
+)
+__ws_nonnull__(1);
 
 #endif // __WS_SESSION_MANAGER_H__
@@ -25,5 +25,1481 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger/trace.h"
+#include "objects/array.h"
+#include "objects/string.h"
+#include "serialize/flat.h"
+#include "serialize/module.h"
 #include "storage/module.h"
+#include "util/crc32.h"
+#include "util/debug.h"
+#include "util/file.h"
+#include "values/nil.h"
+
+/**
+ * Name of the log within the storage directory
+ */
+#define LOG_NAME "log"
+
+/**
+ * Name of the snapshot within the storage directory
+ */
+#define SNAPSHOT_NAME "snapshot"
+
+/**
+ * Name of a snapshot being written
+ */
+#define SNAPSHOT_TMP_NAME "snapshot.tmp"
+
+/**
+ * Name of a log being written during compaction
+ */
+#define LOG_TMP_NAME "log.tmp"
+
+/**
+ * Operations recorded in the log
+ */
+enum record_op {
+    RECORD_SET = 1, //!< set the value of a key
+    RECORD_DELETE = 2, //!< remove a key
+};
+
+/**
+ * Header of a record in the log
+ *
+ * The header is followed by the key and, for RECORD_SET, the value encoded as
+ * MessagePack. Fields are stored in host byte order.
+ */
+struct record_header {
+    uint64_t seq; //!< sequence number of the change
+    uint32_t size; //!< size of key and value, excluding the header
+    uint32_t crc; //!< CRC-32 of the header, with this field zero, and payload
+    uint16_t key_len; //!< length of the key
+    uint8_t op; //!< the operation, see enum record_op
+    uint8_t reserved[5]; //!< zero
+};
+
+/**
+ * Entry of the key/value table
+ *
+ * The table holds the changes made since the snapshot. Keys removed from the
+ * snapshot are kept as deleted entries, which hide them.
+ */
+struct entry {
+    char* key; //!< the key, NULL if the slot is free
+    size_t key_len; //!< length of the key
+    uint64_t hash; //!< hash of the key
+    size_t size; //!< size of the record describing the entry
+    uint64_t seq; //!< sequence number of the change which set the entry
+    struct ws_value value; //!< the value
+    bool deleted; //!< whether the key was removed
+};
+
+/**
+ * Compaction, as handed to the committer
+ *
+ * The job holds a copy of the table, so the table may change in the meantime
+ * without affecting the snapshot written.
+ */
+struct job {
+    struct entry* table; //!< copy of the table, values referenced
+    size_t table_size; //!< number of slots of the copy
+    char* keys; //!< the keys of the copy, back to back
+    uint64_t seq; //!< sequence number of the latest change included
+    uint64_t log_cut; //!< size of the log up to that change
+    int result; //!< outcome of the compaction
+};
+
+/**
+ * Logging context of the storage
+ */
+static struct ws_logger_context const log_ctx = { .prefix = "storage" };
+
+/**
+ * State of the storage
+ */
+static struct {
+    int dir_fd; //!< the storage directory
+    int log_fd; //!< the log, opened for appending
+    struct ws_flat snapshot; //!< the snapshot, mapped
+    struct entry* table; //!< changes since the snapshot, open addressing
+    size_t table_size; //!< number of slots, a power of two
+    size_t count; //!< number of entries in the table
+    size_t live_size; //!< size of the snapshot and the table entries' records
+    uint64_t seq; //!< sequence number of the latest change
+    struct ws_array scratch; //!< record being encoded
+    struct ws_storage_stats stats; //!< counters
+
+    // shared with the committer thread
+    pthread_t committer; //!< the committer thread
+    bool running; //!< whether the committer thread was started
+    pthread_mutex_t lock; //!< lock protecting the fields below
+    pthread_cond_t wake; //!< signalled when there are changes to commit
+    pthread_cond_t committed; //!< signalled when changes were committed
+    struct ws_array pending; //!< records waiting to be written
+    uint64_t pending_seq; //!< sequence number of the latest pending change
+    uint64_t durable_seq; //!< sequence number of the latest commited change
+    uint64_t commits; //!< number of commits
+    int error; //!< error which occurred while committing, or 0
+    struct job job; //!< the compaction handed over
+    bool busy; //!< whether the compaction was handed over and not collected
+    bool finished; //!< whether the compaction was done
+    bool stop; //!< whether the committer is to stop
+} storage = { .dir_fd = -1, .log_fd = -1 };
+
+/**
+ * Main function of the committer thread
+ */
+static void*
+committer_main(
+    void* arg //!< Unused
+);
+
+/**
+ * Apply a change to the table and append it to the log
+ *
+ * The table is changed first and restored if the change can't be logged.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+log_change(
+    enum record_op op, //!< The operation
+    char const* key, //!< The key
+    size_t key_len, //!< Length of the key
+    struct ws_value value //!< The value, persisted, the reference is consumed
+);
+
+/**
+ * Append the record in the scratch array to the log
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+log_append(void);
+
+/**
+ * Hand a compaction to the committer if the log grew too large
+ *
+ * A compaction the committer is done with is collected.
+ */
+static void
+log_maybe_compact(void);
+
+/**
+ * Write the snapshot of a compaction and start the log over
+ *
+ * This is done by the committer, once the log holds every change the
+ * snapshot includes.
+ */
+static void
+job_run(
+    struct job* job //!< The compaction
+);
+
+/**
+ * Hand a compaction over to the committer
+ *
+ * Once committing failed, the committer is gone and no compaction is handed
+ * over.
+ *
+ * @return 0 on success, the error which occurred while committing, another
+ *         negative error number otherwise
+ */
+static int
+job_start(void);
+
+/**
+ * Collect the compaction handed to the committer
+ *
+ * @return 0 if no compaction is pending or it was collected, -EBUSY if it is
+ *         still being done and `wait` is false
+ */
+static int
+job_collect(
+    bool wait //!< Whether to wait for the compaction to be done
+);
+
+/**
+ * Apply the outcome of a compaction and release it
+ *
+ * @return the outcome of the compaction
+ */
+static int
+job_finish(
+    struct job* job //!< The compaction
+);
+
+/**
+ * Release the copy of the table held by a compaction
+ */
+static void
+job_release(
+    struct job* job //!< The compaction
+);
+
+/**
+ * Write the snapshot of a compaction
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+snapshot_write(
+    struct job* job //!< The compaction
+);
+
+/**
+ * Replace the log with one holding the changes made after the snapshot
+ *
+ * If the log was not replaced, the job's cut is reset to zero.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+log_rotate(
+    struct job* job //!< The compaction
+);
+
+/**
+ * Encode a record into the scratch array
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+record_encode(
+    uint64_t seq, //!< Sequence number of the change
+    enum record_op op, //!< The operation
+    char const* key, //!< The key
+    size_t key_len, //!< Length of the key
+    struct ws_value value //!< The value, for RECORD_SET
+);
+
+/**
+ * Apply the records in a buffer
+ *
+ * Records up to `min_seq` are skipped. Decoding happens in place.
+ *
+ * @return the number of bytes of valid records
+ */
+static size_t
+records_replay(
+    char* buf, //!< The records
+    size_t len, //!< Size of the buffer
+    uint64_t min_seq //!< Sequence number of the latest change already applied
+);
+
+/**
+ * Map the snapshot, if there is one
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+snapshot_load(void);
+
+/**
+ * Build the contents of a new snapshot
+ *
+ * The image contains the entries of the current snapshot not changed since,
+ * copied over as they are, and the entries of the job's table.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+snapshot_build(
+    struct ws_flat_builder* builder, //!< Builder to build the image with
+    struct job const* job //!< The compaction
+);
+
+/**
+ * Look up a key in the snapshot
+ *
+ * @return the value of the key in the snapshot, NULL if there is none
+ */
+static struct ws_flat_value const*
+snapshot_find(
+    char const* key, //!< The key
+    size_t key_len //!< Length of the key
+);
+
+/**
+ * Open the log and replay the changes after the snapshot
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+log_load(void);
+
+/**
+ * Map a file privately, for in-place decoding
+ *
+ * @return the mapping, NULL if the file is empty, MAP_FAILED on error
+ */
+static char*
+map_file(
+    int fd, //!< The file
+    size_t* size //!< Location to store the size of the mapping to
+);
+
+/**
+ * Find the slot of a key
+ *
+ * @return the slot holding the key, or the free slot it would go to
+ */
+static struct entry*
+table_slot(
+    struct entry* table, //!< The table
+    size_t table_size, //!< Number of slots of the table
+    char const* key, //!< The key
+    size_t key_len, //!< Length of the key
+    uint64_t hash //!< Hash of the key
+);
+
+/**
+ * Get the entry of a key in the table, inserting one if there is none
+ *
+ * New entries are marked deleted and have no value.
+ *
+ * @return the entry, NULL if memory is exhausted
+ */
+static struct entry*
+table_insert(
+    char const* key, //!< The key
+    size_t key_len //!< Length of the key
+);
+
+/**
+ * Set the value of a key in the table
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+table_set(
+    char const* key, //!< The key
+    size_t key_len, //!< Length of the key
+    struct ws_value value, //!< The value, the reference is consumed
+    size_t size, //!< Size of the record describing the entry
+    uint64_t seq //!< Sequence number of the change
+);
+
+/**
+ * Remove a key
+ *
+ * If the snapshot holds the key, the entry in the table is marked deleted.
+ * Otherwise, it is removed.
+ *
+ * @return 0 on success, -ENOENT if there is no such key, another negative
+ *         error number otherwise
+ */
+static int
+table_delete(
+    char const* key, //!< The key
+    size_t key_len, //!< Length of the key
+    uint64_t seq //!< Sequence number of the change
+);
+
+/**
+ * Remove an entry from the table
+ */
+static void
+table_remove(
+    struct entry* entry //!< The entry
+);
+
+/**
+ * Drop the entries a new snapshot holds from the table
+ *
+ * The size of the live data is recomputed.
+ */
+static void
+table_prune(
+    uint64_t seq //!< Sequence number of the latest change the snapshot holds
+);
+
+/**
+ * Free the entries of the table, leaving it empty
+ */
+static void
+table_clear(void);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_storage_init(
+    char const* path
+) {
+    if ((mkdir(path, 0700) < 0) && (errno != EEXIST)) {
+        return -errno;
+    }
+    storage.dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (storage.dir_fd < 0) {
+        return -errno;
+    }
+
+    ws_array_init(&storage.scratch, 1);
+    ws_array_init(&storage.pending, 1);
+    storage.table_size = 64;
+    storage.table = calloc(storage.table_size, sizeof(*storage.table));
+    if (!storage.table) {
+        ws_storage_deinit();
+        return -ENOMEM;
+    }
+
+    // values decoded from disk must outlive any arena
+    struct ws_arena* prev = ws_value_use_arena(NULL);
+    int res = snapshot_load();
+    if (res == 0) {
+        storage.seq = storage.snapshot.user;
+        res = log_load();
+    }
+    ws_value_use_arena(prev);
+    if (res < 0) {
+        ws_storage_deinit();
+        return res;
+    }
+
+    storage.pending_seq = storage.seq;
+    storage.durable_seq = storage.seq;
+    pthread_mutex_init(&storage.lock, NULL);
+    pthread_cond_init(&storage.wake, NULL);
+    pthread_cond_init(&storage.committed, NULL);
+    res = pthread_create(&storage.committer, NULL, committer_main, NULL);
+    if (res) {
+        pthread_cond_destroy(&storage.committed);
+        pthread_cond_destroy(&storage.wake);
+        pthread_mutex_destroy(&storage.lock);
+        ws_storage_deinit();
+        return -res;
+    }
+    storage.running = true;
+
+    ws_info(&log_ctx, "snapshot of %zu keys mapped, %llu changes replayed",
+            storage.snapshot.root ? (size_t) storage.snapshot.root->len : 0,
+            (unsigned long long) storage.stats.replayed);
+    return 0;
+}
+
+void
+ws_storage_deinit(void)
+{
+    if (storage.running) {
+        job_collect(true);
+
+        // the committer commits whatever is pending before stopping
+        pthread_mutex_lock(&storage.lock);
+        storage.stop = true;
+        pthread_cond_signal(&storage.wake);
+        pthread_mutex_unlock(&storage.lock);
+        pthread_join(storage.committer, NULL);
+
+        pthread_cond_destroy(&storage.committed);
+        pthread_cond_destroy(&storage.wake);
+        pthread_mutex_destroy(&storage.lock);
+    }
+
+    if (storage.log_fd >= 0) {
+        close(storage.log_fd);
+    }
+    if (storage.dir_fd >= 0) {
+        close(storage.dir_fd);
+    }
+
+    if (storage.table) {
+        table_clear();
+    }
+    free(storage.table);
+    ws_flat_close(&storage.snapshot);
+
+    ws_array_deinit(&storage.scratch);
+    ws_array_deinit(&storage.pending);
+
+    memset(&storage, 0, sizeof(storage));
+    storage.dir_fd = -1;
+    storage.log_fd = -1;
+}
+
+int
+ws_storage_get(
+    char const* key,
+    struct ws_value* value
+) {
+    size_t key_len = strlen(key);
+    struct entry* entry = table_slot(storage.table, storage.table_size, key,
+                                     key_len,
+                                     ws_string_hash_bytes(key, key_len));
+    if (entry->key) {
+        if (entry->deleted) {
+            return -ENOENT;
+        }
+        *value = ws_value_ref(entry->value);
+        return 0;
+    }
+
+    // unchanged since the snapshot, read from the mapping
+    struct ws_flat_value const* flat = snapshot_find(key, key_len);
+    if (!flat) {
+        return -ENOENT;
+    }
+
+    struct ws_arena* prev = ws_value_use_arena(NULL);
+    int res = ws_flat_to_value(&storage.snapshot, flat, value);
+    ws_value_use_arena(prev);
+    return res;
+}
+
+int
+ws_storage_set(
+    char const* key,
+    struct ws_value value
+) {
+    size_t key_len = strlen(key);
+    if (key_len > WS_STORAGE_KEY_MAX) {
+        return -EINVAL;
+    }
+
+    // takes the reference the table holds
+    int res = ws_value_persist(&value);
+    if (res < 0) {
+        return res;
+    }
+
+    return log_change(RECORD_SET, key, key_len, value);
+}
+
+int
+ws_storage_delete(
+    char const* key
+) {
+    size_t key_len = strlen(key);
+    struct entry* entry = table_slot(storage.table, storage.table_size, key,
+                                     key_len,
+                                     ws_string_hash_bytes(key, key_len));
+    if (entry->key ? entry->deleted : !snapshot_find(key, key_len)) {
+        return -ENOENT;
+    }
+
+    return log_change(RECORD_DELETE, key, key_len, ws_value_nil());
+}
+
+int
+ws_storage_sync(void)
+{
+    if (!storage.running) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&storage.lock);
+    uint64_t seq = storage.pending_seq;
+    while ((storage.durable_seq < seq) && !storage.error) {
+        pthread_cond_wait(&storage.committed, &storage.lock);
+    }
+    int res = storage.error;
+    pthread_mutex_unlock(&storage.lock);
+    return res;
+}
+
+int
+ws_storage_snapshot(void)
+{
+    WS_TRACE_SCOPE("storage snapshot");
+
+    if (!storage.running) {
+        return -EINVAL;
+    }
+
+    // a compaction in progress may lack the latest changes
+    job_collect(true);
+
+    int res = job_start();
+    if (res < 0) {
+        return res;
+    }
+    return job_collect(true);
+}
+
+void
+ws_storage_get_stats(
+    struct ws_storage_stats* stats
+) {
+    *stats = storage.stats;
+    if (!storage.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&storage.lock);
+    stats->commits = storage.commits;
+    pthread_mutex_unlock(&storage.lock);
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static void*
+committer_main(
+    void* arg __ws_unused__
+) {
+    struct ws_array batch;
+    ws_array_init(&batch, 1);
+
+    pthread_mutex_lock(&storage.lock);
+    while (!storage.error) {
+        if (storage.busy && !storage.finished &&
+                (storage.durable_seq >= storage.job.seq)) {
+            // every change the snapshot holds is in the log by now
+            pthread_mutex_unlock(&storage.lock);
+            job_run(&storage.job);
+            pthread_mutex_lock(&storage.lock);
+            storage.finished = true;
+            pthread_cond_broadcast(&storage.committed);
+            continue;
+        }
+
+        if (!storage.pending.len) {
+            if (storage.stop) {
+                break;
+            }
+            pthread_cond_wait(&storage.wake, &storage.lock);
+            continue;
+        }
+
+        // take everything pending, leaving an empty buffer for new changes
+        struct ws_array swap = storage.pending;
+        storage.pending = batch;
+        batch = swap;
+        uint64_t seq = storage.pending_seq;
+        pthread_mutex_unlock(&storage.lock);
+
+        int res = ws_file_write_all(storage.log_fd, batch.data, batch.len);
+        if ((res == 0) && (fdatasync(storage.log_fd) < 0)) {
+            res = -errno;
+        }
+        batch.len = 0;
+
+        pthread_mutex_lock(&storage.lock);
+        if (res < 0) {
+            // further changes would end up behind a gap in the log
+            storage.error = res;
+        } else {
+            storage.durable_seq = seq;
+        }
+        ++storage.commits;
+        pthread_cond_broadcast(&storage.committed);
+
+        // let the next group accumulate
+        if (!storage.stop && !storage.error) {
+            pthread_mutex_unlock(&storage.lock);
+            struct timespec interval = {
+                .tv_nsec = WS_STORAGE_COMMIT_INTERVAL * 1000 * 1000,
+            };
+            nanosleep(&interval, NULL);
+            pthread_mutex_lock(&storage.lock);
+        }
+    }
+
+    if (storage.busy && !storage.finished) {
+        // the snapshot would lack the changes which failed to commit
+        storage.job.result = storage.error ? storage.error : -ECANCELED;
+        storage.job.log_cut = 0;
+        storage.finished = true;
+        pthread_cond_broadcast(&storage.committed);
+    }
+    pthread_mutex_unlock(&storage.lock);
+
+    ws_array_deinit(&batch);
+    return NULL;
+}
+
+static int
+log_change(
+    enum record_op op,
+    char const* key,
+    size_t key_len,
+    struct ws_value value
+) {
+    uint64_t seq = storage.seq + 1;
+    int res = record_encode(seq, op, key, key_len, value);
+    if (res < 0) {
+        ws_value_unref(value);
+        return res;
+    }
+
+    size_t count = storage.count;
+    struct entry* entry = table_insert(key, key_len);
+    if (!entry) {
+        ws_value_unref(value);
+        return -ENOMEM;
+    }
+    struct entry prev = *entry;
+    entry->value = value;
+    entry->size = op == RECORD_SET ? storage.scratch.len : 0;
+    entry->seq = seq;
+    entry->deleted = op == RECORD_DELETE;
+
+    res = log_append();
+    if (res < 0) {
+        // take the change back, the table must not hold unlogged changes
+        if (storage.count != count) {
+            table_remove(entry);
+        } else {
+            ws_value_unref(entry->value);
+            *entry = prev;
+        }
+        return res;
+    }
+
+    ws_value_unref(prev.value);
+    storage.live_size -= prev.size;
+    storage.live_size += entry->size;
+
+    // a removed key has to stay only if it hides one in a snapshot, including
+    // the one being written
+    if (entry->deleted && !storage.busy && !snapshot_find(key, key_len)) {
+        table_remove(entry);
+    }
+
+    log_maybe_compact();
+    return 0;
+}
+
+static int
+log_append(void)
+{
+    pthread_mutex_lock(&storage.lock);
+    int res = storage.error;
+    if (res == 0) {
+        size_t len = storage.pending.len;
+        res = ws_array_reserve(&storage.pending, len + storage.scratch.len);
+        if (res == 0) {
+            memcpy(storage.pending.data + len, storage.scratch.data,
+                   storage.scratch.len);
+            storage.pending.len += storage.scratch.len;
+            storage.pending_seq = ++storage.seq;
+            pthread_cond_signal(&storage.wake);
+        }
+    }
+    pthread_mutex_unlock(&storage.lock);
+
+    if (res == 0) {
+        ++storage.stats.writes;
+        storage.stats.log_size += storage.scratch.len;
+    }
+    return res;
+}
+
+static void
+log_maybe_compact(void)
+{
+    if (storage.busy) {
+        job_collect(false);
+        return;
+    }
+
+    // the log is mostly superseded changes
+    if ((storage.stats.log_size >= WS_STORAGE_COMPACT_MIN) &&
+            (storage.stats.log_size >= 2 * storage.live_size)) {
+        job_start();
+    }
+}
+
+static void
+job_run(
+    struct job* job
+) {
+    WS_TRACE_SCOPE("storage compaction");
+
+    job->result = snapshot_write(job);
+    if (job->result == 0) {
+        job->result = log_rotate(job);
+    } else {
+        job->log_cut = 0;
+    }
+}
+
+static int
+job_start(void)
+{
+    struct job* job = &storage.job;
+    *job = (struct job) {
+        .table_size = storage.table_size,
+        .seq = storage.seq,
+        .log_cut = storage.stats.log_size,
+    };
+
+    size_t keys_len = 0;
+    for (size_t i = 0; i < storage.table_size; ++i) {
+        if (storage.table[i].key) {
+            keys_len += storage.table[i].key_len + 1;
+        }
+    }
+    job->table = malloc(storage.table_size * sizeof(*job->table));
+    job->keys = malloc(keys_len + 1);
+    if (!job->table || !job->keys) {
+        free(job->table);
+        free(job->keys);
+        return -ENOMEM;
+    }
+    memcpy(job->table, storage.table, storage.table_size * sizeof(*job->table));
+
+    // the values are copied by reference, which is as good as a copy since
+    // values are not modified once they are stored
+    char* key = job->keys;
+    for (size_t i = 0; i < job->table_size; ++i) {
+        struct entry* entry = job->table + i;
+        if (!entry->key) {
+            continue;
+        }
+        memcpy(key, entry->key, entry->key_len + 1);
+        entry->key = key;
+        key += entry->key_len + 1;
+        ws_value_ref(entry->value);
+    }
+
+    // the committer stops for good once committing failed, it has to be
+    // checked under the lock the committer decides that with
+    pthread_mutex_lock(&storage.lock);
+    int res = storage.error;
+    if (res == 0) {
+        storage.busy = true;
+        storage.finished = false;
+        pthread_cond_signal(&storage.wake);
+    }
+    pthread_mutex_unlock(&storage.lock);
+
+    if (res < 0) {
+        job_release(job);
+    }
+    return res;
+}
+
+static int
+job_collect(
+    bool wait
+) {
+    pthread_mutex_lock(&storage.lock);
+    if (!storage.busy) {
+        pthread_mutex_unlock(&storage.lock);
+        return 0;
+    }
+    while (wait && !storage.finished) {
+        pthread_cond_wait(&storage.committed, &storage.lock);
+    }
+    bool finished = storage.finished;
+    if (finished) {
+        storage.busy = false;
+    }
+    pthread_mutex_unlock(&storage.lock);
+
+    if (!finished) {
+        return -EBUSY;
+    }
+    return job_finish(&storage.job);
+}
+
+static int
+job_finish(
+    struct job* job
+) {
+    // the changes up to the snapshot are gone from the log
+    storage.stats.log_size -= job->log_cut;
+
+    int res = job->result;
+    if (res == 0) {
+        // the new snapshot holds the entries, unless they changed since
+        struct ws_flat old = storage.snapshot;
+        res = snapshot_load();
+        if (res < 0) {
+            storage.snapshot = old;
+        } else {
+            ws_flat_close(&old);
+            table_prune(job->seq);
+        }
+    }
+
+    if (res < 0) {
+        // the entries are still in the table
+        ws_warn(&log_ctx, "writing a snapshot failed: %s", strerror(-res));
+    } else {
+        ++storage.stats.snapshots;
+        ws_debug(&log_ctx, "snapshot of %u keys written, %zu bytes",
+                 storage.snapshot.root->len, storage.snapshot.size);
+    }
+
+    job_release(job);
+    return res;
+}
+
+static void
+job_release(
+    struct job* job
+) {
+    for (size_t i = 0; i < job->table_size; ++i) {
+        if (job->table[i].key) {
+            ws_value_unref(job->table[i].value);
+        }
+    }
+    free(job->table);
+    free(job->keys);
+}
+
+static int
+snapshot_write(
+    struct job* job
+) {
+    struct ws_flat_builder builder;
+    int res = ws_flat_builder_init(&builder);
+    if (res == 0) {
+        res = snapshot_build(&builder, job);
+    }
+
+    // the snapshot replaces the old one atomically
+    if (res == 0) {
+        res = ws_file_replace(storage.dir_fd, SNAPSHOT_NAME, SNAPSHOT_TMP_NAME,
+                              builder.out.data, builder.out.len);
+    }
+    ws_flat_builder_deinit(&builder);
+    return res;
+}
+
+static int
+log_rotate(
+    struct job* job
+) {
+    struct stat st;
+    if (fstat(storage.log_fd, &st) < 0) {
+        job->log_cut = 0;
+        return -errno;
+    }
+    if ((uint64_t) st.st_size < job->log_cut) {
+        job->log_cut = 0;
+        return -EIO;
+    }
+
+    int fd = openat(storage.dir_fd, LOG_TMP_NAME,
+                    O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        job->log_cut = 0;
+        return -errno;
+    }
+
+    // changes made while the snapshot was written are carried over, a crash
+    // before the log is replaced only leaves changes which are skipped on
+    // replay
+    char buf[4096];
+    off_t pos = job->log_cut;
+    int res = 0;
+    while ((pos < st.st_size) && (res == 0)) {
+        ssize_t len = pread(storage.log_fd, buf, sizeof(buf), pos);
+        if (len < 0) {
+            res = errno == EINTR ? 0 : -errno;
+        } else if (len == 0) {
+            res = -EIO;
+        } else {
+            res = ws_file_write_all(fd, buf, len);
+            pos += len;
+        }
+    }
+
+    if ((res == 0) && (fsync(fd) < 0)) {
+        res = -errno;
+    }
+    if ((res == 0) && (renameat(storage.dir_fd, LOG_TMP_NAME,
+                                storage.dir_fd, LOG_NAME) < 0)) {
+        res = -errno;
+    }
+    if (res < 0) {
+        close(fd);
+        unlinkat(storage.dir_fd, LOG_TMP_NAME, 0);
+        job->log_cut = 0;
+        return res;
+    }
+
+    // the committer is the only one writing to the log
+    close(storage.log_fd);
+    storage.log_fd = fd;
+    if (fsync(storage.dir_fd) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int
+record_encode(
+    uint64_t seq,
+    enum record_op op,
+    char const* key,
+    size_t key_len,
+    struct ws_value value
+) {
+    struct ws_array* out = &storage.scratch;
+    out->len = 0;
+
+    size_t size = sizeof(struct record_header) + key_len;
+    int res = ws_array_reserve(out, size);
+    if (res < 0) {
+        return res;
+    }
+    memcpy(out->data + sizeof(struct record_header), key, key_len);
+    out->len = size;
+
+    if (op == RECORD_SET) {
+        res = ws_serialize_encode(WS_SERIALIZE_FORMAT_MSGPACK, value, out);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    struct record_header header = {
+        .seq = seq,
+        .size = out->len - sizeof(header),
+        .key_len = key_len,
+        .op = op,
+    };
+    memcpy(out->data, &header, sizeof(header));
+    header.crc = ws_crc32_update(0, out->data, out->len);
+    memcpy(out->data, &header, sizeof(header));
+    return 0;
+}
+
+static size_t
+records_replay(
+    char* buf,
+    size_t len,
+    uint64_t min_seq
+) {
+    size_t pos = 0;
+
+    while (len - pos >= sizeof(struct record_header)) {
+        struct record_header header;
+        memcpy(&header, buf + pos, sizeof(header));
+        if ((header.size > len - pos - sizeof(header)) ||
+                (header.key_len > header.size) ||
+                (header.key_len > WS_STORAGE_KEY_MAX)) {
+            break;
+        }
+
+        // the CRC is computed with the CRC field zeroed
+        uint32_t crc = header.crc;
+        header.crc = 0;
+        uint32_t check = ws_crc32_update(0, &header, sizeof(header));
+        char* payload = buf + pos + sizeof(header);
+        if (ws_crc32_update(check, payload, header.size) != crc) {
+            break;
+        }
+
+        size_t next = pos + sizeof(header) + header.size;
+        if (header.seq <= min_seq) {
+            pos = next;
+            continue;
+        }
+
+        char key[WS_STORAGE_KEY_MAX + 1];
+        memcpy(key, payload, header.key_len);
+        key[header.key_len] = '\0';
+
+        if (header.op == RECORD_SET) {
+            struct ws_value value;
+            ssize_t res = ws_serialize_decode_msgpack(payload + header.key_len,
+                                                      header.size -
+                                                      header.key_len, &value);
+            if ((res <= 0) || (table_set(key, header.key_len, value,
+                                         next - pos, header.seq) < 0)) {
+                break;
+            }
+        } else if (header.op == RECORD_DELETE) {
+            table_delete(key, header.key_len, header.seq);
+        } else {
+            break;
+        }
+
+        if (header.seq > storage.seq) {
+            storage.seq = header.seq;
+        }
+        ++storage.stats.replayed;
+        pos = next;
+    }
+
+    return pos;
+}
+
+static int
+snapshot_load(void)
+{
+    int fd = openat(storage.dir_fd, SNAPSHOT_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -errno;
+    }
+
+    // the mapping is used in place, nothing is decoded up front
+    int res = ws_flat_open(&storage.snapshot, fd);
+    close(fd);
+    if ((res == 0) && (storage.snapshot.root->type != WS_FLAT_TYPE_MAP)) {
+        ws_flat_close(&storage.snapshot);
+        res = -EINVAL;
+    }
+    if (res < 0) {
+        return res == -EINVAL ? -EIO : res;
+    }
+
+    storage.live_size = storage.snapshot.size;
+    return 0;
+}
+
+static int
+snapshot_build(
+    struct ws_flat_builder* builder,
+    struct job const* job
+) {
+    struct ws_array pairs;
+    ws_array_init(&pairs, sizeof(struct ws_flat_value));
+    struct ws_flat_value pair[2];
+    int res = 0;
+
+    struct ws_flat const* old = &storage.snapshot;
+    size_t count = 0;
+    struct ws_flat_value const* values = NULL;
+    if (old->root) {
+        values = ws_flat_values(old, old->root, &count);
+    }
+    for (size_t i = 0; (i < count) && (res == 0); i += 2) {
+        size_t key_len;
+        char const* key = ws_flat_string(old, values + i, &key_len);
+        if (!key) {
+            res = -EIO;
+            break;
+        }
+
+        // changed entries are taken from the table below
+        uint64_t hash = ws_string_hash_bytes(key, key_len);
+        if (table_slot(job->table, job->table_size, key, key_len,
+                       hash)->key) {
+            continue;
+        }
+
+        res = ws_flat_builder_string(builder, key, key_len, pair);
+        if (res == 0) {
+            res = ws_flat_builder_copy(builder, old, values + i + 1, pair + 1);
+        }
+        if (res == 0) {
+            res = ws_array_push(&pairs, pair);
+        }
+        if (res == 0) {
+            res = ws_array_push(&pairs, pair + 1);
+        }
+    }
+
+    for (size_t i = 0; (i < job->table_size) && (res == 0); ++i) {
+        struct entry const* entry = job->table + i;
+        if (!entry->key || entry->deleted) {
+            continue;
+        }
+
+        res = ws_flat_builder_string(builder, entry->key, entry->key_len,
+                                     pair);
+        if (res == 0) {
+            res = ws_flat_builder_value(builder, entry->value, pair + 1);
+        }
+        if (res == 0) {
+            res = ws_array_push(&pairs, pair);
+        }
+        if (res == 0) {
+            res = ws_array_push(&pairs, pair + 1);
+        }
+    }
+
+    struct ws_flat_value root;
+    if (res == 0) {
+        res = ws_flat_builder_map(builder, ws_array_at(&pairs, 0),
+                                  pairs.len / 2, &root);
+    }
+    if (res == 0) {
+        res = ws_flat_builder_finish(builder, &root, job->seq);
+    }
+    ws_array_deinit(&pairs);
+    return res;
+}
+
+static struct ws_flat_value const*
+snapshot_find(
+    char const* key,
+    size_t key_len
+) {
+    if (!storage.snapshot.root) {
+        return NULL;
+    }
+    return ws_flat_map_find_string(&storage.snapshot, storage.snapshot.root,
+                                   key, key_len);
+}
+
+static int
+log_load(void)
+{
+    storage.log_fd = openat(storage.dir_fd, LOG_NAME,
+                            O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (storage.log_fd < 0) {
+        return -errno;
+    }
+
+    size_t size;
+    char* data = map_file(storage.log_fd, &size);
+    if (data == MAP_FAILED) {
+        return -errno;
+    }
+    if (!data) {
+        return 0;
+    }
+
+    size_t valid = records_replay(data, size, storage.seq);
+    munmap(data, size);
+
+    if (valid < size) {
+        // a change which was being written when we went down
+        ws_warn(&log_ctx, "discarding %zu bytes at the end of the log",
+                size - valid);
+        if (ftruncate(storage.log_fd, valid) < 0) {
+            return -errno;
+        }
+    }
+    storage.stats.log_size = valid;
+    return 0;
+}
+
+static char*
+map_file(
+    int fd,
+    size_t* size
+) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return MAP_FAILED;
+    }
+
+    *size = st.st_size;
+    if (!*size) {
+        return NULL;
+    }
+    return mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+}
+
+static struct entry*
+table_slot(
+    struct entry* table,
+    size_t table_size,
+    char const* key,
+    size_t key_len,
+    uint64_t hash
+) {
+    size_t mask = table_size - 1;
+    size_t pos = hash & mask;
+    struct entry* entry;
+
+    while ((entry = table + pos)->key) {
+        if ((entry->hash == hash) && (entry->key_len == key_len) &&
+                (memcmp(entry->key, key, key_len) == 0)) {
+            break;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return entry;
+}
+
+static struct entry*
+table_insert(
+    char const* key,
+    size_t key_len
+) {
+    uint64_t hash = ws_string_hash_bytes(key, key_len);
+    struct entry* entry = table_slot(storage.table, storage.table_size, key,
+                                     key_len, hash);
+    if (entry->key) {
+        return entry;
+    }
+
+    // keep the load factor below one half
+    if ((storage.count + 1) * 2 > storage.table_size) {
+        struct entry* old = storage.table;
+        size_t old_size = storage.table_size;
+
+        storage.table = calloc(old_size * 2, sizeof(*storage.table));
+        if (!storage.table) {
+            storage.table = old;
+            return NULL;
+        }
+        storage.table_size = old_size * 2;
+
+        for (size_t i = 0; i < old_size; ++i) {
+            if (old[i].key) {
+                *table_slot(storage.table, storage.table_size, old[i].key,
+                            old[i].key_len, old[i].hash) = old[i];
+            }
+        }
+        free(old);
+        entry = table_slot(storage.table, storage.table_size, key, key_len,
+                           hash);
+    }
+
+    char* copy = malloc(key_len + 1);
+    if (!copy) {
+        return NULL;
+    }
+    memcpy(copy, key, key_len);
+    copy[key_len] = '\0';
+
+    *entry = (struct entry) {
+        .key = copy,
+        .key_len = key_len,
+        .hash = hash,
+        .deleted = true,
+    };
+    ++storage.count;
+    return entry;
+}
+
+static int
+table_set(
+    char const* key,
+    size_t key_len,
+    struct ws_value value,
+    size_t size,
+    uint64_t seq
+) {
+    struct entry* entry = table_insert(key, key_len);
+    if (!entry) {
+        ws_value_unref(value);
+        return -ENOMEM;
+    }
+
+    ws_value_unref(entry->value);
+    storage.live_size -= entry->size;
+    entry->value = value;
+    entry->size = size;
+    entry->seq = seq;
+    entry->deleted = false;
+    storage.live_size += size;
+    return 0;
+}
+
+static int
+table_delete(
+    char const* key,
+    size_t key_len,
+    uint64_t seq
+) {
+    if (snapshot_find(key, key_len)) {
+        // the entry has to stay, hiding the one in the snapshot
+        struct entry* entry = table_insert(key, key_len);
+        if (!entry) {
+            return -ENOMEM;
+        }
+        ws_value_unref(entry->value);
+        storage.live_size -= entry->size;
+        entry->value = ws_value_nil();
+        entry->size = 0;
+        entry->seq = seq;
+        entry->deleted = true;
+        return 0;
+    }
+
+    struct entry* entry = table_slot(storage.table, storage.table_size, key,
+                                     key_len,
+                                     ws_string_hash_bytes(key, key_len));
+    if (!entry->key) {
+        return -ENOENT;
+    }
+
+    storage.live_size -= entry->size;
+    table_remove(entry);
+    return 0;
+}
+
+static void
+table_remove(
+    struct entry* entry
+) {
+    free(entry->key);
+    ws_value_unref(entry->value);
+    --storage.count;
+
+    // shift back entries of the probe sequence, so lookups don't stop early
+    size_t mask = storage.table_size - 1;
+    size_t hole = entry - storage.table;
+    size_t pos = hole;
+    while (1) {
+        pos = (pos + 1) & mask;
+        struct entry* next = storage.table + pos;
+        if (!next->key) {
+            break;
+        }
+
+        size_t home = next->hash & mask;
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            storage.table[hole] = *next;
+            hole = pos;
+        }
+    }
+    storage.table[hole] = (struct entry) { .key = NULL };
+}
+
+static void
+table_prune(
+    uint64_t seq
+) {
+    struct entry* old = storage.table;
+    struct entry* pruned = calloc(storage.table_size, sizeof(*pruned));
+
+    // without memory, the entries stay, holding what the snapshot holds
+    if (pruned) {
+        storage.table = pruned;
+        storage.count = 0;
+        for (size_t i = 0; i < storage.table_size; ++i) {
+            struct entry* entry = old + i;
+            if (!entry->key) {
+                continue;
+            }
+            if (entry->seq <= seq) {
+                free(entry->key);
+                ws_value_unref(entry->value);
+                continue;
+            }
+            *table_slot(storage.table, storage.table_size, entry->key,
+                        entry->key_len, entry->hash) = *entry;
+            ++storage.count;
+        }
+        free(old);
+    }
+
+    for (size_t i = 0; i < storage.table_size; ++i) {
+        storage.live_size += storage.table[i].size;
+    }
+}
 
+static void
+table_clear(void)
+{
+    for (size_t i = 0; i < storage.table_size; ++i) {
+        struct entry* entry = storage.table + i;
+        if (entry->key) {
+            free(entry->key);
+            ws_value_unref(entry->value);
+        }
+    }
+    memset(storage.table, 0, storage.table_size * sizeof(*storage.table));
+    storage.count = 0;
+}
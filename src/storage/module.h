@@ -28,6 +28,159 @@
 #ifndef __WS_STORAGE_MODULE_H__
 #define __WS_STORAGE_MODULE_H__
 
+#include <stdint.h>
 
+#include "util/attributes.h"
+#include "values/value.h"
+
+/**
+ * @file module.h
+ *
+ * Persistent key/value storage
+ *
+ * The storage keeps values of user-defined keys across restarts. Each change
+ * is appended to a write-ahead log and held in memory. Once the log grows
+ * large compared to the data it describes, a new snapshot is written and the
+ * log is started over. This compaction happens in the background, on the
+ * thread committing the changes.
+ *
+ * Snapshots are flat images (see serialize/flat.h), which are mapped and read
+ * in place. On startup, only the changes logged after the snapshot are
+ * decoded, so startup time does not depend on the amount of data stored.
+ * Values which did not change since the snapshot are decoded when they are
+ * asked for.
+ *
+ * Changes are committed in groups: they are collected in memory and written
+ * and synced by a background thread, with one fsync for all changes which
+ * accumulated since the previous one. Storing a value hence never waits for
+ * the disk. A caller which needs a change to be durable calls
+ * ws_storage_sync().
+ *
+ * Except for ws_storage_sync(), the functions of the storage must only be
+ * called from one thread.
+ */
+
+/**
+ * Maximum length of a key
+ */
+#define WS_STORAGE_KEY_MAX 1024
+
+/**
+ * Minimum time between two syncs of the log, in milliseconds
+ *
+ * Changes made in between are committed together.
+ */
+#define WS_STORAGE_COMMIT_INTERVAL 5
+
+/**
+ * Minimum size of the log before it is compacted into a snapshot, in bytes
+ */
+#define WS_STORAGE_COMPACT_MIN (1 << 20)
+
+/**
+ * Counters of the storage
+ */
+struct ws_storage_stats {
+    uint64_t writes; //!< changes appended to the log
+    uint64_t commits; //!< syncs of the log, each committing a group of changes
+    uint64_t replayed; //!< changes replayed from the log on startup
+    uint64_t snapshots; //!< snapshots written
+    uint64_t log_size; //!< current size of the log, in bytes
+};
+
+/**
+ * Initialize the storage
+ *
+ * The storage lives in a directory, which is created if necessary. The latest
+ * snapshot is mapped, and the changes logged after it are replayed. Changes
+ * which were only partially written before a crash are discarded.
+ *
+ * @return 0 on success, -EIO if the snapshot is damaged, another negative
+ *         error number otherwise
+ */
+int
+ws_storage_init(
+    char const* path //!< Path of the storage directory
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize the storage
+ *
+ * All changes are committed before this function returns.
+ */
+void
+ws_storage_deinit(void);
+
+/**
+ * Get the value of a key
+ *
+ * @return 0 on success, -ENOENT if there is no such key, another negative
+ *         error number otherwise
+ */
+int
+ws_storage_get(
+    char const* key, //!< The key
+    struct ws_value* value //!< Location to store a reference on the value to
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Set the value of a key
+ *
+ * The value is copied if it lives in an arena. The change is visible right
+ * away, but only durable once committed.
+ *
+ * @return 0 on success, -EINVAL if the value can't be stored, another negative
+ *         error number otherwise, e.g. if committing earlier changes failed
+ */
+int
+ws_storage_set(
+    char const* key, //!< The key
+    struct ws_value value //!< The value
+)
+__ws_nonnull__(1);
+
+/**
+ * Remove a key
+ *
+ * @return 0 on success, -ENOENT if there is no such key, another negative
+ *         error number otherwise
+ */
+int
+ws_storage_delete(
+    char const* key //!< The key
+)
+__ws_nonnull__(1);
+
+/**
+ * Wait until all changes made so far are committed
+ *
+ * @return 0 on success, a negative error number if committing failed
+ */
+int
+ws_storage_sync(void);
+
+/**
+ * Write a snapshot and start the log over
+ *
+ * This happens automatically once the log grows too large, but may be useful
+ * before shutting down, to speed up the next startup. The snapshot is written
+ * by the committer thread, but the caller waits for it.
+ *
+ * @return 0 on success, -EINVAL if the storage is not initialized, another
+ *         negative error number otherwise
+ */
+int
+ws_storage_snapshot(void);
+
+/**
+ * Get the counters of the storage
+ */
+void
+ws_storage_get_stats(
+    struct ws_storage_stats* stats //!< Location to store the counters to
+)
+__ws_nonnull__(1);
 
 #endif // __WS_STORAGE_MODULE_H__
@@ -0,0 +1,163 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "util/arena.h"
+
+/**
+ * Move on to a chunk which can hold `size` bytes
+ *
+ * Chunks following the current one are reused if they are large enough.
+ * Otherwise, a new chunk is inserted after the current one.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+next_chunk(
+    struct ws_arena* self, //!< The arena
+    size_t size //!< Number of bytes needed
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+void
+ws_arena_init(
+    struct ws_arena* self,
+    size_t chunk_size
+) {
+    self->first = NULL;
+    self->current = NULL;
+    self->pos = NULL;
+    self->end = NULL;
+    if (chunk_size < WS_CACHELINE_SIZE) {
+        chunk_size = WS_CACHELINE_SIZE;
+    }
+    self->chunk_size = (chunk_size + WS_CACHELINE_SIZE - 1) &
+                       ~(size_t) (WS_CACHELINE_SIZE - 1);
+}
+
+void
+ws_arena_deinit(
+    struct ws_arena* self
+) {
+    struct ws_arena_chunk* chunk = self->first;
+    while (chunk) {
+        struct ws_arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    ws_arena_init(self, self->chunk_size);
+}
+
+void*
+ws_arena_alloc(
+    struct ws_arena* self,
+    size_t size
+) {
+    size = (size + WS_ARENA_ALIGNMENT - 1) & ~(size_t) (WS_ARENA_ALIGNMENT - 1);
+
+    if ((size_t) (self->end - self->pos) < size) {
+        if (next_chunk(self, size) < 0) {
+            return NULL;
+        }
+    }
+
+    void* mem = self->pos;
+    self->pos += size;
+    return mem;
+}
+
+bool
+ws_arena_owns(
+    struct ws_arena const* self,
+    void const* ptr
+) {
+    for (struct ws_arena_chunk* chunk = self->first; chunk;
+            chunk = chunk->next) {
+        if (((char const*) ptr >= chunk->data) &&
+                ((char const*) ptr < chunk->data + chunk->size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static int
+next_chunk(
+    struct ws_arena* self,
+    size_t size
+) {
+    struct ws_arena_chunk* chunk = self->current ? self->current->next
+                                                 : self->first;
+
+    // skip chunks from earlier rounds which are too small
+    while (chunk && (chunk->size < size)) {
+        chunk = chunk->next;
+    }
+
+    if (!chunk) {
+        size_t chunk_size = self->chunk_size;
+        while (chunk_size < size) {
+            chunk_size *= 2;
+        }
+
+        chunk = aligned_alloc(WS_CACHELINE_SIZE, sizeof(*chunk) + chunk_size);
+        if (!chunk) {
+            return -ENOMEM;
+        }
+        chunk->size = chunk_size;
+
+        // link in after the current chunk
+        if (self->current) {
+            chunk->next = self->current->next;
+            self->current->next = chunk;
+        } else {
+            chunk->next = self->first;
+            self->first = chunk;
+        }
+    }
+
+    self->current = chunk;
+    self->pos = chunk->data;
+    self->end = chunk->data + chunk->size;
+    return 0;
+}
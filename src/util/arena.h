@@ -0,0 +1,136 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __WS_UTIL_ARENA_H__
+#define __WS_UTIL_ARENA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util/attributes.h"
+
+/**
+ * Alignment of allocations from an arena
+ */
+#define WS_ARENA_ALIGNMENT 16
+
+/**
+ * A chunk of memory owned by an arena
+ */
+struct ws_arena_chunk {
+    struct ws_arena_chunk* next; //!< next chunk in the arena
+    size_t size; //!< size of `data`
+    WS_CACHELINE_ALIGNED char data[]; //!< the memory handed out
+};
+
+/**
+ * Bump allocator for short-lived allocations
+ *
+ * Memory is handed out by bumping a pointer through a list of chunks. There is
+ * no way to free an individual allocation. Instead, the whole arena is reset
+ * at once, which is O(1): the chunks are kept and reused from the start.
+ *
+ * An arena is not thread safe.
+ */
+struct ws_arena {
+    struct ws_arena_chunk* first; //!< first chunk
+    struct ws_arena_chunk* current; //!< chunk allocations are taken from
+    char* pos; //!< next free byte in the current chunk
+    char* end; //!< end of the current chunk
+    size_t chunk_size; //!< size of chunks allocated when running out of memory
+};
+
+/**
+ * Initialize an arena
+ *
+ * No memory is allocated until the first allocation. The chunk size is rounded
+ * up to a multiple of WS_CACHELINE_SIZE.
+ */
+void
+ws_arena_init(
+    struct ws_arena* self, //!< The arena to initialize
+    size_t chunk_size //!< Size of the chunks the arena allocates
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize an arena, freeing all its memory
+ */
+void
+ws_arena_deinit(
+    struct ws_arena* self //!< The arena to deinitialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Allocate memory from an arena
+ *
+ * The memory is aligned to WS_ARENA_ALIGNMENT and valid until the arena is
+ * reset or deinitialized.
+ *
+ * @return the memory or NULL if the allocation failed
+ */
+void*
+ws_arena_alloc(
+    struct ws_arena* self, //!< The arena to allocate from
+    size_t size //!< Number of bytes to allocate
+)
+__ws_nonnull__(1) __ws_malloc__ __ws_alloc_size__(2);
+
+/**
+ * Reset an arena
+ *
+ * All memory allocated from the arena becomes invalid. The chunks are kept
+ * for further allocations.
+ */
+static inline void
+ws_arena_reset(
+    struct ws_arena* self //!< The arena to reset
+) {
+    self->current = self->first;
+    if (self->first) {
+        self->pos = self->first->data;
+        self->end = self->first->data + self->first->size;
+    }
+}
+
+/**
+ * Check whether a pointer points into memory handed out by an arena
+ *
+ * This walks the chunks of the arena and is only meant for assertions.
+ *
+ * @return true if the memory is owned by the arena, false otherwise
+ */
+bool
+ws_arena_owns(
+    struct ws_arena const* self, //!< The arena
+    void const* ptr //!< The pointer to check
+)
+__ws_nonnull__(1);
+
+#endif // __WS_UTIL_ARENA_H__
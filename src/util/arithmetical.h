@@ -28,6 +28,37 @@
 #ifndef __WS_UTIL_ARITHMETICAL_H__
 #define __WS_UTIL_ARITHMETICAL_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Check whether a number is a power of two
+ *
+ * @return true if `n` is a power of two, false otherwise (also for zero)
+ */
+static inline bool
+ws_is_pow2(
+    size_t n //!< The number to check
+) {
+    return n && !(n & (n - 1));
+}
+
+/**
+ * Round a number up to the next power of two
+ *
+ * @return the smallest power of two which is greater or equal to `n`, 1 for 0
+ *         and 0 if the result is not representable
+ */
+static inline size_t
+ws_round_up_pow2(
+    size_t n //!< The number to round
+) {
+    size_t p = 1;
+    while (p && (p < n)) {
+        p <<= 1;
+    }
+    return p;
+}
 
 
 #endif // __WS_UTIL_ARITHMETICAL_H__
@@ -49,6 +49,14 @@
  *
  */
 
+/**
+ * Assumed size of a cache line, in bytes
+ *
+ * Data which is written by different threads concurrently should be placed at
+ * least this far apart to avoid false sharing.
+ */
+#define WS_CACHELINE_SIZE           64
+
 #ifdef __GNUC__
 
 #define __ws_always_inline__        __attribute__((always_inline))
@@ -69,19 +77,25 @@
 #define __ws_noreturn__             __attribute__((noreturn))
 #define __ws_unused__               __attribute__((unused))
 #define __ws_visibility__(x)        __attribute__((visibility(x)))
+#define __ws_aligned__(x)           __attribute__((aligned(x)))
+#define __ws_cleanup__(f)           __attribute__((cleanup(f)))
 
 #define __ws_vis_default__          __ws_visibility__(default)
 #define __ws_vis_hidden__           __ws_visibility__(hidden)
 #define __ws_vis_internal__         __ws_visibility__(internal)
 #define __ws_vis_protected__        __ws_visibility__(protected)
 
-#define __ws_alloc_size__(x,y)        __attribute__((alloc_size(x,y)))
-#define __ws_alloc_size__(x)          __attribute__((alloc_size(x)))
+#define __ws_alloc_size__(...)      __attribute__((alloc_size(__VA_ARGS__)))
 
 #define __ws_warn_unused_result__   __attribute__((warn_unused_result))
 
 #define WS_FORCE_INLINE             inline __ws_always_inline__
 
+#define WS_CACHELINE_ALIGNED        __ws_aligned__(WS_CACHELINE_SIZE)
+
+#define WS_LIKELY(x)                __builtin_expect(!!(x), 1)
+#define WS_UNLIKELY(x)              __builtin_expect(!!(x), 0)
+
 #else // __GNUC__
 
 #define __ws_always_inline__
@@ -102,18 +116,24 @@
 #define __ws_noreturn__
 #define __ws_unused__
 #define __ws_visibility__(x)
+#define __ws_aligned__(x)
+#define __ws_cleanup__(f)
 
 #define __ws_default__
 #define __ws_hidden__
 #define __ws_internal__
 #define __ws_protected__
 
-#define __ws_alloc_size__(x,y)
-#define __ws_alloc_size__(x)
+#define __ws_alloc_size__(...)
 
 #define __ws_warn_unused_result__
 
-#define R_FORCE_INLINE
+#define WS_FORCE_INLINE             inline
+
+#define WS_CACHELINE_ALIGNED
+
+#define WS_LIKELY(x)                (x)
+#define WS_UNLIKELY(x)              (x)
 
 #endif // __GNUC__
 
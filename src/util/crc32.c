@@ -0,0 +1,86 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+
+#include "util/crc32.h"
+
+/**
+ * Table for computing CRC-32, one entry per byte value
+ */
+static uint32_t crc_table[256];
+
+/**
+ * Guard of the initialization of the table
+ */
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Fill the table
+ */
+static void
+table_init(void);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+uint32_t
+ws_crc32_update(
+    uint32_t crc,
+    void const* data,
+    size_t len
+) {
+    pthread_once(&table_once, table_init);
+
+    unsigned char const* cur = data;
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *cur++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static void
+table_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        }
+        crc_table[i] = crc;
+    }
+}
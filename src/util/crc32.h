@@ -0,0 +1,50 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WS_UTIL_CRC32_H__
+#define __WS_UTIL_CRC32_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compute the CRC-32 of some data
+ *
+ * The CRC is the one of the reflected IEEE polynomial, as used by zlib. Data
+ * may be checksummed in pieces by passing the CRC of the preceding pieces,
+ * starting with zero.
+ *
+ * @return the updated CRC
+ */
+uint32_t
+ws_crc32_update(
+    uint32_t crc, //!< CRC of the preceding data
+    void const* data, //!< The data
+    size_t len //!< Size of the data
+);
+
+#endif // __WS_UTIL_CRC32_H__
@@ -28,6 +28,72 @@
 #ifndef __WS_UTIL_DEBUG_H__
 #define __WS_UTIL_DEBUG_H__
 
+#include "logger/module.h"
+#include "util/attributes.h"
 
+/**
+ * @file debug.h
+ *
+ * Logging macros
+ *
+ * Log statements in hot paths should use these macros rather than calling
+ * ws_log() directly. A statement
+ *
+ *      ws_debug(&log_ctx, "surface %zu damaged", index);
+ *
+ * does nothing at all if WS_LOG_DEBUG is below WS_LOG_COMPILE_LEVEL: the
+ * compiler removes it, yet still checks the arguments against the format.
+ * Otherwise, the statement boils down to a load and a branch which is
+ * predicted not to be taken. As ws_log() is cold, the compiler moves the
+ * evaluation of the arguments and the call out of line, away from the code
+ * around the statement.
+ */
+
+/**
+ * Least severe level of messages compiled in
+ *
+ * May be defined on the command line, e.g. -DWS_LOG_COMPILE_LEVEL=WS_LOG_WARN.
+ * Defaults to WS_LOG_INFO if NDEBUG is defined, WS_LOG_DEBUG otherwise.
+ */
+#ifndef WS_LOG_COMPILE_LEVEL
+#   ifdef NDEBUG
+#       define WS_LOG_COMPILE_LEVEL WS_LOG_INFO
+#   else
+#       define WS_LOG_COMPILE_LEVEL WS_LOG_DEBUG
+#   endif
+#endif
+
+/**
+ * Log a message, if its level is compiled in and currently enabled
+ *
+ * The arguments are only evaluated if the message is logged.
+ */
+#define ws_log_at(ctx, level, ...) \
+    do { \
+        if (((level) <= WS_LOG_COMPILE_LEVEL) && \
+                WS_UNLIKELY(ws_logger_enabled(level))) { \
+            ws_log((ctx), (level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+/**
+ * Log an error
+ */
+#define ws_error(ctx, ...)  ws_log_at((ctx), WS_LOG_ERROR, __VA_ARGS__)
+
+/**
+ * Log a warning
+ */
+#define ws_warn(ctx, ...)   ws_log_at((ctx), WS_LOG_WARN, __VA_ARGS__)
+
+/**
+ * Log an informational message
+ */
+#define ws_info(ctx, ...)   ws_log_at((ctx), WS_LOG_INFO, __VA_ARGS__)
+
+/**
+ * Log a debug message
+ */
+#define ws_debug(ctx, ...)  ws_log_at((ctx), WS_LOG_DEBUG, __VA_ARGS__)
 
 #endif // __WS_UTIL_DEBUG_H__
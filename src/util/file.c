@@ -0,0 +1,92 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "util/file.h"
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_file_write_all(
+    int fd,
+    void const* data,
+    size_t len
+) {
+    char const* cur = data;
+    while (len) {
+        ssize_t res = write(fd, cur, len);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        cur += res;
+        len -= res;
+    }
+    return 0;
+}
+
+int
+ws_file_replace(
+    int dir_fd,
+    char const* name,
+    char const* tmp_name,
+    void const* data,
+    size_t len
+) {
+    int fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0600);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    int res = ws_file_write_all(fd, data, len);
+    if ((res == 0) && (fsync(fd) < 0)) {
+        res = -errno;
+    }
+    close(fd);
+
+    if ((res == 0) && (renameat(dir_fd, tmp_name, dir_fd, name) < 0)) {
+        res = -errno;
+    }
+    if ((res == 0) && (fsync(dir_fd) < 0)) {
+        res = -errno;
+    }
+    if (res < 0) {
+        unlinkat(dir_fd, tmp_name, 0);
+    }
+    return res;
+}
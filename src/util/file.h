@@ -0,0 +1,69 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WS_UTIL_FILE_H__
+#define __WS_UTIL_FILE_H__
+
+#include <stddef.h>
+
+#include "util/attributes.h"
+
+/**
+ * Write a buffer completely
+ *
+ * Short writes are continued and interrupted ones retried.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_file_write_all(
+    int fd, //!< The file descriptor to write to
+    void const* data, //!< The data
+    size_t len //!< Size of the data
+);
+
+/**
+ * Replace a file by one holding a buffer, atomically and durably
+ *
+ * The buffer is written to a temporary file, which is synced and renamed over
+ * the file, and the directory is synced. If anything fails, the temporary file
+ * is removed and the file is left as it was, unless it was already replaced
+ * and only syncing the directory failed.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_file_replace(
+    int dir_fd, //!< The directory holding the file
+    char const* name, //!< Name of the file
+    char const* tmp_name, //!< Name of the temporary file
+    void const* data, //!< The data
+    size_t len //!< Size of the data
+)
+__ws_nonnull__(2, 3);
+
+#endif // __WS_UTIL_FILE_H__
@@ -0,0 +1,382 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util/pool.h"
+
+/**
+ * Initial number of slots of a deque
+ */
+#define DEQUE_INITIAL_SIZE 64
+
+/**
+ * The worker running on the current thread, NULL for other threads
+ */
+static _Thread_local struct ws_pool_worker* current_worker;
+
+/*
+ *
+ * Forward declarations
+ *
+ */
+
+/**
+ * Main function of a worker thread
+ */
+static void*
+worker_main(
+    void* arg //!< The worker
+);
+
+/**
+ * Find a task for a worker: from its own deque, or stolen from another one
+ *
+ * @return the task or NULL if there is none
+ */
+static struct ws_pool_task*
+worker_take(
+    struct ws_pool_worker* worker //!< The worker
+);
+
+/**
+ * Initialize a deque
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+deque_init(
+    struct ws_pool_deque* deque //!< The deque to initialize
+);
+
+/**
+ * Deinitialize a deque
+ */
+static void
+deque_deinit(
+    struct ws_pool_deque* deque //!< The deque to deinitialize
+);
+
+/**
+ * Push a task to the back of a deque
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+deque_push(
+    struct ws_pool_deque* deque, //!< The deque
+    struct ws_pool_task* task //!< The task
+);
+
+/**
+ * Pop a task from the back or the front of a deque
+ *
+ * @return the task or NULL if the deque is empty
+ */
+static struct ws_pool_task*
+deque_pop(
+    struct ws_pool_deque* deque, //!< The deque
+    bool front //!< Whether to take the oldest task instead of the newest
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_pool_init(
+    struct ws_pool* self,
+    size_t nworkers
+) {
+    if (!nworkers) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpus > 2 ? (size_t) ncpus - 1 : 1;
+    }
+
+    if (nworkers > SIZE_MAX / sizeof(*self->workers)) {
+        return -ENOMEM;
+    }
+
+    // the workers are cache line aligned, which calloc() doesn't guarantee;
+    // their size is a multiple of the alignment, as aligned_alloc() requires
+    size_t size = nworkers * sizeof(*self->workers);
+    self->workers = aligned_alloc(alignof(struct ws_pool_worker), size);
+    if (!self->workers) {
+        return -ENOMEM;
+    }
+    memset(self->workers, 0, size);
+
+    int res;
+    self->nworkers = nworkers;
+    atomic_init(&self->next, 0);
+    atomic_init(&self->pending, 0);
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->wake, NULL);
+    self->sleeping = 0;
+    self->stop = false;
+
+    // all deques must exist before the first worker goes stealing
+    for (size_t i = 0; i < nworkers; ++i) {
+        struct ws_pool_worker* worker = self->workers + i;
+        worker->pool = self;
+        worker->index = i;
+        res = deque_init(&worker->deque);
+        if (res < 0) {
+            while (i--) {
+                deque_deinit(&self->workers[i].deque);
+            }
+            goto cleanup;
+        }
+    }
+
+    for (size_t i = 0; i < nworkers; ++i) {
+        struct ws_pool_worker* worker = self->workers + i;
+        res = -pthread_create(&worker->thread, NULL, worker_main, worker);
+        if (res < 0) {
+            // the workers started so far see an empty pool with `stop` set
+            // and exit right away
+            pthread_mutex_lock(&self->lock);
+            self->stop = true;
+            pthread_cond_broadcast(&self->wake);
+            pthread_mutex_unlock(&self->lock);
+            for (size_t j = 0; j < i; ++j) {
+                pthread_join(self->workers[j].thread, NULL);
+            }
+            for (size_t j = 0; j < nworkers; ++j) {
+                deque_deinit(&self->workers[j].deque);
+            }
+            goto cleanup;
+        }
+    }
+
+    return 0;
+
+cleanup:
+    pthread_cond_destroy(&self->wake);
+    pthread_mutex_destroy(&self->lock);
+    free(self->workers);
+    self->workers = NULL;
+    self->nworkers = 0;
+    return res;
+}
+
+void
+ws_pool_deinit(
+    struct ws_pool* self
+) {
+    pthread_mutex_lock(&self->lock);
+    self->stop = true;
+    pthread_cond_broadcast(&self->wake);
+    pthread_mutex_unlock(&self->lock);
+
+    for (size_t i = 0; i < self->nworkers; ++i) {
+        pthread_join(self->workers[i].thread, NULL);
+    }
+    for (size_t i = 0; i < self->nworkers; ++i) {
+        deque_deinit(&self->workers[i].deque);
+    }
+
+    pthread_cond_destroy(&self->wake);
+    pthread_mutex_destroy(&self->lock);
+    free(self->workers);
+    self->workers = NULL;
+    self->nworkers = 0;
+}
+
+int
+ws_pool_submit(
+    struct ws_pool* self,
+    struct ws_pool_task* task
+) {
+    // tasks spawned by a task stay with its worker, where their data is hot
+    struct ws_pool_worker* worker = current_worker;
+    if (!worker || (worker->pool != self)) {
+        size_t next = atomic_fetch_add_explicit(&self->next, 1,
+                                                memory_order_relaxed);
+        worker = self->workers + next % self->nworkers;
+    }
+
+    int res = deque_push(&worker->deque, task);
+    if (res < 0) {
+        return res;
+    }
+
+    // counting under the lock makes sure no worker misses the wakeup between
+    // finding no task and going to sleep
+    pthread_mutex_lock(&self->lock);
+    atomic_fetch_add_explicit(&self->pending, 1, memory_order_relaxed);
+    if (self->sleeping) {
+        pthread_cond_signal(&self->wake);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return 0;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static void*
+worker_main(
+    void* arg
+) {
+    struct ws_pool_worker* worker = arg;
+    struct ws_pool* pool = worker->pool;
+    current_worker = worker;
+
+    while (true) {
+        struct ws_pool_task* task = worker_take(worker);
+        if (task) {
+            atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_relaxed);
+            task->run(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (!atomic_load_explicit(&pool->pending, memory_order_relaxed)) {
+            if (pool->stop) {
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+            ++pool->sleeping;
+            pthread_cond_wait(&pool->wake, &pool->lock);
+            --pool->sleeping;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    current_worker = NULL;
+    return NULL;
+}
+
+static struct ws_pool_task*
+worker_take(
+    struct ws_pool_worker* worker
+) {
+    struct ws_pool_task* task = deque_pop(&worker->deque, false);
+    if (task) {
+        return task;
+    }
+
+    struct ws_pool* pool = worker->pool;
+    for (size_t i = 1; i < pool->nworkers; ++i) {
+        size_t victim = (worker->index + i) % pool->nworkers;
+        task = deque_pop(&pool->workers[victim].deque, true);
+        if (task) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static int
+deque_init(
+    struct ws_pool_deque* deque
+) {
+    deque->tasks = malloc(sizeof(*deque->tasks) * DEQUE_INITIAL_SIZE);
+    if (!deque->tasks) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->mask = DEQUE_INITIAL_SIZE - 1;
+    deque->front = 0;
+    deque->back = 0;
+    return 0;
+}
+
+static void
+deque_deinit(
+    struct ws_pool_deque* deque
+) {
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->tasks);
+    deque->tasks = NULL;
+}
+
+static int
+deque_push(
+    struct ws_pool_deque* deque,
+    struct ws_pool_task* task
+) {
+    pthread_mutex_lock(&deque->lock);
+
+    size_t count = deque->back - deque->front;
+    if (count > deque->mask) {
+        // unroll the ring into a buffer twice the size
+        size_t size = (deque->mask + 1) * 2;
+        struct ws_pool_task** tasks = malloc(sizeof(*tasks) * size);
+        if (!tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return -ENOMEM;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            tasks[i] = deque->tasks[(deque->front + i) & deque->mask];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->mask = size - 1;
+        deque->front = 0;
+        deque->back = count;
+    }
+
+    deque->tasks[deque->back++ & deque->mask] = task;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+static struct ws_pool_task*
+deque_pop(
+    struct ws_pool_deque* deque,
+    bool front
+) {
+    struct ws_pool_task* task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->back != deque->front) {
+        if (front) {
+            task = deque->tasks[deque->front++ & deque->mask];
+        } else {
+            task = deque->tasks[--deque->back & deque->mask];
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
@@ -0,0 +1,136 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __WS_UTIL_POOL_H__
+#define __WS_UTIL_POOL_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util/attributes.h"
+
+/**
+ * A task to be run by a thread pool
+ *
+ * Tasks are intrusive: the structure is meant to be embedded in whatever
+ * describes the work. The pool doesn't allocate anything per task.
+ */
+struct ws_pool_task {
+    void (*run)(struct ws_pool_task*); //!< function running the task
+};
+
+/**
+ * Double ended queue of tasks of a worker
+ *
+ * The owning worker pushes and pops at the back, other workers steal from the
+ * front, so thieves take the oldest tasks, which are the least likely to be
+ * cache hot for the owner.
+ */
+struct ws_pool_deque {
+    pthread_mutex_t lock; //!< lock protecting the deque
+    struct ws_pool_task** tasks; //!< ring of tasks
+    size_t mask; //!< size of the ring - 1, the size being a power of two
+    size_t front; //!< position of the oldest task
+    size_t back; //!< position after the newest task
+};
+
+/**
+ * A worker of a thread pool
+ */
+struct ws_pool_worker {
+    struct ws_pool* pool; //!< the pool the worker belongs to
+    pthread_t thread; //!< the thread of the worker
+    size_t index; //!< index of the worker in the pool
+    WS_CACHELINE_ALIGNED struct ws_pool_deque deque; //!< tasks of the worker
+};
+
+/**
+ * Work stealing thread pool
+ *
+ * Every worker has a deque of tasks. Tasks submitted from outside the pool are
+ * spread over the workers round robin; tasks submitted by a task go to the
+ * deque of the worker running it. A worker which runs out of tasks steals
+ * from the others before it goes to sleep, so one long task doesn't hold up
+ * the ones queued behind it.
+ */
+struct ws_pool {
+    struct ws_pool_worker* workers; //!< the workers
+    size_t nworkers; //!< number of workers
+    atomic_size_t next; //!< worker the next submitted task goes to
+    atomic_size_t pending; //!< number of tasks queued, but not yet taken
+    pthread_mutex_t lock; //!< lock protecting the fields below
+    pthread_cond_t wake; //!< signalled when a task was submitted
+    size_t sleeping; //!< number of workers waiting for tasks
+    bool stop; //!< whether the workers should exit once idle
+};
+
+/**
+ * Initialize a thread pool and start its workers
+ *
+ * If `nworkers` is 0, one worker per online CPU but one is started, leaving
+ * one CPU to the thread submitting the tasks, and at least one worker.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_pool_init(
+    struct ws_pool* self, //!< The pool to initialize
+    size_t nworkers //!< Number of workers, 0 to pick one
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize a thread pool
+ *
+ * Tasks still queued are run before the workers exit. This function blocks
+ * until they did.
+ */
+void
+ws_pool_deinit(
+    struct ws_pool* self //!< The pool to deinitialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Submit a task to a thread pool
+ *
+ * This function may be called from any thread, including the workers. The
+ * task must stay valid until it ran.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_pool_submit(
+    struct ws_pool* self, //!< The pool
+    struct ws_pool_task* task //!< The task to run
+)
+__ws_nonnull__(1, 2);
+
+#endif // __WS_UTIL_POOL_H__
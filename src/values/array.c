@@ -0,0 +1,148 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "values/array.h"
+
+/**
+ * Get the array box of a value
+ *
+ * @return the array box
+ */
+static inline struct ws_value_array*
+get_array(
+    struct ws_value value //!< The value, which must be an array
+) {
+    return (struct ws_value_array*) ws_value_get_box(value);
+}
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_value_array_new(
+    size_t cap,
+    struct ws_value* value
+) {
+    struct ws_value_array* self;
+    self = (struct ws_value_array*) ws_value_box_new(sizeof(*self),
+                                                     WS_VALUE_TYPE_ARRAY);
+    if (!self) {
+        return -ENOMEM;
+    }
+
+    self->len = 0;
+    self->cap = 0;
+    self->values = NULL;
+    if (cap) {
+        self->values = ws_value_mem_alloc(&self->box,
+                                          cap * sizeof(*self->values));
+        if (!self->values) {
+            ws_value_mem_free(&self->box, self);
+            return -ENOMEM;
+        }
+        self->cap = cap;
+    }
+
+    *value = ws_value_from_box(&self->box);
+    return 0;
+}
+
+int
+ws_value_array_persist(
+    struct ws_value_array* self,
+    struct ws_value* value
+) {
+    int res = ws_value_array_new(self->len, value);
+    if (res < 0) {
+        return res;
+    }
+
+    for (size_t i = 0; i < self->len; ++i) {
+        res = ws_value_array_push(*value, self->values[i]);
+        if (res < 0) {
+            ws_value_unref(*value);
+            return res;
+        }
+    }
+    return 0;
+}
+
+void
+ws_value_array_free(
+    struct ws_value_array* self
+) {
+    for (size_t i = 0; i < self->len; ++i) {
+        ws_value_unref(self->values[i]);
+    }
+    free(self->values);
+    free(self);
+}
+
+int
+ws_value_array_push(
+    struct ws_value self,
+    struct ws_value elem
+) {
+    struct ws_value_array* array = get_array(self);
+
+    if (array->len == array->cap) {
+        size_t cap = array->cap ? array->cap * 2 : 4;
+        struct ws_value* values;
+        values = ws_value_mem_realloc(&array->box, array->values,
+                                      array->cap * sizeof(*values),
+                                      cap * sizeof(*values));
+        if (!values) {
+            return -ENOMEM;
+        }
+        array->values = values;
+        array->cap = cap;
+    }
+
+    int res = ws_value_store(&array->box, elem, array->values + array->len);
+    if (res < 0) {
+        return res;
+    }
+    ++array->len;
+    return 0;
+}
+
+struct ws_value const*
+ws_value_array_get(
+    struct ws_value self,
+    size_t* len
+) {
+    struct ws_value_array* array = get_array(self);
+    *len = array->len;
+    return array->values;
+}
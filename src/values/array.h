@@ -0,0 +1,115 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __WS_VALUES_ARRAY_H__
+#define __WS_VALUES_ARRAY_H__
+
+#include <stddef.h>
+
+#include "values/value.h"
+
+/**
+ * Boxed array of values
+ *
+ * The elements are stored contiguously. Objects of the wire protocols are
+ * arrays of named values, see ws_value_named_find().
+ */
+struct ws_value_array {
+    struct ws_value_box box; //!< box header
+    size_t len; //!< number of elements
+    size_t cap; //!< number of elements memory is allocated for
+    struct ws_value* values; //!< the elements
+};
+
+/**
+ * Create an empty array value
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_array_new(
+    size_t cap, //!< Number of elements to allocate memory for
+    struct ws_value* value //!< Location to store the value to
+)
+__ws_nonnull__(2);
+
+/**
+ * Replace an array living in an arena by a heap copy
+ *
+ * The elements are copied to the heap as well, if necessary.
+ *
+ * @note Only to be called by ws_value_persist()
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_array_persist(
+    struct ws_value_array* self, //!< The box to copy
+    struct ws_value* value //!< Location to store the copy to
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Free an array box, releasing all elements
+ *
+ * @note Only to be called by ws_value_unref()
+ */
+void
+ws_value_array_free(
+    struct ws_value_array* self //!< The box to free
+);
+
+/**
+ * Append a value to an array
+ *
+ * The array takes a reference on the element, or stores a heap copy of it if
+ * necessary (see ws_value_store()).
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_array_push(
+    struct ws_value self, //!< The array, which must be an array value
+    struct ws_value elem //!< The element to append
+);
+
+/**
+ * Get the elements of an array
+ *
+ * The elements are borrowed from the array.
+ *
+ * @return the elements
+ */
+struct ws_value const*
+ws_value_array_get(
+    struct ws_value self, //!< The array, which must be an array value
+    size_t* len //!< Location to store the number of elements to
+)
+__ws_nonnull__(2);
+
+#endif // __WS_VALUES_ARRAY_H__
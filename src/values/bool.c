@@ -25,5 +25,41 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #include "values/bool.h"
 
+/*
+ * External definitions of the inline functions, for callers which do not
+ * inline them
+ */
+
+extern inline struct ws_value
+ws_value_bool(
+    bool b
+);
+
+extern inline bool
+ws_value_bool_get(
+    struct ws_value self
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+bool
+ws_value_truthy(
+    struct ws_value self
+) {
+    switch (self.bits & WS_VALUE_TAG_MASK) {
+    case WS_VALUE_TAG_INT:
+    case WS_VALUE_TAG_BOOL:
+        // zero and false share the same payload
+        return self.bits >> WS_VALUE_TAG_BITS;
+
+    default:
+        return self.bits != 0;
+    }
+}
@@ -25,9 +25,51 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_VALUES_BOOL_H__
 #define __WS_VALUES_BOOL_H__
 
+#include <stdbool.h>
+
+#include "values/value.h"
+
+/**
+ * Create a boolean value
+ *
+ * @return the value
+ */
+inline struct ws_value
+ws_value_bool(
+    bool b //!< The boolean
+) {
+    return (struct ws_value) {
+        .bits = ((uint64_t) b << WS_VALUE_TAG_BITS) | WS_VALUE_TAG_BOOL
+    };
+}
 
+/**
+ * Get the boolean stored in a value
+ *
+ * @return the boolean, which is undefined if the value is not a boolean
+ */
+inline bool
+ws_value_bool_get(
+    struct ws_value self //!< The value, which must be a boolean
+) {
+    return self.bits >> WS_VALUE_TAG_BITS;
+}
+
+/**
+ * Interpret a value as a condition
+ *
+ * nil, false and zero are false, everything else is true.
+ *
+ * @return the truth value of the value
+ */
+bool
+ws_value_truthy(
+    struct ws_value self //!< The value to interpret
+)
+__ws_const__;
 
 #endif // __WS_VALUES_BOOL_H__
@@ -25,5 +25,41 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+
 #include "values/int.h"
 
+/*
+ * External definitions of the inline functions, for callers which do not
+ * inline them
+ */
+
+extern inline struct ws_value
+ws_value_int(
+    int64_t i
+);
+
+extern inline int64_t
+ws_value_int_get(
+    struct ws_value self
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_value_int_from(
+    intmax_t i,
+    struct ws_value* value
+) {
+    if ((i < WS_VALUE_INT_MIN) || (i > WS_VALUE_INT_MAX)) {
+        return -ERANGE;
+    }
+
+    *value = ws_value_int(i);
+    return 0;
+}
@@ -25,9 +25,64 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_VALUES_INT_H__
 #define __WS_VALUES_INT_H__
 
+#include <stdint.h>
+
+#include "values/value.h"
+
+/**
+ * Largest integer which can be stored in a value
+ */
+#define WS_VALUE_INT_MAX (INT64_MAX >> WS_VALUE_TAG_BITS)
+
+/**
+ * Smallest integer which can be stored in a value
+ */
+#define WS_VALUE_INT_MIN (INT64_MIN >> WS_VALUE_TAG_BITS)
 
+/**
+ * Create an integer value
+ *
+ * The integer must be in the range [WS_VALUE_INT_MIN, WS_VALUE_INT_MAX].
+ * Use ws_value_int_from() for integers which may be out of range.
+ *
+ * @return the value
+ */
+inline struct ws_value
+ws_value_int(
+    int64_t i //!< The integer
+) {
+    return (struct ws_value) {
+        .bits = ((uint64_t) i << WS_VALUE_TAG_BITS) | WS_VALUE_TAG_INT
+    };
+}
+
+/**
+ * Get the integer stored in a value
+ *
+ * @return the integer, which is undefined if the value is not an integer
+ */
+inline int64_t
+ws_value_int_get(
+    struct ws_value self //!< The value, which must be an integer
+) {
+    // arithmetic shift restores the sign
+    return (int64_t) self.bits >> WS_VALUE_TAG_BITS;
+}
+
+/**
+ * Create an integer value, checking the range
+ *
+ * @return 0 on success, -ERANGE if the integer cannot be stored in a value
+ */
+int
+ws_value_int_from(
+    intmax_t i, //!< The integer
+    struct ws_value* value //!< Location to store the value to
+)
+__ws_nonnull__(2);
 
 #endif // __WS_VALUES_INT_H__
@@ -25,5 +25,18 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #include "values/nil.h"
 
+/*
+ * External definitions of the inline functions, for callers which do not
+ * inline them
+ */
+
+extern inline struct ws_value
+ws_value_nil(void);
+
+extern inline bool
+ws_value_is_nil(
+    struct ws_value self
+);
@@ -25,9 +25,33 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_VALUES_NIL_H__
 #define __WS_VALUES_NIL_H__
 
+#include "values/value.h"
+
+/**
+ * Get the nil value
+ *
+ * @return nil
+ */
+inline struct ws_value
+ws_value_nil(void)
+{
+    return (struct ws_value) { .bits = 0 };
+}
 
+/**
+ * Check whether a value is nil
+ *
+ * @return true if the value is nil, false otherwise
+ */
+inline bool
+ws_value_is_nil(
+    struct ws_value self //!< The value to check
+) {
+    return !self.bits;
+}
 
 #endif // __WS_VALUES_NIL_H__
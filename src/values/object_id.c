@@ -25,5 +25,212 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "values/object_id.h"
 
+/*
+ *
+ * Forward declarations
+ *
+ */
+
+/**
+ * Take a slot for a new item, from the free list or a fresh one
+ *
+ * @return the index of the slot, a negative error number otherwise
+ */
+static int64_t
+slot_take(
+    struct ws_object_table* self //!< The table
+);
+
+/**
+ * Make sure the dense array can hold one more item
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+items_reserve(
+    struct ws_object_table* self //!< The table
+);
+
+/*
+ * External definitions of the inline functions, for callers which do not
+ * inline them
+ */
+
+extern inline struct ws_value
+ws_value_object_id(
+    uint64_t id
+);
+
+extern inline uint64_t
+ws_value_object_id_get(
+    struct ws_value self
+);
+
+extern inline void*
+ws_object_table_get(
+    struct ws_object_table const* self,
+    uint64_t id
+);
+
+extern inline void* const*
+ws_object_table_items(
+    struct ws_object_table const* self,
+    size_t* count
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+void
+ws_object_table_init(
+    struct ws_object_table* self
+) {
+    memset(self, 0, sizeof(*self));
+}
+
+void
+ws_object_table_deinit(
+    struct ws_object_table* self
+) {
+    free(self->slots);
+    free(self->items);
+    free(self->owners);
+    memset(self, 0, sizeof(*self));
+}
+
+int
+ws_object_table_insert(
+    struct ws_object_table* self,
+    void* item,
+    uint64_t* id
+) {
+    int res = items_reserve(self);
+    if (res < 0) {
+        return res;
+    }
+
+    int64_t index = slot_take(self);
+    if (index < 0) {
+        return (int) index;
+    }
+
+    struct ws_object_slot* slot = self->slots + index;
+    slot->link = self->nitems;
+    slot->item = item;
+    self->items[self->nitems] = item;
+    self->owners[self->nitems] = index;
+    ++self->nitems;
+
+    *id = ((uint64_t) slot->gen << WS_OBJECT_ID_INDEX_BITS) | index;
+    return 0;
+}
+
+int
+ws_object_table_remove(
+    struct ws_object_table* self,
+    uint64_t id
+) {
+    if (!ws_object_table_get(self, id)) {
+        return -ENOENT;
+    }
+
+    uint32_t index = (uint32_t) id;
+    struct ws_object_slot* slot = self->slots + index;
+
+    // move the last item into the hole
+    uint32_t pos = slot->link;
+    uint32_t last = --self->nitems;
+    self->items[pos] = self->items[last];
+    self->owners[pos] = self->owners[last];
+    self->slots[self->owners[pos]].link = pos;
+
+    slot->item = NULL;
+    if (slot->gen == WS_OBJECT_ID_GEN_MAX) {
+        // out of generations: the slot is never handed out again, so old ids
+        // cannot resolve to a new item
+        slot->gen = 0;
+        return 0;
+    }
+
+    ++slot->gen;
+    slot->link = self->free;
+    self->free = index + 1;
+    return 0;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static int64_t
+slot_take(
+    struct ws_object_table* self
+) {
+    if (self->free) {
+        uint32_t index = self->free - 1;
+        self->free = self->slots[index].link;
+        return index;
+    }
+
+    // the number of slots stays below 2^32, so `free` cannot overflow
+    if (self->nslots == self->slots_size) {
+        if (self->slots_size > UINT32_MAX / 2) {
+            return -ENOSPC;
+        }
+
+        uint32_t size = self->slots_size ? self->slots_size * 2 : 64;
+        struct ws_object_slot* slots;
+        slots = realloc(self->slots, sizeof(*slots) * size);
+        if (!slots) {
+            return -ENOMEM;
+        }
+        self->slots = slots;
+        self->slots_size = size;
+    }
+
+    // generation 0 is reserved for retired slots, so id 0 never resolves
+    struct ws_object_slot* slot = self->slots + self->nslots;
+    slot->gen = 1;
+    slot->link = 0;
+    slot->item = NULL;
+    return self->nslots++;
+}
+
+static int
+items_reserve(
+    struct ws_object_table* self
+) {
+    if (self->nitems < self->items_size) {
+        return 0;
+    }
+    if (self->items_size > UINT32_MAX / 2) {
+        return -ENOSPC;
+    }
+
+    uint32_t size = self->items_size ? self->items_size * 2 : 64;
+    void** items = realloc(self->items, sizeof(*items) * size);
+    if (!items) {
+        return -ENOMEM;
+    }
+    self->items = items;
+
+    uint32_t* owners = realloc(self->owners, sizeof(*owners) * size);
+    if (!owners) {
+        return -ENOMEM;
+    }
+    self->owners = owners;
+    self->items_size = size;
+    return 0;
+}
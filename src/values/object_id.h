@@ -25,9 +25,182 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_VALUES_OBJECT_ID_H__
 #define __WS_VALUES_OBJECT_ID_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/attributes.h"
+#include "values/value.h"
+
+/**
+ * Largest object id which can be stored in a value
+ */
+#define WS_VALUE_OBJECT_ID_MAX (UINT64_MAX >> WS_VALUE_TAG_BITS)
+
+/**
+ * Number of low bits of an object id holding the slot index
+ *
+ * The bits above hold the generation of the slot.
+ */
+#define WS_OBJECT_ID_INDEX_BITS 32
+
+/**
+ * Largest generation of a slot
+ */
+#define WS_OBJECT_ID_GEN_MAX (WS_VALUE_OBJECT_ID_MAX >> WS_OBJECT_ID_INDEX_BITS)
+
+/**
+ * Slot of an object table
+ *
+ * Slots are never moved or shrunk away, so an object id keeps pointing to the
+ * same slot. The generation is bumped each time the slot is vacated: ids
+ * handed out for earlier occupants carry an older generation and don't match
+ * any more.
+ */
+struct ws_object_slot {
+    uint32_t gen; //!< generation of the slot, 0 if it was retired
+    uint32_t link; //!< position in the dense array or next free slot
+    void* item; //!< the item, NULL if the slot is free
+};
+
+/**
+ * Table resolving object ids to items
+ *
+ * An object id is a slot index and the generation of the slot at the time
+ * the id was handed out. Resolving an id is an array access and a comparison,
+ * and stale ids are detected rather than resolving to whatever took their
+ * slot. Id 0 never resolves to an item.
+ *
+ * The items are also kept in a dense array, so iterating over them doesn't
+ * walk free slots. Removing an item moves the last one into its place.
+ *
+ * An object table is not thread safe. A zeroed table is an empty table.
+ */
+struct ws_object_table {
+    struct ws_object_slot* slots; //!< the slots, indexed by id
+    uint32_t nslots; //!< number of slots in use or on the free list
+    uint32_t slots_size; //!< capacity of `slots`
+    uint32_t free; //!< first free slot + 1, 0 if there is none
+    void** items; //!< the items, densely packed
+    uint32_t* owners; //!< slot of each of the items
+    uint32_t nitems; //!< number of items
+    uint32_t items_size; //!< capacity of `items` and `owners`
+};
 
+/**
+ * Create an object id value
+ *
+ * The id must not exceed WS_VALUE_OBJECT_ID_MAX.
+ *
+ * @return the value
+ */
+inline struct ws_value
+ws_value_object_id(
+    uint64_t id //!< The object id
+) {
+    return (struct ws_value) {
+        .bits = (id << WS_VALUE_TAG_BITS) | WS_VALUE_TAG_OBJECT_ID
+    };
+}
+
+/**
+ * Get the object id stored in a value
+ *
+ * @return the object id, which is undefined if the value is not an object id
+ */
+inline uint64_t
+ws_value_object_id_get(
+    struct ws_value self //!< The value, which must be an object id
+) {
+    return self.bits >> WS_VALUE_TAG_BITS;
+}
+
+/**
+ * Initialize an object table
+ */
+void
+ws_object_table_init(
+    struct ws_object_table* self //!< The table to initialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Deinitialize an object table
+ *
+ * The items are not touched.
+ */
+void
+ws_object_table_deinit(
+    struct ws_object_table* self //!< The table to deinitialize
+)
+__ws_nonnull__(1);
+
+/**
+ * Insert an item into an object table
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_object_table_insert(
+    struct ws_object_table* self, //!< The table
+    void* item, //!< The item, not NULL
+    uint64_t* id //!< Location to store the id of the item to
+)
+__ws_nonnull__(1, 2, 3);
+
+/**
+ * Remove an item from an object table
+ *
+ * The id, and any copy of it, is stale afterwards.
+ *
+ * @return 0 on success, -ENOENT if the id doesn't resolve to an item
+ */
+int
+ws_object_table_remove(
+    struct ws_object_table* self, //!< The table
+    uint64_t id //!< The id of the item
+)
+__ws_nonnull__(1);
+
+/**
+ * Resolve an object id
+ *
+ * @return the item or NULL if the id is stale or was never handed out
+ */
+inline void*
+ws_object_table_get(
+    struct ws_object_table const* self, //!< The table
+    uint64_t id //!< The id to resolve
+) {
+    uint32_t index = (uint32_t) id;
+    if (WS_UNLIKELY(index >= self->nslots)) {
+        return NULL;
+    }
+
+    struct ws_object_slot const* slot = self->slots + index;
+    if (slot->gen != (id >> WS_OBJECT_ID_INDEX_BITS)) {
+        return NULL;
+    }
+    return slot->item;
+}
+
+/**
+ * Get the items of an object table, densely packed
+ *
+ * The array is valid until the table is modified.
+ *
+ * @return the items, in no particular order
+ */
+inline void* const*
+ws_object_table_items(
+    struct ws_object_table const* self, //!< The table
+    size_t* count //!< Location to store the number of items to
+) {
+    *count = self->nitems;
+    return self->items;
+}
 
 #endif // __WS_VALUES_OBJECT_ID_H__
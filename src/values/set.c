@@ -25,5 +25,731 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "values/set.h"
 
+/**
+ * Control byte of an empty slot
+ */
+#define CTRL_EMPTY ((int8_t) -128)
+
+/**
+ * Control byte of a slot whose element was removed
+ */
+#define CTRL_DELETED ((int8_t) -2)
+
+/**
+ * Index returned by lookups which did not find anything
+ */
+#define NOT_FOUND ((size_t) -1)
+
+/**
+ * Minimum number of slots of a non-empty table
+ */
+#define MIN_CAPACITY WS_VALUE_SET_GROUP_WIDTH
+
+/**
+ * Get the set box of a value
+ *
+ * @return the set box
+ */
+static inline struct ws_value_set*
+get_set(
+    struct ws_value value //!< The value, which must be a set
+) {
+    return (struct ws_value_set*) ws_value_get_box(value);
+}
+
+/**
+ * Get the part of a hash selecting the position to start probing at
+ *
+ * @return the upper 57 bits of the hash
+ */
+static inline size_t
+h1(
+    uint64_t hash //!< The hash
+) {
+    return hash >> 7;
+}
+
+/**
+ * Get the part of a hash stored in the control bytes
+ *
+ * @return the lower 7 bits of the hash
+ */
+static inline int8_t
+h2(
+    uint64_t hash //!< The hash
+) {
+    return hash & 0x7f;
+}
+
+/**
+ * Match a group of control bytes against a byte
+ *
+ * @return a mask with bit i set if control byte i equals `byte`
+ */
+static inline uint32_t
+group_match(
+    int8_t const* ctrl, //!< The group of control bytes
+    int8_t byte //!< The byte to match
+);
+
+/**
+ * Match a group of control bytes against the empty and deleted markers
+ *
+ * @return a mask with bit i set if slot i is not occupied
+ */
+static inline uint32_t
+group_match_free(
+    int8_t const* ctrl //!< The group of control bytes
+);
+
+/**
+ * Set a control byte, keeping the mirrored bytes up to date
+ */
+static inline void
+set_ctrl(
+    struct ws_value_set* self, //!< The set
+    size_t pos, //!< The slot
+    int8_t byte //!< The new control byte
+);
+
+/**
+ * Find an element in a set
+ *
+ * @return the slot of the element or NOT_FOUND
+ */
+static size_t
+find(
+    struct ws_value_set const* self, //!< The set to search
+    struct ws_value elem, //!< The element to look for
+    uint64_t hash //!< The hash of the element
+);
+
+/**
+ * Find a slot an element with the hash can be placed in
+ *
+ * The set must have at least one free slot.
+ *
+ * @return the slot
+ */
+static size_t
+find_free(
+    struct ws_value_set const* self, //!< The set to search
+    uint64_t hash //!< The hash of the element to place
+);
+
+/**
+ * Allocate a fresh table for a set
+ *
+ * All slots are empty. The old table is not freed.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+alloc_table(
+    struct ws_value_set* self, //!< The set
+    size_t capacity //!< Number of slots, a power of two
+);
+
+/**
+ * Move all elements into a table with `capacity` slots
+ *
+ * This also gets rid of deleted slots.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+resize(
+    struct ws_value_set* self, //!< The set
+    size_t capacity //!< New number of slots, a power of two
+);
+
+/**
+ * Number of slots needed to hold `count` elements
+ *
+ * @return the capacity
+ */
+static size_t
+capacity_for(
+    size_t count //!< Number of elements
+);
+
+/**
+ * Create a set which is a copy of another set
+ *
+ * The table is copied as a whole, without rehashing.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+clone(
+    struct ws_value_set const* src, //!< The set to copy
+    struct ws_value* result //!< Location to store the copy to
+);
+
+/**
+ * Insert an element known not to be in the set
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+insert_new(
+    struct ws_value_set* self, //!< The set
+    struct ws_value elem, //!< The element to insert
+    uint64_t hash //!< The hash of the element
+);
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_value_set_new(
+    struct ws_value* value
+) {
+    struct ws_value_set* self;
+    self = (struct ws_value_set*) ws_value_box_new(sizeof(*self),
+                                                   WS_VALUE_TYPE_SET);
+    if (!self) {
+        return -ENOMEM;
+    }
+
+    self->count = 0;
+    self->capacity = 0;
+    self->growth_left = 0;
+    self->ctrl = NULL;
+    self->slots = NULL;
+    *value = ws_value_from_box(&self->box);
+    return 0;
+}
+
+int
+ws_value_set_persist(
+    struct ws_value_set* self,
+    struct ws_value* value
+) {
+    return clone(self, value);
+}
+
+void
+ws_value_set_free(
+    struct ws_value_set* self
+) {
+    for (size_t i = 0; i < self->capacity; ++i) {
+        if (self->ctrl[i] >= 0) {
+            ws_value_unref(self->slots[i]);
+        }
+    }
+    free(self->slots);
+    free(self);
+}
+
+int
+ws_value_set_insert(
+    struct ws_value self,
+    struct ws_value elem
+) {
+    struct ws_value_set* set = get_set(self);
+    uint64_t hash = ws_value_hash(elem);
+
+    if (find(set, elem, hash) != NOT_FOUND) {
+        return -EEXIST;
+    }
+    return insert_new(set, elem, hash);
+}
+
+int
+ws_value_set_remove(
+    struct ws_value self,
+    struct ws_value elem
+) {
+    struct ws_value_set* set = get_set(self);
+    size_t pos = find(set, elem, ws_value_hash(elem));
+    if (pos == NOT_FOUND) {
+        return -ENOENT;
+    }
+
+    ws_value_unref(set->slots[pos]);
+    set_ctrl(set, pos, CTRL_DELETED);
+    --set->count;
+    return 0;
+}
+
+bool
+ws_value_set_contains(
+    struct ws_value self,
+    struct ws_value elem
+) {
+    struct ws_value_set* set = get_set(self);
+    return find(set, elem, ws_value_hash(elem)) != NOT_FOUND;
+}
+
+size_t
+ws_value_set_count(
+    struct ws_value self
+) {
+    return get_set(self)->count;
+}
+
+int
+ws_value_set_reserve(
+    struct ws_value self,
+    size_t count
+) {
+    struct ws_value_set* set = get_set(self);
+    if (count <= set->count + set->growth_left) {
+        return 0;
+    }
+    return resize(set, capacity_for(count));
+}
+
+bool
+ws_value_set_next(
+    struct ws_value self,
+    size_t* pos,
+    struct ws_value* elem
+) {
+    struct ws_value_set* set = get_set(self);
+
+    while (*pos < set->capacity) {
+        // skip free slots a group at a time
+        uint32_t full = ~group_match_free(set->ctrl + *pos) &
+                        ((1u << WS_VALUE_SET_GROUP_WIDTH) - 1);
+        if (!full) {
+            *pos += WS_VALUE_SET_GROUP_WIDTH;
+            continue;
+        }
+
+        size_t slot = *pos + __builtin_ctz(full);
+        if (slot >= set->capacity) {
+            // we looked at the mirrored bytes
+            break;
+        }
+
+        *elem = set->slots[slot];
+        *pos = slot + 1;
+        return true;
+    }
+
+    *pos = set->capacity;
+    return false;
+}
+
+int
+ws_value_set_union(
+    struct ws_value self,
+    struct ws_value other,
+    struct ws_value* result
+) {
+    struct ws_value_set* a = get_set(self);
+    struct ws_value_set* b = get_set(other);
+
+    // start with a copy of the larger set, then add the smaller one
+    if (a->count < b->count) {
+        struct ws_value_set* tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    struct ws_value res_value;
+    int res = clone(a, &res_value);
+    if (res < 0) {
+        return res;
+    }
+    struct ws_value_set* res_set = get_set(res_value);
+
+    res = ws_value_set_reserve(res_value, a->count + b->count);
+    if (res < 0) {
+        goto cleanup;
+    }
+
+    size_t pos = 0;
+    struct ws_value elem;
+    while (ws_value_set_next(ws_value_from_box(&b->box), &pos, &elem)) {
+        uint64_t hash = ws_value_hash(elem);
+        if (find(res_set, elem, hash) == NOT_FOUND) {
+            res = insert_new(res_set, elem, hash);
+            if (res < 0) {
+                goto cleanup;
+            }
+        }
+    }
+
+    *result = res_value;
+    return 0;
+
+cleanup:
+    ws_value_unref(res_value);
+    return res;
+}
+
+int
+ws_value_set_intersection(
+    struct ws_value self,
+    struct ws_value other,
+    struct ws_value* result
+) {
+    struct ws_value_set* a = get_set(self);
+    struct ws_value_set* b = get_set(other);
+
+    // iterate the smaller set, probe the larger one
+    if (a->count > b->count) {
+        struct ws_value_set* tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    struct ws_value res_value;
+    int res = ws_value_set_new(&res_value);
+    if (res < 0) {
+        return res;
+    }
+    struct ws_value_set* res_set = get_set(res_value);
+
+    res = ws_value_set_reserve(res_value, a->count);
+    if (res < 0) {
+        goto cleanup;
+    }
+
+    size_t pos = 0;
+    struct ws_value elem;
+    while (ws_value_set_next(ws_value_from_box(&a->box), &pos, &elem)) {
+        uint64_t hash = ws_value_hash(elem);
+        if (find(b, elem, hash) != NOT_FOUND) {
+            res = insert_new(res_set, elem, hash);
+            if (res < 0) {
+                goto cleanup;
+            }
+        }
+    }
+
+    *result = res_value;
+    return 0;
+
+cleanup:
+    ws_value_unref(res_value);
+    return res;
+}
+
+int
+ws_value_set_difference(
+    struct ws_value self,
+    struct ws_value other,
+    struct ws_value* result
+) {
+    struct ws_value_set* a = get_set(self);
+    struct ws_value_set* b = get_set(other);
+    struct ws_value res_value;
+    size_t pos = 0;
+    struct ws_value elem;
+    int res;
+
+    if (b->count < a->count / 2) {
+        // few elements to remove: copy the table and drop them
+        res = clone(a, &res_value);
+        if (res < 0) {
+            return res;
+        }
+
+        while (ws_value_set_next(other, &pos, &elem)) {
+            ws_value_set_remove(res_value, elem);
+        }
+
+        *result = res_value;
+        return 0;
+    }
+
+    res = ws_value_set_new(&res_value);
+    if (res < 0) {
+        return res;
+    }
+    struct ws_value_set* res_set = get_set(res_value);
+
+    res = ws_value_set_reserve(res_value, a->count);
+    if (res < 0) {
+        goto cleanup;
+    }
+
+    while (ws_value_set_next(self, &pos, &elem)) {
+        uint64_t hash = ws_value_hash(elem);
+        if (find(b, elem, hash) == NOT_FOUND) {
+            res = insert_new(res_set, elem, hash);
+            if (res < 0) {
+                goto cleanup;
+            }
+        }
+    }
+
+    *result = res_value;
+    return 0;
+
+cleanup:
+    ws_value_unref(res_value);
+    return res;
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
+
+static inline uint32_t
+group_match(
+    int8_t const* ctrl,
+    int8_t byte
+) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((__m128i const*) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < WS_VALUE_SET_GROUP_WIDTH; ++i) {
+        mask |= (uint32_t) (ctrl[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline uint32_t
+group_match_free(
+    int8_t const* ctrl
+) {
+    // empty and deleted are the only control bytes with the sign bit set
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((__m128i const*) ctrl));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < WS_VALUE_SET_GROUP_WIDTH; ++i) {
+        mask |= (uint32_t) (ctrl[i] < 0) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline void
+set_ctrl(
+    struct ws_value_set* self,
+    size_t pos,
+    int8_t byte
+) {
+    self->ctrl[pos] = byte;
+    if (pos < WS_VALUE_SET_GROUP_WIDTH) {
+        self->ctrl[self->capacity + pos] = byte;
+    }
+}
+
+static size_t
+find(
+    struct ws_value_set const* self,
+    struct ws_value elem,
+    uint64_t hash
+) {
+    if (!self->count) {
+        return NOT_FOUND;
+    }
+
+    size_t mask = self->capacity - 1;
+    size_t pos = h1(hash) & mask;
+    size_t step = 0;
+
+    for (;;) {
+        int8_t const* group = self->ctrl + pos;
+
+        uint32_t match = group_match(group, h2(hash));
+        while (match) {
+            size_t slot = (pos + __builtin_ctz(match)) & mask;
+            if (ws_value_equal(self->slots[slot], elem)) {
+                return slot;
+            }
+            match &= match - 1;
+        }
+
+        // an empty slot ends every probe sequence the element could be on
+        if (group_match(group, CTRL_EMPTY)) {
+            return NOT_FOUND;
+        }
+
+        step += WS_VALUE_SET_GROUP_WIDTH;
+        pos = (pos + step) & mask;
+    }
+}
+
+static size_t
+find_free(
+    struct ws_value_set const* self,
+    uint64_t hash
+) {
+    size_t mask = self->capacity - 1;
+    size_t pos = h1(hash) & mask;
+    size_t step = 0;
+
+    for (;;) {
+        uint32_t match = group_match_free(self->ctrl + pos);
+        if (match) {
+            return (pos + __builtin_ctz(match)) & mask;
+        }
+
+        step += WS_VALUE_SET_GROUP_WIDTH;
+        pos = (pos + step) & mask;
+    }
+}
+
+static int
+alloc_table(
+    struct ws_value_set* self,
+    size_t capacity
+) {
+    size_t size = sizeof(*self->slots) * capacity +
+                  capacity + WS_VALUE_SET_GROUP_WIDTH;
+    struct ws_value* slots = ws_value_mem_alloc(&self->box, size);
+    if (!slots) {
+        return -ENOMEM;
+    }
+
+    self->slots = slots;
+    self->ctrl = (int8_t*) (slots + capacity);
+    self->capacity = capacity;
+    self->growth_left = capacity - capacity / 8;
+    memset(self->ctrl, (uint8_t) CTRL_EMPTY,
+           capacity + WS_VALUE_SET_GROUP_WIDTH);
+    return 0;
+}
+
+static int
+resize(
+    struct ws_value_set* self,
+    size_t capacity
+) {
+    struct ws_value* old_slots = self->slots;
+    int8_t const* old_ctrl = self->ctrl;
+    size_t old_capacity = self->capacity;
+
+    int res = alloc_table(self, capacity);
+    if (res < 0) {
+        return res;
+    }
+
+    // the elements are moved, so references stay as they are
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_ctrl[i] < 0) {
+            continue;
+        }
+
+        uint64_t hash = ws_value_hash(old_slots[i]);
+        size_t slot = find_free(self, hash);
+        self->slots[slot] = old_slots[i];
+        set_ctrl(self, slot, h2(hash));
+    }
+    self->growth_left -= self->count;
+
+    ws_value_mem_free(&self->box, old_slots);
+    return 0;
+}
+
+static size_t
+capacity_for(
+    size_t count
+) {
+    size_t capacity = MIN_CAPACITY;
+    while (capacity - capacity / 8 < count) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static int
+clone(
+    struct ws_value_set const* src,
+    struct ws_value* result
+) {
+    struct ws_value value;
+    int res = ws_value_set_new(&value);
+    if (res < 0) {
+        return res;
+    }
+
+    struct ws_value_set* self = get_set(value);
+    if (!src->count) {
+        *result = value;
+        return 0;
+    }
+
+    res = alloc_table(self, src->capacity);
+    if (res < 0) {
+        goto cleanup;
+    }
+
+    memcpy(self->ctrl, src->ctrl, src->capacity + WS_VALUE_SET_GROUP_WIDTH);
+    self->growth_left = src->growth_left;
+
+    for (size_t i = 0; i < src->capacity; ++i) {
+        if (src->ctrl[i] < 0) {
+            continue;
+        }
+
+        res = ws_value_store(&self->box, src->slots[i], self->slots + i);
+        if (res < 0) {
+            // slots we did not get to must not be released
+            for (size_t j = i; j < src->capacity; ++j) {
+                if (self->ctrl[j] >= 0) {
+                    set_ctrl(self, j, CTRL_DELETED);
+                }
+            }
+            goto cleanup;
+        }
+        ++self->count;
+    }
+
+    *result = value;
+    return 0;
+
+cleanup:
+    ws_value_unref(value);
+    return res;
+}
+
+static int
+insert_new(
+    struct ws_value_set* self,
+    struct ws_value elem,
+    uint64_t hash
+) {
+    if (!self->growth_left) {
+        // reclaim deleted slots if that makes enough room, grow otherwise
+        size_t capacity = self->capacity;
+        if (!capacity || (self->count * 2 > capacity - capacity / 8)) {
+            capacity = capacity ? capacity * 2 : MIN_CAPACITY;
+        }
+
+        int res = resize(self, capacity);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    size_t slot = find_free(self, hash);
+    int res = ws_value_store(&self->box, elem, self->slots + slot);
+    if (res < 0) {
+        return res;
+    }
+
+    if (self->ctrl[slot] == CTRL_EMPTY) {
+        --self->growth_left;
+    }
+    set_ctrl(self, slot, h2(hash));
+    ++self->count;
+    return 0;
+}
@@ -25,9 +25,195 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_VALUES_SET_H__
 #define __WS_VALUES_SET_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "values/value.h"
+
+/**
+ * Number of control bytes inspected at once while probing
+ */
+#define WS_VALUE_SET_GROUP_WIDTH 16
+
+/**
+ * Boxed set of values
+ *
+ * The set is an open addressing hash table in the style of Abseil's Swiss
+ * tables. Next to the slots, a control byte is kept per slot: either a marker
+ * for empty or deleted slots, or the lowest 7 bits of the hash of the element
+ * in the slot. Lookups compare a whole group of WS_VALUE_SET_GROUP_WIDTH
+ * control bytes against the hash with a few SSE2 instructions, and only touch
+ * slots whose control byte matches. The first WS_VALUE_SET_GROUP_WIDTH
+ * control bytes are mirrored behind the last one, so groups may be loaded
+ * from any position without wrapping around.
+ *
+ * The table is kept at most 7/8 full.
+ */
+struct ws_value_set {
+    struct ws_value_box box; //!< box header
+    size_t count; //!< number of elements
+    size_t capacity; //!< number of slots, zero or a power of two
+    size_t growth_left; //!< insertions possible before the table is resized
+    int8_t* ctrl; //!< control bytes, capacity + group width many
+    struct ws_value* slots; //!< the slots
+};
+
+/**
+ * Create an empty set value
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_set_new(
+    struct ws_value* value //!< Location to store the value to
+)
+__ws_nonnull__(1);
+
+/**
+ * Replace a set living in an arena by a heap copy
+ *
+ * The elements are copied to the heap as well, if necessary.
+ *
+ * @note Only to be called by ws_value_persist()
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_set_persist(
+    struct ws_value_set* self, //!< The box to copy
+    struct ws_value* value //!< Location to store the copy to
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Free a set box, releasing all elements
+ *
+ * @note Only to be called by ws_value_unref()
+ */
+void
+ws_value_set_free(
+    struct ws_value_set* self //!< The box to free
+);
+
+/**
+ * Insert a value into a set
+ *
+ * The set takes a reference on the element if it is inserted, or stores a
+ * heap copy of it if necessary (see ws_value_store()).
+ *
+ * @return 0 on success, -EEXIST if the element is already in the set, another
+ *         negative error number otherwise
+ */
+int
+ws_value_set_insert(
+    struct ws_value self, //!< The set, which must be a set value
+    struct ws_value elem //!< The element to insert
+);
+
+/**
+ * Remove a value from a set
+ *
+ * @return 0 on success, -ENOENT if the element was not in the set
+ */
+int
+ws_value_set_remove(
+    struct ws_value self, //!< The set, which must be a set value
+    struct ws_value elem //!< The element to remove
+);
+
+/**
+ * Check whether a value is in a set
+ *
+ * @return true if the element is in the set, false otherwise
+ */
+bool
+ws_value_set_contains(
+    struct ws_value self, //!< The set, which must be a set value
+    struct ws_value elem //!< The element to look for
+);
+
+/**
+ * Get the number of elements in a set
+ *
+ * @return the number of elements
+ */
+size_t
+ws_value_set_count(
+    struct ws_value self //!< The set, which must be a set value
+);
+
+/**
+ * Make sure a set can hold `count` elements without being resized
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_set_reserve(
+    struct ws_value self, //!< The set, which must be a set value
+    size_t count //!< Number of elements to make room for
+);
+
+/**
+ * Iterate over the elements of a set
+ *
+ * Initialize `pos` to zero and call this function until it returns false.
+ * The set must not be modified during the iteration. No reference is taken
+ * on the elements.
+ *
+ * @return true if an element was stored to `elem`, false at the end
+ */
+bool
+ws_value_set_next(
+    struct ws_value self, //!< The set, which must be a set value
+    size_t* pos, //!< Iteration state
+    struct ws_value* elem //!< Location to store the element to
+)
+__ws_nonnull__(2, 3);
+
+/**
+ * Compute the union of two sets
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_set_union(
+    struct ws_value self, //!< The first set
+    struct ws_value other, //!< The second set
+    struct ws_value* result //!< Location to store the new set to
+)
+__ws_nonnull__(3);
 
+/**
+ * Compute the intersection of two sets
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_set_intersection(
+    struct ws_value self, //!< The first set
+    struct ws_value other, //!< The second set
+    struct ws_value* result //!< Location to store the new set to
+)
+__ws_nonnull__(3);
+
+/**
+ * Compute the difference of two sets
+ *
+ * The resulting set contains the elements of `self` which are not in `other`.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_set_difference(
+    struct ws_value self, //!< The set to take elements from
+    struct ws_value other, //!< The set of elements to leave out
+    struct ws_value* result //!< Location to store the new set to
+)
+__ws_nonnull__(3);
 
 #endif // __WS_VALUES_SET_H__
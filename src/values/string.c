@@ -25,5 +25,171 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "values/string.h"
 
+/**
+ * Get the string box of a value
+ *
+ * @return the string box
+ */
+static inline struct ws_value_string*
+get_string(
+    struct ws_value value //!< The value, which must be a string
+) {
+    return (struct ws_value_string*) ws_value_get_box(value);
+}
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_value_string_new(
+    char const* str,
+    size_t len,
+    struct ws_value* value
+) {
+    struct ws_value_string* self;
+    self = (struct ws_value_string*) ws_value_box_new(sizeof(*self),
+                                                      WS_VALUE_TYPE_STRING);
+    if (!self) {
+        return -ENOMEM;
+    }
+    ws_string_init(&self->str);
+
+    if ((len >= WS_STRING_INLINE_SIZE) &&
+            (self->box.flags & WS_VALUE_BOX_ARENA)) {
+        // long strings in arenas live in the arena as well
+        char* buf = ws_value_mem_alloc(&self->box, len + 1);
+        if (!buf) {
+            return -ENOMEM;
+        }
+        memcpy(buf, str, len);
+        buf[len] = '\0';
+        ws_string_borrow(&self->str, buf, len);
+    } else {
+        int res = ws_string_set(&self->str, str, len);
+        if (res < 0) {
+            ws_value_mem_free(&self->box, self);
+            return res;
+        }
+    }
+
+    *value = ws_value_from_box(&self->box);
+    return 0;
+}
+
+int
+ws_value_string_new_borrowed(
+    char const* str,
+    size_t len,
+    struct ws_value* value
+) {
+    struct ws_value_string* self;
+    self = (struct ws_value_string*) ws_value_box_new(sizeof(*self),
+                                                      WS_VALUE_TYPE_STRING);
+    if (!self) {
+        return -ENOMEM;
+    }
+
+    ws_string_init(&self->str);
+    if (self->box.flags & WS_VALUE_BOX_ARENA) {
+        ws_string_borrow(&self->str, str, len);
+    } else {
+        // nothing tells heap values when the buffer goes away
+        int res = ws_string_set(&self->str, str, len);
+        if (res < 0) {
+            ws_value_mem_free(&self->box, self);
+            return res;
+        }
+    }
+    *value = ws_value_from_box(&self->box);
+    return 0;
+}
+
+int
+ws_value_string_new_interned(
+    char const* interned,
+    struct ws_value* value
+) {
+    struct ws_value_string* self;
+    self = (struct ws_value_string*) ws_value_box_new(sizeof(*self),
+                                                      WS_VALUE_TYPE_STRING);
+    if (!self) {
+        return -ENOMEM;
+    }
+
+    ws_string_init(&self->str);
+    ws_string_set_interned(&self->str, interned);
+    *value = ws_value_from_box(&self->box);
+    return 0;
+}
+
+int
+ws_value_string_persist(
+    struct ws_value_string* self,
+    struct ws_value* value
+) {
+    if (self->str.flags & WS_STRING_INTERNED) {
+        return ws_value_string_new_interned(self->str.ext.ptr, value);
+    }
+    return ws_value_string_new(ws_string_cstr(&self->str), self->str.len,
+                               value);
+}
+
+void
+ws_value_string_free(
+    struct ws_value_string* self
+) {
+    ws_string_deinit(&self->str);
+    free(self);
+}
+
+char const*
+ws_value_string_get(
+    struct ws_value self,
+    size_t* len
+) {
+    struct ws_string const* str = &get_string(self)->str;
+    if (len) {
+        *len = str->len;
+    }
+    return ws_string_cstr(str);
+}
+
+struct ws_string const*
+ws_value_string_get_string(
+    struct ws_value self
+) {
+    return &get_string(self)->str;
+}
+
+bool
+ws_value_string_equal(
+    struct ws_value self,
+    struct ws_value other
+) {
+    return ws_string_equal(&get_string(self)->str, &get_string(other)->str);
+}
+
+int
+ws_value_string_cmp(
+    struct ws_value self,
+    struct ws_value other
+) {
+    return ws_string_cmp(&get_string(self)->str, &get_string(other)->str);
+}
+
+uint64_t
+ws_value_string_hash(
+    struct ws_value self
+) {
+    return ws_string_hash(&get_string(self)->str);
+}
@@ -25,9 +25,152 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_VALUES_STRING_H__
 #define __WS_VALUES_STRING_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "objects/string.h"
+#include "values/value.h"
+
+/**
+ * Boxed string value
+ */
+struct ws_value_string {
+    struct ws_value_box box; //!< box header
+    struct ws_string str; //!< the string
+};
+
+/**
+ * Create a string value
+ *
+ * The string is copied.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_string_new(
+    char const* str, //!< The string
+    size_t len, //!< Length of the string, in bytes
+    struct ws_value* value //!< Location to store the value to
+)
+__ws_nonnull__(3);
 
+/**
+ * Create a string value borrowing a buffer
+ *
+ * If the value is allocated from an arena, it refers to the buffer without
+ * copying it. The buffer must be NUL-terminated and stay untouched until the
+ * arena is reset; ws_value_persist() copies it. Otherwise, the string is
+ * copied just like by ws_value_string_new().
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_string_new_borrowed(
+    char const* str, //!< The NUL-terminated buffer
+    size_t len, //!< Length of the string, in bytes
+    struct ws_value* value //!< Location to store the value to
+)
+__ws_nonnull__(1, 3);
+
+/**
+ * Create a string value referring to an interned string
+ *
+ * The string is not copied. Comparing two such values for equality is a
+ * pointer comparison.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_string_new_interned(
+    char const* interned, //!< The interned string
+    struct ws_value* value //!< Location to store the value to
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Replace a string living in an arena by a heap copy
+ *
+ * @note Only to be called by ws_value_persist()
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_string_persist(
+    struct ws_value_string* self, //!< The box to copy
+    struct ws_value* value //!< Location to store the copy to
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Free a string box
+ *
+ * @note Only to be called by ws_value_unref()
+ */
+void
+ws_value_string_free(
+    struct ws_value_string* self //!< The box to free
+);
+
+/**
+ * Get the string stored in a value
+ *
+ * @return the NUL-terminated string
+ */
+char const*
+ws_value_string_get(
+    struct ws_value self, //!< The value, which must be a string
+    size_t* len //!< Location to store the length to, may be NULL
+);
+
+/**
+ * Get the ws_string stored in a value
+ *
+ * @return the string
+ */
+struct ws_string const*
+ws_value_string_get_string(
+    struct ws_value self //!< The value, which must be a string
+);
+
+/**
+ * Check two string values for equality
+ *
+ * @return true if the strings are equal, false otherwise
+ */
+bool
+ws_value_string_equal(
+    struct ws_value self, //!< The string to compare
+    struct ws_value other //!< The string to compare with
+)
+__ws_pure__;
+
+/**
+ * Compare two string values
+ *
+ * @return less than, equal to or greater than zero if `self` is less than,
+ *         equal to or greater than `other`
+ */
+int
+ws_value_string_cmp(
+    struct ws_value self, //!< The string to compare
+    struct ws_value other //!< The string to compare with
+)
+__ws_pure__;
+
+/**
+ * Compute the hash of a string value
+ *
+ * @return the hash of the contents
+ */
+uint64_t
+ws_value_string_hash(
+    struct ws_value self //!< The value, which must be a string
+)
+__ws_pure__;
 
 #endif // __WS_VALUES_STRING_H__
@@ -25,5 +25,270 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "values/array.h"
+#include "values/set.h"
+#include "values/string.h"
 #include "values/value.h"
+#include "values/value_named.h"
+
+/**
+ * Arena boxes are allocated from by the current thread
+ */
+static _Thread_local struct ws_arena* current_arena;
+
+/**
+ * Get the arena an arena box was allocated from
+ *
+ * Arena boxes are preceded by a pointer to their arena, padded to
+ * WS_ARENA_ALIGNMENT.
+ *
+ * @return the arena of the box
+ */
+static inline struct ws_arena*
+box_arena(
+    struct ws_value_box const* box //!< The box, which must live in an arena
+) {
+    return *(struct ws_arena* const*) ((char const*) box - WS_ARENA_ALIGNMENT);
+}
+
+/**
+ * Mix the bits of a word
+ *
+ * @return the mixed word
+ */
+static uint64_t
+mix(
+    uint64_t x //!< The word to mix
+)
+__ws_const__;
+
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+struct ws_arena*
+ws_value_use_arena(
+    struct ws_arena* arena
+) {
+    struct ws_arena* prev = current_arena;
+    current_arena = arena;
+    return prev;
+}
+
+struct ws_value_box*
+ws_value_box_new(
+    size_t size,
+    enum ws_value_type type
+) {
+    struct ws_value_box* box;
+
+    if (current_arena) {
+        char* mem = ws_arena_alloc(current_arena, WS_ARENA_ALIGNMENT + size);
+        if (!mem) {
+            return NULL;
+        }
+        *(struct ws_arena**) mem = current_arena;
+        box = (struct ws_value_box*) (mem + WS_ARENA_ALIGNMENT);
+    } else {
+        box = malloc(size);
+        if (!box) {
+            return NULL;
+        }
+    }
+
+    box->type = type;
+    box->flags = current_arena ? WS_VALUE_BOX_ARENA : 0;
+    atomic_init(&box->refcount, 1);
+    return box;
+}
+
+void*
+ws_value_mem_alloc(
+    struct ws_value_box const* box,
+    size_t size
+) {
+    if (box->flags & WS_VALUE_BOX_ARENA) {
+        return ws_arena_alloc(box_arena(box), size);
+    }
+    return malloc(size);
+}
+
+void*
+ws_value_mem_realloc(
+    struct ws_value_box const* box,
+    void* mem,
+    size_t old_size,
+    size_t size
+) {
+    if (!(box->flags & WS_VALUE_BOX_ARENA)) {
+        return realloc(mem, size);
+    }
+
+    // arenas cannot grow allocations in place
+    void* new_mem = ws_arena_alloc(box_arena(box), size);
+    if (new_mem && mem) {
+        memcpy(new_mem, mem, old_size < size ? old_size : size);
+    }
+    return new_mem;
+}
+
+void
+ws_value_mem_free(
+    struct ws_value_box const* box,
+    void* mem
+) {
+    if (!(box->flags & WS_VALUE_BOX_ARENA)) {
+        free(mem);
+    }
+}
+
+int
+ws_value_persist(
+    struct ws_value* value
+) {
+    if (!ws_value_in_arena(*value)) {
+        ws_value_ref(*value);
+        return 0;
+    }
+
+    // copies have to go to the heap, no matter which arena is selected
+    struct ws_arena* arena = ws_value_use_arena(NULL);
+    struct ws_value_box* box = ws_value_get_box(*value);
+    int res = -EINVAL;
+
+    switch (box->type) {
+    case WS_VALUE_TYPE_STRING:
+        res = ws_value_string_persist((struct ws_value_string*) box, value);
+        break;
+
+    case WS_VALUE_TYPE_SET:
+        res = ws_value_set_persist((struct ws_value_set*) box, value);
+        break;
+
+    case WS_VALUE_TYPE_NAMED:
+        res = ws_value_named_persist((struct ws_value_named*) box, value);
+        break;
+
+    case WS_VALUE_TYPE_ARRAY:
+        res = ws_value_array_persist((struct ws_value_array*) box, value);
+        break;
+
+    default:
+        // scalars are never boxed
+        break;
+    }
+
+    ws_value_use_arena(arena);
+    return res;
+}
+
+int
+ws_value_store(
+    struct ws_value_box const* box,
+    struct ws_value value,
+    struct ws_value* slot
+) {
+    if (box->flags & WS_VALUE_BOX_ARENA) {
+        // the container dies with the arena, so it may reference anything
+        *slot = ws_value_ref(value);
+        return 0;
+    }
+
+    *slot = value;
+    return ws_value_persist(slot);
+}
+
+void
+ws_value_unref(
+    struct ws_value self
+) {
+    if (!ws_value_is_boxed(self)) {
+        return;
+    }
+
+    struct ws_value_box* box = ws_value_get_box(self);
+    if (box->flags & WS_VALUE_BOX_ARENA) {
+        return;
+    }
+
+    if (atomic_fetch_sub_explicit(&box->refcount, 1,
+                                  memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    switch (box->type) {
+    case WS_VALUE_TYPE_STRING:
+        ws_value_string_free((struct ws_value_string*) box);
+        break;
+
+    case WS_VALUE_TYPE_SET:
+        ws_value_set_free((struct ws_value_set*) box);
+        break;
+
+    case WS_VALUE_TYPE_NAMED:
+        ws_value_named_free((struct ws_value_named*) box);
+        break;
+
+    case WS_VALUE_TYPE_ARRAY:
+        ws_value_array_free((struct ws_value_array*) box);
+        break;
+
+    default:
+        // scalars are never boxed
+        break;
+    }
+}
+
+bool
+ws_value_equal(
+    struct ws_value self,
+    struct ws_value other
+) {
+    if (self.bits == other.bits) {
+        return true;
+    }
+
+    if ((ws_value_get_type(self) != WS_VALUE_TYPE_STRING) ||
+            (ws_value_get_type(other) != WS_VALUE_TYPE_STRING)) {
+        return false;
+    }
+
+    return ws_value_string_equal(self, other);
+}
+
+uint64_t
+ws_value_hash(
+    struct ws_value self
+) {
+    if (ws_value_get_type(self) == WS_VALUE_TYPE_STRING) {
+        return ws_value_string_hash(self);
+    }
+    return mix(self.bits);
+}
+
+/*
+ *
+ * Internal implementation
+ *
+ */
 
+static uint64_t
+mix(
+    uint64_t x
+) {
+    // finalizer of MurmurHash3
+    x ^= x >> 33;
+    x *= UINT64_C(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    x *= UINT64_C(0xc4ceb9fe1a85ec53);
+    x ^= x >> 33;
+    return x;
+}
@@ -25,9 +25,333 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_VALUES_VALUE_H__
 #define __WS_VALUES_VALUE_H__
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/arena.h"
+#include "util/attributes.h"
+
+/**
+ * Types of values
+ */
+enum ws_value_type {
+    WS_VALUE_TYPE_NIL, //!< no value
+    WS_VALUE_TYPE_BOOL, //!< boolean, stored inline
+    WS_VALUE_TYPE_INT, //!< integer, stored inline
+    WS_VALUE_TYPE_OBJECT_ID, //!< object id, stored inline
+    WS_VALUE_TYPE_STRING, //!< string, boxed
+    WS_VALUE_TYPE_SET, //!< set of values, boxed
+    WS_VALUE_TYPE_NAMED, //!< value with a name, boxed
+    WS_VALUE_TYPE_ARRAY, //!< sequence of values, boxed
+};
+
+/**
+ * A value
+ *
+ * A value is a single tagged 64 bit word. The lowest WS_VALUE_TAG_BITS bits
+ * hold the tag, see enum ws_value_tag. Scalars are stored inline in the
+ * remaining bits, so they never touch the allocator. Everything else lives in
+ * a reference counted box (struct ws_value_box) the word points to. Boxes are
+ * at least 8 byte aligned, which leaves the low bits of their address free
+ * for the tag.
+ *
+ * The all-zero word is nil, so zero-initialized values are valid.
+ *
+ * Values are passed around by value. Copying the word does not copy or
+ * reference a box; use ws_value_ref() and ws_value_unref() for that.
+ */
+struct ws_value {
+    uint64_t bits; //!< the tagged word
+};
+
+/**
+ * Number of bits used for the tag
+ */
+#define WS_VALUE_TAG_BITS 3
+
+/**
+ * Mask extracting the tag from a value
+ */
+#define WS_VALUE_TAG_MASK ((UINT64_C(1) << WS_VALUE_TAG_BITS) - 1)
+
+/**
+ * Tags of values
+ */
+enum ws_value_tag {
+    WS_VALUE_TAG_BOX = 0, //!< pointer to a box, or nil if all bits are zero
+    WS_VALUE_TAG_INT = 1, //!< integer in the upper bits
+    WS_VALUE_TAG_BOOL = 2, //!< boolean in the upper bits
+    WS_VALUE_TAG_OBJECT_ID = 3, //!< object id in the upper bits
+};
+
+/**
+ * Flags of boxes
+ */
+enum ws_value_box_flags {
+    /**
+     * The box lives in an arena
+     *
+     * Arena boxes are not reference counted. They, and all memory they own,
+     * vanish when the arena is reset.
+     */
+    WS_VALUE_BOX_ARENA = 1 << 0,
+};
+
+/**
+ * Header of boxed values
+ *
+ * Each boxed value type embeds this header as its first member.
+ */
+struct ws_value_box {
+    uint16_t type; //!< type of the boxed value, see enum ws_value_type
+    uint16_t flags; //!< flags, see enum ws_value_box_flags
+    atomic_uint refcount; //!< number of references to the box
+};
+
+/**
+ * Get the type of a value
+ *
+ * @return the type of the value
+ */
+static inline enum ws_value_type
+ws_value_get_type(
+    struct ws_value self //!< The value
+) {
+    static enum ws_value_type const types[] = {
+        [WS_VALUE_TAG_INT] = WS_VALUE_TYPE_INT,
+        [WS_VALUE_TAG_BOOL] = WS_VALUE_TYPE_BOOL,
+        [WS_VALUE_TAG_OBJECT_ID] = WS_VALUE_TYPE_OBJECT_ID,
+    };
+
+    uint64_t tag = self.bits & WS_VALUE_TAG_MASK;
+    if (tag != WS_VALUE_TAG_BOX) {
+        return types[tag];
+    }
+    if (!self.bits) {
+        return WS_VALUE_TYPE_NIL;
+    }
+    return ((struct ws_value_box*) (uintptr_t) self.bits)->type;
+}
+
+/**
+ * Check whether a value is boxed
+ *
+ * @return true if the value points to a box, false if it is a scalar
+ */
+static inline bool
+ws_value_is_boxed(
+    struct ws_value self //!< The value
+) {
+    return self.bits && !(self.bits & WS_VALUE_TAG_MASK);
+}
+
+/**
+ * Get the box of a boxed value
+ *
+ * @return the box the value points to
+ */
+static inline struct ws_value_box*
+ws_value_get_box(
+    struct ws_value self //!< The value, which must be boxed
+) {
+    return (struct ws_value_box*) (uintptr_t) self.bits;
+}
+
+/**
+ * Create a value referring to a box
+ *
+ * The reference count of the box is not touched.
+ *
+ * @return the value
+ */
+static inline struct ws_value
+ws_value_from_box(
+    struct ws_value_box* box //!< The box
+) {
+    return (struct ws_value) { .bits = (uintptr_t) box };
+}
+
+/**
+ * Select the arena boxes are allocated from
+ *
+ * While an arena is selected, all boxes created by the calling thread are
+ * allocated from it, instead of from the heap. This is meant for transient
+ * values which die with the command creating them, e.g. intermediate results
+ * in the command processor. Pass NULL to allocate from the heap again.
+ *
+ * Arena values must not outlive a reset of the arena. Containers allocated
+ * from the heap take care of that themselves: they store heap copies of arena
+ * values put into them. Anything else which keeps values around has to call
+ * ws_value_persist() on them.
+ *
+ * @return the arena selected before
+ */
+struct ws_arena*
+ws_value_use_arena(
+    struct ws_arena* arena //!< The arena to allocate boxes from
+);
+
+/**
+ * Allocate and initialize a box
+ *
+ * The box is allocated from the selected arena or the heap. The header is
+ * initialized with a reference count of one; the rest of the box is
+ * uninitialized.
+ *
+ * @return the box or NULL if the allocation failed
+ */
+struct ws_value_box*
+ws_value_box_new(
+    size_t size, //!< Size of the box, including the header
+    enum ws_value_type type //!< Type of the boxed value
+)
+__ws_malloc__;
+
+/**
+ * Allocate memory owned by a box
+ *
+ * The memory is allocated from the same place as the box itself.
+ *
+ * @return the memory or NULL if the allocation failed
+ */
+void*
+ws_value_mem_alloc(
+    struct ws_value_box const* box, //!< The box owning the memory
+    size_t size //!< Number of bytes to allocate
+)
+__ws_nonnull__(1);
+
+/**
+ * Resize memory owned by a box
+ *
+ * @return the resized memory or NULL if the allocation failed
+ */
+void*
+ws_value_mem_realloc(
+    struct ws_value_box const* box, //!< The box owning the memory
+    void* mem, //!< The memory to resize, may be NULL
+    size_t old_size, //!< Current size of the memory
+    size_t size //!< New size of the memory
+)
+__ws_nonnull__(1);
+
+/**
+ * Free memory owned by a box
+ *
+ * This is a no-op for boxes living in an arena.
+ */
+void
+ws_value_mem_free(
+    struct ws_value_box const* box, //!< The box owning the memory
+    void* mem //!< The memory to free
+)
+__ws_nonnull__(1);
+
+/**
+ * Make sure a value does not live in an arena
+ *
+ * If the value is boxed in an arena, it is replaced by a deep copy on the
+ * heap. Otherwise, the value is left alone. Either way, the caller ends up
+ * owning one reference on a value which outlives arena resets.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_persist(
+    struct ws_value* value //!< The value to persist
+)
+__ws_nonnull__(1);
 
+/**
+ * Store a reference to a value in a box
+ *
+ * If the value lives in an arena but the box does not, a heap copy of the
+ * value is stored. Otherwise, the value is referenced.
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_store(
+    struct ws_value_box const* box, //!< The box storing the value
+    struct ws_value value, //!< The value to store
+    struct ws_value* slot //!< Location to store the value to
+)
+__ws_nonnull__(1, 3);
+
+/**
+ * Check whether a value lives in an arena
+ *
+ * @return true if the value is boxed in an arena, false otherwise
+ */
+static inline bool
+ws_value_in_arena(
+    struct ws_value self //!< The value
+) {
+    return ws_value_is_boxed(self) &&
+           (ws_value_get_box(self)->flags & WS_VALUE_BOX_ARENA);
+}
+
+/**
+ * Take a reference on a value
+ *
+ * This is a no-op for scalars.
+ *
+ * @return the value
+ */
+static inline struct ws_value
+ws_value_ref(
+    struct ws_value self //!< The value to reference
+) {
+    if (ws_value_is_boxed(self)) {
+        atomic_fetch_add_explicit(&ws_value_get_box(self)->refcount, 1,
+                                  memory_order_relaxed);
+    }
+    return self;
+}
+
+/**
+ * Release a reference on a value
+ *
+ * The box is freed if this was the last reference. This is a no-op for
+ * scalars and values living in an arena.
+ */
+void
+ws_value_unref(
+    struct ws_value self //!< The value to release
+);
+
+/**
+ * Compare two values for equality
+ *
+ * Scalars are equal if they have the same type and value, strings if they
+ * have the same contents. Other boxed values are only equal to themselves.
+ *
+ * @return true if the values are equal, false otherwise
+ */
+bool
+ws_value_equal(
+    struct ws_value self, //!< The value to compare
+    struct ws_value other //!< The value to compare with
+)
+__ws_pure__;
+
+/**
+ * Compute a hash of a value
+ *
+ * Values which are equal according to ws_value_equal() have the same hash.
+ *
+ * @return the hash
+ */
+uint64_t
+ws_value_hash(
+    struct ws_value self //!< The value to hash
+)
+__ws_pure__;
 
 #endif // __WS_VALUES_VALUE_H__
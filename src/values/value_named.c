@@ -25,5 +25,91 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "objects/string.h"
+#include "values/nil.h"
 #include "values/value_named.h"
 
+/*
+ *
+ * Interface implementation
+ *
+ */
+
+int
+ws_value_named_new(
+    char const* name,
+    struct ws_value value,
+    struct ws_value* named
+) {
+    char const* interned = ws_string_intern(name, strlen(name));
+    if (!interned) {
+        return -ENOMEM;
+    }
+
+    struct ws_value_named* self;
+    self = (struct ws_value_named*) ws_value_box_new(sizeof(*self),
+                                                     WS_VALUE_TYPE_NAMED);
+    if (!self) {
+        return -ENOMEM;
+    }
+
+    self->name = interned;
+    int res = ws_value_store(&self->box, value, &self->value);
+    if (res < 0) {
+        ws_value_mem_free(&self->box, self);
+        return res;
+    }
+
+    *named = ws_value_from_box(&self->box);
+    return 0;
+}
+
+int
+ws_value_named_persist(
+    struct ws_value_named* self,
+    struct ws_value* value
+) {
+    return ws_value_named_new(self->name, self->value, value);
+}
+
+void
+ws_value_named_free(
+    struct ws_value_named* self
+) {
+    ws_value_unref(self->value);
+    free(self);
+}
+
+char const*
+ws_value_named_get_name(
+    struct ws_value self
+) {
+    return ((struct ws_value_named*) ws_value_get_box(self))->name;
+}
+
+struct ws_value
+ws_value_named_get_value(
+    struct ws_value self
+) {
+    return ((struct ws_value_named*) ws_value_get_box(self))->value;
+}
+
+struct ws_value
+ws_value_named_find(
+    struct ws_value const* values,
+    size_t count,
+    char const* name
+) {
+    for (size_t i = 0; i < count; ++i) {
+        if ((ws_value_get_type(values[i]) == WS_VALUE_TYPE_NAMED) &&
+                (ws_value_named_get_name(values[i]) == name)) {
+            return ws_value_named_get_value(values[i]);
+        }
+    }
+    return ws_value_nil();
+}
@@ -25,9 +25,103 @@
  * along with waysome. If not, see <http://www.gnu.org/licenses/>.
  */
 
+
 #ifndef __WS_VALUES_VALUE_NAMED_H__
 #define __WS_VALUES_VALUE_NAMED_H__
 
+#include <stddef.h>
+
+#include "values/value.h"
+
+/**
+ * Boxed value with a name
+ *
+ * Named values are used for keyword arguments and for the members of
+ * structured values.
+ */
+struct ws_value_named {
+    struct ws_value_box box; //!< box header
+    char const* name; //!< the name, interned
+    struct ws_value value; //!< the value
+};
+
+/**
+ * Create a named value
+ *
+ * The name is interned and the value is stored as described for
+ * ws_value_store().
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_named_new(
+    char const* name, //!< The name
+    struct ws_value value, //!< The value
+    struct ws_value* named //!< Location to store the named value to
+)
+__ws_nonnull__(1, 3);
+
+/**
+ * Replace a named value living in an arena by a heap copy
+ *
+ * @note Only to be called by ws_value_persist()
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+int
+ws_value_named_persist(
+    struct ws_value_named* self, //!< The box to copy
+    struct ws_value* value //!< Location to store the copy to
+)
+__ws_nonnull__(1, 2);
+
+/**
+ * Free a named value box, releasing the value
+ *
+ * @note Only to be called by ws_value_unref()
+ */
+void
+ws_value_named_free(
+    struct ws_value_named* self //!< The box to free
+);
 
+/**
+ * Get the name of a named value
+ *
+ * @return the name, which is an interned string
+ */
+char const*
+ws_value_named_get_name(
+    struct ws_value self //!< The value, which must be a named value
+);
+
+/**
+ * Get the value of a named value
+ *
+ * No reference is taken.
+ *
+ * @return the value
+ */
+struct ws_value
+ws_value_named_get_value(
+    struct ws_value self //!< The value, which must be a named value
+);
+
+/**
+ * Find a named value by name
+ *
+ * Since names are interned, this is a pointer comparison per value. Values
+ * which are not named values are skipped.
+ *
+ * @return the value of the first named value with the name or nil if there is
+ *         none. No reference is taken.
+ */
+struct ws_value
+ws_value_named_find(
+    struct ws_value const* values, //!< The values to search
+    size_t count, //!< Number of values
+    char const* name //!< The name to look for, interned
+)
+__ws_nonnull__(3);
 
 #endif // __WS_VALUES_VALUE_NAMED_H__
@@ -0,0 +1,265 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file compositor.c
+ *
+ * Smoke test of the compositor, running on the headless backend
+ *
+ * Surfaces are filled with solid colors, so the framebuffer tells which
+ * surface ended up where, and which pixels were repainted.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "compositor/module.h"
+
+/**
+ * Size of the output
+ */
+#define OUTPUT_SIZE 16
+
+/**
+ * Color the compositor fills uncovered parts of the output with
+ */
+#define BACKGROUND 0xFF000000u
+
+/**
+ * Check a condition, failing the test if it doesn't hold
+ */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+/**
+ * Framebuffer of the headless backend in use
+ */
+static struct ws_framebuffer const* fb;
+
+/**
+ * Set up the compositor with a fresh headless backend
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+setup(void)
+{
+    struct ws_compositor_backend* backend;
+    backend = ws_compositor_backend_headless_new(OUTPUT_SIZE, OUTPUT_SIZE);
+    CHECK(backend);
+    CHECK(ws_compositor_init(backend) == 0);
+    fb = &backend->fb;
+    return 0;
+}
+
+/**
+ * Fill pixels with a color
+ */
+static void
+fill(
+    uint32_t* pixels, //!< The pixels
+    size_t count, //!< Number of pixels
+    uint32_t color //!< The color
+) {
+    while (count--) {
+        *pixels++ = color;
+    }
+}
+
+/**
+ * Count the pixels of the output within a rectangle which have a color
+ *
+ * @return the number of pixels
+ */
+static size_t
+count_color(
+    struct ws_rect const* rect, //!< The rectangle
+    uint32_t color //!< The color
+) {
+    size_t count = 0;
+    for (int32_t y = rect->y; y < rect->y + rect->height; ++y) {
+        for (int32_t x = rect->x; x < rect->x + rect->width; ++x) {
+            count += fb->pixels[y * fb->stride + x] == color;
+        }
+    }
+    return count;
+}
+
+/**
+ * Get a pixel of the output
+ *
+ * @return the pixel
+ */
+static uint32_t
+pixel(
+    int32_t x, //!< Column of the pixel
+    int32_t y //!< Row of the pixel
+) {
+    return fb->pixels[y * fb->stride + x];
+}
+
+/**
+ * The first frame repaints everything, later ones only what was damaged
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+test_first_frame(void)
+{
+    CHECK(setup() == 0);
+
+    struct ws_rect output = { 0, 0, OUTPUT_SIZE, OUTPUT_SIZE };
+    CHECK(ws_compositor_repaint() == OUTPUT_SIZE * OUTPUT_SIZE);
+    CHECK(count_color(&output, BACKGROUND) == OUTPUT_SIZE * OUTPUT_SIZE);
+
+    CHECK(ws_compositor_repaint() == 0);
+    struct ws_compositor_stats stats;
+    ws_compositor_get_stats(&stats);
+    CHECK(stats.frames == 1);
+    CHECK(stats.frames_skipped == 1);
+
+    CHECK(ws_compositor_damage_all() == 0);
+    CHECK(ws_compositor_repaint() == OUTPUT_SIZE * OUTPUT_SIZE);
+
+    ws_compositor_deinit();
+    return 0;
+}
+
+/**
+ * Only damaged pixels of a surface are recomposited
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+test_damage(void)
+{
+    CHECK(setup() == 0);
+    CHECK(ws_compositor_repaint() > 0);
+
+    uint32_t pixels[4 * 4];
+    fill(pixels, 16, 0xFFFF0000u);
+    struct ws_buffer* buffer = ws_buffer_wrap(pixels, 4, 4, 4 * 4);
+    CHECK(buffer);
+
+    struct ws_rect geometry = { 2, 2, 4, 4 };
+    struct ws_surface* surface = ws_compositor_surface_new(&geometry);
+    CHECK(surface);
+    ws_surface_attach(surface, buffer);
+    ws_buffer_unref(buffer);
+
+    CHECK(ws_surface_damage(surface, &(struct ws_rect) { 0, 0, 4, 4 }) == 0);
+    CHECK(ws_compositor_repaint() == 16);
+    CHECK(count_color(&geometry, 0xFFFF0000u) == 16);
+    CHECK(pixel(1, 1) == BACKGROUND);
+    CHECK(pixel(6, 6) == BACKGROUND);
+
+    // the client redraws everything, but only reports one pixel
+    fill(pixels, 16, 0xFF00FF00u);
+    CHECK(ws_surface_damage(surface, &(struct ws_rect) { 1, 1, 1, 1 }) == 0);
+    CHECK(ws_compositor_repaint() == 1);
+    CHECK(pixel(3, 3) == 0xFF00FF00u);
+    CHECK(count_color(&geometry, 0xFFFF0000u) == 15);
+
+    // damage outside of the surface is clipped away
+    CHECK(ws_surface_damage(surface, &(struct ws_rect) { 8, 8, 2, 2 }) == 0);
+    CHECK(ws_compositor_repaint() == 0);
+
+    ws_compositor_surface_destroy(surface);
+    CHECK(ws_compositor_repaint() == 16);
+    CHECK(count_color(&geometry, BACKGROUND) == 16);
+
+    ws_compositor_deinit();
+    return 0;
+}
+
+/**
+ * Moving and restacking surfaces repaints the areas involved
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+test_stacking(void)
+{
+    CHECK(setup() == 0);
+
+    uint32_t red[4 * 4];
+    uint32_t blue[4 * 4];
+    fill(red, 16, 0xFFFF0000u);
+    fill(blue, 16, 0xFF0000FFu);
+
+    struct ws_surface* surfaces[2];
+    struct ws_rect geometry[2] = { { 0, 0, 4, 4 }, { 2, 2, 4, 4 } };
+    uint32_t* contents[2] = { red, blue };
+    for (int i = 0; i < 2; ++i) {
+        struct ws_buffer* buffer = ws_buffer_wrap(contents[i], 4, 4, 4 * 4);
+        CHECK(buffer);
+        surfaces[i] = ws_compositor_surface_new(geometry + i);
+        CHECK(surfaces[i]);
+        ws_surface_attach(surfaces[i], buffer);
+        ws_buffer_unref(buffer);
+        CHECK(ws_surface_damage(surfaces[i],
+                                &(struct ws_rect) { 0, 0, 4, 4 }) == 0);
+    }
+    CHECK(ws_compositor_repaint() == OUTPUT_SIZE * OUTPUT_SIZE);
+
+    // the surface created last is on top
+    CHECK(pixel(0, 0) == 0xFFFF0000u);
+    CHECK(pixel(3, 3) == 0xFF0000FFu);
+    CHECK(pixel(5, 5) == 0xFF0000FFu);
+
+    CHECK(ws_compositor_raise(surfaces[0]) == 0);
+    CHECK(ws_compositor_repaint() == 16);
+    CHECK(pixel(3, 3) == 0xFFFF0000u);
+    CHECK(pixel(5, 5) == 0xFF0000FFu);
+
+    // the old and the new area are repainted, nothing else
+    struct ws_rect moved = { 10, 10, 4, 4 };
+    CHECK(ws_surface_set_geometry(surfaces[0], &moved) == 0);
+    CHECK(ws_compositor_repaint() == 32);
+    CHECK(pixel(0, 0) == BACKGROUND);
+    CHECK(pixel(3, 3) == 0xFF0000FFu);
+    CHECK(count_color(&moved, 0xFFFF0000u) == 16);
+
+    ws_compositor_deinit();
+    return 0;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+    failed += test_first_frame();
+    failed += test_damage();
+    failed += test_stacking();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file session.c
+ *
+ * Test of the session manager, which keeps the session in a fresh temporary
+ * directory
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // mkdtemp()
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "session/manager.h"
+#include "values/int.h"
+
+/**
+ * Check a condition, failing the test if it doesn't hold
+ */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+/**
+ * Remove a session directory along with the files in it
+ */
+static void
+session_remove(
+    char const* path //!< Path of the directory
+) {
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] != '.') {
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+/**
+ * Update a workspace and write a checkpoint holding the update
+ *
+ * @return 0 on success, a negative error number otherwise
+ */
+static int
+checkpoint(
+    int64_t workspace //!< The workspace, which is also its state
+) {
+    int res = ws_session_update(WS_SESSION_WORKSPACES, ws_value_int(workspace),
+                                ws_value_int(workspace));
+    if (res < 0) {
+        return res;
+    }
+
+    // the second call waits for the checkpoint the first one handed over
+    for (int i = 0; i < 2; ++i) {
+        while ((res = ws_session_checkpoint()) == -EBUSY) {
+            usleep(100);
+        }
+        if (res < 0) {
+            return res;
+        }
+    }
+    return 0;
+}
+
+/**
+ * A damaged checkpoint is discarded along with the ones following it
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+test_damaged(void)
+{
+    char path[] = "/tmp/ws-test-session-XXXXXX";
+    CHECK(mkdtemp(path));
+    CHECK(ws_session_init(path) == 0);
+
+    char log[sizeof(path) + 16];
+    snprintf(log, sizeof(log), "%s/checkpoints", path);
+    CHECK(checkpoint(1) == 0);
+    struct stat st;
+    CHECK(stat(log, &st) == 0);
+    CHECK(checkpoint(2) == 0);
+    CHECK(checkpoint(3) == 0);
+    ws_session_deinit();
+
+    // flip a bit within the image of the second checkpoint
+    int fd = open(log, O_RDWR);
+    CHECK(fd >= 0);
+    char byte;
+    CHECK(pread(fd, &byte, 1, st.st_size + 32) == 1);
+    byte ^= 0x10;
+    CHECK(pwrite(fd, &byte, 1, st.st_size + 32) == 1);
+    close(fd);
+
+    CHECK(ws_session_init(path) == 0);
+    struct ws_session_stats stats;
+    ws_session_get_stats(&stats);
+    CHECK(stats.replayed == 1);
+    CHECK(ws_session_restore(WS_SESSION_WORKSPACES, ws_value_int(1)));
+    CHECK(!ws_session_restore(WS_SESSION_WORKSPACES, ws_value_int(2)));
+    CHECK(!ws_session_restore(WS_SESSION_WORKSPACES, ws_value_int(3)));
+    ws_session_deinit();
+
+    session_remove(path);
+    return 0;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+    failed += test_damaged();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file shm_pool.c
+ *
+ * Test of shared memory pools and the buffers imported from them
+ *
+ * Pools are backed by memfds, standing in for the memory of a client.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memfd_create()
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "compositor/buffer.h"
+#include "compositor/module.h"
+
+/**
+ * Size of a page, the granularity at which truncation is noticed
+ */
+#define PAGE 4096
+
+/**
+ * Check a condition, failing the test if it doesn't hold
+ */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+/**
+ * Create the memory of a client, filled with a pattern
+ *
+ * @return the file descriptor of the memory, -1 on error
+ */
+static int
+client_memory(
+    size_t size //!< Size of the memory, a multiple of four
+) {
+    int fd = memfd_create("ws-test-pool", MFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    uint32_t* pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fd, 0);
+    if (pixels == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    for (size_t i = 0; i < size / 4; ++i) {
+        pixels[i] = 0xFF000000u | i;
+    }
+    munmap(pixels, size);
+    return fd;
+}
+
+/**
+ * Buffers are only imported if they lie within the pool
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+test_import(void)
+{
+    int fd = client_memory(4 * 4 * 4);
+    CHECK(fd >= 0);
+    struct ws_shm_pool* pool = ws_shm_pool_new(fd, 4 * 4 * 4);
+    CHECK(pool);
+
+    int handles[2];
+    struct ws_buffer* buffer = ws_buffer_import_shm(handles, pool, 0, 4, 4,
+                                                    16);
+    CHECK(buffer);
+    CHECK(ws_buffer_pixels(buffer)[5] == 0xFF000005u);
+
+    // the pixels are read in place, so they must not reach past the pool
+    CHECK(!ws_buffer_import_shm(handles + 1, pool, 16, 4, 4, 16));
+    CHECK(!ws_buffer_import_shm(handles + 1, pool, 0, 4, 4, 12));
+    CHECK(!ws_buffer_import_shm(handles + 1, pool, 2, 2, 2, 8));
+    CHECK(!ws_buffer_import_shm(handles + 1, pool, 0, 0, 4, 16));
+    CHECK(!ws_buffer_import_shm(handles + 1, pool, 0, 1, INT32_MAX,
+                                INT32_MAX & ~3));
+    CHECK(!ws_buffer_import_shm(handles + 1, pool, 0, INT32_MAX, 1,
+                                INT32_MAX & ~3));
+    CHECK(!ws_buffer_import_shm(handles + 1, pool, 64 + 4, 1, 1, 4));
+
+    struct ws_buffer* last = ws_buffer_import_shm(handles + 1, pool, 48, 4, 1,
+                                                  16);
+    CHECK(last);
+    CHECK(ws_buffer_pixels(last)[3] == 0xFF00000Fu);
+
+    ws_buffer_forget(handles);
+    ws_buffer_forget(handles + 1);
+    ws_buffer_unref(buffer);
+    ws_buffer_unref(last);
+    ws_shm_pool_unref(pool);
+    return 0;
+}
+
+/**
+ * Importing a buffer again is served by the cache
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+test_cache(void)
+{
+    int fd = client_memory(4 * 4 * 4);
+    CHECK(fd >= 0);
+    struct ws_shm_pool* pool = ws_shm_pool_new(fd, 4 * 4 * 4);
+    CHECK(pool);
+
+    struct ws_buffer_cache_stats before;
+    struct ws_buffer_cache_stats after;
+    ws_buffer_cache_get_stats(&before);
+
+    int handle;
+    struct ws_buffer* first = ws_buffer_import_shm(&handle, pool, 0, 4, 4, 16);
+    struct ws_buffer* again = ws_buffer_import_shm(&handle, pool, 0, 4, 4, 16);
+    CHECK(first && (first == again));
+
+    // a handle reused for another buffer gets a new one
+    struct ws_buffer* other = ws_buffer_import_shm(&handle, pool, 0, 2, 2, 16);
+    CHECK(other && (other != first));
+    CHECK(first->width == 4);
+
+    ws_buffer_cache_get_stats(&after);
+    CHECK(after.imports - before.imports == 3);
+    CHECK(after.hits - before.hits == 1);
+
+    ws_buffer_forget(&handle);
+    ws_buffer_unref(first);
+    ws_buffer_unref(again);
+    ws_buffer_unref(other);
+    ws_shm_pool_unref(pool);
+    return 0;
+}
+
+/**
+ * Pools only grow
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+test_resize(void)
+{
+    int fd = client_memory(2 * PAGE);
+    CHECK(fd >= 0);
+    struct ws_shm_pool* pool = ws_shm_pool_new(dup(fd), PAGE);
+    CHECK(pool);
+
+    int handle;
+    CHECK(!ws_buffer_import_shm(&handle, pool, PAGE, 4, 4, 16));
+    CHECK(ws_shm_pool_resize(pool, PAGE / 2) == -EINVAL);
+    CHECK(ws_shm_pool_resize(pool, 2 * PAGE) == 0);
+    CHECK(pool->size == 2 * PAGE);
+
+    struct ws_buffer* buffer = ws_buffer_import_shm(&handle, pool, PAGE, 4, 4,
+                                                    16);
+    CHECK(buffer);
+    CHECK(ws_buffer_pixels(buffer)[0] == (0xFF000000u | (PAGE / 4)));
+
+    ws_buffer_forget(&handle);
+    ws_buffer_unref(buffer);
+    ws_shm_pool_unref(pool);
+    close(fd);
+    return 0;
+}
+
+/**
+ * A client truncating its memory breaks its pool, not the compositor
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+test_truncate(void)
+{
+    int fd = client_memory(4 * PAGE);
+    CHECK(fd >= 0);
+    struct ws_shm_pool* pool = ws_shm_pool_new(dup(fd), 4 * PAGE);
+    CHECK(pool);
+
+    int handle;
+    struct ws_buffer* buffer = ws_buffer_import_shm(&handle, pool, 0, 32, 32,
+                                                    32 * 4);
+    CHECK(buffer);
+
+    struct ws_compositor_backend* backend;
+    backend = ws_compositor_backend_headless_new(64, 64);
+    CHECK(backend);
+    CHECK(ws_compositor_init(backend) == 0);
+
+    struct ws_surface* surface;
+    surface = ws_compositor_surface_new(&(struct ws_rect) { 0, 0, 32, 32 });
+    CHECK(surface);
+    ws_surface_attach(surface, buffer);
+    CHECK(ws_compositor_repaint() == 64 * 64);
+    CHECK(backend->fb.pixels[1] == 0xFF000001u);
+    CHECK(!pool->broken);
+
+    CHECK(ftruncate(fd, 0) == 0);
+
+    // reading the pool faults, which swaps in zeroed memory
+    CHECK(ws_surface_damage(surface, &(struct ws_rect) { 0, 0, 32, 32 }) == 0);
+    CHECK(ws_compositor_repaint() == 32 * 32);
+    CHECK(pool->broken);
+    CHECK(backend->fb.pixels[1] != 0xFF000001u);
+
+    ws_shm_pool_begin_access(pool);
+    uint32_t value = ws_buffer_pixels(buffer)[1];
+    CHECK(ws_shm_pool_end_access(pool) == -EFAULT);
+    CHECK(value == 0);
+
+    ws_compositor_surface_destroy(surface);
+    ws_compositor_deinit();
+    ws_buffer_forget(&handle);
+    ws_buffer_unref(buffer);
+    ws_shm_pool_unref(pool);
+    close(fd);
+    return 0;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+    failed += test_import();
+    failed += test_cache();
+    failed += test_resize();
+    failed += test_truncate();
+    return failed ? 1 : 0;
+}
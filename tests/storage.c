@@ -0,0 +1,230 @@
+/*
+ * waysome - wayland based window manager
+ *
+ * Copyright in alphabetical order:
+ *
+ * Copyright (C) 2014-2015 Julian Ganz
+ * Copyright (C) 2014-2015 Manuel Messner
+ * Copyright (C) 2014-2015 Marcel Müller
+ * Copyright (C) 2014-2015 Matthias Beyer
+ * Copyright (C) 2014-2015 Nadja Sommerfeld
+ *
+ * This file is part of waysome.
+ *
+ * waysome is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 2.1 of the License, or (at your option)
+ * any later version.
+ *
+ * waysome is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with waysome. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file storage.c
+ *
+ * Test of the storage, which is kept in a fresh temporary directory
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // mkdtemp()
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "storage/module.h"
+#include "values/int.h"
+#include "values/string.h"
+
+/**
+ * Seconds after which a test is considered to hang
+ */
+#define TIMEOUT 30
+
+/**
+ * Check a condition, failing the test if it doesn't hold
+ */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+/**
+ * Remove a storage directory along with the files in it
+ */
+static void
+storage_remove(
+    char const* path //!< Path of the directory
+) {
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] != '.') {
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+/**
+ * Check the value stored for a key
+ *
+ * @return 0 if the key holds the integer, or is absent if `expected` is
+ *         negative, 1 otherwise
+ */
+static int
+check_int(
+    char const* key, //!< The key
+    long expected //!< The value expected, negative for none
+) {
+    struct ws_value value;
+    int res = ws_storage_get(key, &value);
+    if (expected < 0) {
+        CHECK(res == -ENOENT);
+        return 0;
+    }
+    CHECK(res == 0);
+    long stored = ws_value_int_get(value);
+    ws_value_unref(value);
+    CHECK(stored == expected);
+    return 0;
+}
+
+/**
+ * A failed commit fails later snapshots instead of blocking them
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+test_commit_error(void)
+{
+    char path[] = "/tmp/ws-test-storage-XXXXXX";
+    CHECK(mkdtemp(path));
+    CHECK(ws_storage_init(path) == 0);
+
+    // writing past the limit fails with EFBIG rather than killing us
+    struct rlimit old;
+    CHECK(getrlimit(RLIMIT_FSIZE, &old) == 0);
+    struct rlimit limit = { .rlim_cur = 4096, .rlim_max = old.rlim_max };
+    signal(SIGXFSZ, SIG_IGN);
+    CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+
+    char big[8192];
+    memset(big, 'x', sizeof(big));
+    struct ws_value value;
+    CHECK(ws_value_string_new(big, sizeof(big), &value) == 0);
+    CHECK(ws_storage_set("big", value) == 0);
+    ws_value_unref(value);
+
+    alarm(TIMEOUT);
+    CHECK(ws_storage_sync() < 0);
+    CHECK(ws_storage_snapshot() < 0);
+    CHECK(ws_storage_snapshot() < 0);
+    ws_storage_deinit();
+    alarm(0);
+
+    CHECK(setrlimit(RLIMIT_FSIZE, &old) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+    storage_remove(path);
+    return 0;
+}
+
+/**
+ * Changes survive a restart, whether compacted into the snapshot or replayed
+ * from the log
+ *
+ * @return 0 on success, 1 otherwise
+ */
+static int
+test_restart(void)
+{
+    char path[] = "/tmp/ws-test-storage-XXXXXX";
+    CHECK(mkdtemp(path));
+    CHECK(ws_storage_init(path) == 0);
+    alarm(TIMEOUT);
+
+    // overwriting a few large values grows the log past the point where it
+    // gets compacted
+    char filler[1024];
+    memset(filler, 'f', sizeof(filler));
+    struct ws_value value;
+    CHECK(ws_value_string_new(filler, sizeof(filler), &value) == 0);
+    for (int i = 0; i < 4 * (WS_STORAGE_COMPACT_MIN / 1024); ++i) {
+        char key[32];
+        snprintf(key, sizeof(key), "filler%d", i % 8);
+        CHECK(ws_storage_set(key, value) == 0);
+    }
+    ws_value_unref(value);
+
+    for (long i = 0; i < 64; ++i) {
+        char key[32];
+        snprintf(key, sizeof(key), "key%ld", i);
+        CHECK(ws_storage_set(key, ws_value_int(i)) == 0);
+    }
+    CHECK(ws_storage_snapshot() == 0);
+
+    // these only make it to the log
+    for (long i = 0; i < 64; i += 2) {
+        char key[32];
+        snprintf(key, sizeof(key), "key%ld", i);
+        CHECK(ws_storage_delete(key) == 0);
+    }
+    CHECK(ws_storage_set("key1", ws_value_int(100)) == 0);
+
+    struct ws_storage_stats stats;
+    ws_storage_get_stats(&stats);
+    CHECK(stats.snapshots >= 2);
+    CHECK(stats.log_size < WS_STORAGE_COMPACT_MIN);
+    ws_storage_deinit();
+
+    CHECK(ws_storage_init(path) == 0);
+    ws_storage_get_stats(&stats);
+    CHECK(stats.replayed == 33);
+    CHECK(check_int("key1", 100) == 0);
+    for (long i = 2; i < 64; ++i) {
+        char key[32];
+        snprintf(key, sizeof(key), "key%ld", i);
+        CHECK(check_int(key, (i % 2) ? i : -1) == 0);
+    }
+
+    struct ws_value stored;
+    CHECK(ws_storage_get("filler7", &stored) == 0);
+    size_t len;
+    ws_value_string_get(stored, &len);
+    ws_value_unref(stored);
+    CHECK(len == sizeof(filler));
+
+    ws_storage_deinit();
+    alarm(0);
+    storage_remove(path);
+    return 0;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+    failed += test_commit_error();
+    failed += test_restart();
+    return failed ? 1 : 0;
+}